@@ -0,0 +1,265 @@
+#ifndef CHECKPOINT_HPP
+#define CHECKPOINT_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+#include "libdeflate.h"
+
+
+/// State of a decoding thread, enough to resume its decoding
+struct worker_checkpoint {
+    size_t start = 0; ///< Compressed position the thread started from (its skip)
+    size_t sync_bits = ~0UL; ///< Bit position of the first block it decoded, ~0 if not found yet
+    size_t first_block = ~0UL; ///< Position of the block where it resolved its first reads, ~0 if none yet
+    size_t next_block_bits = 0; ///< Bit position of the next block to decode, 0 to start over
+    bool done = false; ///< Stopped decoding, only its deferred reads are left
+    bool finished = false; ///< Also output its deferred reads, next_context is then resolved (empty if it couldn't be)
+    int until_counter = -1;
+
+    /// Statistics of the window
+    struct {
+        unsigned nb_blocks, total_block_size, nb_reads_printed, nb_unsolved_reads,
+                 nb_unexpected_length_reads, nb_record_resolved_reads;
+    } stats = {};
+
+    size_t flushed_size = 0; ///< Bytes moved out of the window so far
+    size_t reads_begin = ~0UL; ///< Decompressed position of the block where its reads start, ~0 if none yet
+    size_t kept_text_end = 0, keep_text_until = 0; ///< Text kept around the undetermined reads, and to keep
+    size_t nb_newlines = 0; ///< Determined ones, in the blocks the reads were output from
+    std::vector<uint32_t> undetermined_origins; ///< Counts of the origins of the other characters of those blocks
+    std::vector<byte> window; ///< The 32K preceding the next block
+    std::vector<uint16_t> origins; ///< Where their undetermined characters come from, if tracked
+    std::vector<byte> next_context; ///< Captured for the next thread, if any
+    std::vector<uint16_t> next_context_origins;
+    std::vector<byte> deferred_reads; ///< Where the reads waiting for the initial context are, as stored by the window
+};
+
+namespace checkpoint_io {
+
+template <typename T>
+bool put(FILE* f, const T& value) { return fwrite(&value, sizeof(value), 1, f) == 1; }
+
+template <typename T>
+bool put(FILE* f, const std::vector<T>& values) {
+    return put(f, values.size()) && fwrite(values.data(), sizeof(T), values.size(), f) == values.size();
+}
+
+template <typename T>
+bool get(FILE* f, T& value) { return fread(&value, sizeof(value), 1, f) == 1; }
+
+template <typename T>
+bool get(FILE* f, std::vector<T>& values) {
+    size_t size;
+    if (!get(f, size) || size > (1UL << 32))
+        return false;
+    values.resize(size);
+    return fread(values.data(), sizeof(T), size, f) == size;
+}
+
+} // namespace checkpoint_io
+
+/**
+ * Periodically saves the state of all the threads of a parallel decoding to a
+ * file, along with the size of standard output, which must be a regular file.
+ * The threads all stop at a block boundary with their output flushed, so the
+ * saved output is exactly what they decoded until then. Their states are only
+ * built while saving, one at a time. The reads a thread defers are saved as
+ * offsets, decoded again when resuming.
+ */
+class checkpointer {
+public:
+    checkpointer(const char* path, unsigned interval_seconds, const byte* in, size_t in_nbytes, unsigned nthreads) :
+        path(path), interval(std::chrono::seconds(interval_seconds != 0 ? interval_seconds : 60)),
+        in_nbytes(in_nbytes), footer(in_nbytes >= 8 ? load_footer(in + in_nbytes - 8) : 0),
+        workers(nthreads), states(nthreads), active(nthreads)
+    {
+        schedule();
+    }
+
+    /// Read the saved state and truncate standard output back to its saved size
+    bool load() {
+        using namespace checkpoint_io;
+        FILE* f = fopen(path.c_str(), "rb");
+        if (f == nullptr) {
+            fprintf(stderr, "can't resume: unable to open %s\n", path.c_str());
+            return false;
+        }
+
+        char file_magic[magic_size];
+        size_t file_in_nbytes = 0;
+        uint64_t file_footer = 0, output_offset = 0;
+        unsigned nthreads = 0;
+        bool ok = fread(file_magic, magic_size, 1, f) == 1 && memcmp(file_magic, magic(), magic_size) == 0
+            && get(f, file_in_nbytes) && get(f, file_footer) && get(f, output_offset) && get(f, nthreads)
+            && nthreads > 0 && nthreads <= 4096;
+        if (ok && (file_in_nbytes != in_nbytes || file_footer != footer)) {
+            fclose(f);
+            fprintf(stderr, "can't resume: %s was saved for another input\n", path.c_str());
+            return false;
+        }
+
+        workers.resize(ok ? nthreads : 0);
+        for (worker_checkpoint& w : workers)
+            ok = ok && get(f, w.start) && get(f, w.sync_bits) && get(f, w.first_block) && get(f, w.next_block_bits)
+                && get(f, w.done) && get(f, w.finished) && get(f, w.until_counter) && get(f, w.stats) && get(f, w.flushed_size)
+                && get(f, w.reads_begin) && get(f, w.kept_text_end) && get(f, w.keep_text_until)
+                && get(f, w.nb_newlines) && get(f, w.undetermined_origins)
+                && get(f, w.window) && get(f, w.origins) && get(f, w.next_context) && get(f, w.next_context_origins)
+                && get(f, w.deferred_reads);
+        fclose(f);
+        if (!ok) {
+            fprintf(stderr, "can't resume: %s is corrupt\n", path.c_str());
+            return false;
+        }
+
+        if (ftruncate(STDOUT_FILENO, output_offset) != 0 || lseek(STDOUT_FILENO, output_offset, SEEK_SET) < 0) {
+            fprintf(stderr, "can't resume: unable to truncate standard output\n");
+            return false;
+        }
+        fprintf(stderr, "resuming %u threads from %s, after %lu bytes of output\n",
+                nthreads, path.c_str(), (unsigned long)output_offset);
+        states.resize(nthreads);
+        active = nthreads;
+        resuming = true;
+        return true;
+    }
+
+    unsigned nthreads() const
+    { return workers.size(); }
+
+    /// State a thread resumes from, when resuming
+    const worker_checkpoint& resumed(unsigned worker) const
+    { return workers[worker]; }
+
+    /// Same, moved to the thread resuming from it
+    worker_checkpoint take_resumed(unsigned worker)
+    { return std::move(workers[worker]); }
+
+    /// Builds the current state of a thread, called while it waits
+    typedef std::function<worker_checkpoint()> state_function;
+
+    /// Polled by the threads between two blocks: should they call arrive()?
+    bool due() {
+        if (requested.load(std::memory_order_relaxed))
+            return true;
+        if (std::chrono::steady_clock::now().time_since_epoch().count() < deadline.load(std::memory_order_relaxed))
+            return false;
+        requested.store(true, std::memory_order_relaxed);
+        return true;
+    }
+
+    /// Hand over the state of a thread with its output flushed, and wait until all the threads did and it is saved
+    void arrive(unsigned worker, state_function state) {
+        std::unique_lock<std::mutex> lock(mutex);
+        states[worker] = std::move(state);
+        arrived++;
+        if (arrived == active) {
+            complete();
+            return;
+        }
+        const unsigned current_epoch = epoch;
+        cv.wait(lock, [&]{ return epoch != current_epoch; });
+    }
+
+    /// Hand over the final state of a thread which stopped decoding, valid until it calls finish()
+    void leave(unsigned worker, state_function state) {
+        std::lock_guard<std::mutex> lock(mutex);
+        states[worker] = std::move(state);
+        active--;
+        if (requested.load(std::memory_order_relaxed) && arrived == active)
+            complete();
+    }
+
+    /**
+     * Run 'output', which writes the last output of a thread which left and
+     * returns its final state, so that no checkpoint is saved in the meantime
+     */
+    template <typename F>
+    void finish(unsigned worker, F output) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto state = std::make_shared<worker_checkpoint>(output());
+        states[worker] = [state]() { return *state; };
+    }
+
+    bool resuming = false;
+
+protected:
+    static const char* magic() { return "LDCKPT04"; }
+    static constexpr size_t magic_size = 8;
+
+    static uint64_t load_footer(const byte* p) {
+        uint64_t value = 0;
+        for (int i = 7; i >= 0; i--)
+            value = (value << 8) | uint64_t(p[i]);
+        return value;
+    }
+
+    void schedule() {
+        deadline.store((std::chrono::steady_clock::now() + interval).time_since_epoch().count(),
+                       std::memory_order_relaxed);
+    }
+
+    /// Save the states, with the mutex held, and release the waiting threads
+    void complete() {
+        save();
+        arrived = 0;
+        epoch++;
+        schedule();
+        requested.store(false, std::memory_order_relaxed);
+        cv.notify_all();
+    }
+
+    /// Write to a temporary file renamed over the previous one, so that a checkpoint is never half written
+    void save() {
+        using namespace checkpoint_io;
+        fdatasync(STDOUT_FILENO);
+        const uint64_t output_offset = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+        const std::string tmp_path = path + ".tmp";
+        FILE* f = fopen(tmp_path.c_str(), "wb");
+        bool ok = f != nullptr && fwrite(magic(), magic_size, 1, f) == 1 && put(f, in_nbytes) && put(f, footer)
+            && put(f, output_offset) && put(f, unsigned(states.size()));
+        for (unsigned i = 0; ok && i < states.size(); i++) {
+            const worker_checkpoint w = states[i]();
+            ok = ok && put(f, w.start) && put(f, w.sync_bits) && put(f, w.first_block) && put(f, w.next_block_bits)
+                && put(f, w.done) && put(f, w.finished) && put(f, w.until_counter) && put(f, w.stats) && put(f, w.flushed_size)
+                && put(f, w.reads_begin) && put(f, w.kept_text_end) && put(f, w.keep_text_until)
+                && put(f, w.nb_newlines) && put(f, w.undetermined_origins)
+                && put(f, w.window) && put(f, w.origins) && put(f, w.next_context) && put(f, w.next_context_origins)
+                && put(f, w.deferred_reads);
+        }
+        ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+        if (f != nullptr)
+            ok = fclose(f) == 0 && ok;
+        if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0)
+            fprintf(stderr, "warning: unable to save a checkpoint to %s\n", path.c_str());
+    }
+
+    const std::string path;
+    const std::chrono::steady_clock::duration interval;
+    const size_t in_nbytes;
+    const uint64_t footer; ///< CRC32 and ISIZE of the last member, to recognize the input
+    std::vector<worker_checkpoint> workers; ///< As loaded
+    std::vector<state_function> states; ///< As handed over by the threads
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    unsigned active; ///< Threads still decoding
+    unsigned arrived = 0;
+    unsigned epoch = 0;
+    std::atomic<bool> requested = {false};
+    std::atomic<std::chrono::steady_clock::rep> deadline = {0};
+};
+
+
+#endif // CHECKPOINT_HPP
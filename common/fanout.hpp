@@ -0,0 +1,139 @@
+#ifndef FANOUT_HPP
+#define FANOUT_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "libdeflate.h"
+#include "memory_accounting.hpp"
+
+
+/**
+ * Hands the resolved reads of a decompression, by batches of newline-terminated
+ * reads, to several consumers each running on their own threads. A batch is
+ * shared by the consumers and freed when the last one is done with it. At most
+ * 'max_batches' batches are in flight: publishing waits for the slowest
+ * consumer to catch up, so that decoding goes at its pace.
+ */
+struct libdeflate_fanout {
+    explicit libdeflate_fanout(unsigned max_batches) :
+        max_batches(std::max(max_batches, 1u))
+    {}
+
+    ~libdeflate_fanout() {
+        close();
+    }
+
+    void add_consumer(libdeflate_consume_func consume, void* ctx, unsigned nthreads) {
+        std::lock_guard<std::mutex> lock(mutex);
+        consumers.emplace_back(new consumer(consume, ctx));
+        consumer& c = *consumers.back();
+        for (unsigned i = 0; i < std::max(nthreads, 1u); i++)
+            c.threads.emplace_back([this, &c]() { run(c); });
+    }
+
+    /// Hand a copy of [data, data+len) to every consumer, once fewer than 'max_batches' batches are in flight
+    void publish(const byte* data, size_t len) {
+        if (len == 0)
+            return;
+        std::unique_lock<std::mutex> lock(mutex);
+        space.wait(lock, [this]() { return in_flight < max_batches; });
+
+        unsigned nb_active = 0;
+        for (auto& c : consumers)
+            nb_active += !c->stopped;
+        if (nb_active == 0)
+            return;
+
+        batch* b = new batch(data, len, nb_active);
+        in_flight++;
+        for (auto& c : consumers) {
+            if (c->stopped)
+                continue;
+            c->queue.push_back(b);
+            c->ready.notify_one();
+        }
+    }
+
+    /// Let the consumers finish the batches in flight, and stop their threads
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closing = true;
+            for (auto& c : consumers)
+                c->ready.notify_all();
+        }
+        for (auto& c : consumers)
+            for (std::thread& thread : c->threads)
+                thread.join();
+        consumers.clear();
+    }
+
+protected:
+    struct batch {
+        batch(const byte* data, size_t len, unsigned refs) :
+            data(accounted_new<byte>(LIBDEFLATE_MEMORY_OUTPUT_BUFFERS, len)), len(len), refs(refs)
+        { memcpy(this->data, data, len); }
+
+        ~batch()
+        { accounted_delete(LIBDEFLATE_MEMORY_OUTPUT_BUFFERS, data, len); }
+
+        byte* const data;
+        const size_t len;
+        std::atomic<unsigned> refs; ///< Consumers not done with it
+    };
+
+    struct consumer {
+        consumer(libdeflate_consume_func consume, void* ctx) : consume(consume), ctx(ctx) {}
+
+        const libdeflate_consume_func consume;
+        void* const ctx;
+        bool stopped = false; ///< Asked not to get any more batches
+        std::deque<batch*> queue;
+        std::condition_variable ready;
+        std::vector<std::thread> threads;
+    };
+
+    /// Body of the threads of a consumer
+    void run(consumer& c) {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            c.ready.wait(lock, [this, &c]() { return closing || !c.queue.empty(); });
+            if (c.queue.empty())
+                return;
+            batch* b = c.queue.front();
+            c.queue.pop_front();
+            const bool skip = c.stopped;
+            lock.unlock();
+
+            const bool stop = !skip && c.consume(c.ctx, b->data, b->len) != 0;
+            const bool last = b->refs.fetch_sub(1, std::memory_order_acq_rel) == 1;
+            if (last)
+                delete b;
+
+            lock.lock();
+            c.stopped = c.stopped || stop;
+            if (last) {
+                in_flight--;
+                space.notify_all();
+            }
+        }
+    }
+
+    const unsigned max_batches;
+    std::mutex mutex;
+    std::condition_variable space; ///< A batch was freed
+    std::vector<std::unique_ptr<consumer>> consumers;
+    unsigned in_flight = 0;
+    bool closing = false;
+};
+
+
+#endif // FANOUT_HPP
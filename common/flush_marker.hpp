@@ -0,0 +1,41 @@
+#ifndef FLUSH_MARKER_HPP
+#define FLUSH_MARKER_HPP
+
+#include <cstring>
+
+#include "libdeflate.h"
+
+
+/**
+ * zlib's Z_SYNC_FLUSH and Z_FULL_FLUSH, as used by pigz between its chunks, end
+ * what was compressed so far with an empty stored block: its 3-bit header and
+ * zero padding to the next byte, then LEN = 0000 and NLEN = FFFF. The next
+ * block starts exactly after these 4 bytes. After a full flush, no back-reference
+ * reaches before the marker either.
+ */
+static constexpr unsigned flush_marker_size = 4;
+
+/// Whether the bytes at 'p' look like the end of an empty stored block (the byte before them must be readable)
+inline bool is_flush_marker(const byte* p)
+{
+    // the zero header and padding fill at least the top 3 bits of the previous byte
+    return p[0] == 0x00 && p[1] == 0x00 && p[2] == 0xFF && p[3] == 0xFF && (p[-1] & 0xE0) == 0;
+}
+
+/// First flush marker in (begin, end), nullptr if there is none. memchr() skips most of the data
+inline const byte* find_flush_marker(const byte* begin, const byte* end)
+{
+    const byte* p = begin + 1;
+    while (end - p >= ptrdiff_t(flush_marker_size)) {
+        const byte* ff = static_cast<const byte*>(memchr(p + 2, 0xFF, end - p - 2));
+        if (ff == nullptr || ff + 1 >= end)
+            return nullptr;
+        if (ff[1] == 0xFF && is_flush_marker(ff - 2))
+            return ff - 2;
+        p = ff - 1; // ff[1] may be the first FF of a marker
+    }
+    return nullptr;
+}
+
+
+#endif // FLUSH_MARKER_HPP
@@ -0,0 +1,65 @@
+#ifndef MEMORY_ACCOUNTING_HPP
+#define MEMORY_ACCOUNTING_HPP
+
+#include <atomic>
+#include <cstddef>
+
+#include "libdeflate.h"
+
+
+/// Current and peak bytes allocated by each component of the decompressor, for all threads
+struct memory_accounting {
+
+    static memory_accounting& instance() {
+        static memory_accounting accounting;
+        return accounting;
+    }
+
+    void allocated(libdeflate_memory_component component, size_t bytes) {
+        update_peak(peak[component], current[component].fetch_add(bytes, std::memory_order_relaxed) + bytes);
+        update_peak(total_peak, total_current.fetch_add(bytes, std::memory_order_relaxed) + bytes);
+    }
+
+    void released(libdeflate_memory_component component, size_t bytes) {
+        current[component].fetch_sub(bytes, std::memory_order_relaxed);
+        total_current.fetch_sub(bytes, std::memory_order_relaxed);
+    }
+
+    std::atomic<size_t> current[LIBDEFLATE_MEMORY_NB_COMPONENTS] = {};
+    std::atomic<size_t> peak[LIBDEFLATE_MEMORY_NB_COMPONENTS] = {};
+    std::atomic<size_t> total_current = {0};
+    std::atomic<size_t> total_peak = {0};
+
+protected:
+    static void update_peak(std::atomic<size_t>& peak, size_t value) {
+        size_t previous = peak.load(std::memory_order_relaxed);
+        while (previous < value && !peak.compare_exchange_weak(previous, value, std::memory_order_relaxed))
+            ;
+    }
+};
+
+/// new[] accounted to 'component', zero-initialized if 'zeroed'
+template <typename T>
+T* accounted_new(libdeflate_memory_component component, size_t n, bool zeroed = false) {
+    T* array = zeroed ? new T[n]() : new T[n];
+    memory_accounting::instance().allocated(component, n * sizeof(T));
+    return array;
+}
+
+/// delete[] of an array of 'n' elements obtained with accounted_new()
+template <typename T>
+void accounted_delete(libdeflate_memory_component component, T* array, size_t n) {
+    if (array == nullptr)
+        return;
+    delete[] array;
+    memory_accounting::instance().released(component, n * sizeof(T));
+}
+
+/// Reads a parallel FASTQ thread keeps for the previous thread's context, past which it waits for that context
+constexpr size_t deferred_reads_budget = 32UL << 20;
+
+/// Memory the planner expects one decoding thread of 'strategy' to use
+size_t thread_memory_estimate(enum libdeflate_strategy strategy, size_t output_buffer_size);
+
+
+#endif // MEMORY_ACCOUNTING_HPP
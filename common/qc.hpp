@@ -0,0 +1,257 @@
+#ifndef QC_HPP
+#define QC_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <vector>
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+
+#include "libdeflate.h"
+
+
+/// Quality control statistics of reads, as summed over all the threads of the decompressions
+struct qc_totals {
+    static constexpr unsigned nb_bases = 5; ///< A, C, G, T and N
+    static constexpr unsigned quality_offset = 33; ///< Phred+33
+
+    std::vector<uint64_t> base_counts[nb_bases]; ///< Per position
+    std::vector<uint64_t> quality_sums; ///< Per position, of the quality scores
+    std::vector<uint64_t> lengths; ///< Reads of each length
+    std::vector<uint64_t> quality_lengths; ///< Reads with a determined quality line, by length
+    uint64_t per_read_gc[101] = {}; ///< Reads by percentage of GC among their ACGT bases
+
+    void add(const qc_totals& other) {
+        for (unsigned b = 0; b < nb_bases; b++)
+            add(base_counts[b], other.base_counts[b]);
+        add(quality_sums, other.quality_sums);
+        add(lengths, other.lengths);
+        add(quality_lengths, other.quality_lengths);
+        for (unsigned i = 0; i <= 100; i++)
+            per_read_gc[i] += other.per_read_gc[i];
+    }
+
+    static void add(std::vector<uint64_t>& to, const std::vector<uint64_t>& from) {
+        if (to.size() < from.size())
+            to.resize(from.size());
+        for (size_t i = 0; i < from.size(); i++)
+            to[i] += from[i];
+    }
+};
+
+/**
+ * @brief Shared quality control statistics, which the accumulators of the threads are merged into
+ */
+struct libdeflate_qc {
+    void merge(const qc_totals& totals) {
+        std::lock_guard<std::mutex> lock(mutex);
+        this->totals.add(totals);
+    }
+
+    /// Write the statistics as a JSON object, returns false on a write error
+    bool write_json(FILE* f) {
+        std::lock_guard<std::mutex> lock(mutex);
+        const qc_totals& t = totals;
+        static const char base_names[qc_totals::nb_bases] = {'A', 'C', 'G', 'T', 'N'};
+
+        uint64_t nb_reads = 0, nb_bases = 0, nb_quality_reads = 0, gc = 0, at = 0;
+        size_t min_length = 0, max_length = 0;
+        for (size_t len = 0; len < t.lengths.size(); len++) {
+            if (t.lengths[len] == 0)
+                continue;
+            if (nb_reads == 0)
+                min_length = len;
+            max_length = len;
+            nb_reads += t.lengths[len];
+            nb_bases += t.lengths[len] * len;
+        }
+        for (uint64_t count : t.quality_lengths)
+            nb_quality_reads += count;
+        for (size_t i = 0; i < t.base_counts[0].size(); i++) {
+            at += t.base_counts[0][i] + t.base_counts[3][i];
+            gc += t.base_counts[1][i] + t.base_counts[2][i];
+        }
+
+        fprintf(f, "{\n  \"reads\": %lu,\n  \"bases\": %lu,\n  \"reads_with_quality\": %lu,\n",
+                (unsigned long)nb_reads, (unsigned long)nb_bases, (unsigned long)nb_quality_reads);
+        fprintf(f, "  \"gc_content\": %.3f,\n", at + gc != 0 ? 100.0 * gc / (at + gc) : 0.0);
+        fprintf(f, "  \"length\": {\"min\": %lu, \"max\": %lu, \"distribution\": [",
+                (unsigned long)min_length, (unsigned long)max_length);
+        const char* sep = "";
+        for (size_t len = 0; len < t.lengths.size(); len++) {
+            if (t.lengths[len] == 0)
+                continue;
+            fprintf(f, "%s[%lu, %lu]", sep, (unsigned long)len, (unsigned long)t.lengths[len]);
+            sep = ", ";
+        }
+        fprintf(f, "]},\n  \"per_position\": {\n    \"quality_mean\": [");
+
+        // reads reaching a position, overall and with a quality line
+        uint64_t reads_left = nb_reads, quality_reads_left = nb_quality_reads;
+        for (size_t i = 0; i < max_length; i++) {
+            if (i < t.quality_lengths.size())
+                quality_reads_left -= t.quality_lengths[i]; // those ending before i
+            const uint64_t sum = i < t.quality_sums.size() ? t.quality_sums[i] : 0;
+            fprintf(f, "%s%.2f", i ? ", " : "", quality_reads_left ? double(sum) / quality_reads_left : 0.0);
+        }
+        fprintf(f, "]");
+        for (unsigned b = 0; b < qc_totals::nb_bases; b++) {
+            fprintf(f, ",\n    \"%c\": [", base_names[b]);
+            reads_left = nb_reads;
+            for (size_t i = 0; i < max_length; i++) {
+                if (i < t.lengths.size())
+                    reads_left -= t.lengths[i];
+                const uint64_t count = i < t.base_counts[b].size() ? t.base_counts[b][i] : 0;
+                fprintf(f, "%s%.3f", i ? ", " : "", reads_left ? 100.0 * count / reads_left : 0.0);
+            }
+            fprintf(f, "]");
+        }
+        fprintf(f, "\n  },\n  \"per_read_gc\": [");
+        for (unsigned i = 0; i <= 100; i++)
+            fprintf(f, "%s%lu", i ? ", " : "", (unsigned long)t.per_read_gc[i]);
+        fprintf(f, "]\n}\n");
+        return !ferror(f);
+    }
+
+protected:
+    std::mutex mutex;
+    qc_totals totals;
+};
+
+/**
+ * Quality control statistics of the reads of one thread, merged into the shared
+ * statistics when destroyed. Per position, bases and quality scores are first
+ * counted in 8-bit and 16-bit counters, 16 positions at a time, and added to the
+ * 64-bit totals every 255 reads, before these counters could overflow.
+ */
+class qc_accumulator {
+public:
+    explicit qc_accumulator(libdeflate_qc* shared) : shared(shared) {}
+
+    ~qc_accumulator() {
+        widen();
+        shared->merge(totals);
+    }
+
+    /// Account a resolved read
+    void add_sequence(const byte* seq, size_t length) {
+        reserve(length);
+        if (totals.lengths.size() <= length)
+            totals.lengths.resize(length + 1);
+        totals.lengths[length]++;
+
+        size_t i = 0, gc = 0, acgt = 0;
+#ifdef __SSE2__
+        const __m128i case_mask = _mm_set1_epi8(char(0xDF));
+        const __m128i letters[qc_totals::nb_bases] = {
+            _mm_set1_epi8('A'), _mm_set1_epi8('C'), _mm_set1_epi8('G'), _mm_set1_epi8('T'), _mm_set1_epi8('N')};
+        for (; i + 16 <= length; i += 16) {
+            const __m128i v = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(seq + i)), case_mask);
+            __m128i is_base[qc_totals::nb_bases];
+            for (unsigned b = 0; b < qc_totals::nb_bases; b++) {
+                is_base[b] = _mm_cmpeq_epi8(v, letters[b]);
+                __m128i* counter = reinterpret_cast<__m128i*>(&counts8[b][i]);
+                _mm_storeu_si128(counter, _mm_sub_epi8(_mm_loadu_si128(counter), is_base[b])); // -(-1)
+            }
+            gc += __builtin_popcount(_mm_movemask_epi8(_mm_or_si128(is_base[1], is_base[2])));
+            acgt += __builtin_popcount(_mm_movemask_epi8(
+                _mm_or_si128(_mm_or_si128(is_base[0], is_base[1]), _mm_or_si128(is_base[2], is_base[3]))));
+        }
+#endif
+        for (; i < length; i++) {
+            const int b = base_index(seq[i]);
+            if (b >= 0) {
+                counts8[b][i]++;
+                gc += b == 1 || b == 2;
+                acgt += b < 4;
+            }
+        }
+        if (acgt != 0)
+            totals.per_read_gc[(gc * 100 + acgt / 2) / acgt]++;
+        count_read();
+    }
+
+    /// Account the quality line of a read, unless it has undetermined characters
+    void add_quality(const byte* quality, size_t length) {
+        if (memchr(quality, '|', length) != nullptr)
+            return;
+        reserve(length);
+        if (totals.quality_lengths.size() <= length)
+            totals.quality_lengths.resize(length + 1);
+        totals.quality_lengths[length]++;
+
+        size_t i = 0;
+#ifdef __SSE2__
+        const __m128i offset = _mm_set1_epi8(char(qc_totals::quality_offset)), zero = _mm_setzero_si128();
+        for (; i + 16 <= length; i += 16) {
+            const __m128i q = _mm_subs_epu8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(quality + i)), offset);
+            __m128i* lo = reinterpret_cast<__m128i*>(&quality16[i]);
+            __m128i* hi = reinterpret_cast<__m128i*>(&quality16[i + 8]);
+            _mm_storeu_si128(lo, _mm_add_epi16(_mm_loadu_si128(lo), _mm_unpacklo_epi8(q, zero)));
+            _mm_storeu_si128(hi, _mm_add_epi16(_mm_loadu_si128(hi), _mm_unpackhi_epi8(q, zero)));
+        }
+#endif
+        for (; i < length; i++)
+            quality16[i] += quality[i] > qc_totals::quality_offset ? quality[i] - qc_totals::quality_offset : 0;
+        count_read();
+    }
+
+protected:
+    static constexpr unsigned widen_interval = 255; ///< Reads, or quality lines (up to 255 each), per narrow counter
+
+    static int base_index(byte c) {
+        switch (c & 0xDF) {
+        case 'A': return 0;
+        case 'C': return 1;
+        case 'G': return 2;
+        case 'T': return 3;
+        case 'N': return 4;
+        default: return -1;
+        }
+    }
+
+    /// Make room for reads of 'length' positions, rounded up to whole vectors
+    void reserve(size_t length) {
+        if (length <= quality16.size())
+            return;
+        const size_t size = (length + 15) & ~size_t(15);
+        for (unsigned b = 0; b < qc_totals::nb_bases; b++) {
+            counts8[b].resize(size);
+            totals.base_counts[b].resize(size);
+        }
+        quality16.resize(size);
+        totals.quality_sums.resize(size);
+    }
+
+    void count_read() {
+        if (++nb_narrow == widen_interval)
+            widen();
+    }
+
+    /// Add the narrow counters to the totals
+    void widen() {
+        for (unsigned b = 0; b < qc_totals::nb_bases; b++)
+            for (size_t i = 0; i < counts8[b].size(); i++) {
+                totals.base_counts[b][i] += counts8[b][i];
+                counts8[b][i] = 0;
+            }
+        for (size_t i = 0; i < quality16.size(); i++) {
+            totals.quality_sums[i] += quality16[i];
+            quality16[i] = 0;
+        }
+        nb_narrow = 0;
+    }
+
+    libdeflate_qc* const shared;
+    qc_totals totals;
+    std::vector<uint8_t> counts8[qc_totals::nb_bases];
+    std::vector<uint16_t> quality16;
+    unsigned nb_narrow = 0; ///< Reads and quality lines in the narrow counters
+};
+
+
+#endif // QC_HPP
@@ -0,0 +1,280 @@
+#ifndef RANGED_INPUT_HPP
+#define RANGED_INPUT_HPP
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <sys/mman.h>
+
+#include "libdeflate.h"
+#include "memory_accounting.hpp"
+
+
+/// Chunks of a ranged input a decompressor is reading, and those read ahead for it, kept in the cache until it moves on
+struct ranged_window {
+    size_t first = 1, last = 0; ///< Empty
+    size_t ahead = 0; ///< Last chunk read ahead, 'last' if none
+    unsigned sequential = 0; ///< Chunks it went through in order, so many are read ahead
+    size_t ahead_end = SIZE_MAX; ///< No chunk starting at or past this byte is read ahead
+};
+
+/**
+ * An input fetched by chunks as it is decoded. The whole input is reserved as a
+ * sparse anonymous mapping, so that the decompressors read it through a plain
+ * pointer: they only have to require() the bytes they are about to decode, at
+ * block boundaries. Fetched chunks stay in the mapping, up to 'cache_size',
+ * beyond which the least recently required chunk that no decompressor holds,
+ * nor has read ahead, is dropped (and fetched again if it is needed later).
+ * Chunks are only read ahead while those held fit in the cache, so that it
+ * only grows past 'cache_size' if the chunks the decompressors require don't
+ * fit in it on their own.
+ */
+struct libdeflate_ranged_input {
+    libdeflate_ranged_input(uint64_t size, libdeflate_read_range_func read_range, void* ctx,
+                            size_t chunk_size, unsigned readahead, size_t cache_size) :
+        size(size), chunk_size(std::max(chunk_size, min_chunk_size)), readahead(readahead),
+        cache_size(cache_size), read_range(read_range), ctx(ctx),
+        chunks((size + this->chunk_size - 1) / this->chunk_size)
+    {
+        void* mapping = size != 0 && size <= SIZE_MAX
+            ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0)
+            : MAP_FAILED;
+        if (mapping == MAP_FAILED)
+            return;
+        mem = static_cast<byte*>(mapping);
+        for (unsigned i = 0; i < nb_fetchers; i++)
+            fetchers.emplace_back([this]() { fetch_ahead(); });
+    }
+
+    ~libdeflate_ranged_input() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        to_fetch.notify_all();
+        for (std::thread& fetcher : fetchers)
+            fetcher.join();
+        if (mem != nullptr)
+            munmap(mem, size);
+        memory_accounting::instance().released(LIBDEFLATE_MEMORY_INPUT, resident.size() * chunk_size);
+    }
+
+    bool valid() const
+    { return mem != nullptr; }
+
+    const byte* data() const
+    { return mem; }
+
+    /**
+     * Make the bytes [p, p+len) readable (as far as they are in the input) for
+     * the decompressor holding 'window', fetching what isn't cached and reading
+     * ahead. The decompressor must not read past them before its next call.
+     */
+    void require(ranged_window& window, const byte* p, size_t len) {
+        size_t begin = std::min(size_t(p - mem), size_t(size - 1));
+        size_t end = std::min(begin + std::max(len, size_t(1)), size_t(size));
+        size_t first = begin / chunk_size, last = (end - 1) / chunk_size;
+        if (first != window.first || last != window.last)
+            move(window, first, last);
+    }
+
+    /// Read ahead for 'window' only the chunks starting before 'end', none if it is the start, all if NULL
+    void limit_readahead(ranged_window& window, const byte* end) const
+    { window.ahead_end = end != nullptr ? size_t(end - mem) : SIZE_MAX; }
+
+    /// Let the chunks of 'window' be dropped, when a decompressor is done
+    void release(ranged_window& window) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t c = window.first; c <= window.ahead; c++)
+            chunks[c].pins--;
+        window = ranged_window();
+    }
+
+    /// Bytes fetched so far, and calls to 'read_range' it took
+    void stats(uint64_t* fetched_bytes, uint64_t* fetches) {
+        std::lock_guard<std::mutex> lock(mutex);
+        *fetched_bytes = fetched_nbytes;
+        *fetches = nb_fetches;
+    }
+
+    const uint64_t size;
+    const size_t chunk_size;
+    const unsigned readahead; ///< Most chunks fetched in the background after those required
+    const size_t cache_size; ///< 0 for no limit
+
+protected:
+    static constexpr size_t min_chunk_size = 1UL << 20; ///< Deflate blocks are much shorter
+    static constexpr unsigned nb_fetchers = 4;
+    static constexpr unsigned nb_attempts = 3;
+
+    enum chunk_state : uint8_t {
+        absent,
+        queued, ///< To read ahead, whoever needs it first fetches it
+        pending, ///< Being fetched
+        ready
+    };
+
+    struct chunk {
+        chunk_state state = absent;
+        unsigned pins = 0; ///< Windows holding it
+        uint64_t last_use = 0;
+    };
+
+    void move(ranged_window& window, size_t first, size_t last) {
+        // reading ahead is only worth it once the decompressor streams through the input
+        const bool in_order = window.first <= window.last && first >= window.first && first <= window.last + 1;
+        window.sequential = in_order ? std::min(window.sequential + 1, readahead) : 0;
+
+        std::unique_lock<std::mutex> lock(mutex);
+        for (size_t c = first; c <= last; c++) {
+            chunks[c].pins++;
+            chunks[c].last_use = ++clock;
+        }
+        for (size_t c = window.first; c <= window.ahead; c++)
+            chunks[c].pins--;
+        window.first = first;
+        window.last = last;
+        window.ahead = last;
+
+        for (size_t c = first; c <= last; c++) {
+            while (chunks[c].state != ready) {
+                if (chunks[c].state == pending)
+                    fetched.wait(lock);
+                else if (!fetch(lock, c)) {
+                    fprintf(stderr, "unable to fetch bytes %lu to %lu of the input\n",
+                            (unsigned long)(c * chunk_size), (unsigned long)(chunk_end(c) - 1));
+                    exit(1);
+                }
+            }
+        }
+
+        const size_t ahead = std::min(last + window.sequential, chunks.size() - 1);
+        for (size_t c = last + 1; c <= ahead; c++) {
+            if (uint64_t(c) * chunk_size >= window.ahead_end)
+                break;
+            if (chunks[c].state == absent && cache_size != 0 && (held() + 1) * chunk_size > cache_size)
+                break;
+            chunks[c].pins++;
+            chunks[c].last_use = ++clock;
+            window.ahead = c;
+            if (chunks[c].state != absent)
+                continue;
+            chunks[c].state = queued;
+            nb_in_flight++;
+            queue.push_back(c);
+            to_fetch.notify_one();
+        }
+    }
+
+    /// Chunks that can't be dropped to make room: those held by a window, and those being fetched
+    size_t held() const {
+        size_t nb_held = nb_in_flight;
+        for (size_t c : resident)
+            nb_held += chunks[c].pins != 0;
+        return nb_held;
+    }
+
+    uint64_t chunk_end(size_t c) const
+    { return std::min(uint64_t(c + 1) * chunk_size, size); }
+
+    /// Fetch chunk 'c', with the mutex held by 'lock' but released meanwhile
+    bool fetch(std::unique_lock<std::mutex>& lock, size_t c) {
+        const uint64_t offset = uint64_t(c) * chunk_size;
+        const size_t len = chunk_end(c) - offset;
+        if (chunks[c].state == absent)
+            nb_in_flight++;
+        chunks[c].state = pending;
+        evict(); // room for it
+        lock.unlock();
+        unsigned attempts = 0;
+        bool ok = false;
+        while (!ok && attempts < nb_attempts) {
+            ok = read_range(ctx, offset, mem + offset, len) == 0;
+            attempts++;
+        }
+        lock.lock();
+
+        nb_fetches += attempts;
+        nb_in_flight--;
+        if (ok) {
+            chunks[c].state = ready;
+            fetched_nbytes += len;
+            resident.push_back(c);
+            memory_accounting::instance().allocated(LIBDEFLATE_MEMORY_INPUT, chunk_size);
+        } else
+            chunks[c].state = absent; // whoever needs it tries again, and gives up
+        fetched.notify_all();
+        return ok;
+    }
+
+    /// Drop the least recently used chunks no window holds, to fit in the cache along with those being fetched
+    void evict() {
+        while (cache_size != 0 && (resident.size() + nb_in_flight) * chunk_size > cache_size) {
+            size_t victim = resident.size();
+            for (size_t i = 0; i < resident.size(); i++) {
+                const chunk& candidate = chunks[resident[i]];
+                if (candidate.state == ready && candidate.pins == 0 &&
+                    (victim == resident.size() || candidate.last_use < chunks[resident[victim]].last_use))
+                    victim = i;
+            }
+            if (victim == resident.size())
+                return; // all held, the cache grows for now
+
+            const size_t c = resident[victim];
+            madvise(mem + uint64_t(c) * chunk_size, chunk_end(c) - uint64_t(c) * chunk_size, MADV_DONTNEED);
+            chunks[c].state = absent;
+            resident[victim] = resident.back();
+            resident.pop_back();
+            memory_accounting::instance().released(LIBDEFLATE_MEMORY_INPUT, chunk_size);
+        }
+    }
+
+    /// Body of the background fetchers, serving the read-ahead queue
+    void fetch_ahead() {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            to_fetch.wait(lock, [this]() { return stopping || !queue.empty(); });
+            if (stopping)
+                return;
+            const size_t c = queue.front();
+            queue.pop_front();
+            if (chunks[c].state == queued)
+                fetch(lock, c);
+        }
+    }
+
+    const libdeflate_read_range_func read_range;
+    void* const ctx;
+    byte* mem = nullptr;
+
+    std::mutex mutex;
+    std::condition_variable fetched; ///< A chunk was fetched, or failed to be
+    std::condition_variable to_fetch; ///< Read-ahead was requested
+    std::vector<chunk> chunks;
+    std::vector<size_t> resident; ///< Fetched chunks, in no particular order
+    std::deque<size_t> queue; ///< Chunks to read ahead
+    size_t nb_in_flight = 0; ///< Chunks queued or being fetched
+    uint64_t clock = 0;
+    uint64_t fetched_nbytes = 0;
+    uint64_t nb_fetches = 0;
+    bool stopping = false;
+    std::vector<std::thread> fetchers;
+};
+
+/// Have 'd', and the copies made of it afterwards, fetch what they decode from 'input' (or stop, if NULL)
+void set_ranged_input(struct libdeflate_decompressor* d, struct libdeflate_ranged_input* input);
+
+/// Make [p, p+len) readable for 'd', if its input is a ranged input
+void require_input(struct libdeflate_decompressor* d, const byte* p, size_t len);
+
+/// Have 'd' read ahead its ranged input, if any, only before 'end', not at all if it is the start, or all if NULL
+void limit_readahead(struct libdeflate_decompressor* d, const byte* end);
+
+
+#endif // RANGED_INPUT_HPP
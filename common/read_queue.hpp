@@ -0,0 +1,183 @@
+#ifndef READ_QUEUE_HPP
+#define READ_QUEUE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include <time.h>
+#include <unistd.h>
+
+#include "libdeflate.h"
+#include "memory_accounting.hpp"
+
+
+/**
+ * Distributes the resolved reads of a decompression, by batches of
+ * newline-terminated reads, among consumer threads: each batch goes to a single
+ * consumer, whichever asks first. The queue is a bounded ring where producers
+ * and consumers claim their slot with a compare-and-swap on its position and
+ * hand it over through a per-slot sequence number (Vyukov's MPMC queue), so no
+ * thread ever holds a lock. A full queue makes the decoding threads wait for the
+ * consumers, and an empty one the consumers for the decoding, backing off from
+ * yielding to short sleeps.
+ */
+struct libdeflate_read_queue {
+    static constexpr size_t cache_line = 64;
+
+    libdeflate_read_queue(unsigned capacity, size_t batch_size) :
+        mask(round_capacity(capacity) - 1),
+        batch_size(batch_size != 0 ? batch_size : default_batch_size()),
+        cells(mask + 1)
+    {
+        for (size_t i = 0; i <= mask; i++)
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    ~libdeflate_read_queue() {
+        libdeflate_read_batch* b;
+        while ((b = try_pop()) != nullptr)
+            release(b);
+    }
+
+    /// Queue copies of [data, data+len), cut at newlines into batches of about 'batch_size'
+    void publish(const byte* data, size_t len) {
+        while (len > 0) {
+            size_t n = len;
+            if (n > batch_size) {
+                const void* nl = memrchr(data, '\n', batch_size);
+                if (nl == nullptr)
+                    nl = memchr(data + batch_size, '\n', len - batch_size);
+                n = nl != nullptr ? static_cast<const byte*>(nl) - data + 1 : len;
+            }
+            push(make_batch(data, n));
+            data += n;
+            len -= n;
+        }
+    }
+
+    /// Next batch, waiting for one, or nullptr once the queue is closed and empty
+    libdeflate_read_batch* pop() {
+        for (unsigned attempt = 0;; attempt++) {
+            libdeflate_read_batch* b = try_pop();
+            if (b != nullptr)
+                return b;
+            if (closed.load(std::memory_order_acquire))
+                return try_pop(); // what was pushed before closing
+            back_off(attempt);
+        }
+    }
+
+    void release(libdeflate_read_batch* b) {
+        accounted_delete(LIBDEFLATE_MEMORY_OUTPUT_BUFFERS, reinterpret_cast<byte*>(b),
+                         sizeof(libdeflate_read_batch) + b->len);
+    }
+
+    /// No more batches: consumers get nullptr once they took the last ones
+    void close() {
+        closed.store(true, std::memory_order_release);
+    }
+
+    /// Half of the L2 cache, so that a batch and the consumer's own data stay in it
+    static size_t default_batch_size() {
+        long l2 = -1;
+#ifdef _SC_LEVEL2_CACHE_SIZE
+        l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+        if (l2 <= 0)
+            l2 = 1L << 20;
+        return std::min(std::max(size_t(l2) / 2, size_t(64) << 10), size_t(4) << 20);
+    }
+
+protected:
+    struct cell {
+        std::atomic<size_t> sequence; ///< Position it is ready to be pushed at, or +1 once pushed
+        libdeflate_read_batch* batch;
+        char padding[cache_line - sizeof(std::atomic<size_t>) - sizeof(libdeflate_read_batch*)]; ///< One per cache line
+    };
+
+    static size_t round_capacity(unsigned capacity) {
+        size_t size = 2;
+        while (size < capacity)
+            size *= 2;
+        return size;
+    }
+
+    static libdeflate_read_batch* make_batch(const byte* data, size_t len) {
+        byte* mem = accounted_new<byte>(LIBDEFLATE_MEMORY_OUTPUT_BUFFERS, sizeof(libdeflate_read_batch) + len);
+        libdeflate_read_batch* b = reinterpret_cast<libdeflate_read_batch*>(mem);
+        memcpy(mem + sizeof(libdeflate_read_batch), data, len);
+        b->reads = mem + sizeof(libdeflate_read_batch);
+        b->len = len;
+        return b;
+    }
+
+    static void back_off(unsigned attempt) {
+        if (attempt < 64) {
+            std::this_thread::yield();
+        } else {
+            struct timespec delay = {0, 50000};
+            nanosleep(&delay, nullptr);
+        }
+    }
+
+    void push(libdeflate_read_batch* b) {
+        for (unsigned attempt = 0; !try_push(b); attempt++)
+            back_off(attempt);
+    }
+
+    bool try_push(libdeflate_read_batch* b) {
+        size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        cell* c;
+        for (;;) {
+            c = &cells[pos & mask];
+            const intptr_t diff = intptr_t(c->sequence.load(std::memory_order_acquire)) - intptr_t(pos);
+            if (diff == 0) {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                return false; // full
+            } else {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        c->batch = b;
+        c->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    libdeflate_read_batch* try_pop() {
+        size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+        cell* c;
+        for (;;) {
+            c = &cells[pos & mask];
+            const intptr_t diff = intptr_t(c->sequence.load(std::memory_order_acquire)) - intptr_t(pos + 1);
+            if (diff == 0) {
+                if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                return nullptr; // empty
+            } else {
+                pos = dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        libdeflate_read_batch* b = c->batch;
+        c->sequence.store(pos + mask + 1, std::memory_order_release);
+        return b;
+    }
+
+    const size_t mask;
+    const size_t batch_size;
+    std::vector<cell> cells;
+    char padding0[cache_line];
+    std::atomic<size_t> enqueue_pos{0}; ///< Contended by the producers
+    char padding1[cache_line];
+    std::atomic<size_t> dequeue_pos{0}; ///< Contended by the consumers
+    char padding2[cache_line];
+    std::atomic<bool> closed{false};
+};
+
+
+#endif // READ_QUEUE_HPP
@@ -0,0 +1,289 @@
+#ifndef SHM_RING_HPP
+#define SHM_RING_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <errno.h>
+#include <signal.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libdeflate.h"
+
+
+/**
+ * Ring of batches of newline-terminated reads in a memfd, which other
+ * processes map to read the batches in place. Each batch is stored contiguously
+ * after its 8-byte length, a length of ~0 meaning that the next batch starts
+ * back at the beginning of the ring. Positions only grow: the producer publishes
+ * by moving 'write_pos', and each consumer releases what it has read by moving
+ * its own 'read_pos', the producer waiting for the slowest one before reusing
+ * the space. Waiting is done on futexes, bumped whenever there is something new.
+ * Atomics of 32 and 64 bits are lock-free, so they work across processes. A
+ * consumer which exits without leaving is noticed by its pid when the producer
+ * waits for space, and its slot freed.
+ */
+struct libdeflate_shm_ring {
+    static constexpr uint64_t magic_number = 0x474e495246524f46ULL; // "FORFRING"
+    static constexpr uint64_t wrap_marker = ~0ULL;
+    static constexpr unsigned max_consumers = 64;
+
+    struct consumer_slot {
+        std::atomic<uint32_t> state; ///< free, joining or active
+        int32_t pid; ///< Of the consumer process, set before it is active
+        std::atomic<uint64_t> read_pos;
+        char padding2[48]; ///< One per cache line
+    };
+
+    /// Start of the memfd, followed by the data
+    struct header {
+        uint64_t magic;
+        uint64_t capacity; ///< Of the data, a multiple of 8
+        std::atomic<uint64_t> write_pos;
+        std::atomic<uint32_t> data_seq; ///< Futex, bumped when a batch is published or the ring closed
+        std::atomic<uint32_t> space_seq; ///< Futex, bumped when a consumer releases space, joins or leaves
+        std::atomic<uint32_t> closed;
+        std::atomic<uint32_t> nb_joined;
+        char padding[24];
+        consumer_slot consumers[max_consumers];
+    };
+
+    enum { slot_free = 0, slot_joining = 1, slot_active = 2 };
+
+    /// Create a ring of about 'size' bytes in a new memfd, nullptr on error
+    static libdeflate_shm_ring* create(size_t size) {
+        const size_t capacity = std::max(size & ~size_t(7), size_t(1) << 16);
+        int fd = int(syscall(SYS_memfd_create, "libdeflate-reads", 0));
+        if (fd < 0 || ftruncate(fd, sizeof(header) + capacity) != 0) {
+            fprintf(stderr, "cannot create the shared-memory ring: %s\n", strerror(errno));
+            if (fd >= 0)
+                close(fd);
+            return nullptr;
+        }
+        libdeflate_shm_ring* ring = map(fd);
+        if (ring == nullptr)
+            return nullptr;
+        ring->hdr->magic = magic_number;
+        ring->hdr->capacity = capacity;
+        ring->capacity = capacity;
+        return ring;
+    }
+
+    /// Map the ring of the memfd 'fd' (which it then owns), nullptr if it isn't one
+    static libdeflate_shm_ring* attach(int fd) {
+        libdeflate_shm_ring* ring = map(fd);
+        if (ring == nullptr)
+            return nullptr;
+        if (ring->hdr->magic != magic_number || sizeof(header) + ring->hdr->capacity > ring->mapped_size) {
+            fprintf(stderr, "not a shared-memory ring of reads\n");
+            delete ring;
+            return nullptr;
+        }
+        ring->capacity = ring->hdr->capacity;
+        return ring;
+    }
+
+    ~libdeflate_shm_ring() {
+        munmap(hdr, mapped_size);
+        close(fd);
+    }
+
+    /// Producer side: copy [data, data+len) to the ring, cut at newlines into batches of at most a quarter of it
+    void publish(const byte* data, size_t len) {
+        const size_t max_batch = capacity / 4 - 8;
+        std::lock_guard<std::mutex> lock(producer_mutex); // the decoding threads
+        while (len > 0) {
+            size_t n = len;
+            if (n > max_batch) {
+                const void* nl = memrchr(data, '\n', max_batch);
+                n = nl != nullptr ? static_cast<const byte*>(nl) - data + 1 : max_batch;
+            }
+            push(data, n);
+            data += n;
+            len -= n;
+        }
+    }
+
+    /// Producer side: wait for 'n' consumers to have joined
+    void wait_consumers(unsigned n) {
+        for (;;) {
+            const uint32_t seq = hdr->space_seq.load(std::memory_order_acquire);
+            if (hdr->nb_joined.load(std::memory_order_acquire) >= n)
+                return;
+            futex_wait(hdr->space_seq, seq);
+        }
+    }
+
+    /// Producer side: no more batches
+    void close_ring() {
+        hdr->closed.store(1, std::memory_order_release);
+        bump(hdr->data_seq);
+    }
+
+    /// Consumer side: take a slot, reading from the next batch published on, returns its index or -1
+    int join() {
+        for (unsigned i = 0; i < max_consumers; i++) {
+            uint32_t expected = slot_free;
+            consumer_slot& slot = hdr->consumers[i];
+            if (!slot.state.compare_exchange_strong(expected, slot_joining))
+                continue;
+            slot.pid = int32_t(getpid());
+            // active before reading the position, so that the producer can't reuse the space in between
+            slot.read_pos.store(hdr->write_pos.load(std::memory_order_acquire), std::memory_order_relaxed);
+            slot.state.store(slot_active, std::memory_order_seq_cst);
+            slot.read_pos.store(hdr->write_pos.load(std::memory_order_seq_cst), std::memory_order_release);
+            hdr->nb_joined.fetch_add(1);
+            bump(hdr->space_seq);
+            return int(i);
+        }
+        fprintf(stderr, "no free consumer slot in the shared-memory ring\n");
+        return -1;
+    }
+
+    /// Consumer side: wait for the next batch, false once the ring is closed and every batch read
+    bool next(unsigned consumer, const byte** reads, size_t* len) {
+        consumer_slot& slot = hdr->consumers[consumer];
+        for (;;) {
+            uint64_t pos = slot.read_pos.load(std::memory_order_relaxed);
+            const uint32_t seq = hdr->data_seq.load(std::memory_order_acquire);
+            if (pos < hdr->write_pos.load(std::memory_order_acquire)) {
+                const size_t offset = pos % capacity;
+                const uint64_t length = load_length(offset);
+                if (length == wrap_marker) {
+                    slot.read_pos.store(pos + capacity - offset, std::memory_order_release);
+                    bump(hdr->space_seq);
+                    continue;
+                }
+                *reads = data() + offset + 8;
+                *len = length;
+                return true;
+            }
+            if (hdr->closed.load(std::memory_order_acquire))
+                return false;
+            futex_wait(hdr->data_seq, seq);
+        }
+    }
+
+    /// Consumer side: done with the batch returned by next()
+    void advance(unsigned consumer) {
+        consumer_slot& slot = hdr->consumers[consumer];
+        const uint64_t pos = slot.read_pos.load(std::memory_order_relaxed);
+        slot.read_pos.store(pos + record_size(load_length(pos % capacity)), std::memory_order_release);
+        bump(hdr->space_seq);
+    }
+
+    /// Consumer side: stop holding the producer back
+    void leave(unsigned consumer) {
+        hdr->consumers[consumer].state.store(slot_free, std::memory_order_release);
+        bump(hdr->space_seq);
+    }
+
+    int fd;
+
+protected:
+    libdeflate_shm_ring(int fd, header* hdr, size_t mapped_size) :
+        fd(fd), hdr(hdr), mapped_size(mapped_size), capacity(0)
+    {}
+
+    static libdeflate_shm_ring* map(int fd) {
+        struct stat st;
+        void* p = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(header))
+            p = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) {
+            fprintf(stderr, "cannot map the shared-memory ring\n");
+            close(fd);
+            return nullptr;
+        }
+        return new libdeflate_shm_ring(fd, static_cast<header*>(p), st.st_size);
+    }
+
+    byte* data() const
+    { return reinterpret_cast<byte*>(hdr + 1); }
+
+    uint64_t load_length(size_t offset) const {
+        uint64_t length;
+        memcpy(&length, data() + offset, 8);
+        return length;
+    }
+
+    static uint64_t record_size(uint64_t length)
+    { return 8 + ((length + 7) & ~uint64_t(7)); }
+
+    static void futex_wait(std::atomic<uint32_t>& word, uint32_t seq) {
+        struct timespec timeout = {0, 100 * 1000 * 1000}; // to check for dead consumers every so often
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT, seq, &timeout, nullptr, 0);
+    }
+
+    static void bump(std::atomic<uint32_t>& word) {
+        word.fetch_add(1, std::memory_order_release);
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+    }
+
+    /// Read position of the slowest consumer, or 'write_pos' if there is none
+    uint64_t min_read_pos(uint64_t write_pos) const {
+        uint64_t min_pos = write_pos;
+        for (unsigned i = 0; i < max_consumers; i++)
+            if (hdr->consumers[i].state.load(std::memory_order_seq_cst) == slot_active)
+                min_pos = std::min(min_pos, hdr->consumers[i].read_pos.load(std::memory_order_acquire));
+        return min_pos;
+    }
+
+    /// Free the slots of the consumers which exited without leaving
+    void reap_dead_consumers() {
+        for (unsigned i = 0; i < max_consumers; i++) {
+            consumer_slot& slot = hdr->consumers[i];
+            uint32_t expected = slot_active;
+            if (slot.state.load(std::memory_order_acquire) == slot_active
+                && kill(slot.pid, 0) != 0 && errno == ESRCH
+                && slot.state.compare_exchange_strong(expected, slot_free)) {
+                fprintf(stderr, "consumer process %d of the shared-memory ring is gone, releasing its slot\n", int(slot.pid));
+            }
+        }
+    }
+
+    void push(const byte* batch, size_t len) {
+        const uint64_t pos = hdr->write_pos.load(std::memory_order_relaxed);
+        const size_t offset = pos % capacity;
+        const uint64_t size = record_size(len);
+        const uint64_t skip = offset + size > capacity ? capacity - offset : 0;
+
+        for (;;) {
+            const uint32_t seq = hdr->space_seq.load(std::memory_order_acquire);
+            if (pos + skip + size - min_read_pos(pos) <= capacity)
+                break;
+            reap_dead_consumers();
+            if (pos + skip + size - min_read_pos(pos) <= capacity)
+                break;
+            futex_wait(hdr->space_seq, seq);
+        }
+
+        if (skip != 0) {
+            const uint64_t marker = wrap_marker;
+            memcpy(data() + offset, &marker, 8);
+        }
+        byte* record = data() + (pos + skip) % capacity;
+        const uint64_t length = len;
+        memcpy(record + 8, batch, len);
+        memcpy(record, &length, 8);
+        hdr->write_pos.store(pos + skip + size, std::memory_order_release);
+        bump(hdr->data_seq);
+    }
+
+    header* const hdr;
+    const size_t mapped_size;
+    size_t capacity;
+    std::mutex producer_mutex;
+};
+
+
+#endif // SHM_RING_HPP
@@ -2,11 +2,23 @@
 #define SYNCHRONIZER_HPP
 
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
 
 
 /// Keep track of where to end the decoding in the current thread
 struct alignas(64) synchronizer {
 
+    /// Reads output by a thread and the ones before it, and the newlines of the blocks they output reads from
+    struct read_tally {
+        size_t nb_reads = 0;
+        size_t nb_newlines = 0;
+        bool from_start = true; ///< The first thread decoded from the start of the stream
+        bool resolved = true; ///< Every undetermined newline was resolved
+    };
+
     // Post method
     void signal_first_decoded_sequence(size_t in_pos_blk, unsigned _first_seq_block_pos) {
         blk_start_in_pos.store(in_pos_blk, std::memory_order_release);
@@ -27,9 +39,60 @@ struct alignas(64) synchronizer {
         return block_pos >= first_seq_block_pos.load(std::memory_order_acquire);
     }
 
+    /** The next thread asks for the 32K of data preceding the block it started
+     * decoding at (its unknown initial context), given as a bit position
+     */
+    void request_context(size_t in_pos_bits) {
+        context_in_pos_bits.store(in_pos_bits, std::memory_order_release);
+    }
+
+    /// Observer method returning true if the next thread started decoding at that block
+    bool wants_context(size_t in_pos_bits) const {
+        return in_pos_bits == context_in_pos_bits.load(std::memory_order_acquire);
+    }
+
+    /// Post method, nullptr if the context couldn't be determined, with the reads tallied up to this thread
+    void provide_context(const unsigned char* window, const read_tally& reads) {
+        std::lock_guard<std::mutex> lock(context_mutex);
+        if (window != nullptr)
+            memcpy(context, window, sizeof(context));
+        tally = reads;
+        context_available = window != nullptr;
+        context_provided = true;
+        context_cv.notify_all();
+    }
+
+    /// Blocks until the previous thread provided the context, returns nullptr if it couldn't
+    const unsigned char* wait_context() {
+        std::unique_lock<std::mutex> lock(context_mutex);
+        context_cv.wait(lock, [this]{ return context_provided; });
+        return context_available ? context : nullptr;
+    }
+
+    /// Blocks until the previous thread provided the context or 'timeout' elapsed, returns whether it did
+    bool wait_context_for(std::chrono::milliseconds timeout) {
+        std::unique_lock<std::mutex> lock(context_mutex);
+        return context_cv.wait_for(lock, timeout, [this]{ return context_provided; });
+    }
+
+    /// Blocks until the previous thread provided the context, returns the reads it tallied
+    read_tally wait_tally() {
+        std::unique_lock<std::mutex> lock(context_mutex);
+        context_cv.wait(lock, [this]{ return context_provided; });
+        return tally;
+    }
+
 protected:
     std::atomic<size_t> blk_start_in_pos = {~0UL};
     std::atomic<unsigned> first_seq_block_pos = {~0U};
+
+    std::atomic<size_t> context_in_pos_bits = {~0UL};
+    std::mutex context_mutex;
+    std::condition_variable context_cv;
+    bool context_provided = false;
+    bool context_available = false;
+    read_tally tally;
+    unsigned char context[1 << 15];
 };
 
 
@@ -0,0 +1,185 @@
+#ifndef WINDOW_CACHE_HPP
+#define WINDOW_CACHE_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <list>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "libdeflate.h"
+#include "memory_accounting.hpp"
+
+
+/**
+ * 32K windows preceding some blocks of the inputs decoded so far, keyed by the
+ * bit position of the block, so that a random access near a block that was
+ * already reached restarts from it instead of searching for a block and decoding
+ * 20 more. A decompression caches the window of the first block it outputs the
+ * reads of, then one about every 'spacing' bytes of input, once their reads are
+ * resolved, and the least recently used windows are dropped to stay under
+ * 'max_memory'. Like the window of a checkpoint, a window may keep undetermined
+ * characters (such as in quality lines): restarting from it gives what decoding
+ * on from there did, but only a determined window can be used by a thread whose
+ * initial context is to be provided by the previous one.
+ */
+struct libdeflate_window_cache {
+    static constexpr size_t window_size = 1UL << 15;
+    static constexpr size_t spacing = 1UL << 20;
+    static constexpr size_t reach = 2 * spacing; ///< About the 20 blocks a random access skips, which it may restart across
+    static constexpr size_t entry_size = window_size + 64; ///< Accounted for a window and its bookkeeping
+
+    explicit libdeflate_window_cache(size_t max_memory) :
+        max_entries(std::max(max_memory / entry_size, size_t(1)))
+    {}
+
+    ~libdeflate_window_cache() {
+        memory_accounting::instance().released(LIBDEFLATE_MEMORY_WINDOW_CACHE, entries.size() * entry_size);
+    }
+
+    /**
+     * Random accesses from bit 'from' to bit 'to', where their search finds the block they take first, which output
+     * the reads of a cached block first, after decoding the blocks ending at the bytes 'block_ends' from there
+     */
+    struct seek_start {
+        size_t from, to;
+        std::vector<size_t> block_ends;
+
+        seek_start() : from(~0UL), to(0) {}
+
+        bool empty() const { return from > to; }
+    };
+
+    /// Identifies an input by its size and last 8 bytes, which are in the gzip footer of a whole member
+    static uint64_t input_key(const byte* in, size_t in_nbytes) {
+        uint64_t key = in_nbytes * 0x9E3779B97F4A7C15ULL;
+        for (size_t i = in_nbytes >= 8 ? in_nbytes - 8 : 0; i < in_nbytes; i++)
+            key = (key ^ uint64_t(in[i])) * 0x100000001B3ULL;
+        return key;
+    }
+
+    /**
+     * Copy to 'window' the window of a cached block near bit 'from_bits' of
+     * 'input', no further than 'reach' bytes, returns the bit position of the
+     * block or ~0 if there is none. Without a previous thread, this is the block
+     * a random access from 'from_bits' outputs the reads of first, when it was
+     * cached by an access starting there, whose 'block_ends' are copied to
+     * 'skipped_block_ends', else the nearest block at or before 'from_bits',
+     * from which the caller decodes without output up to that first block. With
+     * a previous thread, which decodes up to our first block, it is the first
+     * determined block at or after 'from_bits'
+     */
+    size_t find(uint64_t input, size_t from_bits, bool previous_thread, std::vector<byte>& window,
+                std::vector<size_t>& skipped_block_ends) {
+        std::lock_guard<std::mutex> lock(mutex);
+        nb_lookups++;
+        auto it = entries.end();
+        if (previous_thread) {
+            it = entries.lower_bound(key(input, from_bits));
+            while (it != entries.end() && it->first.first == input && it->first.second <= from_bits + reach * 8
+                   && !it->second.determined)
+                ++it;
+            if (it != entries.end() && (it->first.first != input || it->first.second > from_bits + reach * 8))
+                it = entries.end();
+        } else {
+            auto after = entries.upper_bound(key(input, from_bits));
+            for (it = after; it != entries.end() && it->first.first == input
+                    && it->first.second <= from_bits + reach * 8; ++it)
+                if (it->second.seeks.from <= from_bits && from_bits <= it->second.seeks.to)
+                    break;
+            if (it != entries.end() && (it->first.first != input || it->first.second > from_bits + reach * 8))
+                it = entries.end();
+            if (it == entries.end() && after != entries.begin()) {
+                it = std::prev(after);
+                if (it->first.first != input || it->first.second + reach * 8 < from_bits)
+                    it = entries.end();
+            }
+        }
+        if (it == entries.end())
+            return ~0UL;
+        nb_hits++;
+        lru.splice(lru.end(), lru, it->second.lru);
+        window = it->second.window;
+        if (it->first.second > from_bits)
+            skipped_block_ends = it->second.seeks.block_ends;
+        return it->first.second;
+    }
+
+    /**
+     * Cache the window preceding the block at bit 'bits' of 'input', unless one as good is cached close to it. If
+     * 'seeks' is not empty, the block is the first one whose reads these random accesses output, which then restart
+     * from it: it is cached even close to others
+     */
+    void insert(uint64_t input, size_t bits, const byte* window, bool determined,
+                const seek_start& seeks = seek_start()) {
+        std::lock_guard<std::mutex> lock(mutex);
+        const size_t margin = seeks.empty() ? spacing * 8 / 2 : 0;
+        auto it = entries.lower_bound(key(input, bits > margin ? bits - margin : 0));
+        if (it != entries.end() && it->first.first == input && it->first.second <= bits + margin) {
+            entry& e = it->second;
+            lru.splice(lru.end(), lru, e.lru);
+            if (!seeks.empty()) {
+                if (e.seeks.empty())
+                    e.seeks = seeks;
+                e.seeks.from = std::min(e.seeks.from, seeks.from);
+                e.seeks.to = std::max(e.seeks.to, seeks.to);
+            }
+            if (e.determined || !determined)
+                return;
+            if (it->first.second == bits) {
+                e.window.assign(window, window + window_size);
+                e.determined = true;
+                return;
+            }
+            if (!e.seeks.empty()) // kept for the accesses it starts
+                return;
+            lru.erase(e.lru);
+            entries.erase(it);
+            memory_accounting::instance().released(LIBDEFLATE_MEMORY_WINDOW_CACHE, entry_size);
+        }
+
+        if (entries.size() >= max_entries) {
+            entries.erase(lru.front());
+            lru.pop_front();
+        } else
+            memory_accounting::instance().allocated(LIBDEFLATE_MEMORY_WINDOW_CACHE, entry_size);
+        it = entries.emplace(key(input, bits), entry()).first;
+        it->second.window.assign(window, window + window_size);
+        it->second.determined = determined;
+        it->second.seeks = seeks;
+        it->second.lru = lru.insert(lru.end(), it->first);
+    }
+
+    void stats(uint64_t* hits, uint64_t* lookups) {
+        std::lock_guard<std::mutex> lock(mutex);
+        *hits = nb_hits;
+        *lookups = nb_lookups;
+    }
+
+protected:
+    typedef std::pair<uint64_t, size_t> entry_key; ///< Input, bit position of the block
+
+    static entry_key key(uint64_t input, size_t bits)
+    { return entry_key(input, bits); }
+
+    struct entry {
+        std::vector<byte> window;
+        bool determined = false; ///< Has no undetermined characters
+        seek_start seeks; ///< The random accesses which output the reads of the block first
+        std::list<entry_key>::iterator lru;
+    };
+
+    const size_t max_entries;
+    std::mutex mutex;
+    std::map<entry_key, entry> entries;
+    std::list<entry_key> lru; ///< Least recently used first
+    uint64_t nb_hits = 0;
+    uint64_t nb_lookups = 0;
+};
+
+
+#endif // WINDOW_CACHE_HPP
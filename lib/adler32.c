@@ -86,8 +86,7 @@
 
 
 
-#define NUM_IMPLS (NEED_GENERIC_IMPL + NEED_SSE2_IMPL + NEED_AVX2_IMPL + \
-		   NEED_NEON_IMPL)
+#define NUM_IMPLS (NEED_GENERIC_IMPL + NEED_SSE2_IMPL + NEED_AVX2_IMPL)
 
 
 
@@ -149,9 +148,9 @@ static u32 dispatch(u32 adler, const byte *buffer, size_t size)
 #endif /* NUM_IMPLS != 1 */
 
 LIBDEFLATEAPI u32
-libdeflate_adler32(u32 adler, const byte *buffer, size_t size)
+libdeflate_adler32(u32 adler, const void *buffer, size_t size)
 {
 	if (buffer == NULL) /* return initial value */
 		return 1;
-	return adler32_impl(adler, buffer, size);
+	return adler32_impl(adler, (const byte *)buffer, size);
 }
@@ -0,0 +1,222 @@
+/*
+ * bgzf_compress.c - compress to BGZF, concurrently
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "deflate_compress.h"
+#include "gzip_constants.h"
+#include "unaligned.h"
+
+#include "libdeflate.h"
+#include <string.h>
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* BGZF members compressed by a thread between two writes */
+#define MEMBERS_PER_BATCH	64
+
+/* The empty member ending a BGZF file */
+static const u8 bgzf_eof[28] = {
+	0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00,
+	0x42, 0x43, 0x02, 0x00, 0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00,
+};
+
+/*
+ * Compress at most BGZF_BLOCK_SIZE bytes into a BGZF member at 'out', which has
+ * space for BGZF_MAX_MEMBER_SIZE bytes, and return its size.  If the data
+ * doesn't compress, it is stored in an uncompressed block, which always fits.
+ */
+static size_t
+bgzf_compress_member(struct libdeflate_compressor *c,
+		     const u8 *in, size_t in_nbytes, u8 *out)
+{
+	u8 *out_next = out + BGZF_HEADER_SIZE;
+	size_t deflate_size;
+	size_t member_size;
+
+	out[0] = GZIP_ID1;
+	out[1] = GZIP_ID2;
+	out[2] = GZIP_CM_DEFLATE;
+	out[3] = GZIP_FEXTRA;
+	put_unaligned_le32(GZIP_MTIME_UNAVAILABLE, &out[4]);
+	out[8] = 0;
+	out[9] = GZIP_OS_UNKNOWN;
+	put_unaligned_le16(BGZF_XLEN, &out[10]);
+	out[12] = BGZF_SI1;
+	out[13] = BGZF_SI2;
+	put_unaligned_le16(2, &out[14]);
+
+	deflate_size = libdeflate_deflate_compress(c, in, in_nbytes, out_next,
+						   BGZF_MAX_MEMBER_SIZE -
+						   BGZF_HEADER_SIZE -
+						   GZIP_FOOTER_SIZE);
+	if (deflate_size == 0) {
+		/* BFINAL = 1, BTYPE = 00, then LEN and NLEN */
+		*out_next++ = 1;
+		put_unaligned_le16((u16)in_nbytes, out_next);
+		put_unaligned_le16((u16)~in_nbytes, out_next + 2);
+		memcpy(out_next + 4, in, in_nbytes);
+		deflate_size = 5 + in_nbytes;
+		out_next--;
+	}
+	out_next += deflate_size;
+
+	put_unaligned_le32(libdeflate_crc32(0, in, in_nbytes), out_next);
+	put_unaligned_le32((u32)in_nbytes, out_next + 4);
+	member_size = out_next + GZIP_FOOTER_SIZE - out;
+
+	put_unaligned_le16((u16)(member_size - 1), &out[16]);
+	return member_size;
+}
+
+/*
+ * Each thread of a pool compresses a batch of consecutive members to memory
+ * with its own compressor, one round after the other, while the batches of a
+ * round are written in order, and the index entries computed from the member
+ * sizes.
+ */
+LIBDEFLATEAPI size_t
+libdeflate_bgzf_compress(int compression_level,
+			 const struct libdeflate_compress_options *options,
+			 const void *in, size_t in_nbytes, unsigned nthreads,
+			 libdeflate_write_func write, void *ctx,
+			 libdeflate_write_func write_index, void *index_ctx)
+{
+	const u8 *in_bytes = (const u8 *)in;
+	const size_t nb_members = (in_nbytes + BGZF_BLOCK_SIZE - 1) / BGZF_BLOCK_SIZE;
+	size_t out_nbytes = 0;
+	std::vector<u8> index(8);
+	bool ok = true;
+
+	nthreads = std::max(1U, std::min<unsigned>(nthreads,
+		(nb_members + MEMBERS_PER_BATCH - 1) / MEMBERS_PER_BATCH));
+
+	std::vector<libdeflate_compressor*> compressors(nthreads);
+	for (auto& c : compressors) {
+		c = libdeflate_alloc_compressor_ex(compression_level, options);
+		ok &= c != nullptr;
+	}
+	std::vector<std::vector<u8>> batches(nthreads);
+	std::vector<std::vector<u16>> sizes(nthreads); /* minus 1, as BSIZE */
+
+	/* A round starts when 'round' is incremented, from member 'round_first' */
+	std::mutex mutex;
+	std::condition_variable cv;
+	unsigned round = 0;
+	size_t round_first = 0;
+	bool stop = false;
+	std::vector<unsigned> rounds_done(nthreads, 0);
+
+	std::vector<std::thread> threads;
+	threads.reserve(nthreads);
+	for (unsigned t = 0; ok && t < nthreads; t++) {
+		threads.emplace_back([&, t]() {
+			for (unsigned r = 1; ; r++) {
+				size_t first;
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					cv.wait(lock, [&]{ return round >= r || stop; });
+					if (stop)
+						return;
+					first = round_first;
+				}
+
+				size_t begin = std::min(first + t * MEMBERS_PER_BATCH, nb_members);
+				size_t end = std::min(begin + MEMBERS_PER_BATCH, nb_members);
+				std::vector<u8>& batch = batches[t];
+				size_t batch_size = 0;
+
+				batch.resize((end - begin) * BGZF_MAX_MEMBER_SIZE);
+				sizes[t].clear();
+				for (size_t m = begin; m < end; m++) {
+					size_t start = m * BGZF_BLOCK_SIZE;
+					size_t size = bgzf_compress_member(
+						compressors[t], in_bytes + start,
+						std::min<size_t>(BGZF_BLOCK_SIZE, in_nbytes - start),
+						&batch[batch_size]);
+					sizes[t].push_back(u16(size - 1));
+					batch_size += size;
+				}
+				batch.resize(batch_size);
+
+				std::lock_guard<std::mutex> lock(mutex);
+				rounds_done[t] = r;
+				cv.notify_all();
+			}
+		});
+	}
+
+	for (size_t first = 0; ok && first < nb_members;
+	     first += size_t(nthreads) * MEMBERS_PER_BATCH) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			round_first = first;
+			round++;
+			cv.notify_all();
+		}
+		for (unsigned t = 0; t < nthreads; t++) {
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				cv.wait(lock, [&]{ return rounds_done[t] == round; });
+			}
+			if (!ok || batches[t].empty())
+				continue;
+			ok = write(ctx, batches[t].data(), batches[t].size()) == 0;
+
+			size_t m = std::min(first + t * MEMBERS_PER_BATCH, nb_members);
+			for (u16 size : sizes[t]) {
+				out_nbytes += size + 1;
+				if (++m == nb_members)
+					break;
+				index.resize(index.size() + 16);
+				put_unaligned_le64(out_nbytes, &index[index.size() - 16]);
+				put_unaligned_le64(u64(m) * BGZF_BLOCK_SIZE, &index[index.size() - 8]);
+			}
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stop = true;
+		cv.notify_all();
+	}
+	for (std::thread& thread : threads)
+		thread.join();
+
+	for (auto c : compressors)
+		libdeflate_free_compressor(c);
+
+	if (ok)
+		ok = write(ctx, bgzf_eof, sizeof(bgzf_eof)) == 0;
+	out_nbytes += sizeof(bgzf_eof);
+
+	if (ok && write_index != nullptr) {
+		put_unaligned_le64(u64(index.size() / 16), &index[0]);
+		ok = write_index(index_ctx, index.data(), index.size()) == 0;
+	}
+	return ok ? out_nbytes : 0;
+}
@@ -364,5 +364,5 @@ libdeflate_crc32(u32 remainder, const void *buffer, size_t nbytes)
 {
 	if (buffer == NULL) /* return initial value */
 		return 0;
-	return ~crc32_impl(~remainder, buffer, nbytes);
+	return ~crc32_impl(~remainder, (const u8 *)buffer, nbytes);
 }
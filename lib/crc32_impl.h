@@ -106,7 +106,7 @@ FUNCNAME_ALIGNED(u32 remainder, const __m128i *p, size_t vec_count)
 	const __v2di multipliers_2 = __v2di{ 0xF1DA05AA, 0x81256527 };
 	const __v2di multipliers_1 = __v2di{ 0xAE689191, 0xCCAA009E };
 	const __v2di final_multiplier = __v2di{ 0xB8BC6765 };
-	const __m128i mask32 = (__m128i) __v4si{ 0xFFFFFFFF };
+	const __m128i mask32 = (__m128i) __v4si{ (int)0xFFFFFFFF };
 	const __v2di barrett_reduction_constants =
 			__v2di{ 0x00000001F7011641, 0x00000001DB710641 };
 
@@ -136,7 +136,7 @@ FUNCNAME_ALIGNED(u32 remainder, const __m128i *p, size_t vec_count)
 	 * have been XOR'ed with the CRC of the first part of the message.
 	 */
 	x0 = *p++;
-	x0 ^= (__m128i) __v4si{ remainder };
+	x0 ^= (__m128i) __v4si{ (int)remainder };
 
 	if (p > end512) /* only 128, 256, or 384 bits of input? */
 		goto _128_bits_at_a_time;
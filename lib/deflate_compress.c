@@ -29,6 +29,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <chrono>
 
 #include "aligned_malloc.h"
 #include "deflate_compress.h"
@@ -65,6 +66,10 @@
 #  include "bt_matchfinder.h"
 #endif
 
+#if defined(__AVX2__) || defined(__SSE4_1__)
+#  include <immintrin.h>
+#endif
+
 /*
  * The compressor always chooses a block of at least MIN_BLOCK_LENGTH bytes,
  * except if the last block has to be shorter.
@@ -78,6 +83,24 @@
  */
 #define SOFT_MAX_BLOCK_LENGTH	300000
 
+/*
+ * Before each block, the parsers probe this many bytes for incompressible data,
+ * such as already compressed files, which they output as uncompressed blocks
+ * without searching for matches.
+ */
+#define INCOMPRESSIBLE_PROBE_LENGTH	4096
+
+/*
+ * A probe whose bytes look random is still compressible if it repeats earlier
+ * data, such as a second copy of a compressed file.  Its matches are found with
+ * a hash table of the positions of the window, inserted every
+ * INCOMPRESSIBLE_HASH_STRIDE bytes: any match longer than the stride plus 4
+ * bytes is found.  The probe is compressible once 1/16 of it is matched.
+ */
+#define INCOMPRESSIBLE_HASH_ORDER	12
+#define INCOMPRESSIBLE_HASH_STRIDE	16
+#define INCOMPRESSIBLE_MIN_MATCH_LEN	(INCOMPRESSIBLE_HASH_STRIDE + 4)
+
 /*
  * The number of observed matches or literals that represents sufficient data to
  * decide whether the current block should be terminated or not.
@@ -194,6 +217,13 @@ struct deflate_codes {
 	struct deflate_lens lens;
 };
 
+/* The litlen codewords of the match lengths with the extra length bits
+ * appended, so that a match length is added to the bitbuffer at once.  */
+struct deflate_fused_lengths {
+	u32 codewords[DEFLATE_MAX_MATCH_LEN + 1];
+	u8 lens[DEFLATE_MAX_MATCH_LEN + 1];
+};
+
 /* Symbol frequency counters for the DEFLATE Huffman codes.  */
 struct deflate_freqs {
 	u32 litlen[DEFLATE_NUM_LITLEN_SYMS];
@@ -326,9 +356,13 @@ struct block_split_stats {
 /* The main DEFLATE compressor structure  */
 struct libdeflate_compressor {
 
-	/* Pointer to the compress() implementation chosen at allocation time */
-	size_t (*impl)(struct libdeflate_compressor *,
-		       const u8 *, size_t, u8 *, size_t);
+	/* The parser of the current compression level.  It compresses the
+	 * input from its second argument up to its third one, using the data
+	 * from its first one as the window, and returns where it stopped: at
+	 * the end, or before a block to compress with another parser.  */
+	const u8 *(*impl)(struct libdeflate_compressor *,
+			  struct deflate_output_bitstream *,
+			  const u8 *, const u8 *, const u8 *);
 
 	/* Frequency counters for the current block  */
 	struct deflate_freqs freqs;
@@ -339,6 +373,9 @@ struct libdeflate_compressor {
 	/* Static Huffman codes */
 	struct deflate_codes static_codes;
 
+	/* The match lengths in the codes chosen for the block being output  */
+	struct deflate_fused_lengths fused_lengths;
+
 	/* Block split statistics for the currently pending block */
 	struct block_split_stats split_stats;
 
@@ -370,6 +407,21 @@ struct libdeflate_compressor {
 	/* The compression level with which this compressor was created.  */
 	unsigned compression_level;
 
+	/* Throughput to adapt the compression level to, in MB/s, or 0.  The
+	 * level then stays at most 'max_level'.  The input consumed and the
+	 * time spent since the last change of level are accumulated from
+	 * 'throughput_pos' and 'throughput_start_ns'.  */
+	unsigned target_mb_per_sec;
+	unsigned max_level;
+	const u8 *throughput_pos;
+	u64 throughput_start_ns;
+	u64 throughput_nbytes;
+	u64 throughput_ns;
+
+	/* End the output with an empty stored block rather than a final block,
+	 * so that more compressed data can follow, byte-aligned.  */
+	bool sync_flush;
+
 	/* Temporary space for Huffman code output  */
 	u32 precode_freqs[DEFLATE_NUM_PRECODE_SYMS];
 	u8 precode_lens[DEFLATE_NUM_PRECODE_SYMS];
@@ -687,13 +739,17 @@ sort_symbols(unsigned num_syms, const u32 restrict freqs[],
 
 	memset(counters, 0, num_counters * sizeof(counters[0]));
 
-	/* Count the frequencies.  */
+	/* Count the frequencies.  Zero frequencies are skipped: they are
+	 * usually in long runs, for which the branch is cheaper than
+	 * repeatedly incrementing the same counter.  */
 	for (sym = 0; sym < num_syms; sym++)
-		counters[MIN(freqs[sym], num_counters - 1)]++;
+		if (freqs[sym] != 0)
+			counters[MIN(freqs[sym], num_counters - 1)]++;
 
 	/* Make the counters cumulative, ignoring the zero-th, which
-	 * counted symbols with zero frequency.  As a side effect, this
-	 * calculates the number of symbols with nonzero frequency.  */
+	 * stayed zero since zero frequencies were not counted.  As a
+	 * side effect, this calculates the number of symbols with
+	 * nonzero frequency.  */
 	num_used_syms = 0;
 	for (i = 1; i < num_counters; i++) {
 		unsigned count = counters[i];
@@ -907,8 +963,34 @@ compute_length_counts(u32 restrict A[], unsigned root_idx,
 	}
 }
 
+/* Reverse the Huffman codeword 'codeword', which is 'len' bits in length.  */
+static u32
+deflate_reverse_codeword(u32 codeword, u8 len)
+{
+	/* The following branchless algorithm is faster than going bit by bit.
+	 * Note: since no codewords are longer than 16 bits, we only need to
+	 * reverse the low 16 bits of the 'u32'.  */
+	STATIC_ASSERT(DEFLATE_MAX_CODEWORD_LEN <= 16);
+
+	/* Flip adjacent 1-bit fields  */
+	codeword = ((codeword & 0x5555) << 1) | ((codeword & 0xAAAA) >> 1);
+
+	/* Flip adjacent 2-bit fields  */
+	codeword = ((codeword & 0x3333) << 2) | ((codeword & 0xCCCC) >> 2);
+
+	/* Flip adjacent 4-bit fields  */
+	codeword = ((codeword & 0x0F0F) << 4) | ((codeword & 0xF0F0) >> 4);
+
+	/* Flip adjacent 8-bit fields  */
+	codeword = ((codeword & 0x00FF) << 8) | ((codeword & 0xFF00) >> 8);
+
+	/* Return the high 'len' bits of the bit-reversed 16 bit value.  */
+	return codeword >> (16 - len);
+}
+
 /*
- * Generate the codewords for a canonical Huffman code.
+ * Generate the codewords for a canonical Huffman code, bit-reversed as DEFLATE
+ * outputs them.
  *
  * @A
  *	The output array for codewords.  In addition, initially this
@@ -954,15 +1036,18 @@ gen_codewords(u32 restrict A[], u8 restrict lens[],
 	/* Generate the codewords themselves.  We initialize the
 	 * 'next_codewords' array to provide the lexicographically first
 	 * codeword of each length, then assign codewords in symbol
-	 * order.  This produces a canonical code.  */
+	 * order.  This produces a canonical code.  The codewords are
+	 * reversed in the same pass.  */
 	next_codewords[0] = 0;
 	next_codewords[1] = 0;
 	for (len = 2; len <= max_codeword_len; len++)
 		next_codewords[len] =
 			(next_codewords[len - 1] + len_counts[len - 1]) << 1;
 
-	for (sym = 0; sym < num_syms; sym++)
-		A[sym] = next_codewords[lens[sym]]++;
+	for (sym = 0; sym < num_syms; sym++) {
+		len = lens[sym];
+		A[sym] = deflate_reverse_codeword(next_codewords[len]++, len);
+	}
 }
 
 /*
@@ -995,9 +1080,10 @@ gen_codewords(u32 restrict A[], u8 restrict lens[],
  *
  * @codewords
  *	An array of @num_syms entries in which this function will return
- *	the codeword for each symbol, right-justified and padded on the
- *	left with zeroes.  Codewords for symbols with 0 frequency will be
- *	undefined.
+ *	the codeword for each symbol, bit-reversed since DEFLATE outputs
+ *	codewords starting from their high bit into the low bits of the
+ *	bitstream, right-justified and padded on the left with zeroes.
+ *	Codewords for symbols with 0 frequency will be undefined.
  *
  * ---------------------------------------------------------------------
  *
@@ -1151,45 +1237,6 @@ deflate_reset_symbol_frequencies(struct libdeflate_compressor *c)
 	memset(&c->freqs, 0, sizeof(c->freqs));
 }
 
-/* Reverse the Huffman codeword 'codeword', which is 'len' bits in length.  */
-static u32
-deflate_reverse_codeword(u32 codeword, u8 len)
-{
-	/* The following branchless algorithm is faster than going bit by bit.
-	 * Note: since no codewords are longer than 16 bits, we only need to
-	 * reverse the low 16 bits of the 'u32'.  */
-	STATIC_ASSERT(DEFLATE_MAX_CODEWORD_LEN <= 16);
-
-	/* Flip adjacent 1-bit fields  */
-	codeword = ((codeword & 0x5555) << 1) | ((codeword & 0xAAAA) >> 1);
-
-	/* Flip adjacent 2-bit fields  */
-	codeword = ((codeword & 0x3333) << 2) | ((codeword & 0xCCCC) >> 2);
-
-	/* Flip adjacent 4-bit fields  */
-	codeword = ((codeword & 0x0F0F) << 4) | ((codeword & 0xF0F0) >> 4);
-
-	/* Flip adjacent 8-bit fields  */
-	codeword = ((codeword & 0x00FF) << 8) | ((codeword & 0xFF00) >> 8);
-
-	/* Return the high 'len' bits of the bit-reversed 16 bit value.  */
-	return codeword >> (16 - len);
-}
-
-/* Make a canonical Huffman code with bit-reversed codewords.  */
-static void
-deflate_make_huffman_code(unsigned num_syms, unsigned max_codeword_len,
-			  const u32 freqs[], u8 lens[], u32 codewords[])
-{
-	unsigned sym;
-
-	make_canonical_huffman_code(num_syms, max_codeword_len,
-				    freqs, lens, codewords);
-
-	for (sym = 0; sym < num_syms; sym++)
-		codewords[sym] = deflate_reverse_codeword(codewords[sym], lens[sym]);
-}
-
 /*
  * Build the literal/length and offset Huffman codes for a DEFLATE block.
  *
@@ -1203,17 +1250,17 @@ deflate_make_huffman_codes(const struct deflate_freqs *freqs,
 	STATIC_ASSERT(MAX_LITLEN_CODEWORD_LEN <= DEFLATE_MAX_LITLEN_CODEWORD_LEN);
 	STATIC_ASSERT(MAX_OFFSET_CODEWORD_LEN <= DEFLATE_MAX_OFFSET_CODEWORD_LEN);
 
-	deflate_make_huffman_code(DEFLATE_NUM_LITLEN_SYMS,
-				  MAX_LITLEN_CODEWORD_LEN,
-				  freqs->litlen,
-				  codes->lens.litlen,
-				  codes->codewords.litlen);
-
-	deflate_make_huffman_code(DEFLATE_NUM_OFFSET_SYMS,
-				  MAX_OFFSET_CODEWORD_LEN,
-				  freqs->offset,
-				  codes->lens.offset,
-				  codes->codewords.offset);
+	make_canonical_huffman_code(DEFLATE_NUM_LITLEN_SYMS,
+				    MAX_LITLEN_CODEWORD_LEN,
+				    freqs->litlen,
+				    codes->lens.litlen,
+				    codes->codewords.litlen);
+
+	make_canonical_huffman_code(DEFLATE_NUM_OFFSET_SYMS,
+				    MAX_OFFSET_CODEWORD_LEN,
+				    freqs->offset,
+				    codes->lens.offset,
+				    codes->codewords.offset);
 }
 
 /* Initialize c->static_codes.  */
@@ -1251,6 +1298,58 @@ deflate_get_offset_slot(struct libdeflate_compressor *c, unsigned offset)
 #endif
 }
 
+/* Fill c->fused_lengths with the litlen codewords of the match lengths in
+ * 'codes', followed by their extra length bits.  */
+static void
+deflate_fuse_lengths(struct libdeflate_compressor *c,
+		     const struct deflate_codes *codes)
+{
+	unsigned slot;
+	unsigned length;
+
+	STATIC_ASSERT(MAX_LITLEN_CODEWORD_LEN +
+		      DEFLATE_MAX_EXTRA_LENGTH_BITS <= 32);
+	for (slot = 0; slot < ARRAY_LEN(deflate_length_slot_base); slot++) {
+		unsigned base = deflate_length_slot_base[slot];
+		unsigned num_extra_bits = deflate_extra_length_bits[slot];
+		unsigned end = MIN(base + (1U << num_extra_bits),
+				   DEFLATE_MAX_MATCH_LEN + 1);
+		u32 codeword = codes->codewords.litlen[257 + slot];
+		unsigned len = codes->lens.litlen[257 + slot];
+
+		/* The last slot overwrites the entry of length 258 */
+		for (length = base; length < end; length++) {
+			c->fused_lengths.codewords[length] =
+				codeword | ((length - base) << len);
+			c->fused_lengths.lens[length] = len + num_extra_bits;
+		}
+	}
+}
+
+/* Add the offset codeword and extra offset bits of a match to the bitbuffer,
+ * at once if they fit.  The caller must make sure there is room for
+ * MAX_OFFSET_CODEWORD_LEN + DEFLATE_MAX_EXTRA_OFFSET_BITS bits.  */
+static forceinline void
+deflate_add_offset_bits(struct deflate_output_bitstream * restrict os,
+			const struct deflate_codes * restrict codes,
+			unsigned offset, unsigned offset_slot)
+{
+	unsigned len = codes->lens.offset[offset_slot];
+	bitbuf_t extra = offset - deflate_offset_slot_base[offset_slot];
+
+	if (CAN_BUFFER(MAX_OFFSET_CODEWORD_LEN +
+		       DEFLATE_MAX_EXTRA_OFFSET_BITS)) {
+		deflate_add_bits(os, codes->codewords.offset[offset_slot] |
+				 (extra << len),
+				 len + deflate_extra_offset_bits[offset_slot]);
+	} else {
+		deflate_add_bits(os, codes->codewords.offset[offset_slot], len);
+		deflate_flush_bits(os);
+		deflate_add_bits(os, extra,
+				 deflate_extra_offset_bits[offset_slot]);
+	}
+}
+
 /* Write the header fields common to all DEFLATE block types.  */
 static void
 deflate_write_block_header(struct deflate_output_bitstream *os,
@@ -1262,10 +1361,10 @@ deflate_write_block_header(struct deflate_output_bitstream *os,
 }
 
 static unsigned
-deflate_compute_precode_items(const u8 lens[restrict],
+deflate_compute_precode_items(const u8 * restrict lens,
 			      const unsigned num_lens,
-			      u32 precode_freqs[restrict],
-			      unsigned precode_items[restrict])
+			      u32 * restrict precode_freqs,
+			      unsigned * restrict precode_items)
 {
 	unsigned *itemptr;
 	unsigned run_start;
@@ -1284,11 +1383,11 @@ deflate_compute_precode_items(const u8 lens[restrict],
 		/* len = the length being repeated  */
 		len = lens[run_start];
 
-		/* Extend the run.  */
-		run_end = run_start;
-		do {
-			run_end++;
-		} while (run_end != num_lens && len == lens[run_end]);
+		/* Extend the run, a word at a time: each length is compared
+		 * with the previous one.  */
+		run_end = run_start + 1 +
+			  lz_extend(&lens[run_start + 1], &lens[run_start], 0,
+				    num_lens - run_start - 1);
 
 		if (len == 0) {
 			/* Run of zeroes.  */
@@ -1389,10 +1488,10 @@ deflate_precompute_huffman_header(struct libdeflate_compressor *c)
 
 	/* Build the precode. */
 	STATIC_ASSERT(MAX_PRE_CODEWORD_LEN <= DEFLATE_MAX_PRE_CODEWORD_LEN);
-	deflate_make_huffman_code(DEFLATE_NUM_PRECODE_SYMS,
-				  MAX_PRE_CODEWORD_LEN,
-				  c->precode_freqs, c->precode_lens,
-				  c->precode_codewords);
+	make_canonical_huffman_code(DEFLATE_NUM_PRECODE_SYMS,
+				    MAX_PRE_CODEWORD_LEN,
+				    c->precode_freqs, c->precode_lens,
+				    c->precode_codewords);
 
 	/* Count how many precode lengths we actually need to output. */
 	for (c->num_explicit_lens = DEFLATE_NUM_PRECODE_SYMS;
@@ -1451,7 +1550,8 @@ deflate_write_huffman_header(struct libdeflate_compressor *c,
 static void
 deflate_write_sequences(struct deflate_output_bitstream * restrict os,
 			const struct deflate_codes * restrict codes,
-			const struct deflate_sequence sequences[restrict],
+			const struct deflate_fused_lengths * restrict fused_lengths,
+			const struct deflate_sequence * restrict sequences,
 			const u8 * restrict in_next)
 {
 	const struct deflate_sequence *seq = sequences;
@@ -1459,9 +1559,6 @@ deflate_write_sequences(struct deflate_output_bitstream * restrict os,
 	for (;;) {
 		u32 litrunlen = seq->litrunlen_and_length & 0x7FFFFF;
 		unsigned length = seq->litrunlen_and_length >> 23;
-		unsigned length_slot;
-		unsigned litlen_symbol;
-		unsigned offset_symbol;
 
 		if (litrunlen) {
 		#if 1
@@ -1530,18 +1627,11 @@ deflate_write_sequences(struct deflate_output_bitstream * restrict os,
 
 		in_next += length;
 
-		length_slot = seq->length_slot;
-		litlen_symbol = 257 + length_slot;
-
-		/* Litlen symbol  */
-		deflate_add_bits(os, codes->codewords.litlen[litlen_symbol],
-				 codes->lens.litlen[litlen_symbol]);
-
-		/* Extra length bits  */
+		/* Litlen symbol and extra length bits  */
 		STATIC_ASSERT(CAN_BUFFER(MAX_LITLEN_CODEWORD_LEN +
 					 DEFLATE_MAX_EXTRA_LENGTH_BITS));
-		deflate_add_bits(os, length - deflate_length_slot_base[length_slot],
-				 deflate_extra_length_bits[length_slot]);
+		deflate_add_bits(os, fused_lengths->codewords[length],
+				 fused_lengths->lens[length]);
 
 		if (!CAN_BUFFER(MAX_LITLEN_CODEWORD_LEN +
 				DEFLATE_MAX_EXTRA_LENGTH_BITS +
@@ -1549,18 +1639,9 @@ deflate_write_sequences(struct deflate_output_bitstream * restrict os,
 				DEFLATE_MAX_EXTRA_OFFSET_BITS))
 			deflate_flush_bits(os);
 
-		/* Offset symbol  */
-		offset_symbol = seq->offset_symbol;
-		deflate_add_bits(os, codes->codewords.offset[offset_symbol],
-				 codes->lens.offset[offset_symbol]);
-
-		if (!CAN_BUFFER(MAX_OFFSET_CODEWORD_LEN +
-				DEFLATE_MAX_EXTRA_OFFSET_BITS))
-			deflate_flush_bits(os);
-
-		/* Extra offset bits  */
-		deflate_add_bits(os, seq->offset - deflate_offset_slot_base[offset_symbol],
-				 deflate_extra_offset_bits[offset_symbol]);
+		/* Offset symbol and extra offset bits  */
+		deflate_add_offset_bits(os, codes, seq->offset,
+					seq->offset_symbol);
 
 		deflate_flush_bits(os);
 
@@ -1590,8 +1671,6 @@ deflate_write_item_list(struct deflate_output_bitstream *os,
 		unsigned length = cur_node->item & OPTIMUM_LEN_MASK;
 		unsigned offset = cur_node->item >> OPTIMUM_OFFSET_SHIFT;
 		unsigned litlen_symbol;
-		unsigned length_slot;
-		unsigned offset_slot;
 
 		if (length == 1) {
 			/* Literal  */
@@ -1601,13 +1680,8 @@ deflate_write_item_list(struct deflate_output_bitstream *os,
 			deflate_flush_bits(os);
 		} else {
 			/* Match length  */
-			length_slot = deflate_length_slot[length];
-			litlen_symbol = 257 + length_slot;
-			deflate_add_bits(os, codes->codewords.litlen[litlen_symbol],
-					 codes->lens.litlen[litlen_symbol]);
-
-			deflate_add_bits(os, length - deflate_length_slot_base[length_slot],
-					 deflate_extra_length_bits[length_slot]);
+			deflate_add_bits(os, c->fused_lengths.codewords[length],
+					 c->fused_lengths.lens[length]);
 
 			if (!CAN_BUFFER(MAX_LITLEN_CODEWORD_LEN +
 					DEFLATE_MAX_EXTRA_LENGTH_BITS +
@@ -1615,18 +1689,9 @@ deflate_write_item_list(struct deflate_output_bitstream *os,
 					DEFLATE_MAX_EXTRA_OFFSET_BITS))
 				deflate_flush_bits(os);
 
-
 			/* Match offset  */
-			offset_slot = deflate_get_offset_slot(c, offset);
-			deflate_add_bits(os, codes->codewords.offset[offset_slot],
-					 codes->lens.offset[offset_slot]);
-
-			if (!CAN_BUFFER(MAX_OFFSET_CODEWORD_LEN +
-					DEFLATE_MAX_EXTRA_OFFSET_BITS))
-				deflate_flush_bits(os);
-
-			deflate_add_bits(os, offset - deflate_offset_slot_base[offset_slot],
-					 deflate_extra_offset_bits[offset_slot]);
+			deflate_add_offset_bits(os, codes, offset,
+						deflate_get_offset_slot(c, offset));
 
 			deflate_flush_bits(os);
 		}
@@ -1682,6 +1747,72 @@ deflate_write_uncompressed_blocks(struct deflate_output_bitstream *os,
 	} while (data_length != 0);
 }
 
+/* Whether the block ending at 'in_next' is the last one of the stream */
+static forceinline bool
+deflate_is_final_block(const struct libdeflate_compressor *c,
+		       const u8 *in_next, const u8 *in_end)
+{
+	return in_next == in_end && !c->sync_flush;
+}
+
+/*
+ * Flush the output bitstream, after an empty stored block if the compressor
+ * does a sync flush: the output then ends byte-aligned with 00 00 FF FF, and
+ * the blocks compressed next can be appended to it.
+ */
+static u32
+deflate_finish_output(const struct libdeflate_compressor *c,
+		      struct deflate_output_bitstream *os)
+{
+	if (c->sync_flush)
+		deflate_write_uncompressed_block(os, os->next, 0, false);
+	return deflate_flush_output(os);
+}
+
+/*
+ * Return the sum of freqs[i] * lens[i]: the number of bits taken by the symbols
+ * of an alphabet of 'num_syms' symbols with the frequencies 'freqs', when their
+ * codewords (or extra bits) have the lengths 'lens'.
+ */
+static forceinline u32
+deflate_dot_product(const u32 freqs[], const u8 lens[], unsigned num_syms)
+{
+	u32 cost = 0;
+	unsigned i = 0;
+
+#if defined(__AVX2__)
+	__m256i v = _mm256_setzero_si256();
+	__m128i w;
+
+	for (; i + 8 <= num_syms; i += 8) {
+		__m256i f = _mm256_loadu_si256((const __m256i *)&freqs[i]);
+		__m256i l = _mm256_cvtepu8_epi32(
+				_mm_loadl_epi64((const __m128i *)&lens[i]));
+		v = _mm256_add_epi32(v, _mm256_mullo_epi32(f, l));
+	}
+	w = _mm_add_epi32(_mm256_castsi256_si128(v),
+			  _mm256_extracti128_si256(v, 1));
+	w = _mm_add_epi32(w, _mm_shuffle_epi32(w, 0x4E));
+	w = _mm_add_epi32(w, _mm_shuffle_epi32(w, 0xB1));
+	cost = _mm_cvtsi128_si32(w);
+#elif defined(__SSE4_1__)
+	__m128i v = _mm_setzero_si128();
+
+	for (; i + 4 <= num_syms; i += 4) {
+		__m128i f = _mm_loadu_si128((const __m128i *)&freqs[i]);
+		__m128i l = _mm_cvtepu8_epi32(
+				_mm_cvtsi32_si128(load_u32_unaligned(&lens[i])));
+		v = _mm_add_epi32(v, _mm_mullo_epi32(f, l));
+	}
+	v = _mm_add_epi32(v, _mm_shuffle_epi32(v, 0x4E));
+	v = _mm_add_epi32(v, _mm_shuffle_epi32(v, 0xB1));
+	cost = _mm_cvtsi128_si32(v);
+#endif
+	for (; i < num_syms; i++)
+		cost += freqs[i] * lens[i];
+	return cost;
+}
+
 /*
  * Choose the best type of block to use (dynamic Huffman, static Huffman, or
  * uncompressed), then output it.
@@ -1700,9 +1831,9 @@ deflate_flush_block(struct libdeflate_compressor * restrict c,
 	u32 dynamic_cost = 0;
 	u32 static_cost = 0;
 	u32 uncompressed_cost = 0;
+	u32 extra_bits_cost;
 	struct deflate_codes *codes;
 	int block_type;
-	unsigned sym;
 
 	/* Tally the end-of-block symbol. */
 	c->freqs.litlen[DEFLATE_END_OF_BLOCK]++;
@@ -1713,42 +1844,39 @@ deflate_flush_block(struct libdeflate_compressor * restrict c,
 	/* Account for the cost of sending dynamic Huffman codes. */
 	deflate_precompute_huffman_header(c);
 	dynamic_cost += 5 + 5 + 4 + (3 * c->num_explicit_lens);
-	for (sym = 0; sym < DEFLATE_NUM_PRECODE_SYMS; sym++) {
-		u32 extra = deflate_extra_precode_bits[sym];
-		dynamic_cost += c->precode_freqs[sym] *
-				(extra + c->precode_lens[sym]);
-	}
-
-	/* Account for the cost of encoding literals. */
-	for (sym = 0; sym < 256; sym++) {
-		dynamic_cost += c->freqs.litlen[sym] *
-				c->codes.lens.litlen[sym];
-	}
-	for (sym = 0; sym < 144; sym++)
-		static_cost += c->freqs.litlen[sym] * 8;
-	for (; sym < 256; sym++)
-		static_cost += c->freqs.litlen[sym] * 9;
-
-	/* Account for the cost of encoding the end-of-block symbol. */
-	dynamic_cost += c->codes.lens.litlen[256];
-	static_cost += 7;
-
-	/* Account for the cost of encoding lengths. */
-	for (sym = 257; sym < 257 + ARRAY_LEN(deflate_extra_length_bits); sym++) {
-		u32 extra = deflate_extra_length_bits[sym - 257];
-		dynamic_cost += c->freqs.litlen[sym] *
-				(extra + c->codes.lens.litlen[sym]);
-		static_cost += c->freqs.litlen[sym] *
-				(extra + c->static_codes.lens.litlen[sym]);
-	}
-
-	/* Account for the cost of encoding offsets. */
-	for (sym = 0; sym < ARRAY_LEN(deflate_extra_offset_bits); sym++) {
-		u32 extra = deflate_extra_offset_bits[sym];
-		dynamic_cost += c->freqs.offset[sym] *
-				(extra + c->codes.lens.offset[sym]);
-		static_cost += c->freqs.offset[sym] * (extra + 5);
-	}
+	dynamic_cost += deflate_dot_product(c->precode_freqs, c->precode_lens,
+					    DEFLATE_NUM_PRECODE_SYMS);
+	dynamic_cost += deflate_dot_product(c->precode_freqs,
+					    deflate_extra_precode_bits,
+					    DEFLATE_NUM_PRECODE_SYMS);
+
+	/* Account for the extra bits of the lengths and offsets, which cost
+	 * the same with both codes. */
+	extra_bits_cost = deflate_dot_product(&c->freqs.litlen[257],
+					      deflate_extra_length_bits,
+					      ARRAY_LEN(deflate_extra_length_bits));
+	extra_bits_cost += deflate_dot_product(c->freqs.offset,
+					       deflate_extra_offset_bits,
+					       ARRAY_LEN(deflate_extra_offset_bits));
+
+	/* Account for the cost of encoding literals, the end-of-block symbol,
+	 * lengths and offsets.  The frequency of the end-of-block symbol is 1,
+	 * and the symbols past the last length or offset slot are unused.  */
+	dynamic_cost += deflate_dot_product(c->freqs.litlen,
+					    c->codes.lens.litlen,
+					    DEFLATE_NUM_LITLEN_SYMS);
+	dynamic_cost += deflate_dot_product(c->freqs.offset,
+					    c->codes.lens.offset,
+					    DEFLATE_NUM_OFFSET_SYMS);
+	dynamic_cost += extra_bits_cost;
+
+	static_cost += deflate_dot_product(c->freqs.litlen,
+					   c->static_codes.lens.litlen,
+					   DEFLATE_NUM_LITLEN_SYMS);
+	static_cost += deflate_dot_product(c->freqs.offset,
+					   c->static_codes.lens.offset,
+					   DEFLATE_NUM_OFFSET_SYMS);
+	static_cost += extra_bits_cost;
 
 	/* Compute the cost of using uncompressed blocks. */
 	uncompressed_cost += (-(os->bitcount + 3) & 7) + 32 +
@@ -1784,13 +1912,14 @@ deflate_flush_block(struct libdeflate_compressor * restrict c,
 			deflate_write_huffman_header(c, os);
 
 		/* Output the literals, matches, and end-of-block symbol. */
+		deflate_fuse_lengths(c, codes);
 	#if SUPPORT_NEAR_OPTIMAL_PARSING
 		if (use_item_list)
 			deflate_write_item_list(os, codes, c, block_length);
 		else
 	#endif
-			deflate_write_sequences(os, codes, c->p.g.sequences,
-						block_begin);
+			deflate_write_sequences(os, codes, &c->fused_lengths,
+						c->p.g.sequences, block_begin);
 		deflate_write_end_of_block(os, codes);
 	}
 }
@@ -1949,26 +2078,368 @@ should_end_block(struct block_split_stats *stats,
 
 /******************************************************************************/
 
+/*
+ * Return true if the 'len' bytes at 'p' look incompressible: their bytes are
+ * almost uniformly distributed, so that Huffman coding can't save anything and
+ * there are hardly any matches.  The test uses the collision entropy: with
+ * 'counts' the number of occurrences of each byte value, the sum of their
+ * squares is about len^2 / 256 for uniform bytes, and is larger as soon as a
+ * few byte values are more frequent.  The histogram is counted into four
+ * tables, so that consecutive equal bytes don't wait on each other.
+ */
+static bool
+deflate_is_incompressible(const u8 *p, size_t len)
+{
+	u32 counts[4][256];
+	u64 sum_squares = 0;
+	size_t i;
+
+	memset(counts, 0, sizeof(counts));
+	for (i = 0; i + 4 <= len; i += 4) {
+		counts[0][p[i]]++;
+		counts[1][p[i + 1]]++;
+		counts[2][p[i + 2]]++;
+		counts[3][p[i + 3]]++;
+	}
+	for (; i < len; i++)
+		counts[0][p[i]]++;
+
+	for (i = 0; i < 256; i++) {
+		u32 count = counts[0][i] + counts[1][i] +
+			    counts[2][i] + counts[3][i];
+		sum_squares += count * count;
+	}
+
+	/* Random bytes give len^2 / 256 + len; allow 1/8 more.  */
+	return sum_squares * 256 < (u64)len * len * 9 / 8 + (u64)len * 256 * 9 / 8;
+}
+
+/* An entry of the hash table of deflate_has_few_matches(): a position, relative
+ * to the beginning of the input, and the 4 bytes there, which are compared
+ * first so that stale entries don't need to be read from the input.  */
+struct incompressible_hash_entry {
+	u32 seq;
+	u32 pos;
+};
+
+/* Insert into 'hash_tab' the positions of [begin, end) that are multiples of
+ * INCOMPRESSIBLE_HASH_STRIDE, relative to 'in_base'.  */
+static void
+deflate_insert_probe_hashes(struct incompressible_hash_entry hash_tab[],
+			    const u8 *in_base, const u8 *begin, const u8 *end)
+{
+	size_t pos = (begin - in_base + INCOMPRESSIBLE_HASH_STRIDE - 1) &
+		     ~(size_t)(INCOMPRESSIBLE_HASH_STRIDE - 1);
+
+	for (; pos < (size_t)(end - in_base); pos += INCOMPRESSIBLE_HASH_STRIDE) {
+		u32 seq = load_u32_unaligned(in_base + pos);
+		struct incompressible_hash_entry *entry =
+			&hash_tab[lz_hash(seq, INCOMPRESSIBLE_HASH_ORDER)];
+
+		entry->seq = seq;
+		entry->pos = pos;
+	}
+}
+
+/*
+ * Return true if the 'len' bytes at 'p' have hardly any matches within the
+ * window, whose sampled positions are in 'hash_tab'.  Every position of the
+ * probe is looked up, and its own sampled positions are inserted as it goes,
+ * so that repeats within the probe are found too.  Hash table entries are only
+ * candidates: they may be stale or collide, so each match is checked.
+ */
+static bool
+deflate_has_few_matches(struct incompressible_hash_entry hash_tab[],
+			const u8 *in_base, const u8 *p, size_t len)
+{
+	const u8 * const end = p + len;
+	size_t matched = 0;
+
+	while (end - p >= INCOMPRESSIBLE_MIN_MATCH_LEN) {
+		size_t pos = p - in_base;
+		u32 seq = load_u32_unaligned(p);
+		struct incompressible_hash_entry *entry =
+			&hash_tab[lz_hash(seq, INCOMPRESSIBLE_HASH_ORDER)];
+		const u8 *cand = in_base + entry->pos;
+
+		/* The sequences differ at almost every position of random
+		 * data, a branch better predicted than the window test.  */
+		if (entry->seq == seq && cand < p &&
+		    p - cand <= DEFLATE_MAX_MATCH_OFFSET) {
+			unsigned match_len = lz_extend(p, cand, 4, end - p);
+
+			if (match_len >= INCOMPRESSIBLE_MIN_MATCH_LEN) {
+				matched += match_len;
+				if (matched >= len / 16)
+					return false;
+				p += match_len;
+				continue;
+			}
+		}
+		if (pos % INCOMPRESSIBLE_HASH_STRIDE == 0) {
+			entry->seq = seq;
+			entry->pos = pos;
+		}
+		p++;
+	}
+	return true;
+}
+
+/*
+ * Called by the parsers before each block: if the data at '*in_next_p' is
+ * incompressible, output it up to the next compressible probe as uncompressed
+ * blocks, advance '*in_next_p' past it and return true.  A probe is
+ * incompressible when both its byte histogram looks random and it has hardly
+ * any matches; the histogram is checked first, as it is cheaper.  'in' is the
+ * beginning of the input, which bounds the window.  The matchfinder must then
+ * be restarted, with the window before '*in_next_p'.
+ */
+static bool
+deflate_skip_incompressible(const struct libdeflate_compressor *c,
+			    struct deflate_output_bitstream *os,
+			    const u8 *in, const u8 **in_next_p,
+			    const u8 *in_end)
+{
+	const u8 *in_begin = *in_next_p;
+	const u8 *in_next = in_begin;
+	struct incompressible_hash_entry hash_tab[1 << INCOMPRESSIBLE_HASH_ORDER];
+	bool hashed = false;
+
+	while ((size_t)(in_end - in_next) >= INCOMPRESSIBLE_PROBE_LENGTH &&
+	       deflate_is_incompressible(in_next, INCOMPRESSIBLE_PROBE_LENGTH)) {
+		if (!hashed) {
+			memset(hash_tab, 0, sizeof(hash_tab));
+			deflate_insert_probe_hashes(hash_tab, in,
+				in_next - MIN(in_next - in, DEFLATE_MAX_MATCH_OFFSET),
+				in_next);
+			hashed = true;
+		}
+		if (!deflate_has_few_matches(hash_tab, in, in_next,
+					     INCOMPRESSIBLE_PROBE_LENGTH))
+			break;
+		in_next += INCOMPRESSIBLE_PROBE_LENGTH;
+	}
+
+	if (in_next == in_begin)
+		return false;
+
+	/* Don't leave a tail too short to be worth compressing.  */
+	if (in_end - in_next < INCOMPRESSIBLE_PROBE_LENGTH)
+		in_next = in_end;
+
+	deflate_write_uncompressed_blocks(os, in_begin, in_next - in_begin,
+					  deflate_is_final_block(c, in_next, in_end));
+	*in_next_p = in_next;
+	return true;
+}
+
+/******************************************************************************/
+
+/*
+ * Compression levels.  Each uses one of the parsers, and their searches for
+ * matches stop after 'max_search_depth' candidates or at a match of
+ * 'nice_match_length' bytes.  'relative_time' is about the time each level
+ * takes per byte, level 1 taking 10, as measured on FASTQ and on source code.
+ */
+
+enum deflate_parser {
+	DEFLATE_PARSER_GREEDY,
+	DEFLATE_PARSER_LAZY,
+	DEFLATE_PARSER_NEAR_OPTIMAL,
+};
+
+struct deflate_level_params {
+	u8 parser;
+	u8 num_optim_passes;
+	u16 max_search_depth;
+	u16 nice_match_length;
+	u16 relative_time;
+};
+
+#if SUPPORT_NEAR_OPTIMAL_PARSING
+#  define MAX_COMPRESSION_LEVEL	12
+#else
+#  define MAX_COMPRESSION_LEVEL	9
+#endif
+
+static const struct deflate_level_params
+deflate_level_params[MAX_COMPRESSION_LEVEL + 1] = {
+	/* 0 (unused) */ { DEFLATE_PARSER_GREEDY, 0, 0, 0, 0 },
+	/* 1 */ { DEFLATE_PARSER_GREEDY, 0, 2, 8, 10 },
+	/* 2 */ { DEFLATE_PARSER_GREEDY, 0, 6, 10, 13 },
+	/* 3 */ { DEFLATE_PARSER_GREEDY, 0, 12, 14, 16 },
+	/* 4 */ { DEFLATE_PARSER_GREEDY, 0, 24, 24, 22 },
+	/* 5 */ { DEFLATE_PARSER_LAZY, 0, 20, 30, 26 },
+	/* 6 */ { DEFLATE_PARSER_LAZY, 0, 40, 65, 38 },
+	/* 7 */ { DEFLATE_PARSER_LAZY, 0, 100, 130, 65 },
+#if SUPPORT_NEAR_OPTIMAL_PARSING
+	/* 8 */ { DEFLATE_PARSER_NEAR_OPTIMAL, 1, 12, 20, 110 },
+	/* 9 */ { DEFLATE_PARSER_NEAR_OPTIMAL, 2, 16, 26, 140 },
+	/* 10 */ { DEFLATE_PARSER_NEAR_OPTIMAL, 2, 30, 50, 150 },
+	/* 11 */ { DEFLATE_PARSER_NEAR_OPTIMAL, 3, 60, 80, 170 },
+	/* 12 */ { DEFLATE_PARSER_NEAR_OPTIMAL, 4, 100, 133, 210 },
+#else
+	/* 8 */ { DEFLATE_PARSER_LAZY, 0, 150, 200, 100 },
+	/* 9 */ { DEFLATE_PARSER_LAZY, 0, 200, DEFLATE_MAX_MATCH_LEN, 125 },
+#endif
+};
+
+/*
+ * Input consumed between two decisions to change the compression level when
+ * adapting to a target throughput: enough for the time measurements to be
+ * meaningful, and a few blocks.
+ */
+#define THROUGHPUT_INTERVAL	(1 << 20)
+
+static forceinline u64
+deflate_now_ns(void)
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* Start measuring the throughput from 'in_next', when a compression starts. */
+static void
+deflate_start_throughput(struct libdeflate_compressor *c, const u8 *in_next)
+{
+	c->throughput_pos = in_next;
+	c->throughput_start_ns = deflate_now_ns();
+}
+
+/*
+ * Account for the input consumed up to 'in_next' and return the level to use
+ * from there.  When the compression was slower than the target, or fast enough
+ * that a higher level may still reach it, the speed measured with the current
+ * level and the relative times of the levels give the highest level estimated
+ * to reach the target.  If the estimate is off, the next measurement corrects
+ * it, so that the compressor settles around the target.
+ */
+static int
+deflate_throughput_level(struct libdeflate_compressor *c, const u8 *in_next)
+{
+	u64 now_ns = deflate_now_ns();
+	unsigned level = c->compression_level;
+	u64 mb_per_sec;
+	u64 max_time;
+	unsigned new_level;
+
+	c->throughput_nbytes += in_next - c->throughput_pos;
+	c->throughput_ns += now_ns - c->throughput_start_ns;
+	c->throughput_pos = in_next;
+	c->throughput_start_ns = now_ns;
+
+	if (c->throughput_nbytes < THROUGHPUT_INTERVAL)
+		return level;
+	mb_per_sec = c->throughput_nbytes * 1000 / MAX(c->throughput_ns, 1);
+	if (mb_per_sec < c->target_mb_per_sec ||
+	    mb_per_sec > c->target_mb_per_sec + c->target_mb_per_sec / 4) {
+		max_time = mb_per_sec * deflate_level_params[level].relative_time /
+			   c->target_mb_per_sec;
+		new_level = c->max_level;
+		while (new_level > 1 &&
+		       deflate_level_params[new_level].relative_time > max_time)
+			new_level--;
+		if (new_level != level)
+			return new_level;
+	}
+	c->throughput_nbytes = 0;
+	c->throughput_ns = 0;
+	return level;
+}
+
+/* Use the search parameters of a compression level using the same parser. */
+static void
+deflate_set_search_params(struct libdeflate_compressor *c, int level)
+{
+	const struct deflate_level_params *params = &deflate_level_params[level];
+
+	c->compression_level = level;
+	c->max_search_depth = params->max_search_depth;
+	c->nice_match_length = params->nice_match_length;
+#if SUPPORT_NEAR_OPTIMAL_PARSING
+	if (params->parser == DEFLATE_PARSER_NEAR_OPTIMAL)
+		c->p.n.num_optim_passes = params->num_optim_passes;
+#endif
+	c->throughput_nbytes = 0;
+	c->throughput_ns = 0;
+}
+
+/*
+ * Called by the parsers before each block when adapting to a target
+ * throughput.  Returns true if the level changed to one using another parser:
+ * the parser then stops before the block, for libdeflate_deflate_compress() to
+ * continue with the other one.
+ */
+static bool
+deflate_adapt_level(struct libdeflate_compressor *c, const u8 *in_next)
+{
+	int level = deflate_throughput_level(c, in_next);
+	bool new_parser;
+
+	if (level == (int)c->compression_level)
+		return false;
+	new_parser = deflate_level_params[level].parser !=
+		     deflate_level_params[c->compression_level].parser;
+	deflate_set_search_params(c, level);
+	return new_parser;
+}
+
+/*
+ * Restart the hash chains matchfinder at 'in_next', when a parser starts there
+ * or after incompressible data was output without it: the window before
+ * 'in_next' is inserted again, so that the data that follows can still match
+ * it.
+ */
+static void
+deflate_restart_hc_matchfinder(struct libdeflate_compressor *c,
+			       const u8 *in, const u8 *in_next,
+			       const u8 *in_end, const u8 **in_cur_base_p,
+			       u32 next_hashes[2])
+{
+	const u8 *in_window = in_next - MIN((size_t)(in_next - in),
+					    MATCHFINDER_WINDOW_SIZE);
+
+	hc_matchfinder_init(&c->p.g.hc_mf);
+	*in_cur_base_p = in_window;
+	next_hashes[0] = next_hashes[1] = 0;
+	if (in_next != in_window)
+		hc_matchfinder_skip_positions(&c->p.g.hc_mf, in_cur_base_p,
+					      in_window, in_end,
+					      in_next - in_window,
+					      next_hashes);
+}
+
 /*
  * This is the "greedy" DEFLATE compressor. It always chooses the longest match.
  */
-static size_t
+static const u8 *
 deflate_compress_greedy(struct libdeflate_compressor * restrict c,
-			const u8 * restrict in, size_t in_nbytes,
-			u8 * restrict out, size_t out_nbytes_avail)
+			struct deflate_output_bitstream *os,
+			const u8 *in, const u8 *in_next, const u8 *in_end)
 {
-	const u8 *in_next = in;
-	const u8 *in_end = in_next + in_nbytes;
-	struct deflate_output_bitstream os;
-	const u8 *in_cur_base = in_next;
+	const u8 *in_cur_base;
 	unsigned max_len = DEFLATE_MAX_MATCH_LEN;
 	unsigned nice_len = MIN(c->nice_match_length, max_len);
-	u32 next_hashes[2] = {0, 0};
+	u32 next_hashes[2];
 
-	deflate_init_output(&os, out, out_nbytes_avail);
-	hc_matchfinder_init(&c->p.g.hc_mf);
+	deflate_restart_hc_matchfinder(c, in, in_next, in_end, &in_cur_base,
+				       next_hashes);
 
 	do {
+		if (c->target_mb_per_sec != 0) {
+			if (deflate_adapt_level(c, in_next))
+				return in_next;
+			nice_len = MIN(c->nice_match_length, max_len);
+		}
+
+		if (deflate_skip_incompressible(c, os, in, &in_next, in_end)) {
+			if (in_next == in_end)
+				break;
+			deflate_restart_hc_matchfinder(c, in, in_next, in_end,
+						       &in_cur_base,
+						       next_hashes);
+		}
+
 		/* Starting a new DEFLATE block.  */
 
 		const u8 * const in_block_begin = in_next;
@@ -2024,12 +2495,12 @@ deflate_compress_greedy(struct libdeflate_compressor * restrict c,
 			 !should_end_block(&c->split_stats, in_block_begin, in_next, in_end));
 
 		deflate_finish_sequence(next_seq, litrunlen);
-		deflate_flush_block(c, &os, in_block_begin,
+		deflate_flush_block(c, os, in_block_begin,
 				    in_next - in_block_begin,
-				    in_next == in_end, false);
+				    deflate_is_final_block(c, in_next, in_end), false);
 	} while (in_next != in_end);
 
-	return deflate_flush_output(&os);
+	return in_end;
 }
 
 /*
@@ -2037,23 +2508,34 @@ deflate_compress_greedy(struct libdeflate_compressor * restrict c,
  * see if there's a longer match at the next position.  If yes, it outputs a
  * literal and continues to the next position.  If no, it outputs the match.
  */
-static size_t
+static const u8 *
 deflate_compress_lazy(struct libdeflate_compressor * restrict c,
-		      const u8 * restrict in, size_t in_nbytes,
-		      u8 * restrict out, size_t out_nbytes_avail)
+		      struct deflate_output_bitstream *os,
+		      const u8 *in, const u8 *in_next, const u8 *in_end)
 {
-	const u8 *in_next = in;
-	const u8 *in_end = in_next + in_nbytes;
-	struct deflate_output_bitstream os;
-	const u8 *in_cur_base = in_next;
+	const u8 *in_cur_base;
 	unsigned max_len = DEFLATE_MAX_MATCH_LEN;
 	unsigned nice_len = MIN(c->nice_match_length, max_len);
-	u32 next_hashes[2] = {0, 0};
+	u32 next_hashes[2];
 
-	deflate_init_output(&os, out, out_nbytes_avail);
-	hc_matchfinder_init(&c->p.g.hc_mf);
+	deflate_restart_hc_matchfinder(c, in, in_next, in_end, &in_cur_base,
+				       next_hashes);
 
 	do {
+		if (c->target_mb_per_sec != 0) {
+			if (deflate_adapt_level(c, in_next))
+				return in_next;
+			nice_len = MIN(c->nice_match_length, max_len);
+		}
+
+		if (deflate_skip_incompressible(c, os, in, &in_next, in_end)) {
+			if (in_next == in_end)
+				break;
+			deflate_restart_hc_matchfinder(c, in, in_next, in_end,
+						       &in_cur_base,
+						       next_hashes);
+		}
+
 		/* Starting a new DEFLATE block.  */
 
 		const u8 * const in_block_begin = in_next;
@@ -2171,12 +2653,12 @@ deflate_compress_lazy(struct libdeflate_compressor * restrict c,
 			 !should_end_block(&c->split_stats, in_block_begin, in_next, in_end));
 
 		deflate_finish_sequence(next_seq, litrunlen);
-		deflate_flush_block(c, &os, in_block_begin,
+		deflate_flush_block(c, os, in_block_begin,
 				    in_next - in_block_begin,
-				    in_next == in_end, false);
+				    deflate_is_final_block(c, in_next, in_end), false);
 	} while (in_next != in_end);
 
-	return deflate_flush_output(&os);
+	return in_end;
 }
 
 #if SUPPORT_NEAR_OPTIMAL_PARSING
@@ -2454,6 +2936,35 @@ deflate_optimize_block(struct libdeflate_compressor *c, u32 block_length,
 	}
 }
 
+/*
+ * Like deflate_restart_hc_matchfinder(), for the binary trees matchfinder.
+ */
+static void
+deflate_restart_bt_matchfinder(struct libdeflate_compressor *c,
+			       const u8 *in, const u8 *in_next,
+			       const u8 *in_end, unsigned nice_len,
+			       const u8 **in_cur_base_p,
+			       const u8 **in_next_slide_p,
+			       u32 next_hashes[2])
+{
+	const u8 *in_window = in_next - MIN((size_t)(in_next - in),
+					    MATCHFINDER_WINDOW_SIZE);
+	const u8 *p;
+
+	bt_matchfinder_init(&c->p.n.bt_mf);
+	*in_cur_base_p = in_window;
+	*in_next_slide_p = in_window + MIN((size_t)(in_end - in_window),
+					   MATCHFINDER_WINDOW_SIZE);
+	next_hashes[0] = next_hashes[1] = 0;
+	for (p = in_window; p != in_next; p++) {
+		if (in_end - p >= BT_MATCHFINDER_REQUIRED_NBYTES)
+			bt_matchfinder_skip_position(&c->p.n.bt_mf, in_window,
+						     p - in_window, nice_len,
+						     c->max_search_depth,
+						     next_hashes);
+	}
+}
+
 /*
  * This is the "near-optimal" DEFLATE compressor.  It computes the optimal
  * representation of each DEFLATE block using a minimum-cost path search over
@@ -2467,24 +2978,39 @@ deflate_optimize_block(struct libdeflate_compressor *c, u32 block_length,
  * - Symbol costs are unknown until the symbols have already been chosen
  *   (so iterative optimization must be used)
  */
-static size_t
+static const u8 *
 deflate_compress_near_optimal(struct libdeflate_compressor * restrict c,
-			      const u8 * restrict in, size_t in_nbytes,
-			      u8 * restrict out, size_t out_nbytes_avail)
+			      struct deflate_output_bitstream *os,
+			      const u8 *in, const u8 *in_next,
+			      const u8 *in_end)
 {
-	const u8 *in_next = in;
-	const u8 *in_end = in_next + in_nbytes;
-	struct deflate_output_bitstream os;
-	const u8 *in_cur_base = in_next;
-	const u8 *in_next_slide = in_next + MIN(in_end - in_next, MATCHFINDER_WINDOW_SIZE);
+	const u8 * const in_begin = in_next;
+	const u8 *in_cur_base;
+	const u8 *in_next_slide;
 	unsigned max_len = DEFLATE_MAX_MATCH_LEN;
 	unsigned nice_len = MIN(c->nice_match_length, max_len);
-	u32 next_hashes[2] = {0, 0};
+	u32 next_hashes[2];
 
-	deflate_init_output(&os, out, out_nbytes_avail);
-	bt_matchfinder_init(&c->p.n.bt_mf);
+	deflate_restart_bt_matchfinder(c, in, in_next, in_end, nice_len,
+				       &in_cur_base, &in_next_slide,
+				       next_hashes);
 
 	do {
+		if (c->target_mb_per_sec != 0) {
+			if (deflate_adapt_level(c, in_next))
+				return in_next;
+			nice_len = MIN(c->nice_match_length, max_len);
+		}
+
+		if (deflate_skip_incompressible(c, os, in, &in_next, in_end)) {
+			if (in_next == in_end)
+				break;
+			deflate_restart_bt_matchfinder(c, in, in_next, in_end,
+						       nice_len, &in_cur_base,
+						       &in_next_slide,
+						       next_hashes);
+		}
+
 		/* Starting a new DEFLATE block.  */
 
 		struct lz_match *cache_ptr = c->p.n.match_cache;
@@ -2511,7 +3037,7 @@ deflate_compress_near_optimal(struct libdeflate_compressor * restrict c,
 			if (in_next == in_next_slide) {
 				bt_matchfinder_slide_window(&c->p.n.bt_mf);
 				in_cur_base = in_next;
-				in_next_slide = in_next + MIN(in_end - in_next,
+				in_next_slide = in_next + MIN((size_t)(in_end - in_next),
 							      MATCHFINDER_WINDOW_SIZE);
 			}
 
@@ -2586,7 +3112,7 @@ deflate_compress_near_optimal(struct libdeflate_compressor * restrict c,
 					if (in_next == in_next_slide) {
 						bt_matchfinder_slide_window(&c->p.n.bt_mf);
 						in_cur_base = in_next;
-						in_next_slide = in_next + MIN(in_end - in_next,
+						in_next_slide = in_next + MIN((size_t)(in_end - in_next),
 									      MATCHFINDER_WINDOW_SIZE);
 					}
 					if (unlikely(max_len > in_end - in_next)) {
@@ -2614,12 +3140,12 @@ deflate_compress_near_optimal(struct libdeflate_compressor * restrict c,
 		/* All the matches for this block have been cached.  Now choose
 		 * the sequence of items to output and flush the block.  */
 		deflate_optimize_block(c, in_next - in_block_begin, cache_ptr,
-				       in_block_begin == in);
-		deflate_flush_block(c, &os, in_block_begin, in_next - in_block_begin,
-				    in_next == in_end, true);
+				       in_block_begin == in_begin);
+		deflate_flush_block(c, os, in_block_begin, in_next - in_block_begin,
+				    deflate_is_final_block(c, in_next, in_end), true);
 	} while (in_next != in_end);
 
-	return deflate_flush_output(&os);
+	return in_end;
 }
 
 #endif /* SUPPORT_NEAR_OPTIMAL_PARSING */
@@ -2658,108 +3184,77 @@ deflate_init_offset_slot_fast(struct libdeflate_compressor *c)
 	}
 }
 
-LIBDEFLATEAPI struct libdeflate_compressor *
-libdeflate_alloc_compressor(int compression_level)
+/* Segments of libdeflate_deflate_compress_iov() shorter than this are gathered
+ * into a buffer of this size rather than compressed in place.  */
+#define IOV_GATHER_SIZE		(256U << 10)
+
+/* Size of a compressor supporting 'level' and the levels below it */
+static size_t
+deflate_level_size(int level)
 {
 	struct libdeflate_compressor *c;
-	size_t size;
 
 #if SUPPORT_NEAR_OPTIMAL_PARSING
-	if (compression_level >= 8)
-		size = offsetof(struct libdeflate_compressor, p) + sizeof(c->p.n);
-	else
+	if (deflate_level_params[level].parser == DEFLATE_PARSER_NEAR_OPTIMAL)
+		return offsetof(struct libdeflate_compressor, p) + sizeof(c->p.n);
 #endif
-		size = offsetof(struct libdeflate_compressor, p) + sizeof(c->p.g);
-
-	c = aligned_malloc(MATCHFINDER_ALIGNMENT, size);
-	if (!c)
-		return NULL;
+	return offsetof(struct libdeflate_compressor, p) + sizeof(c->p.g);
+}
 
-	switch (compression_level) {
-	case 1:
-		c->impl = deflate_compress_greedy;
-		c->max_search_depth = 2;
-		c->nice_match_length = 8;
-		break;
-	case 2:
-		c->impl = deflate_compress_greedy;
-		c->max_search_depth = 6;
-		c->nice_match_length = 10;
-		break;
-	case 3:
-		c->impl = deflate_compress_greedy;
-		c->max_search_depth = 12;
-		c->nice_match_length = 14;
-		break;
-	case 4:
+/* Use a compression level, with its parser. */
+static void
+deflate_set_level(struct libdeflate_compressor *c, int level)
+{
+	switch (deflate_level_params[level].parser) {
+	case DEFLATE_PARSER_GREEDY:
 		c->impl = deflate_compress_greedy;
-		c->max_search_depth = 24;
-		c->nice_match_length = 24;
 		break;
-	case 5:
+	case DEFLATE_PARSER_LAZY:
 		c->impl = deflate_compress_lazy;
-		c->max_search_depth = 20;
-		c->nice_match_length = 30;
-		break;
-	case 6:
-		c->impl = deflate_compress_lazy;
-		c->max_search_depth = 40;
-		c->nice_match_length = 65;
-		break;
-	case 7:
-		c->impl = deflate_compress_lazy;
-		c->max_search_depth = 100;
-		c->nice_match_length = 130;
 		break;
 #if SUPPORT_NEAR_OPTIMAL_PARSING
-	case 8:
-		c->impl = deflate_compress_near_optimal;
-		c->max_search_depth = 12;
-		c->nice_match_length = 20;
-		c->p.n.num_optim_passes = 1;
-		break;
-	case 9:
-		c->impl = deflate_compress_near_optimal;
-		c->max_search_depth = 16;
-		c->nice_match_length = 26;
-		c->p.n.num_optim_passes = 2;
-		break;
-	case 10:
+	case DEFLATE_PARSER_NEAR_OPTIMAL:
 		c->impl = deflate_compress_near_optimal;
-		c->max_search_depth = 30;
-		c->nice_match_length = 50;
-		c->p.n.num_optim_passes = 2;
-		break;
-	case 11:
-		c->impl = deflate_compress_near_optimal;
-		c->max_search_depth = 60;
-		c->nice_match_length = 80;
-		c->p.n.num_optim_passes = 3;
-		break;
-	case 12:
-		c->impl = deflate_compress_near_optimal;
-		c->max_search_depth = 100;
-		c->nice_match_length = 133;
-		c->p.n.num_optim_passes = 4;
-		break;
-#else
-	case 8:
-		c->impl = deflate_compress_lazy;
-		c->max_search_depth = 150;
-		c->nice_match_length = 200;
-		break;
-	case 9:
-		c->impl = deflate_compress_lazy;
-		c->max_search_depth = 200;
-		c->nice_match_length = DEFLATE_MAX_MATCH_LEN;
 		break;
 #endif
-	default:
-		aligned_free(c);
+	}
+	deflate_set_search_params(c, level);
+}
+
+LIBDEFLATEAPI struct libdeflate_compressor *
+libdeflate_alloc_compressor(int compression_level)
+{
+	return libdeflate_alloc_compressor_ex(compression_level, NULL);
+}
+
+LIBDEFLATEAPI struct libdeflate_compressor *
+libdeflate_alloc_compressor_ex(int compression_level,
+			       const struct libdeflate_compress_options *options)
+{
+	struct libdeflate_compressor *c;
+	size_t size;
+
+	if (compression_level < 1 || compression_level > MAX_COMPRESSION_LEVEL)
 		return NULL;
+
+	/* With a memory limit, use the levels that fit in it.  */
+	while (options && options->max_memory != 0 &&
+	       deflate_level_size(compression_level) > options->max_memory) {
+		if (--compression_level == 0)
+			return NULL;
 	}
+	size = deflate_level_size(compression_level);
+
+	c = (struct libdeflate_compressor *)aligned_malloc(MATCHFINDER_ALIGNMENT, size);
+	if (!c)
+		return NULL;
 
-	c->compression_level = compression_level;
+	/* When adapting to a throughput, start with the fastest level: the
+	 * speed measured with it gives the level to continue with.  */
+	c->max_level = compression_level;
+	c->target_mb_per_sec = options ? options->target_mb_per_sec : 0;
+	deflate_set_level(c, c->target_mb_per_sec != 0 ? 1 : compression_level);
+	c->sync_flush = false;
 
 	deflate_init_offset_slot_fast(c);
 	deflate_init_static_codes(c);
@@ -2778,14 +3273,122 @@ libdeflate_deflate_compress(struct libdeflate_compressor *c,
 	/* For extremely small inputs just use a single uncompressed block. */
 	if (unlikely(in_nbytes < 16)) {
 		struct deflate_output_bitstream os;
-		deflate_init_output(&os, out, out_nbytes_avail);
+		deflate_init_output(&os, (u8 *)out, out_nbytes_avail);
 		if (in_nbytes == 0)
 			in = &os; /* Avoid passing NULL to memcpy() */
-		deflate_write_uncompressed_block(&os, in, in_nbytes, true);
-		return deflate_flush_output(&os);
+		deflate_write_uncompressed_block(&os, (const u8 *)in, in_nbytes,
+						 !c->sync_flush);
+		return deflate_finish_output(c, &os);
+	}
+
+	struct deflate_output_bitstream os;
+	const u8 *in_next = (const u8 *)in;
+	const u8 *in_end = in_next + in_nbytes;
+
+	deflate_init_output(&os, (u8 *)out, out_nbytes_avail);
+
+	if (c->target_mb_per_sec != 0) {
+		int level;
+
+		deflate_start_throughput(c, in_next);
+		for (;;) {
+			in_next = (*c->impl)(c, &os, (const u8 *)in, in_next,
+					     in_end);
+			if (in_next == in_end)
+				break;
+			/* The level changed to one using another parser.  */
+			deflate_set_level(c, c->compression_level);
+		}
+		level = deflate_throughput_level(c, in_end);
+		if (level != (int)c->compression_level)
+			deflate_set_level(c, level);
+		return deflate_finish_output(c, &os);
+	}
+
+	(*c->impl)(c, &os, (const u8 *)in, in_next, in_end);
+	return deflate_finish_output(c, &os);
+}
+
+/*
+ * Compress 'in_nbytes' bytes at 'in' after the first 'out_nbytes' bytes of
+ * 'out', ending with a sync flush unless they are the last of the data.
+ * Returns the new output size, or 0 if the data didn't fit.
+ */
+static size_t
+deflate_compress_run(struct libdeflate_compressor *c,
+		     const void *in, size_t in_nbytes, bool last,
+		     u8 *out, size_t out_nbytes, size_t out_nbytes_avail)
+{
+	size_t run_nbytes;
+
+	c->sync_flush = !last;
+	run_nbytes = libdeflate_deflate_compress(c, in, in_nbytes,
+						 out + out_nbytes,
+						 out_nbytes_avail - out_nbytes);
+	c->sync_flush = false;
+	return run_nbytes == 0 ? 0 : out_nbytes + run_nbytes;
+}
+
+LIBDEFLATEAPI size_t
+libdeflate_deflate_compress_iov(struct libdeflate_compressor *c,
+				const struct libdeflate_iovec *in, size_t in_iovcnt,
+				void *out, size_t out_nbytes_avail)
+{
+	u8 *gather = NULL;
+	size_t gathered = 0;
+	size_t out_nbytes = 0;
+	size_t last = in_iovcnt; /* last segment with data */
+	size_t i;
+
+	for (i = 0; i < in_iovcnt; i++)
+		if (in[i].len != 0)
+			last = i;
+	if (last == in_iovcnt)
+		return libdeflate_deflate_compress(c, NULL, 0, out, out_nbytes_avail);
+
+	for (i = 0; i <= last; i++) {
+		const u8 *data = (const u8 *)in[i].base;
+		size_t len = in[i].len;
+
+		if (len >= IOV_GATHER_SIZE) {
+			if (gathered != 0) {
+				out_nbytes = deflate_compress_run(c, gather, gathered, false,
+								  (u8 *)out, out_nbytes, out_nbytes_avail);
+				gathered = 0;
+				if (out_nbytes == 0)
+					break;
+			}
+			out_nbytes = deflate_compress_run(c, data, len, i == last,
+							  (u8 *)out, out_nbytes, out_nbytes_avail);
+			if (out_nbytes == 0)
+				break;
+			continue;
+		}
+
+		if (gather == NULL) {
+			gather = (u8 *)malloc(IOV_GATHER_SIZE);
+			if (gather == NULL) {
+				out_nbytes = 0;
+				break;
+			}
+		}
+		if (gathered + len > IOV_GATHER_SIZE) {
+			out_nbytes = deflate_compress_run(c, gather, gathered, false,
+							  (u8 *)out, out_nbytes, out_nbytes_avail);
+			gathered = 0;
+			if (out_nbytes == 0)
+				break;
+		}
+		memcpy(gather + gathered, data, len);
+		gathered += len;
+		if (i == last) {
+			out_nbytes = deflate_compress_run(c, gather, gathered, true,
+							  (u8 *)out, out_nbytes, out_nbytes_avail);
+		}
 	}
 
-	return (*c->impl)(c, in, in_nbytes, out, out_nbytes_avail);
+	free(gather);
+	return out_nbytes;
 }
 
 LIBDEFLATEAPI void
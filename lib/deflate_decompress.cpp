@@ -49,11 +49,19 @@
 #include <stdlib.h>
 #include <string.h>
 #include <fstream>
+#include <algorithm>
 #include <vector>
 #include <string>
 #include <set>
 #include <tuple>
+#include <atomic>
+#include <memory>
+#include <new>
+#include <mutex>
+#include <unordered_map>
+#include <fcntl.h> // open()
 #include <unistd.h> // write()
+#include <errno.h>
 
 #include <stdexcept>
 #include <pthread.h>
@@ -63,6 +71,15 @@
 
 #include "libdeflate.h"
 #include "synchronizer.hpp"
+#include "memory_accounting.hpp"
+#include "checkpoint.hpp"
+#include "ranged_input.hpp"
+#include "window_cache.hpp"
+#include "fanout.hpp"
+#include "read_queue.hpp"
+#include "shm_ring.hpp"
+#include "qc.hpp"
+#include "flush_marker.hpp"
 
 #ifdef DEB
 #define PRINT_DEBUG(...) {fprintf(stderr, __VA_ARGS__);}
@@ -152,6 +169,11 @@ struct libdeflate_decompressor {
 
 	u16 working_space[2 * (DEFLATE_MAX_CODEWORD_LEN + 1) +
 			  DEFLATE_MAX_NUM_SYMS];
+
+	/* Input fetched as it is decoded, if not NULL, and the chunks of it we
+	 * are reading */
+	struct libdeflate_ranged_input *ranged_input;
+	ranged_window input_window;
 };
 
 /*****************************************************************************
@@ -294,6 +316,23 @@ public:
         return in_end - in_next;
     }
 
+    /**
+     * Were all the bits of the input consumed? The bit buffer may still hold the
+     * last bytes, such as an empty final block after a flush, with the zeros read
+     * past the end above them.
+     */
+    inline bool exhausted() const {
+        return in_next == in_end && bitsleft <= 8 * overrun_count;
+    }
+
+    /**
+     * Did we read past the end of the input by more than our own lookahead?
+     * Then the input is truncated, and the zeros we've been decoding aren't data.
+     */
+    inline bool overrun() const {
+        return overrun_count > sizeof(bitbuf_t);
+    }
+
     inline size_t position() const {
         return in_next - begin - (bitsleft / 8);
     }
@@ -302,6 +341,18 @@ public:
         return 8*position() - (bitsleft % 8);
     }
 
+    /**
+     * Move to the bit position 'pos_bits', as returned by position_bits()
+     */
+    inline void seek_bits(size_t pos_bits) {
+        in_next = begin + pos_bits / 8;
+        bitbuf = 0;
+        bitsleft = 0;
+        overrun_count = 0;
+        ensure_bits<8>();
+        remove_bits(pos_bits % 8);
+    }
+
 
     /**
      * Load more bits from the input buffer until the specified number of bits is
@@ -1061,16 +1112,18 @@ bool prepare_static(struct libdeflate_decompressor * restrict d) {
 #define output_buffer_bits 21
 
 struct OutputBuffer {
-    OutputBuffer() :
-        begin(new byte[1UL << output_buffer_bits]),
+    OutputBuffer(int fd = 1, size_t buffer_size = 1UL << output_buffer_bits) :
+        fd(fd),
+        begin(accounted_new<byte>(LIBDEFLATE_MEMORY_OUTPUT_BUFFERS, buffer_size)),
         next(begin),
-        end(begin + (1UL << output_buffer_bits)) {
+        end(begin + buffer_size) {
 
     }
 
     ~OutputBuffer() {
+        release();
         flush(); // Flush remaining sequences
-        delete[] begin;
+        accounted_delete(LIBDEFLATE_MEMORY_OUTPUT_BUFFERS, begin, end - begin);
     }
 
     size_t size() const {
@@ -1081,16 +1134,81 @@ struct OutputBuffer {
         assert(end >= next);
         return end-next;
     }
+    /**
+     * Write [from, from+length) to 'fd' in one piece. The threads share the file
+     * descriptors, and a write to a pipe larger than PIPE_BUF may otherwise be
+     * interleaved with another thread's, cutting lines apart.
+     */
+    void write_all(const byte* from, size_t length) {
+        std::lock_guard<std::mutex> lock(*write_mutex);
+        while(length > 0) {
+            ssize_t written = write(fd, from, length);
+            if(written < 0 && errno == EINTR)
+                continue;
+            if(written <= 0) {
+                fprintf(stderr, "write error\n");
+                exit(1);
+            }
+            from += written;
+            length -= written;
+        }
+    }
+
+    /// Lock of the writes to 'fd', shared by the buffers of all the threads writing to it
+    static std::mutex* fd_mutex(int fd) {
+        static std::mutex registry_mutex;
+        static std::unordered_map<int, std::unique_ptr<std::mutex>> mutexes;
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        std::unique_ptr<std::mutex>& mutex = mutexes[fd];
+        if(!mutex)
+            mutex.reset(new std::mutex);
+        return mutex.get();
+    }
+
+    /// Hand [from, from+length) to the first consumer set: fanout, read queue, shared memory ring, or 'fd'
+    void dispatch(const byte* from, size_t length) {
+        if(fanout != nullptr)
+            fanout->publish(from, length);
+        else if(read_queue != nullptr)
+            read_queue->publish(from, length);
+        else if(shm_ring != nullptr)
+            shm_ring->publish(from, length);
+        else
+            write_all(from, length);
+    }
+
+    /// Dispatch [from, from+length), or keep it after the held bytes while holding
+    void emit(const byte* from, size_t length) {
+        if(!holding) {
+            dispatch(from, length);
+            return;
+        }
+        held.insert(held.end(), from, from + length);
+        if(held.capacity() != held_capacity) {
+            memory_accounting::instance().allocated(LIBDEFLATE_MEMORY_DEFERRED_READS, held.capacity() - held_capacity);
+            held_capacity = held.capacity();
+        }
+    }
+
     void flush() {
         if(size() == 0) return;
-        if(write(1, begin, size()) != (ssize_t)size()) {
-            fprintf(stderr, "write error\n");
-            exit(1);
-        }
+        emit(begin, size());
         next = begin;
     }
 
-    void add_sequence(byte* from, size_t length) {
+    /// Stop holding the output: dispatch what was held, then write through as usual
+    void release() {
+        if(!holding) return;
+        holding = false;
+        flush();
+        if(!held.empty())
+            dispatch(held.data(), held.size());
+        std::vector<byte>().swap(held);
+        memory_accounting::instance().released(LIBDEFLATE_MEMORY_DEFERRED_READS, held_capacity);
+        held_capacity = 0;
+    }
+
+    void add_sequence(const byte* from, size_t length) {
         if(available() < length+1)
             flush();
 
@@ -1099,9 +1217,30 @@ struct OutputBuffer {
         *next++ = byte('\n');
     }
 
+    /// Append raw bytes, written through if they don't fit in the buffer
+    void add(const byte* from, size_t length) {
+        if(available() < length)
+            flush();
+
+        if(available() < length) {
+            emit(from, length);
+            return;
+        }
+        memcpy(next, from, length);
+        next += length;
+    }
+
+    const int fd;
     byte* const begin;
     byte* next;
     const byte* const end;
+    std::mutex* const write_mutex = fd_mutex(fd);
+    libdeflate_fanout* fanout = nullptr; /// Publishes the buffer instead of writing it to 'fd', if not null
+    libdeflate_read_queue* read_queue = nullptr; /// Queues the buffer instead of writing it to 'fd', if not null
+    libdeflate_shm_ring* shm_ring = nullptr; /// Publishes the buffer to other processes instead of writing it to 'fd', if not null
+    bool holding = false; /// Keep the flushed bytes in 'held' until release(), to output them after the previous thread's
+    std::vector<byte> held;
+    size_t held_capacity = 0; /// Of 'held', as accounted
 };
 
 /**
@@ -1110,14 +1249,14 @@ struct OutputBuffer {
 class DeflateWindow {
 public:
     DeflateWindow() :
-        buffer(new byte[1 << deflate_window_bits]),
+        buffer(accounted_new<byte>(LIBDEFLATE_MEMORY_WINDOWS, 1 << deflate_window_bits)),
         buffer_end(buffer + (1 << deflate_window_bits))
     {
         clear();
     }
 
     ~DeflateWindow()    {
-        delete[] buffer;
+        accounted_delete(LIBDEFLATE_MEMORY_WINDOWS, buffer, buffer_end - buffer);
     }
 
     void clear() {
@@ -1263,6 +1402,194 @@ protected:
     const byte* target_end;
 };
 
+
+/**
+ * @brief Window of a serial decompression starting at the beginning of a deflate
+ * stream: the context is known, so any content is accepted and every decoded
+ * byte is handed over to a callback before being evicted
+ */
+class ExactDeflateWindow : public DeflateWindow {
+    using Base = DeflateWindow;
+
+public:
+    static constexpr bool ascii_only = false;
+    static constexpr bool has_dummy_32k = false;
+
+    ExactDeflateWindow(libdeflate_write_func write, void* ctx) :
+        DeflateWindow(),
+        stopped(false), write(write), ctx(ctx), pending(buffer)
+    {}
+
+    bool check_match(unsigned length, unsigned offset) {
+        return offset > 0 && offset <= size() && length <= available();
+    }
+
+    void copy(InputStream & in, unsigned length) {
+        if (available() < length)
+            flush();
+        Base::copy(in, length);
+    }
+
+    /// Hand over the bytes decoded since the last call
+    void emit() {
+        if (next > pending && !stopped)
+            stopped = write(ctx, pending, next - pending) != 0;
+        pending = next;
+    }
+
+    /// Called by do_block when the window is full: emit, then only keep the 32K context
+    size_t flush(size_t window_size=1UL<<15) {
+        emit();
+        if (size() <= window_size)
+            return 0;
+        size_t moved_by = Base::flush(window_size);
+        pending = next;
+        return moved_by;
+    }
+
+    bool stopped; /// The callback asked to stop
+
+protected:
+    libdeflate_write_func write;
+    void* ctx;
+    byte* pending; /// Start of the decoded bytes not handed over yet
+};
+
+/**
+ * @brief Window of a serial decompression writing straight to the caller's
+ * segments: the segments themselves are the history, so a match whose source
+ * is in earlier segments is copied piecewise. Once the segments are full, the
+ * rest of the stream is only decoded to be checked, and the output is discarded
+ */
+class SegmentedDeflateWindow {
+public:
+    static constexpr bool ascii_only = false;
+    static constexpr bool has_dummy_32k = false;
+
+    SegmentedDeflateWindow(const libdeflate_iovec* iov, size_t iovcnt) :
+        written(0), capacity(0), overflowed(false),
+        iov(iov), iovcnt(iovcnt), seg(0), next(nullptr), seg_end(nullptr)
+    {
+        for (size_t i = 0; i < iovcnt; i++)
+            capacity += iov[i].len;
+        if (iovcnt != 0) {
+            next = static_cast<byte*>(iov[0].base);
+            seg_end = next + iov[0].len;
+        }
+    }
+
+    unsigned available() const {
+        if (overflowed)
+            return UINT32_MAX;
+        return unsigned(std::min(capacity - written, size_t(UINT32_MAX)));
+    }
+
+    void push(byte c) {
+        written++;
+        if (overflowed)
+            return;
+        advance();
+        *next++ = c;
+    }
+
+    bool check_match(unsigned length, unsigned offset) {
+        (void)length;
+        return offset > 0 && offset <= written;
+    }
+
+    void copy_match(unsigned length, unsigned offset) {
+        assert(offset > 0 && offset <= written);
+        written += length;
+        if (overflowed)
+            return;
+        assert(written <= capacity);
+
+        advance();
+        byte* const seg_begin = static_cast<byte*>(iov[seg].base);
+        if (likely(offset <= size_t(next - seg_begin) && length <= size_t(seg_end - next))) {
+            /* Source and destination in the current segment  */
+            const byte* src = next - offset;
+            if (offset >= length) {
+                memcpy(next, src, length);
+            } else {
+                for (unsigned i = 0; i < length; i++)
+                    next[i] = src[i];
+            }
+            next += length;
+            return;
+        }
+
+        /* Find the segment holding the source  */
+        size_t src_seg = seg;
+        const byte* src = next;
+        size_t back = offset;
+        while (back > size_t(src - static_cast<const byte*>(iov[src_seg].base))) {
+            back -= src - static_cast<const byte*>(iov[src_seg].base);
+            src_seg--;
+            src = static_cast<const byte*>(iov[src_seg].base) + iov[src_seg].len;
+        }
+        src -= back;
+
+        /* Copy in pieces which don't cross a segment boundary, nor overlap  */
+        while (length > 0) {
+            advance();
+            while (src == static_cast<const byte*>(iov[src_seg].base) + iov[src_seg].len) {
+                src_seg++;
+                src = static_cast<const byte*>(iov[src_seg].base);
+            }
+            size_t n = std::min<size_t>(std::min<size_t>(length, offset), seg_end - next);
+            n = std::min<size_t>(n, static_cast<const byte*>(iov[src_seg].base) + iov[src_seg].len - src);
+            memcpy(next, src, n);
+            next += n;
+            src += n;
+            length -= n;
+        }
+    }
+
+    void copy(InputStream & in, unsigned length) {
+        if (!overflowed && length > capacity - written)
+            overflowed = true;
+        written += length;
+        if (overflowed) {
+            in.in_next += length;
+            return;
+        }
+        while (length > 0) {
+            advance();
+            size_t n = std::min<size_t>(length, seg_end - next);
+            in.copy(next, n);
+            next += n;
+            length -= n;
+        }
+    }
+
+    /// Called by do_block when the segments are full
+    size_t flush() {
+        overflowed = true;
+        return 0;
+    }
+
+    size_t written; /// Decoded bytes, including those which didn't fit
+    size_t capacity; /// Total size of the segments
+    bool overflowed; /// The stream didn't fit in the segments
+
+protected:
+    /// Move to the next segment with room left, when the current one is full
+    void advance() {
+        while (next == seg_end && seg + 1 < iovcnt) {
+            seg++;
+            next = static_cast<byte*>(iov[seg].base);
+            seg_end = next + iov[seg].len;
+        }
+    }
+
+    const libdeflate_iovec* iov;
+    size_t iovcnt;
+    size_t seg; /// Current segment
+    byte* next; /// Next byte to be written, in the current segment
+    byte* seg_end;
+};
+
 static constexpr char ascii2Dna[256] =
     {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 2, 0, 0, 0, 4, 0, 0, 0, 0, 0, 0,
@@ -1272,28 +1599,347 @@ static constexpr char ascii2Dna[256] =
      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
 
+/**
+ * @brief Barcode demultiplexer, shared by all the decoding threads
+ * Owns one output file per sample. The threads never write to these files
+ * directly but through their own DemuxOutputs buffers.
+ */
+struct libdeflate_demultiplexer {
+    static constexpr unsigned undetermined = 0; /// Output of reads without a (known) barcode
+    static constexpr unsigned max_outputs = 1024; /// Beyond that, new barcodes are undetermined
+
+    libdeflate_demultiplexer(const char* prefix, unsigned max_mismatches) :
+        prefix(prefix), max_mismatches(max_mismatches), has_whitelist(false),
+        nb_outputs(0)
+    {
+        for (unsigned i = 0; i < max_outputs; i++)
+            counts[i] = 0;
+    }
+
+    ~libdeflate_demultiplexer() {
+        for (unsigned i = 0; i < nb_outputs; i++)
+            close(fds[i]);
+    }
+
+    /// Open the output file of a new sample, returns its index or -1
+    int add_output(const std::string& name, const std::string& barcode) {
+        unsigned idx = nb_outputs.load(std::memory_order_relaxed);
+        if (idx >= max_outputs)
+            return -1;
+
+        std::string path = prefix + name;
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "cannot open demultiplexing output %s\n", path.c_str());
+            return -1;
+        }
+
+        names[idx] = name;
+        barcodes[idx] = barcode;
+        fds[idx] = fd;
+        if (!barcode.empty())
+            by_barcode[barcode] = idx;
+        nb_outputs.store(idx + 1, std::memory_order_release);
+        return idx;
+    }
+
+    /// Read the expected barcodes, as "BARCODE" or "SAMPLE BARCODE" lines
+    bool load_barcodes(const char* path) {
+        std::ifstream in(path);
+        if (!in) {
+            fprintf(stderr, "cannot read barcode file %s\n", path);
+            return false;
+        }
+
+        std::string line;
+        while (std::getline(in, line)) {
+            std::string name, barcode;
+            size_t sep = line.find_first_of(" \t,");
+            if (sep == std::string::npos) {
+                barcode = line;
+            } else {
+                name = line.substr(0, sep);
+                size_t bc_start = line.find_first_not_of(" \t,", sep);
+                if (bc_start != std::string::npos)
+                    barcode = line.substr(bc_start, line.find_first_of(" \t\r", bc_start) - bc_start);
+            }
+            if (!barcode.empty() && barcode.back() == '\r')
+                barcode.pop_back();
+            if (barcode.empty())
+                continue;
+            if (name.empty())
+                name = barcode;
+            if (add_output(name, barcode) < 0)
+                return false;
+        }
+
+        has_whitelist = true;
+        return true;
+    }
+
+    /**
+     * Output index for a barcode. Without whitelist, unseen barcodes get a new
+     * output. With a whitelist, the barcode must be within max_mismatches
+     * substitutions of exactly one expected barcode.
+     */
+    unsigned route(const std::string& barcode) {
+        if (barcode.empty())
+            return undetermined;
+
+        if (!has_whitelist) {
+            std::lock_guard<std::mutex> guard(mutex);
+            auto it = by_barcode.find(barcode);
+            if (it != by_barcode.end())
+                return it->second;
+            int idx = add_output(barcode, barcode);
+            return idx < 0 ? undetermined : unsigned(idx);
+        }
+
+        unsigned best = undetermined;
+        unsigned best_dist = max_mismatches + 1;
+        bool ambiguous = false;
+        for (unsigned i = undetermined + 1; i < nb_outputs; i++) {
+            const std::string& expected = barcodes[i];
+            if (expected.size() != barcode.size())
+                continue;
+            unsigned dist = 0;
+            for (size_t j = 0; j < expected.size() && dist <= max_mismatches; j++)
+                dist += expected[j] != barcode[j];
+            if (dist < best_dist) {
+                best = i;
+                best_dist = dist;
+                ambiguous = false;
+            } else if (dist == best_dist) {
+                ambiguous = true;
+            }
+        }
+        return ambiguous ? undetermined : best;
+    }
+
+    unsigned outputs() const
+    { return nb_outputs.load(std::memory_order_acquire); }
+
+    void final_stats() {
+        size_t total = 0;
+        for (unsigned i = 0; i < outputs(); i++)
+            total += counts[i];
+        fprintf(stderr, "demultiplexed %lu reads:\n", total);
+        for (unsigned i = 0; i < outputs(); i++)
+            if (counts[i] > 0 || i != undetermined)
+                fprintf(stderr, "  %s%s\t%lu\n", prefix.c_str(), names[i].c_str(), (unsigned long)counts[i]);
+    }
+
+    const std::string prefix;
+    const unsigned max_mismatches;
+    bool has_whitelist;
+
+    std::string names[max_outputs];
+    std::string barcodes[max_outputs];
+    int fds[max_outputs];
+    std::atomic<size_t> counts[max_outputs];
+    std::atomic<unsigned> nb_outputs;
+
+    std::unordered_map<std::string, unsigned> by_barcode;
+    std::mutex mutex; /// Guards the creation of outputs when there's no whitelist
+};
+
+/**
+ * @brief Thread local side of the demultiplexer: one small output buffer per
+ * sample, and a cache of the barcodes already routed by this thread
+ */
+class DemuxOutputs {
+public:
+    static constexpr size_t buffer_size = 1UL << 16;
+
+    void add_sequence(libdeflate_demultiplexer& demux, const std::string& barcode, const byte* seq, size_t length) {
+        unsigned idx;
+        auto it = routes.find(barcode);
+        if (it != routes.end()) {
+            idx = it->second;
+        } else {
+            idx = demux.route(barcode);
+            if (routes.size() < (1UL << 16)) // sequencing errors produce many rare barcodes
+                routes.emplace(barcode, idx);
+        }
+
+        if (idx >= outputs.size())
+            outputs.resize(demux.outputs());
+        if (!outputs[idx])
+            outputs[idx].reset(new OutputBuffer(demux.fds[idx], buffer_size));
+
+        outputs[idx]->add_sequence(seq, length);
+        demux.counts[idx].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void flush() {
+        for (auto& output : outputs)
+            if (output)
+                output->flush();
+    }
+
+protected:
+    std::vector<std::unique_ptr<OutputBuffer>> outputs;
+    std::unordered_map<std::string, unsigned> routes;
+};
+
+/**
+ * @brief Concurrent set of read fingerprints, shared by all the decoding threads
+ * Each read is hashed to 128 bits: the high half picks a shard, the low half is
+ * stored (and picks the slot), so that distinct reads are practically never
+ * confused. Shards are open addressing tables with their own lock and grow
+ * independently.
+ */
+struct libdeflate_duplicates {
+    static constexpr unsigned shard_bits = 8;
+    static constexpr size_t initial_shard_size = 1UL << 12;
+
+    explicit libdeflate_duplicates(bool drop) :
+        drop(drop), nb_reads(0), nb_duplicates(0)
+    {
+        for (Shard& shard : shards) {
+            shard.slots = accounted_new<u64>(LIBDEFLATE_MEMORY_DUPLICATES, initial_shard_size, true);
+            shard.mask = initial_shard_size - 1;
+            shard.count = 0;
+        }
+    }
+
+    ~libdeflate_duplicates() {
+        for (Shard& shard : shards)
+            accounted_delete(LIBDEFLATE_MEMORY_DUPLICATES, shard.slots, shard.mask + 1);
+    }
+
+    static inline u64 mix(u64 h) {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    /// Insert a read, returns false if an identical read was already there
+    bool insert(const byte* seq, size_t length) {
+        u64 lo = 0x9E3779B97F4A7C15ULL ^ length, hi = 0xC2B2AE3D27D4EB4FULL + length;
+        size_t i = 0;
+        for (; i + 8 <= length; i += 8) {
+            u64 w = get_unaligned_le64(seq + i);
+            lo = (lo ^ w) * 0xbf58476d1ce4e5b9ULL;
+            lo ^= lo >> 31;
+            hi = (hi + w) * 0x94d049bb133111ebULL;
+            hi ^= hi >> 29;
+        }
+        u64 tail = 0;
+        for (unsigned shift = 0; i < length; i++, shift += 8)
+            tail |= u64(seq[i]) << shift;
+        lo = mix(lo ^ tail);
+        hi = mix(hi + tail + lo);
+        if (lo == 0) // 0 marks empty slots
+            lo = 1;
+
+        Shard& shard = shards[hi >> (64 - shard_bits)];
+        std::lock_guard<std::mutex> guard(shard.mutex);
+        for (size_t slot = lo & shard.mask ; ; slot = (slot + 1) & shard.mask) {
+            if (shard.slots[slot] == lo)
+                return false;
+            if (shard.slots[slot] == 0) {
+                shard.slots[slot] = lo;
+                break;
+            }
+        }
+        if (++shard.count > (shard.mask + 1) / 2)
+            shard.grow();
+        return true;
+    }
+
+    void final_stats() {
+        size_t reads = nb_reads, duplicates = nb_duplicates;
+        fprintf(stderr, "found %lu duplicate reads out of %lu (%.2f%%)%s\n",
+                duplicates, reads, reads ? 100.0 * duplicates / reads : 0.0,
+                drop ? ", not printed" : "");
+    }
+
+    struct alignas(64) Shard {
+        std::mutex mutex;
+        u64* slots;
+        size_t mask;
+        size_t count;
+
+        void grow() {
+            size_t new_mask = 2 * mask + 1;
+            u64* new_slots = accounted_new<u64>(LIBDEFLATE_MEMORY_DUPLICATES, new_mask + 1, true);
+            for (size_t i = 0; i <= mask; i++) {
+                if (slots[i] == 0)
+                    continue;
+                size_t slot = slots[i] & new_mask;
+                while (new_slots[slot] != 0)
+                    slot = (slot + 1) & new_mask;
+                new_slots[slot] = slots[i];
+            }
+            accounted_delete(LIBDEFLATE_MEMORY_DUPLICATES, slots, mask + 1);
+            slots = new_slots;
+            mask = new_mask;
+        }
+    };
+
+    const bool drop; /// Don't output the duplicates
+    std::atomic<size_t> nb_reads;
+    std::atomic<size_t> nb_duplicates;
+    Shard shards[1U << shard_bits];
+};
+
+/**
+ * Replace the characters coming from the unknown initial context (see
+ * InstrDeflateWindow::backref_origins) by their value in 'context', the 32K
+ * preceding the first decoded block. Returns false if 'context' is unknown.
+ */
+static bool resolve_undetermined(byte* chars, const uint16_t* origins, size_t length, const byte* context)
+{
+    for (size_t i = 0; i < length; i++) {
+        if (origins[i] > 0) {
+            if (context == nullptr)
+                return false;
+            chars[i] = context[(1 << 15) - origins[i]];
+        }
+    }
+    return true;
+}
+
 class InstrDeflateWindow : public FlushableDeflateWindow {
     using Base = FlushableDeflateWindow;
 
 public:
-    InstrDeflateWindow(byte* target, byte* target_end) :
+    static constexpr bool ascii_only = true; /// Literals above '~' can't be FASTQ, see do_block
+
+    InstrDeflateWindow(byte* target, byte* target_end, size_t output_buffer_size = 1UL << output_buffer_bits) :
         FlushableDeflateWindow(target, target_end),
         has_dummy_32k(true), output_to_target(true),
         fully_reconstructed(false),
         nb_back_refs_in_block(0), len_back_refs_in_block(0),
-        buffer_counts(new uint32_t[1 << deflate_window_bits]),
-        backref_origins(new uint16_t[1 << deflate_window_bits])
+#ifdef RECORD_BUFFER_COUNTS_AND_BACKREFS
+        buffer_counts(accounted_new<uint32_t>(LIBDEFLATE_MEMORY_INSTRUMENTATION, 1 << deflate_window_bits)),
+#else
+        buffer_counts(nullptr), // only used for statistics
+#endif
+        backref_origins(accounted_new<uint16_t>(LIBDEFLATE_MEMORY_INSTRUMENTATION, 1 << deflate_window_bits)),
+        output(1, output_buffer_size)
     {
         clear();
 
         for (int i = 0; i < (1<<15); i ++)
         {
             buffer[i] = '|';
+#ifdef RECORD_BUFFER_COUNTS_AND_BACKREFS
             buffer_counts[i] = 0; // PERF: maybe remove this
+#endif
             backref_origins[i] = (1<<15) - i; // PERF: maybe remove this
         }
     }
 
+    ~InstrDeflateWindow() {
+        accounted_delete(LIBDEFLATE_MEMORY_INSTRUMENTATION, buffer_counts, 1 << deflate_window_bits);
+        accounted_delete(LIBDEFLATE_MEMORY_INSTRUMENTATION, backref_origins, 1 << deflate_window_bits);
+    }
+
     void clear() {
         assert(has_dummy_32k);
 
@@ -1307,16 +1953,19 @@ public:
         nb_reads_printed = 0;
         nb_unsolved_reads = 0;
         nb_unexpected_length_reads = 0;
+        nb_record_resolved_reads = 0;
+        nb_context_resolved_reads = 0;
     }
 
     // record into a dedicated buffer that store counts of back references
     void record_match(unsigned length, unsigned offset) {
-#ifdef  RECORD_BUFFER_COUNTS_AND_BACKREFS
         size_t start = size() - offset;
-        for (unsigned int i = 0; i < length; i++) {
+        if (track_origins)
+            for (unsigned int i = 0; i < length; i++) // may overlap, copy forward like the match itself
+                backref_origins[size()+i] = backref_origins[start+i];
+#ifdef  RECORD_BUFFER_COUNTS_AND_BACKREFS
+        for (unsigned int i = 0; i < length; i++)
 	        buffer_counts[size()+i] = ++buffer_counts[start+i];
-            backref_origins[size()+i] = backref_origins[start+i];
-        }
         nb_back_refs_in_block++;
         len_back_refs_in_block += length;
 #endif
@@ -1346,9 +1995,10 @@ public:
 
     void push(byte c) {
         DEBUG_FIRST_BLOCK(if (c >' ' && c<'}') fprintf(stderr,"literal %c\n",c);)
+        if (track_origins)
+            backref_origins[size()] = 0;
 #ifdef  RECORD_BUFFER_COUNTS_AND_BACKREFS
         buffer_counts[size()] = 0;
-        backref_origins[size()] = 0;
 #endif
         Base::push(c);
         block_size++;
@@ -1361,12 +2011,12 @@ public:
     }
 
     void copy(InputStream & in, unsigned length) {
-#ifdef  RECORD_BUFFER_COUNTS_AND_BACKREFS
         size_t start = size();
-        for(size_t i=start ; i < start + length ; i++) {
+        if (track_origins)
+            memset(backref_origins + start, 0, length*sizeof(uint16_t));
+#ifdef  RECORD_BUFFER_COUNTS_AND_BACKREFS
+        for(size_t i=start ; i < start + length ; i++)
             buffer_counts[i]=0;
-            backref_origins[i]=0;
-        }
 #endif
         Base::copy(in, length);
     }
@@ -1615,9 +2265,7 @@ public:
                 unsigned offset = std::get<0>(seq_tuple);
                 int length = std::get<1>(seq_tuple);
 
-                output.add_sequence(buffer+offset, length);
-
-                nb_reads_printed ++; // record this for later
+                emit_read(buffer+offset, length);
             }
         }
 
@@ -1625,6 +2273,78 @@ public:
     }
 
 
+    /// Hand over a resolved read to standard output or to the demultiplexer
+    /// ('begin' bounds the header preceding it, when the read isn't in the window)
+    void emit_read(byte* seq, unsigned length, const byte* begin = nullptr) {
+        if (qc) {
+            qc->add_sequence(seq, length);
+            if (begin == nullptr)
+                add_window_quality(seq, length);
+        }
+
+        if (duplicates != nullptr) {
+            nb_reads_seen++;
+            if (!duplicates->insert(seq, length)) {
+                nb_duplicates++;
+                if (duplicates->drop)
+                    return;
+            }
+        }
+
+        if (demux != nullptr)
+            demux_outputs.add_sequence(*demux, header_barcode(seq, begin != nullptr ? begin : buffer), seq, length);
+        else
+            output.add_sequence(seq, length);
+        nb_reads_printed ++; // record this for later
+    }
+
+    /// Account the quality line of the read at 'seq' in the window, if it is decoded already
+    void add_window_quality(const byte* seq, unsigned length) {
+        const byte* plus = seq + length + 1;
+        if (plus >= next || seq[length] != '\n' || *plus != '+')
+            return;
+        const byte* eol = static_cast<const byte*>(memchr(plus, '\n', next - plus));
+        if (eol == nullptr || eol + 1 + length > next || (eol + 1 + length < next && eol[1 + length] != '\n'))
+            return;
+        qc->add_quality(eol + 1, length);
+    }
+
+    /**
+     * Barcode at the end of the header line preceding the read at 'seq', e.g.
+     * "ACGTACGT+TTGCAAGG" for "@id 1:N:0:ACGTACGT+TTGCAAGG". Empty if the
+     * header doesn't end with DNA or if it isn't resolved.
+     */
+    static std::string header_barcode(const byte* seq, const byte* begin) {
+        const byte* end = seq - 1;
+        if (end <= begin || *end != '\n')
+            return std::string();
+
+        const byte* start = end;
+        while (start > begin && (ascii2Dna[start[-1]] > 0 || start[-1] == '+'))
+            start--;
+        while (start < end && *start == '+')
+            start++;
+
+        if (start == end || start == begin || start[-1] == '|')
+            return std::string();
+        return std::string(reinterpret_cast<const char*>(start), end - start);
+    }
+
+    /// The 32K preceding the next block
+    const byte* context() const
+    { return next - (1UL<<15); }
+
+    bool context_determined() const
+    { return memchr(next - (1UL<<15), '|', 1UL<<15) == nullptr; }
+
+    /// Copy the 32K preceding the next block, and where its undetermined characters come from
+    void get_context(byte* context, uint16_t* origins) const {
+        constexpr size_t window_size = 1UL<<15;
+        memcpy(context, next - window_size, window_size);
+        if (track_origins)
+            memcpy(origins, backref_origins + size() - window_size, window_size*sizeof(uint16_t));
+    }
+
     unsigned dump(byte* const dst, int start=0, int len=0) {
         if (len == 0)
             len = size();
@@ -1709,11 +2429,12 @@ public:
     void flush() {
         //fprintf(stderr,"flushing block!!\n");
 
-#ifdef RECORD_BUFFER_COUNTS_AND_BACKREFS
         constexpr size_t window_size = 1UL<<15;
+        if (track_origins)
+            memmove(backref_origins, backref_origins + size() - window_size, window_size*sizeof(uint16_t));
+#ifdef RECORD_BUFFER_COUNTS_AND_BACKREFS
         // update counts
         memmove(buffer_counts, buffer_counts + size() - window_size, window_size*sizeof(uint32_t));
-        memmove(backref_origins, backref_origins + size() - window_size, window_size*sizeof(uint16_t));
 #endif 
 
         unsigned moved_by;
@@ -1766,10 +2487,19 @@ public:
     void final_stats()
     {
         fprintf(stderr,"done, printed %d reads\n",nb_reads_printed);
+        if (nb_context_resolved_reads > 0)
+            fprintf(stderr,"%u of them were resolved using the context decoded by the previous thread\n",nb_context_resolved_reads);
+        if (nb_record_resolved_reads > 0)
+            fprintf(stderr,"%u of them were delimited using the length of their quality line\n",nb_record_resolved_reads);
         if (nb_unsolved_reads > 0)
             fprintf(stderr,"and also didn't print %u reads containing undetermined characters\n",nb_unsolved_reads);
         if (same_readlength && (nb_unexpected_length_reads > 0))
             fprintf(stderr,"and finally also didn't parse correctly %u reads that had read length != to estimated constant %d\n",nb_unexpected_length_reads,same_readlength);
+        if (duplicates != nullptr) {
+            fprintf(stderr,"%lu of the reads were duplicates\n",nb_duplicates);
+            duplicates->nb_reads += nb_reads_seen;
+            duplicates->nb_duplicates += nb_duplicates;
+        }
     }
 
     byte* current_blk;
@@ -1789,6 +2519,7 @@ public:
     // Offsets in the primary unknown context window
     // initially backref_origins[1<<15 - 1]=1, backref_origins[1<<15 - 2]=2, etc
     uint16_t* backref_origins;
+    bool track_origins = false; /// Maintain backref_origins, when starting from an unknown context
 
     // some info to help fastq parsing
     unsigned header_length;
@@ -1801,24 +2532,42 @@ public:
     std::vector<std::string> unsolved_reads; // reads where context wasn't elucidated, to be solved at the end
     unsigned nb_unsolved_reads;
     unsigned nb_unexpected_length_reads;
+    unsigned nb_record_resolved_reads; // reads glued to their header, delimited using their quality line
+    unsigned nb_context_resolved_reads; // reads depending on the initial context, resolved at the end
     unsigned nb_reads_printed;
 
-    OutputBuffer output = {};
+    OutputBuffer output;
+
+    libdeflate_demultiplexer* demux = nullptr; /// Shared barcode router, if demultiplexing
+    DemuxOutputs demux_outputs;
+
+    libdeflate_duplicates* duplicates = nullptr; /// Shared set of reads, if looking for duplicates
+    size_t nb_reads_seen = 0;
+    size_t nb_duplicates = 0;
+
+    std::unique_ptr<qc_accumulator> qc; /// Statistics of the reads, if gathering them
 };
 
 class FASTQParserDeflateWindow : public InstrDeflateWindow {
     using Base = InstrDeflateWindow;
 
     public:
-    FASTQParserDeflateWindow(byte* target, byte* target_end) :
-        InstrDeflateWindow(target, target_end), dont_record(true)
+    FASTQParserDeflateWindow(byte* target, byte* target_end, size_t output_buffer_size = 1UL << output_buffer_bits) :
+        InstrDeflateWindow(target, target_end, output_buffer_size), dont_record(true),
+        undetermined_origins(accounted_new<uint32_t>(LIBDEFLATE_MEMORY_INSTRUMENTATION, (1 << 15) + 1, true))
     {
         clear(); // for some reason, need to call it, even though base class will call it too
     }
 
+    ~FASTQParserDeflateWindow() {
+        accounted_delete(LIBDEFLATE_MEMORY_INSTRUMENTATION, undetermined_origins, (1 << 15) + 1);
+        memory_accounting::instance().released(LIBDEFLATE_MEMORY_DEFERRED_READS, deferred_bytes);
+    }
+
     void clear()
     {
         reset_state('\0');
+        pending_read_end = nullptr;
         incomplete_context = false;
         fully_reconstructed = false;
         Base::clear(); // :)
@@ -1895,7 +2644,9 @@ class FASTQParserDeflateWindow : public InstrDeflateWindow {
                     else
                     {
                         if (c == '\n')
-                            end_of_dna(position, c);
+                            end_of_dna(position, c, position);
+                        else if (nb_undetermined_parts > 0) // quality values can start with DNA letters, after an undetermined '+' line
+                            quality_after_dna(position, c);
                         else // if that's not a | nor a \n, it means we were parsing quality values
                             reset_state(c);
                     }
@@ -1913,13 +2664,12 @@ class FASTQParserDeflateWindow : public InstrDeflateWindow {
                 else
                 {
                     if (c != '|') // keep reading U^+, otherwise..
-                        end_of_dna(position, c);
+                        end_of_dna(position, c, position);
                 }
                 break;
 
             case State::PostRead:
-                if (--wait_post_read == 0)
-                    reset_state(c);
+                post_read(c, position);
             break;
         }
         
@@ -1932,8 +2682,7 @@ class FASTQParserDeflateWindow : public InstrDeflateWindow {
 
         if (state == State::PostRead)
         {
-            if (--wait_post_read == 0)
-                reset_state(c);
+            post_read(c, position);
             return;
         }
 
@@ -1978,11 +2727,16 @@ class FASTQParserDeflateWindow : public InstrDeflateWindow {
                 else
                 {
                     if (state == State::InDNA)
-                        reset_state(c);
+                    {
+                        if (nb_undetermined_parts > 0)
+                            quality_after_dna(position, c);
+                        else
+                            reset_state(c);
+                    }
                     else 
                     {
                         if (state == State::InDNAU)
-                            end_of_dna(position, c);
+                            end_of_dna(position, c, position);
                     }
                 }
             }
@@ -2000,7 +2754,7 @@ class FASTQParserDeflateWindow : public InstrDeflateWindow {
                     if (isNewline)
                     {
                         if (state == State::None)       state = State::LeftTrailing;
-                        else if (state == State::InDNA || state== State::InDNAU) end_of_dna(position, c);
+                        else if (state == State::InDNA || state== State::InDNAU) end_of_dna(position, c, position);
                     }
                 }
             }
@@ -2010,13 +2764,30 @@ class FASTQParserDeflateWindow : public InstrDeflateWindow {
     }
 
 
-    void end_of_dna(byte* const position, byte c)
+    /* the DNA since the last undetermined characters began the quality line, e.g. "ACGT|||A?B;": the read ended before
+     * them, as if the quality line had started at that DNA */
+    void quality_after_dna(byte* const position, byte c)
+    {
+        state = State::InDNAU;
+        end_of_dna(position, c, position_after_last_undetermined);
+    }
+
+    /// the DNA starting at start_read ends at dna_end, usually 'position' where 'c' follows it
+    void end_of_dna(byte* const position, byte c, byte* const dna_end)
     {
-        unsigned read_length = position-start_read;
-        const unsigned min_read_length = 35;
+        unsigned read_length = dna_end-start_read;
         
         //fprintf(stderr,"end, readlen: %X %X\n", position, start_read);
 
+        // a short read may start with undetermined characters, which could be DNA too
+        if (read_length < min_read_length && start_read > buffer && start_read[-1] == '|')
+        {
+            const byte* prefix = start_read;
+            while (prefix > buffer && prefix[-1] == '|' && read_length + (start_read - prefix) < min_read_length)
+                prefix--;
+            read_length += start_read - prefix;
+        }
+
         if (read_length < min_read_length)
         {
             reset_state(c);
@@ -2025,70 +2796,430 @@ class FASTQParserDeflateWindow : public InstrDeflateWindow {
         
         //fprintf(stderr,"got some sort of seq: %.*s\n",read_length,start_read);
 
-        // trim trailing |'s
+        // trailing |'s: the '\n', '+' line, '\n' separating the read from its quality if there are as many,
+        // otherwise the read ends with some of them
+        byte* read_end = dna_end;
         if (state == State::InDNAU)
         {
-            if (position_before_last_undetermined > 0)
-                read_length = position_before_last_undetermined - start_read;
+            const unsigned trailing = dna_end - position_before_last_undetermined;
+            if (c == '\n' && dna_end == position)
+            {
+                if (trailing == quality_header_length + 1)
+                    read_end = position_before_last_undetermined;
+            }
             else
             {
-                read_length = 0;
-                nb_undetermined_parts = 0;
+                if (trailing <= quality_header_length + 2)
+                    read_end = position_before_last_undetermined;
+                else
+                    read_end = dna_end - (quality_header_length + 2);
             }
         }
 
-        // heuristic: rescue some undetermined reads if we have guessed that the read length is fixed
-        if (unlikely(nb_undetermined_parts == 1 && (same_readlength > 0) && (read_length > same_readlength)))
+        // the read is only delimited once its quality line is known
+        pending_read_end = read_end;
+        pending_read_end_known = (state == State::InDNA);
+        reset_state(c);
+        enter_post_read(read_end, position);
+    }
+
+    void undetermined_read()
+    {
+        if (fully_reconstructed)
+            nb_unsolved_reads++;
+        else
+            incomplete_context = true;
+    }
+
+    /* skip the '+' line and measure the quality line that follow a read. newlines there are often undetermined,
+     * so they are located by counting characters from the end of the read, using the '+' line length
+     * estimated from the first block */
+    void enter_post_read(byte* const read_end, byte* const position)
+    {
+        const unsigned consumed = position + 1 - read_end; // characters after the read, including the current one
+        const unsigned quality_start = quality_header_length + 2; // '\n', '+' line, '\n'
+        state = State::PostRead;
+        post_read_wait = (consumed < quality_start) ? quality_start - consumed : 0;
+        quality_length = (consumed > quality_start) ? consumed - quality_start : 0;
+        quality_start_known = true;
+        quality_end_undetermined = false;
+        for (const byte* p = read_end + 2; p <= position && p < read_end + quality_start; p++)
+            if (*p == '|')
+                quality_start_known = false; // its newline may be undetermined, the '+' lines may vary in length
+    }
+
+    void post_read(byte c, byte* const position)
+    {
+        if (post_read_wait > 0)
         {
-            //fprintf(stderr,"possibly something can be done about this sequence: %.*s\n",read_length,start_read);
-            //fprintf(stderr,"possibly %d %d\n",same_readlength,read_length - (position_after_last_undetermined-start_read));
-            if (same_readlength == read_length - (position_after_last_undetermined-start_read))
+            post_read_wait--;
+            const unsigned k = position - pending_read_end;
+            if (k == 1 && c != '+' && c != '|')
             {
-                //fprintf(stderr,"possibly removing header from\t %.*s to\n%.*s\n",read_length,start_read,same_readlength,position_after_last_undetermined);
-                start_read = position_after_last_undetermined;
-                read_length = same_readlength;
-                nb_undetermined_parts--;
+                // a header line ending with DNA isn't followed by a '+' line: parse it as the start of a line
+                pending_read_end = nullptr;
+                reset_state('\n');
+                update_state(c, position);
             }
-            else
+            else if ((k <= quality_header_length && c == '\n') || (post_read_wait == 0 && c != '\n' && c != '|'))
+                quality_start_known = false; // '+' line of another length
+            else if (c == '|' && k > 1)
+                quality_start_known = false; // as in enter_post_read
+            return;
+        }
+
+        if (quality_end_undetermined)
+        {
+            // an undetermined character in the quality line is only its end if a header (or more of them) follows.
+            // it may as well be a quality value followed by others ('@' is one too), the length is then a lower bound
+            quality_end_undetermined = false;
+            if (c == '@' || c == '|')
             {
-                // using position_before_last_undetermined isnt ideal because we may already be treating a read like: ACTG|CGG| where CGG is quality 
-                if (same_readlength == position_before_last_undetermined - start_read+1)
-                {
-                    //fprintf(stderr,"possibly removing nucleotide-like quality from\t %.*s to\n%.*s\n",read_length,start_read,same_readlength,start_read);
-                    read_length = position_before_last_undetermined - start_read;
-                    nb_undetermined_parts--;
-                }
+                resolve_pending_read(false, position - 1);
+                reset_state('|');
+                update_state(c, position);
+                return;
             }
+            quality_length++;
         }
 
-        if (nb_undetermined_parts > 0)
+        if (c == '\n')
         {
-            if (fully_reconstructed)
+            resolve_pending_read(quality_start_known, position);
+            reset_state(c);
+        }
+        else if (c == '|')
+            quality_end_undetermined = true;
+        else
+            quality_length++;
+    }
+
+    /* called at the end of the quality line following a read, at 'position'. the read is the DNA line
+     * ending at pending_read_end; quality_length is its length if exact_length, a lower bound otherwise
+     * (the quality line may go on with undetermined characters) */
+    void resolve_pending_read(bool exact_length, byte* const position)
+    {
+        byte* const read_end = pending_read_end;
+        pending_read_end = nullptr;
+
+        byte* read = read_end;
+        while (read > buffer + 1 && ascii2Dna[read[-1]] > 0)
+            read--;
+        const unsigned length = read_end - read;
+
+        // either both newlines are determined, or the quality line confirms the undetermined ones. undetermined
+        // characters right after DNA aren't taken as a newline: the read could go on before them, or the header end with DNA
+        const byte* before = read - 1;
+        while (before > buffer && *before == '|')
+            before--;
+        const bool header_before = read[-1] == '\n' || (read[-1] == '|' && *before != '|' && ascii2Dna[*before] == 0);
+        // without a previous thread to resolve it later, a read is also delimited by a quality line of unsure length
+        const bool delimited = (read[-1] == '\n' && pending_read_end_known)
+            || (header_before && (exact_length || !track_origins) && length == quality_length);
+        if (delimited && read[-1] == '\n' && length < min_read_length)
+            return; // not a read
+        if (delimited && length >= min_read_length)
+        {
+            if (read[-1] == '|' && fully_reconstructed)
+                nb_record_resolved_reads++;
+            if (same_readlength > 0 && length != same_readlength && fully_reconstructed)
+                nb_unexpected_length_reads++;
+            putative_sequences.push_back(std::make_tuple(read-buffer,length));
+            return;
+        }
+
+        // the read starts, ends or is interrupted by undetermined characters, or is glued to the end of its header
+        if ((read[-1] == '|' || read[-1] == '\n') && track_origins && !context_lost)
+            defer_read(read_end, exact_length && quality_length >= min_read_length, position);
+        else
+            undetermined_read();
+    }
+
+    /* keep a read depending on the unknown initial context, with a bit of its header and what follows it
+     * up to the end of its quality line, until the previous thread provides that context */
+    void defer_read(const byte* read_end, bool exact_length, const byte* position)
+    {
+        const size_t available = std::min<size_t>(read_end - buffer, 1 << 15);
+        // the quality line bounds the read, unless its own newlines were undetermined
+        size_t read_length = max_deferred_read_length;
+        if (exact_length && quality_length < max_deferred_read_length)
+            read_length = quality_length;
+        else
+        {
+            // it starts after the last determined character that isn't DNA
+            const byte* start = read_end;
+            const byte* const limit = read_end - std::min<size_t>(available, max_deferred_read_length);
+            while (start > limit && (ascii2Dna[start[-1]] > 0 || start[-1] == '|'))
+                start--;
+            read_length = read_end - start;
+        }
+        size_t length = read_length + max_deferred_prefix;
+        length = std::min(length, available);
+        const size_t offset = deferred_chars.size();
+        const byte* const begin = read_end - length;
+        const byte* const end = position + 1;
+        grow_deferred(deferred_chars, end - begin);
+        grow_deferred(deferred_origins, end - begin);
+        grow_deferred(deferred_reads, 1);
+        deferred_chars.insert(deferred_chars.end(), begin, end);
+        deferred_origins.insert(deferred_origins.end(), backref_origins + (begin - buffer), backref_origins + (end - buffer));
+        deferred_reads.push_back({offset, (unsigned)length, (unsigned)(end - read_end), exact_length ? quality_length : 0,
+                                  flushed_size + (read_end - buffer)});
+        account_deferred_reads();
+    }
+
+    /// Make room for 'n' more elements, by a quarter at a time rather than doubling, to stay close to the memory budget
+    template <typename T>
+    static void grow_deferred(std::vector<T>& v, size_t n)
+    {
+        if (v.size() + n > v.capacity())
+            v.reserve(std::max(v.size() + n, v.capacity() + v.capacity() / 4));
+    }
+
+    /// Forget the deferred reads from the 'first' one on
+    void drop_deferred_reads(size_t first)
+    {
+        if (deferred_reads.size() <= first)
+            return;
+        deferred_chars.resize(deferred_reads[first].offset);
+        deferred_origins.resize(deferred_chars.size());
+        deferred_reads.resize(first);
+    }
+
+    /// Charge the capacity of the deferred reads' buffers to the memory accounting, after it changed
+    void account_deferred_reads()
+    {
+        const size_t bytes = deferred_reads.capacity() * sizeof(deferred_read) + deferred_chars.capacity()
+                           + deferred_origins.capacity() * sizeof(uint16_t);
+        if (bytes > deferred_bytes)
+            memory_accounting::instance().allocated(LIBDEFLATE_MEMORY_DEFERRED_READS, bytes - deferred_bytes);
+        else if (bytes < deferred_bytes)
+            memory_accounting::instance().released(LIBDEFLATE_MEMORY_DEFERRED_READS, deferred_bytes - bytes);
+        deferred_bytes = bytes;
+    }
+
+    /// Output the deferred reads, given the 32K preceding the first decoded block (nullptr if unknown)
+    void resolve_deferred_reads(const byte* context)
+    {
+        if (context != nullptr)
+        {
+            for (size_t origin = 1; origin <= (1 << 15); origin++)
             {
-                //fprintf(stderr,"undetermined seq: %.*s at block %u\n",read_length,start_read,nb_blocks);
-                nb_unsolved_reads++;
+                if (context[(1 << 15) - origin] == '\n')
+                    nb_newlines += undetermined_origins[origin];
+                undetermined_origins[origin] = 0;
+            }
+        }
+
+        std::vector<size_t> resolved_read_ends; // the kept text holds them too
+        for (const deferred_read& r : deferred_reads)
+        {
+            if (r.exact_length == kept_text)
+                continue;
+            byte* chars = &deferred_chars[r.offset];
+            byte* const chars_end = chars + r.length + r.suffix_length;
+            bool is_read = resolve_undetermined(chars, &deferred_origins[r.offset], chars_end - chars, context);
+
+            // the end of the read was guessed from the count of undetermined characters, it can be further,
+            // or just past its newline
+            byte* read_end = chars + r.length;
+            if (is_read && read_end[-1] == '\n' && read_end < chars_end && read_end[0] == '+')
+                read_end--;
+            while (is_read && read_end < chars_end && ascii2Dna[*read_end] > 0)
+                read_end++;
+            // or before, when the quality line started with undetermined characters
+            auto ends_read = [chars_end](const byte* p) { return p + 1 < chars_end && p[0] == '\n' && p[1] == '+'; };
+            if (is_read && !ends_read(read_end))
+            {
+                byte* p = read_end;
+                byte* const low = read_end - std::min<ptrdiff_t>(read_end - (chars + 1), min_read_length);
+                while (p > low && !(ascii2Dna[p[-1]] > 0 && ends_read(p)))
+                    p--;
+                if (ascii2Dna[p[-1]] > 0 && ends_read(p))
+                    read_end = p;
+            }
+            const ptrdiff_t moved_by = read_end - (chars + r.length);
+            is_read = is_read && ends_read(read_end);
+            if (is_read && r.stream_position + moved_by == last_resolved_read_end)
+                continue;
+
+            byte* read = read_end;
+            while (is_read && read > chars + 1 && ascii2Dna[read[-1]] > 0)
+                read--;
+            const unsigned length = read_end - read;
+            // exact_length assumed the '+' line of the first block, the resolved quality line tells if it had another length
+            auto quality_line_matches = [chars_end](const byte* read_end, unsigned length) {
+                const byte* q = static_cast<const byte*>(memchr(read_end + 1, '\n', chars_end - (read_end + 1)));
+                const byte* q_end = q == nullptr ? nullptr : static_cast<const byte*>(memchr(q + 1, '\n', chars_end - (q + 1)));
+                return q_end != nullptr && unsigned(q_end - (q + 1)) == length;
+            };
+            is_read = is_read && read[-1] == '\n' && length >= min_read_length
+                && (r.exact_length == 0 || moved_by != 0 || length == r.exact_length || quality_line_matches(read_end, length));
+
+            if (is_read)
+            {
+                last_resolved_read_end = r.stream_position + moved_by;
+                resolved_read_ends.push_back(last_resolved_read_end);
+                emit_read(read, length, chars);
+                nb_context_resolved_reads++;
             }
             else
-                incomplete_context = true;
-            reset_state(c);
+                nb_unsolved_reads++;
         }
-        else
+        resolve_kept_text(context, resolved_read_ends);
+        std::vector<deferred_read>().swap(deferred_reads);
+        std::vector<byte>().swap(deferred_chars);
+        std::vector<uint16_t>().swap(deferred_origins);
+        block_first_deferred_read = 0;
+        account_deferred_reads();
+    }
+
+    /**
+     * Keep the text around the runs of undetermined characters long enough to hold a whole read: the parser only
+     * sees reads with some determined DNA, those are output once the kept text is resolved, see resolve_kept_text
+     */
+    void keep_undetermined_records()
+    {
+        // the first block may end the reads of the window before it, then a run may go on from the previous block
+        const bool first_block = reads_begin == flushed_size + (current_blk - buffer);
+        byte* p = first_block ? buffer : current_blk;
+        while (p > buffer && p[-1] == '|')
+            p--;
+        const bool open = keep_text_until > kept_text_end;
+        size_t run_begin = extend_kept_text(p);
+        if (first_block && dropped_until > reads_begin)
+        {
+            run_begin = std::min(run_begin, dropped_begin);
+            keep_text_until = std::max(keep_text_until, dropped_until);
+        }
+        if (keep_text_until <= kept_text_end)
+            return;
+
+        const size_t window_begin = flushed_size;
+        const size_t begin = std::max(open ? kept_text_end : run_begin, window_begin);
+        const size_t end = std::min(keep_text_until, window_begin + size());
+        if (begin >= end)
+            return;
+        const size_t offset = deferred_chars.size();
+        grow_deferred(deferred_chars, end - begin);
+        grow_deferred(deferred_origins, end - begin);
+        grow_deferred(deferred_reads, 1);
+        deferred_chars.insert(deferred_chars.end(), buffer + (begin - window_begin), buffer + (end - window_begin));
+        deferred_origins.insert(deferred_origins.end(), backref_origins + (begin - window_begin), backref_origins + (end - window_begin));
+        deferred_reads.push_back({offset, (unsigned)(end - begin), 0, kept_text, end});
+        kept_text_end = end;
+        account_deferred_reads();
+    }
+
+    /// Extend keep_text_until past the reads the runs of undetermined characters from 'p' on may hold, up to their
+    /// quality line. Returns the stream position of the first run, with the newline before it, ~0 if none
+    size_t extend_kept_text(byte* p)
+    {
+        size_t first_run = ~0UL;
+        while ((p = static_cast<byte*>(memchr(p, '|', next - p))) != nullptr)
         {
-            if (same_readlength > 0 && read_length != same_readlength && fully_reconstructed)
+            byte* const run = p;
+            while (p < next && *p == '|')
+                p++;
+            const size_t run_length = p - run;
+            if (run_length < min_read_length)
+                continue;
+            if (first_run == ~0UL)
+                first_run = flushed_size + (run - buffer) - (run > buffer);
+            const size_t record_end = std::min<size_t>(run_length, max_deferred_read_length) + quality_header_length + 3;
+            keep_text_until = std::max(keep_text_until, flushed_size + (p - buffer) + record_end);
+        }
+        return first_run;
+    }
+
+    /**
+     * Output the reads of the kept text the parser didn't, those with undetermined characters only in their
+     * sequence, given the context and the ends of the deferred reads resolved with it (in the kept text too).
+     * Only the reads whose quality line ends in the blocks we output the reads of are ours, the previous
+     * thread outputs the others
+     */
+    void resolve_kept_text(const byte* context, std::vector<size_t>& resolved_read_ends)
+    {
+        std::sort(resolved_read_ends.begin(), resolved_read_ends.end());
+        std::vector<byte> text; // of the current stretch, from the lines not parsed yet
+        std::vector<uint16_t> origins;
+        size_t text_end = 0; // stream position
+        for (const deferred_read& r : deferred_reads)
+        {
+            if (r.exact_length != kept_text)
+                continue;
+            if (r.stream_position - r.length != text_end) // a stretch not following the previous one
             {
-                //fprintf(stderr,"unexpected length sequence: %.*s\n",read_length,start_read);
-                nb_unexpected_length_reads++;
+                text.clear();
+                origins.clear();
             }
+            if (!resolve_undetermined(&deferred_chars[r.offset], &deferred_origins[r.offset], r.length, context))
+                return;
+            text.insert(text.end(), &deferred_chars[r.offset], &deferred_chars[r.offset] + r.length);
+            origins.insert(origins.end(), &deferred_origins[r.offset], &deferred_origins[r.offset] + r.length);
+            text_end = r.stream_position;
+
+            // a record: a newline, the read, a '+' line, and a quality line as long as the read
+            const size_t text_begin = text_end - text.size();
+            byte* const end = text.data() + text.size();
+            byte* line = static_cast<byte*>(memchr(text.data(), '\n', text.size()));
+            byte* parsed = line;
+            for (; line != nullptr; line = static_cast<byte*>(memchr(line + 1, '\n', end - line - 1)))
+            {
+                parsed = line;
+                byte* const read = line + 1;
+                byte* read_end = read;
+                while (read_end < end && ascii2Dna[*read_end] > 0)
+                    read_end++;
+                const size_t length = read_end - read;
+                if (read_end + 1 >= end)
+                    break; // may go on in the next stretch
+                if (length < min_read_length || *read_end != '\n' || read_end[1] != '+')
+                    continue;
+                const byte* const plus_end = static_cast<byte*>(memchr(read_end + 1, '\n', end - read_end - 1));
+                if (plus_end == nullptr || plus_end + 1 + length >= end)
+                    break;
+                const byte* const quality_end = plus_end + 1 + length;
+                if (*quality_end != '\n' || memchr(plus_end + 1, '\n', length) != nullptr)
+                    continue;
 
-            putative_sequences.push_back(std::make_tuple(start_read-buffer,read_length));
+                const uint16_t* const read_origins = origins.data() + (read - text.data());
+                const size_t read_end_position = text_begin + (read_end - text.data());
+                if (text_begin + (quality_end - text.data()) < reads_begin
+                        || std::none_of(read_origins, read_origins + length, [](uint16_t o) { return o > 0; })
+                        || std::binary_search(resolved_read_ends.begin(), resolved_read_ends.end(), read_end_position))
+                    continue;
+                emit_read(read, length, text.data());
+                nb_context_resolved_reads++;
+            }
 
-            wait_post_read = read_length + 5; // heuristic, skipping the '\n+\nquality\n' after the read
-            reset_state(c);
-            if (fully_reconstructed)
-                state = State::PostRead;
+            // the lines from the last one not parsed are parsed again with the next stretch
+            if (parsed == nullptr)
+                parsed = end;
+            const size_t consumed = parsed - text.data();
+            text.erase(text.begin(), text.begin() + consumed);
+            origins.erase(origins.begin(), origins.begin() + consumed);
         }
     }
 
+    /**
+     * Resolve the deferred reads before the end of the decoding, to release their memory: the undetermined
+     * characters of the window are replaced too, and the next blocks decoded exactly. If 'context' is nullptr,
+     * the reads depending on it are dropped from now on.
+     */
+    void resolve_context(const byte* context)
+    {
+        resolve_deferred_reads(context);
+        if (context == nullptr) {
+            context_lost = true;
+            return;
+        }
+        resolve_undetermined(buffer, backref_origins, size(), context);
+        memset(backref_origins, 0, size() * sizeof(uint16_t));
+        // the reads the kept text cut short go on in the next blocks, the parser now sees them
+        keep_text_until = kept_text_end;
+        parse_window_again();
+    }
 
     void parse_block(bool is_final_block)
     {
@@ -2099,23 +3230,57 @@ class FASTQParserDeflateWindow : public InstrDeflateWindow {
         //}
 #endif
 
-        if (putative_sequences.size() >= 10 && (!incomplete_context)) // heuristic 
+        if (is_final_block && state == State::PostRead && quality_end_undetermined)
+        {
+            // the end of the stream confirms that the last character was the newline ending the quality line
+            quality_end_undetermined = false;
+            resolve_pending_read(quality_start_known, next - 1);
+            reset_state('|');
+        }
+
+        const size_t nb_deferred_in_block = deferred_reads.size() - block_first_deferred_read;
+        if (putative_sequences.size() + nb_deferred_in_block >= 10 && (!incomplete_context)) // heuristic 
             fully_reconstructed = true;
 
+
         PRINT_DEBUG("end of block, status: total buffer size %d, fully reconstructed? %d, nb reads: %d", (int)(next-buffer), fully_reconstructed, putative_sequences());
 
         if (fully_reconstructed)
         { 
+            if (reads_begin == ~0UL)
+                reads_begin = flushed_size + (current_blk - buffer);
             for (auto seq_tuple: putative_sequences)
             {
                 unsigned offset = std::get<0>(seq_tuple);
                 int length = std::get<1>(seq_tuple);
                 //printf("%.*s\n",length,buffer+offset);
-                output.add_sequence(buffer+offset, length);
-                nb_reads_printed ++; // record this for later
+                emit_read(buffer+offset, length);
             }
+            count_newlines();
+            if (track_origins && !context_lost)
+                keep_undetermined_records();
         }
     }
+
+    /* count the newlines of a block we output the reads of, to check their number in the end. undetermined
+     * characters are counted by origin, until resolve_deferred_reads() knows which are newlines */
+    void count_newlines()
+    {
+        nb_newlines += std::count(current_blk, next, byte('\n'));
+        if (!track_origins)
+            return;
+        for (const byte* p = current_blk; (p = static_cast<const byte*>(memchr(p, '|', next - p))) != nullptr; p++)
+            undetermined_origins[backref_origins[p - buffer]]++;
+    }
+
+    /// Add our reads, including dropped duplicates, and our newlines to those of the previous threads
+    void tally_reads(synchronizer::read_tally& reads) const
+    {
+        reads.nb_reads += nb_reads_printed + (duplicates != nullptr && duplicates->drop ? nb_duplicates : 0);
+        reads.nb_newlines += nb_newlines;
+        for (size_t origin = 1; origin <= (1 << 15); origin++)
+            reads.resolved &= undetermined_origins[origin] == 0;
+    }
     
     void notify_end_block(InputStream& in_stream){
         putative_sequences.clear();
@@ -2125,9 +3290,126 @@ class FASTQParserDeflateWindow : public InstrDeflateWindow {
         start_read -= moved_by;
         position_before_last_undetermined -= moved_by;
         position_after_last_undetermined -= moved_by ;
+        if (pending_read_end != nullptr)
+            pending_read_end -= moved_by;
+        if (!fully_reconstructed) // the previous thread takes care of those
+        {
+            // unless the quality line of one goes on in our first block, its end was only guessed: the text around
+            // them is kept there, see keep_undetermined_records
+            dropped_begin = ~0UL;
+            dropped_until = 0;
+            for (size_t i = block_first_deferred_read; i < deferred_reads.size(); i++)
+            {
+                const deferred_read& r = deferred_reads[i];
+                if (r.exact_length != 0)
+                    continue;
+                dropped_begin = std::min<size_t>(dropped_begin, r.stream_position - r.length);
+                dropped_until = std::max<size_t>(dropped_until, r.stream_position + r.length + quality_header_length + 3);
+            }
+            drop_deferred_reads(block_first_deferred_read);
+        }
+        block_first_deferred_read = deferred_reads.size();
+        flushed_size += moved_by;
         Base::notify_end_block(in_stream);
     }
     
+    /// Record the state between two blocks in 'state', with the 32K context unless 'with_window' is false
+    void save_checkpoint(worker_checkpoint& state, bool with_window) const {
+        constexpr size_t window_size = 1UL<<15;
+        if (with_window) {
+            state.window.assign(next - window_size, next);
+            if (track_origins)
+                state.origins.assign(backref_origins + size() - window_size, backref_origins + size());
+        }
+        state.stats = {nb_blocks, total_block_size, nb_reads_printed, nb_unsolved_reads,
+                       nb_unexpected_length_reads, nb_record_resolved_reads};
+        state.flushed_size = flushed_size;
+        state.reads_begin = reads_begin;
+        state.kept_text_end = kept_text_end;
+        state.keep_text_until = keep_text_until;
+        state.nb_newlines = nb_newlines;
+        if (track_origins)
+            state.undetermined_origins.assign(undetermined_origins, undetermined_origins + (1 << 15) + 1);
+        const byte* reads = reinterpret_cast<const byte*>(deferred_reads.data());
+        state.deferred_reads.assign(reads, reads + deferred_reads.size() * sizeof(deferred_read));
+    }
+
+    /// Rebuild the parser state at the end of the window, dropping the reads found there as they were handled
+    void parse_window_again() {
+        reset_state('\0');
+        pending_read_end = nullptr;
+        const size_t nb_deferred_reads = deferred_reads.size();
+        for (byte* j = buffer; j < next; j++)
+            update_state(*j, j);
+        putative_sequences.clear();
+        drop_deferred_reads(nb_deferred_reads);
+        incomplete_context = (nb_undetermined_parts > 0);
+    }
+
+    /**
+     * Get back the state recorded by save_checkpoint(). The reads are resolved from there: the parser state at
+     * the end of the context is rebuilt by parsing it again, dropping the reads it finds, as they were output.
+     */
+    void restore_checkpoint(worker_checkpoint&& state) {
+        constexpr size_t window_size = 1UL<<15;
+        if (state.window.size() == window_size) {
+            memcpy(buffer, state.window.data(), window_size);
+            if (track_origins && state.origins.size() == window_size)
+                memcpy(backref_origins, state.origins.data(), window_size * sizeof(uint16_t));
+            next = buffer + window_size;
+            current_blk = next;
+            has_dummy_32k = false;
+            fully_reconstructed = true;
+            dont_record = false;
+            parse_window_again();
+        }
+
+        nb_blocks = state.stats.nb_blocks;
+        total_block_size = state.stats.total_block_size;
+        nb_reads_printed = state.stats.nb_reads_printed;
+        nb_unsolved_reads = state.stats.nb_unsolved_reads;
+        nb_unexpected_length_reads = state.stats.nb_unexpected_length_reads;
+        nb_record_resolved_reads = state.stats.nb_record_resolved_reads;
+        flushed_size = state.flushed_size;
+        reads_begin = state.reads_begin;
+        kept_text_end = state.kept_text_end;
+        keep_text_until = state.keep_text_until;
+        nb_newlines = state.nb_newlines;
+        if (state.undetermined_origins.size() == (1 << 15) + 1)
+            std::copy(state.undetermined_origins.begin(), state.undetermined_origins.end(), undetermined_origins);
+        block_first_deferred_read = deferred_reads.size();
+    }
+
+    /**
+     * Get back the deferred reads recorded by save_checkpoint(), before restore_checkpoint(). Their characters
+     * aren't saved, as they would take several times the size of the input: replay_deferred_reads() copies them
+     * back while the blocks they come from are decoded again, from the first one.
+     */
+    void restore_deferred_reads(const worker_checkpoint& state) {
+        const deferred_read* reads = reinterpret_cast<const deferred_read*>(state.deferred_reads.data());
+        deferred_reads.assign(reads, reads + state.deferred_reads.size() / sizeof(deferred_read));
+        const size_t nb_chars = deferred_reads.empty() ? 0
+            : deferred_reads.back().offset + deferred_reads.back().length + deferred_reads.back().suffix_length;
+        deferred_chars.resize(nb_chars);
+        deferred_origins.resize(nb_chars);
+        block_first_deferred_read = deferred_reads.size(); // kept by notify_end_block() while replaying
+        account_deferred_reads();
+    }
+
+    /// Copy back the characters of the deferred reads from 'replayed' on which end in the block just decoded again,
+    /// returns the index of the first one left
+    size_t replay_deferred_reads(size_t replayed) {
+        for (; replayed < deferred_reads.size(); replayed++) {
+            const deferred_read& r = deferred_reads[replayed];
+            if (r.stream_position + r.suffix_length > flushed_size + size())
+                break;
+            const size_t begin = r.stream_position - r.length - flushed_size;
+            memcpy(&deferred_chars[r.offset], buffer + begin, r.length + r.suffix_length);
+            memcpy(&deferred_origins[r.offset], backref_origins + begin, (r.length + r.suffix_length) * sizeof(uint16_t));
+        }
+        return replayed;
+    }
+
     bool check_ascii() {
         bool res = Base::check_ascii();
         if (res)
@@ -2149,7 +3431,43 @@ class FASTQParserDeflateWindow : public InstrDeflateWindow {
     byte *position_after_last_undetermined;
     std::vector<std::tuple<unsigned,int>> putative_sequences;
     bool incomplete_context;
-    unsigned wait_post_read;
+
+    static const unsigned min_read_length = 35;
+
+    // record structure following a read (PostRead state)
+    byte *pending_read_end; // the read, waiting for its quality line
+    bool pending_read_end_known; // followed by a determined newline
+    unsigned post_read_wait;
+    unsigned quality_length;
+    bool quality_start_known;
+    bool quality_end_undetermined; // last character of the quality line so far was undetermined
+
+    // reads waiting for the initial context, see defer_read
+    struct deferred_read {
+        size_t offset; // in deferred_chars and deferred_origins
+        unsigned length; // of the data kept before the (presumed) end of the read
+        unsigned suffix_length; // of the data kept from the end of the read
+        unsigned exact_length; // length of the read if known from its quality line, otherwise 0
+        size_t stream_position; // of the presumed end of the read, in the decompressed stream (+32K)
+    };
+    static const unsigned max_deferred_prefix = 64; // enough for barcodes at the end of the header
+    static const unsigned max_deferred_read_length = 1 << 12;
+    static const unsigned kept_text = ~0U; // exact_length of the text kept by keep_undetermined_records
+    std::vector<deferred_read> deferred_reads;
+    std::vector<byte> deferred_chars;
+    std::vector<uint16_t> deferred_origins;
+    size_t deferred_bytes = 0; // capacity of the three, as accounted
+    size_t block_first_deferred_read = 0;
+    size_t last_resolved_read_end = ~0UL; // several undetermined parts of a read may end up at the same end
+    bool context_lost = false; // the previous thread couldn't provide the context, see resolve_context
+    size_t flushed_size = 0; // bytes moved out of the window so far
+    size_t reads_begin = ~0UL; // stream position of the first block we output the reads of
+    size_t kept_text_end = 0, keep_text_until = 0; // stream positions, see keep_undetermined_records
+    size_t dropped_begin = ~0UL, dropped_until = 0; // text of the reads dropped with the last block, see notify_end_block
+
+    // newlines of the blocks we output the reads of, see count_newlines
+    size_t nb_newlines = 0;
+    uint32_t* const undetermined_origins; // counts, indexed like backref_origins
 };
 
 #ifdef OLD_PARSER
@@ -2158,6 +3476,13 @@ typedef InstrDeflateWindow ParsingDeflateWindow;
 typedef FASTQParserDeflateWindow ParsingDeflateWindow; 
 #endif
 
+/* When the input is a ranged input, fetch what the blocks starting at 'p' may need */
+static inline void fetch_input(struct libdeflate_decompressor * restrict d, const byte* p)
+{
+    if (unlikely(d->ranged_input != nullptr))
+        d->ranged_input->require(d->input_window, p, d->ranged_input->chunk_size);
+}
+
 template < typename WindowType>
 bool do_uncompressed(InputStream& in_stream, WindowType& out) {
     /* Uncompressed block: copy 'len' bytes literally from the input
@@ -2195,9 +3520,10 @@ template <typename WindowType>
 bool do_block(struct libdeflate_decompressor * restrict d, InputStream& in_stream, WindowType& out, bool &is_final_block, bool already_aligned=false)
 {
     /* Starting to read the next block.  */
+    fetch_input(d, in_stream.in_next);
     in_stream.ensure_bits<1 + 2 + 5 + 5 + 4>();
 
-    if (in_stream.size() == 0) // Rayan: i've added that check but i doubt it's useful (actually.. maybe it is, if we have been unable to decompress any block..)
+    if (in_stream.exhausted()) // Rayan: i've added that check but i doubt it's useful (actually.. maybe it is, if we have been unable to decompress any block..)
     {
         fprintf(stderr,"reached end of file\n");
         is_final_block = true;
@@ -2259,11 +3585,13 @@ bool do_block(struct libdeflate_decompressor * restrict d, InputStream& in_strea
                     PRINT_DEBUG("first block is asking to flush already, probably bad\n");
                     return false;
                 }
+                if (unlikely(in_stream.overrun()))
+                    return false;
                 out.flush(); // shouldn't flush at that time, we want that char in the current buffer
                 //fprintf(stderr,"wanted to flush now, but shouldn't\n");exit(1); // TODO remove that if it never happens
             }
 
-            if(unlikely(char(entry >> HUFFDEC_RESULT_SHIFT) > '~')) {
+            if(WindowType::ascii_only && unlikely(char(entry >> HUFFDEC_RESULT_SHIFT) > '~')) {
                 PRINT_DEBUG("fail, unprintable literal unexpected in fastq\n");
                 return false;
             }
@@ -2273,7 +3601,7 @@ bool do_block(struct libdeflate_decompressor * restrict d, InputStream& in_strea
 
         /* Match or end-of-block  */
         entry >>= HUFFDEC_RESULT_SHIFT;
-        in_stream.ensure_bits<in_stream.bitbuf_max_ensure>();
+        in_stream.ensure_bits<InputStream::bitbuf_max_ensure>();
 
         /* Pop the extra length bits and add them to the length base to
          * produce the full length.  */
@@ -2290,8 +3618,10 @@ bool do_block(struct libdeflate_decompressor * restrict d, InputStream& in_strea
                 if (likely(length == HUFFDEC_END_OF_BLOCK_LENGTH))
                 {
                     DEBUG_FIRST_BLOCK(exit(1);)
-                    return true; // Block done
+                    return !in_stream.overrun(); // Block done
                 } else {
+                        if (unlikely(in_stream.overrun()))
+                            return false;
                         out.flush(); // same as above
                         //fprintf(stderr,"wanted to flush now, but shouldn't\n");exit(1); // TODO remove that if it never happens
                         assert(length <= out.available());
@@ -2364,6 +3694,28 @@ void handle_skip(int &skip_counter,  ParsingDeflateWindow &out_window)
     }
 }
 
+/* gets back the deferred reads of a checkpoint, decoding again the blocks they come from: from the first one, with
+ * the same unknown context as initially, before the rest of the state is restored */
+static bool replay_deferred_reads(struct libdeflate_decompressor * restrict d, const byte * restrict const in,
+                                  InputStream& in_stream, ParsingDeflateWindow& out_window, const worker_checkpoint& state)
+{
+    out_window.restore_deferred_reads(state);
+    const size_t nb_reads = out_window.deferred_reads.size();
+    if (nb_reads == 0)
+        return true;
+    fetch_input(d, in + state.sync_bits / 8);
+    in_stream.seek_bits(state.sync_bits);
+    bool is_final_block = false;
+    for (size_t replayed = 0; replayed < nb_reads; )
+    {
+        if (is_final_block || !do_block(d, in_stream, out_window, is_final_block, true))
+            return false;
+        replayed = out_window.replay_deferred_reads(replayed);
+        out_window.notify_end_block(in_stream);
+    }
+    return true;
+}
+
 /* sets some parameters based on decompression of the first block
  */
 void estimate_file_structure(struct libdeflate_decompressor * restrict d, const byte * restrict const in, size_t in_nbytes, unsigned &header_length, unsigned &quality_header_length, std::string barcode, unsigned & same_readlength)
@@ -2371,7 +3723,7 @@ void estimate_file_structure(struct libdeflate_decompressor * restrict d, const
     // very basic, decompress first block
     bool dummy;
     InputStream in_stream(in, in_nbytes);
-    InstrDeflateWindow out_window(nullptr, nullptr);
+    InstrDeflateWindow out_window(nullptr, nullptr, 0 /* never outputs */);
     do_block(d, in_stream, out_window, dummy);
 
     byte beg[10000]; // assumes reads are shorter than 5kbp
@@ -2448,6 +3800,145 @@ void estimate_file_structure(struct libdeflate_decompressor * restrict d, const
  
 }
 
+/// Lines of 'data' (without '\n' nor '\r'), the last one is dropped if it's incomplete
+static std::vector<std::pair<const byte*, size_t>> split_lines(const byte* data, size_t len)
+{
+    std::vector<std::pair<const byte*, size_t>> lines;
+    const byte* const end = data + len;
+    while (data < end) {
+        const byte* eol = static_cast<const byte*>(memchr(data, '\n', end - data));
+        if (eol == nullptr)
+            break;
+        size_t length = eol - data;
+        if (length > 0 && data[length-1] == '\r')
+            length--;
+        lines.emplace_back(data, length);
+        data = eol + 1;
+    }
+    return lines;
+}
+
+static bool starts_with(const std::pair<const byte*, size_t>& line, const char* prefix)
+{
+    size_t length = strlen(prefix);
+    return line.second >= length && memcmp(line.first, prefix, length) == 0;
+}
+
+/**
+ * @brief Decompressed data handed over by a serial decompression: written as is,
+ * or for FASTQ, only the sequence lines (like the parallel parser does), going
+ * through the duplicates set and the demultiplexer
+ */
+struct libdeflate_stream_output {
+    libdeflate_stream_output(bool fastq, const libdeflate_decompress_options* options) :
+        fastq(fastq), line(0),
+        output(1, (options != nullptr && options->output_buffer_size != 0) ?
+               options->output_buffer_size : 1UL << output_buffer_bits),
+        demux(options != nullptr ? options->demux : nullptr),
+        duplicates(options != nullptr ? options->duplicates : nullptr)
+    {
+        output.fanout = options != nullptr ? options->fanout : nullptr;
+        output.read_queue = options != nullptr ? options->read_queue : nullptr;
+        output.shm_ring = options != nullptr ? options->shm_ring : nullptr;
+        if (fastq && options != nullptr && options->qc != nullptr)
+            qc.reset(new qc_accumulator(options->qc));
+    }
+
+    void add(const byte* data, size_t len) {
+        if (!fastq) {
+            output.add(data, len);
+            return;
+        }
+
+        // records are 4 lines: header, sequence, '+' and quality
+        const byte* const end = data + len;
+        while (data < end) {
+            const byte* eol = static_cast<const byte*>(memchr(data, '\n', end - data));
+            bool wanted = line < 2 || (line == 3 && qc);
+            if (eol == nullptr) {
+                if (wanted)
+                    partial.insert(partial.end(), data, end);
+                return;
+            }
+
+            if (wanted) {
+                const byte* begin = data;
+                size_t length = eol - data;
+                if (!partial.empty()) {
+                    partial.insert(partial.end(), data, eol);
+                    begin = partial.data();
+                    length = partial.size();
+                }
+                if (length > 0 && begin[length-1] == '\r')
+                    length--;
+
+                if (line == 0) {
+                    header.assign(begin, begin + length);
+                    header.push_back(byte('\n'));
+                } else if (line == 1) {
+                    emit_read(begin, length);
+                } else {
+                    qc->add_quality(begin, length);
+                }
+                partial.clear();
+            }
+            line = (line + 1) & 3;
+            data = eol + 1;
+        }
+    }
+
+    void emit_read(const byte* seq, size_t length) {
+        if (qc)
+            qc->add_sequence(seq, length);
+
+        if (duplicates != nullptr) {
+            nb_reads_seen++;
+            if (!duplicates->insert(seq, length)) {
+                nb_duplicates++;
+                if (duplicates->drop)
+                    return;
+            }
+        }
+
+        if (demux != nullptr)
+            demux_outputs.add_sequence(*demux, InstrDeflateWindow::header_barcode(header.data() + header.size(), header.data()), seq, length);
+        else
+            output.add_sequence(seq, length);
+        nb_reads_printed++;
+    }
+
+    void flush() {
+        output.flush();
+        demux_outputs.flush();
+    }
+
+    void final_stats() {
+        if (!fastq)
+            return;
+        fprintf(stderr,"done, printed %lu reads\n",nb_reads_printed);
+        if (duplicates != nullptr) {
+            fprintf(stderr,"%lu of the reads were duplicates\n",nb_duplicates);
+            duplicates->nb_reads += nb_reads_seen;
+            duplicates->nb_duplicates += nb_duplicates;
+        }
+    }
+
+    const bool fastq;
+    unsigned line; /// Line of the current record
+    std::vector<byte> header; /// Header of the current record, with its '\n'
+    std::vector<byte> partial; /// Start of a line cut between two calls
+
+    OutputBuffer output;
+    libdeflate_demultiplexer* demux;
+    DemuxOutputs demux_outputs;
+    libdeflate_duplicates* duplicates;
+    std::unique_ptr<qc_accumulator> qc; /// Also keeps quality lines, if gathering statistics
+
+    size_t nb_reads_printed = 0;
+    size_t nb_reads_seen = 0;
+    size_t nb_duplicates = 0;
+};
+
 // Original API:
 
 LIBDEFLATEAPI enum libdeflate_result
@@ -2457,16 +3948,38 @@ libdeflate_deflate_decompress(struct libdeflate_decompressor * restrict d,
 			      size_t *actual_out_nbytes_ret,
                   synchronizer* stop,  // indicating where to stop
                   synchronizer* prev_sync, // for passing our first extracted sequence coordinate to the previous thread
-                  size_t skip, size_t until)
+                  size_t skip, size_t until,
+                  const struct libdeflate_decompress_options *options,
+                  checkpointer* checkpoint, unsigned worker)
 {
     InputStream in_stream(in, in_nbytes);
 
+    // estimated before allocating our window, so that both windows don't coexist. a ranged input isn't read ahead
+    // for this first block, nor past 'until', where we stop 20 blocks later
+    unsigned header_length, quality_header_length, same_readlength;
+    std::string barcode;
+    limit_readahead(d, in);
+    estimate_file_structure(d, in, in_nbytes, header_length, quality_header_length, barcode, same_readlength);
+    limit_readahead(d, until < in_nbytes ? in + until : nullptr);
+
     byte *out_next = out;
     byte * const out_end = out_next + out_nbytes_avail;
-    ParsingDeflateWindow out_window(out, out_end);
-    ParsingDeflateWindow backup_out(out, out_end);
-
-    estimate_file_structure(d, in, in_nbytes, out_window.header_length, out_window.quality_header_length, out_window.barcode, out_window.same_readlength);
+    size_t output_buffer_size = (options != nullptr && options->output_buffer_size != 0) ?
+        options->output_buffer_size : 1UL << output_buffer_bits;
+    ParsingDeflateWindow out_window(out, out_end, output_buffer_size);
+    out_window.header_length = header_length;
+    out_window.quality_header_length = quality_header_length;
+    out_window.barcode = barcode;
+    out_window.same_readlength = same_readlength;
+    if (options != nullptr) {
+        out_window.demux = options->demux;
+        out_window.duplicates = options->duplicates;
+        out_window.output.fanout = options->fanout;
+        out_window.output.read_queue = options->read_queue;
+        out_window.output.shm_ring = options->shm_ring;
+        if (options->qc != nullptr)
+            out_window.qc.reset(new qc_accumulator(options->qc));
+    }
 
     // blocks counter
     int failed_decomp_counter = 0;
@@ -2482,16 +3995,175 @@ libdeflate_deflate_decompress(struct libdeflate_decompressor * restrict d,
     {
         in_stream.in_next += skip;
         out_window.output_to_target = false;
+        out_window.track_origins = prev_sync != nullptr; // some reads may only be resolved with the previous thread's data
         skip_counter = 20; // skip 20 blocks before checking for valid fastq 
     }
 
+    // the planner starts threads right after a flush marker when there is one, the sync search then succeeds at once
+    bool flush_marker = false;
+    if (skip >= flush_marker_size + 1) {
+        require_input(d, in + skip - flush_marker_size - 1, flush_marker_size + 1);
+        flush_marker = is_flush_marker(in + skip - flush_marker_size);
+    }
+
+    // context of the next thread, captured when we reach the block it started at
+    std::unique_ptr<byte[]> next_context;
+    std::unique_ptr<uint16_t[]> next_context_origins;
+    bool next_context_captured = false;
+    constexpr size_t next_context_bytes = (1 << 15) * (sizeof(byte) + sizeof(uint16_t));
+    if (stop != nullptr)
+    {
+        next_context.reset(new byte[1 << 15]);
+        next_context_origins.reset(new uint16_t[1 << 15]);
+        memory_accounting::instance().allocated(LIBDEFLATE_MEMORY_CONTEXTS, next_context_bytes);
+    }
+
     bool keep_going = true, aligned = false;
+    size_t sync_bits = ~0UL, first_block = ~0UL; // recorded for checkpoints
+
+    // only threads with a previous one defer reads, or hold their output. they wait for its context before their
+    // buffers grow (by a quarter) past their budget, or past -M once they hold min_deferred_wait of them, as waiting
+    // is only worth it then
+    const size_t max_memory = (options != nullptr && prev_sync != nullptr) ? options->max_memory : 0;
+    constexpr size_t min_deferred_wait = 1UL << 20;
+
+    // windows cached every so often, to restart later random accesses from
+    libdeflate_window_cache* cache = options != nullptr ? options->window_cache : nullptr;
+    uint64_t cache_input = 0;
+    size_t last_cached_bits = ~0UL;
+    if (cache != nullptr && in_nbytes != 0) {
+        require_input(d, in + in_nbytes - std::min(in_nbytes, size_t(8)), 8);
+        cache_input = libdeflate_window_cache::input_key(in, in_nbytes);
+    }
+
+    worker_checkpoint resumed_state;
+    const worker_checkpoint* resumed = nullptr;
+    if (checkpoint != nullptr && checkpoint->resuming) {
+        resumed_state = checkpoint->take_resumed(worker);
+        resumed = &resumed_state;
+    }
+    if (resumed != nullptr && (resumed->done || resumed->next_block_bits != 0))
+    {
+        sync_bits = resumed->sync_bits;
+        first_block = resumed->first_block;
+        if (!replay_deferred_reads(d, in, in_stream, out_window, resumed_state)) {
+            fprintf(stderr, "can't resume: unable to decode again the reads deferred by thread %u\n", worker);
+            exit(1);
+        }
+        out_window.restore_checkpoint(std::move(resumed_state));
+        if (!resumed->done) {
+            fetch_input(d, in + resumed->next_block_bits / 8);
+            in_stream.seek_bits(resumed->next_block_bits);
+            out_window.output_to_target = true;
+            skip_counter = 0;
+            until_counter = resumed->until_counter;
+        }
+        if (stop != nullptr && resumed->next_context.size() == (1 << 15)) {
+            memcpy(next_context.get(), resumed->next_context.data(), 1 << 15);
+            if (resumed->next_context_origins.size() == (1 << 15))
+                memcpy(next_context_origins.get(), resumed->next_context_origins.data(), (1 << 15) * sizeof(uint16_t));
+            next_context_captured = true;
+        }
+        aligned = true;
+        keep_going = !resumed->done;
+        fprintf(stderr, "Thread %lu resumed %s\n", pthread_self(),
+                resumed->done ? "after decoding" : "from a checkpoint");
+    }
+
+    std::vector<byte> cached_window, pending_window;
+    size_t cached_bits = ~0UL, pending_cached_bits = ~0UL;
+    bool pending_determined = false;
+    // without a previous thread, the first block at or after 'skip' which the search of a random access would take,
+    // 20 blocks before those we output the reads of. the window of the first of these is cached for the accesses
+    // from 'skip' to it, with the ends of the blocks from there. when restarting from a cached window before 'skip',
+    // we look for it without output
+    libdeflate_window_cache::seek_start seek;
+    std::vector<size_t> skipped_block_ends;
+    bool seeking_sync = false;
+    if (cache != nullptr && skip != 0 && resumed == nullptr)
+        cached_bits = cache->find(cache_input, skip * 8, prev_sync != nullptr, cached_window, skipped_block_ends);
+    if (cached_bits != ~0UL)
+    {
+        // the previous thread has no reads of ours to resolve: the window is determined, or there is no previous thread
+        worker_checkpoint state;
+        state.window = std::move(cached_window);
+        out_window.track_origins = false;
+        out_window.restore_checkpoint(std::move(state));
+        fetch_input(d, in + cached_bits / 8);
+        in_stream.seek_bits(cached_bits);
+        // a window cached after 'skip' is that of the first block whose reads it outputs, else that block is ahead
+        seeking_sync = prev_sync == nullptr && cached_bits <= skip * 8;
+        out_window.output_to_target = !seeking_sync;
+        skip_counter = seeking_sync ? 20 : 0;
+        aligned = true;
+        sync_bits = cached_bits;
+        if (!seeking_sync)
+            last_cached_bits = cached_bits;
+        // and 'until' is counted from the same block as when they were decoded, which may have stopped before it
+        for (size_t end : skipped_block_ends)
+            if (handle_until(until, until_counter, end))
+                keep_going = false;
+        first_block = cached_bits / 8;
+        if (prev_sync != nullptr) {
+            prev_sync->request_context(sync_bits);
+            prev_sync->signal_first_decoded_sequence(first_block, 0);
+        }
+        fprintf(stderr, "Thread %lu restarted from the window cached at block %lu\n", pthread_self(), first_block);
+    }
+
+    // state handed over to the checkpoints, with the window once it can be resumed from. built while we wait
+    // in arrive(), or between leave() and finish()
+    auto checkpoint_state = [&](bool done) {
+        worker_checkpoint state;
+        state.start = skip;
+        state.sync_bits = sync_bits;
+        state.first_block = first_block;
+        state.done = done;
+        state.until_counter = until_counter;
+        if (next_context_captured) {
+            state.next_context.assign(next_context.get(), next_context.get() + (1 << 15));
+            state.next_context_origins.assign(next_context_origins.get(), next_context_origins.get() + (1 << 15));
+        }
+        if (done || (aligned && out_window.fully_reconstructed)) {
+            out_window.save_checkpoint(state, !done);
+            state.next_block_bits = done ? 0 : in_stream.position_bits();
+        }
+        return state;
+    };
+
     InputStream backup_in(in_stream);
+    bool reached_final_block = false;
 
-    do {
+    while ((!aligned) || (aligned && keep_going)) {
         //PRINT_DEBUG("before block,             out window %x - %x\n", out_window.next, out_window.buffer_end);
 
         size_t block_inpos = in_stream.position();
+        size_t block_inpos_bits = in_stream.position_bits();
+
+        if (unlikely(checkpoint != nullptr && checkpoint->due())) {
+            out_window.output.flush();
+            checkpoint->arrive(worker, [&]() { return checkpoint_state(false); });
+        }
+
+        // over the memory budget, we stop decoding ahead until the previous thread provides our context, and
+        // release the reads waiting for it (still saving the checkpoints others wait for)
+        const size_t waiting_bytes = out_window.deferred_bytes + out_window.output.held_capacity;
+        if (unlikely(prev_sync != nullptr && waiting_bytes >= min_deferred_wait
+                && (waiting_bytes + waiting_bytes / 4 >= deferred_reads_budget || (max_memory != 0
+                    && memory_accounting::instance().total_current.load(std::memory_order_relaxed) > max_memory)))) {
+            out_window.output.flush();
+            while (!prev_sync->wait_context_for(std::chrono::milliseconds(100)))
+                if (checkpoint != nullptr && checkpoint->due())
+                    checkpoint->arrive(worker, [&]() { return checkpoint_state(false); });
+            out_window.output.release();
+            if (out_window.track_origins)
+                out_window.resolve_context(prev_sync->wait_context());
+        }
+
+        if (stop != nullptr && aligned && !next_context_captured && stop->wants_context(block_inpos_bits)) {
+            out_window.get_context(next_context.get(), next_context_origins.get());
+            next_context_captured = true;
+        }
 
         if(stop != nullptr && keep_going) {
             keep_going &= ! stop->caught_up_block(block_inpos);
@@ -2502,6 +4174,7 @@ libdeflate_deflate_decompress(struct libdeflate_decompressor * restrict d,
             }
         }
 
+        fetch_input(d, in_stream.in_next);
         in_stream.ensure_bits<1>();
         bool went_fine = aligned || in_stream.bits(1) == 0; 
         bool is_final_block = false;
@@ -2512,6 +4185,19 @@ libdeflate_deflate_decompress(struct libdeflate_decompressor * restrict d,
             //if(went_fine) went_fine = out_window.check_buffer_fastq(false);
             if(went_fine) {
                 PRINT_DEBUG("First sync block at %d %d\n", in_stream.position(), in_stream.position_bits());
+                sync_bits = seek.to = block_inpos_bits;
+                if (prev_sync != nullptr)
+                    prev_sync->request_context(block_inpos_bits);
+                // no back-reference of a first block longer than the window went before the marker: a full flush,
+                // later blocks can't either. the window is exact, only this block is skipped, for the read cut by the
+                // marker, and no read waits for the previous thread's context. the reads are held until the previous
+                // thread output its own, to come out in order (but with checkpoints, which take flushed output as written)
+                if (flush_marker && block_inpos_bits == skip * 8 && out_window.context_determined()) {
+                    skip_counter = 2;
+                    out_window.track_origins = false;
+                    out_window.output.holding = prev_sync != nullptr && checkpoint == nullptr;
+                    fprintf(stderr, "Thread %lu started on a full flush marker, decoding exactly\n", pthread_self());
+                }
             }
         }
 
@@ -2522,10 +4208,19 @@ libdeflate_deflate_decompress(struct libdeflate_decompressor * restrict d,
             //fprintf(stderr,"block decompressed!\n");//, out_window.buffer);
             failed_decomp_counter = 0; // reset failed block counter
 
+            // the same first block as the search: the first one of more than 10K at or after 'skip'
+            if (unlikely(seeking_sync) && block_inpos_bits >= skip * 8 && out_window.block_size > (10UL << 10)) {
+                seeking_sync = false;
+                seek.to = block_inpos_bits;
+                if (flush_marker && block_inpos_bits == skip * 8)
+                    skip_counter = 2;
+            }
+
             long long position = in_stream.position();
-            if (handle_until(until, until_counter, position))
+            if (!seeking_sync && handle_until(until, until_counter, position))
                 break;
-            handle_skip(skip_counter, out_window);
+            if (!seeking_sync)
+                handle_skip(skip_counter, out_window);
 
             if (skip_counter == 0 && keep_going)
             {
@@ -2534,6 +4229,7 @@ libdeflate_deflate_decompress(struct libdeflate_decompressor * restrict d,
                 out_window.parse_block(is_final_block);
 
                 if ((!previously_reconstructed) && out_window.fully_reconstructed) {
+                    first_block = block_inpos;
                     if(prev_sync != nullptr) {
                         fprintf(stderr, "Thread %lu found it's first sequence in block %lu\n",
                                 pthread_self(), block_inpos);
@@ -2550,6 +4246,29 @@ libdeflate_deflate_decompress(struct libdeflate_decompressor * restrict d,
             }
 
             out_window.notify_end_block(in_stream);
+            reached_final_block = is_final_block;
+
+            // the window preceding a block is cached once the reads of the block are resolved, and restarting from it
+            // outputs them again. the first one is that of the first block we output the reads of
+            if (cache != nullptr) {
+                if (pending_cached_bits != ~0UL && out_window.fully_reconstructed) {
+                    if (last_cached_bits == ~0UL && seek.to != 0 && skip != 0 && prev_sync == nullptr) {
+                        seek.from = skip * 8;
+                        cache->insert(cache_input, pending_cached_bits, pending_window.data(), pending_determined, seek);
+                    } else
+                        cache->insert(cache_input, pending_cached_bits, pending_window.data(), pending_determined);
+                    last_cached_bits = pending_cached_bits;
+                }
+                pending_cached_bits = ~0UL;
+                if (last_cached_bits == ~0UL && seek.to != 0)
+                    seek.block_ends.push_back(position);
+                if (keep_going && !is_final_block && !seeking_sync && skip_counter <= 1 && (last_cached_bits == ~0UL
+                        || in_stream.position_bits() >= last_cached_bits + libdeflate_window_cache::spacing * 8)) {
+                    pending_window.assign(out_window.context(), out_window.context() + (1 << 15));
+                    pending_determined = out_window.context_determined();
+                    pending_cached_bits = in_stream.position_bits();
+                }
+            }
         }
         else
         {
@@ -2577,14 +4296,92 @@ libdeflate_deflate_decompress(struct libdeflate_decompressor * restrict d,
             PRINT_DEBUG("restored after bad block\n");
         }
         keep_going &= ! is_final_block;
-    } while((!aligned) || (aligned && keep_going));
+    }
+
+    // a stream ending before the next thread's first block, or before a gzip header, is a member followed by
+    // others: the reads after it were not output. the lookahead past the input is zeros, not in position()
+    const size_t stream_end = std::min(in_stream.position() + in_stream.overrun_count, in_nbytes);
+    if (reached_final_block && (stop != nullptr || stream_end < in_nbytes)) {
+        const size_t next_member = stream_end + 8; // after the footer
+        bool header = stop != nullptr;
+        if (!header && next_member + 2 <= in_nbytes + 8) {
+            fetch_input(d, in + next_member);
+            header = in[next_member] == 0x1F && in[next_member + 1] == 0x8B;
+        }
+        if (header) {
+            fprintf(stderr, "another gzip member follows the one ending at byte %lu, which parallel decoding doesn't support, decode it with -t 1\n",
+                    stream_end);
+            exit(1);
+        }
+        fprintf(stderr, "ignoring %lu bytes of trailing garbage\n", in_nbytes - stream_end);
+    }
+
+    // the other threads may still save checkpoints, without waiting for us
+    if (checkpoint != nullptr) {
+        out_window.output.flush();
+        checkpoint->leave(worker, [&]() { return checkpoint_state(true); });
+    }
 
     //out_window.flush(); // no need to call, is called at the end of each block. 
 
     *actual_out_nbytes_ret = out_window.get_evicted_length(); // tell how many bytes we actually output
 
+    // reads depending on our unknown initial context can now be resolved with the previous thread's data,
+    // then the next thread gets its own context from ours
+    bool resolved = next_context_captured; // as saved, when they were already output
+    auto resolve = [&](const byte* context) {
+        out_window.output.release();
+        out_window.resolve_deferred_reads(context);
+        resolved = next_context_captured && (!out_window.track_origins
+                || resolve_undetermined(next_context.get(), next_context_origins.get(), 1 << 15, context));
+    };
+    if (resumed != nullptr && resumed->finished)
+        checkpoint->finish(worker, [&]() { return resumed_state; });
+    else {
+        const byte* context = (prev_sync != nullptr) ? prev_sync->wait_context() : nullptr;
+        if (checkpoint != nullptr)
+            checkpoint->finish(worker, [&]() { // their output and our final state are saved together
+                resolve(context);
+                out_window.output.flush();
+                worker_checkpoint state = checkpoint_state(true);
+                state.finished = true;
+                if (!resolved)
+                    state.next_context.clear();
+                return state;
+            });
+        else
+            resolve(context);
+    }
+
+    // every record ends with its fourth newline (but maybe the last one): the last thread checks that all the
+    // records of a whole stream were output, from the reads and newlines tallied by each thread in turn
+    synchronizer::read_tally reads;
+    if (prev_sync != nullptr)
+        reads = prev_sync->wait_tally();
+    else
+        reads.from_start = skip == 0;
+    out_window.tally_reads(reads);
+    if (stop != nullptr)
+    {
+        out_window.output.flush(); // before the next thread outputs what it held
+        stop->provide_context(resolved ? next_context.get() : nullptr, reads);
+        memory_accounting::instance().released(LIBDEFLATE_MEMORY_CONTEXTS, next_context_bytes);
+    }
+
     out_window.final_stats(); // print final stats
 
+    const bool whole_stream = stop == nullptr && reads.from_start
+        && (reached_final_block || (resumed != nullptr && resumed->done && resumed->until_counter == -1));
+    if (whole_stream && (!reads.resolved || reads.nb_reads != (reads.nb_newlines + 3) / 4)) {
+        fprintf(stderr, "output %lu reads, but the stream holds %s%lu FASTQ records: some could not be delimited\n",
+                reads.nb_reads, reads.resolved ? "" : "at least ", (reads.nb_newlines + 3) / 4);
+        return LIBDEFLATE_INCOMPLETE_OUTPUT;
+    }
+    if (stop == nullptr && !reads.from_start && reads.nb_reads == 0) {
+        fprintf(stderr, "no reads could be delimited after byte %lu without the data before it\n", skip);
+        return LIBDEFLATE_INCOMPLETE_OUTPUT;
+    }
+
     return LIBDEFLATE_SUCCESS;
 }
 
@@ -2597,11 +4394,458 @@ libdeflate_alloc_decompressor(void)
 LIBDEFLATEAPI struct libdeflate_decompressor *
 libdeflate_copy_decompressor(libdeflate_decompressor* d)
 {
-    return new libdeflate_decompressor(*d);
+    libdeflate_decompressor* copy = new libdeflate_decompressor(*d);
+    copy->input_window = ranged_window(); // reads its own chunks
+    return copy;
 }
 
 LIBDEFLATEAPI void
 libdeflate_free_decompressor(struct libdeflate_decompressor *d)
 {
+	if (d != nullptr)
+		set_ranged_input(d, nullptr);
 	delete d;
 }
+
+void set_ranged_input(struct libdeflate_decompressor* d, struct libdeflate_ranged_input* input)
+{
+    if (d->ranged_input != nullptr)
+        d->ranged_input->release(d->input_window);
+    d->ranged_input = input;
+}
+
+void require_input(struct libdeflate_decompressor* d, const byte* p, size_t len)
+{
+    if (d->ranged_input != nullptr)
+        d->ranged_input->require(d->input_window, p, len);
+}
+
+void limit_readahead(struct libdeflate_decompressor* d, const byte* end)
+{
+    if (d->ranged_input != nullptr)
+        d->ranged_input->limit_readahead(d->input_window, end);
+}
+
+LIBDEFLATEAPI struct libdeflate_ranged_input *
+libdeflate_alloc_ranged_input(uint64_t size, libdeflate_read_range_func read_range,
+			      void *ctx, size_t chunk_size, unsigned readahead,
+			      size_t cache_size)
+{
+    libdeflate_ranged_input* input = new libdeflate_ranged_input(size, read_range, ctx,
+                                                                 chunk_size, readahead, cache_size);
+    if (!input->valid()) {
+        delete input;
+        return nullptr;
+    }
+    return input;
+}
+
+LIBDEFLATEAPI const byte *
+libdeflate_ranged_input_data(const struct libdeflate_ranged_input *input)
+{
+    return input->data();
+}
+
+LIBDEFLATEAPI void
+libdeflate_get_ranged_input_stats(struct libdeflate_ranged_input *input,
+				  uint64_t *fetched_nbytes, uint64_t *nb_fetches)
+{
+    input->stats(fetched_nbytes, nb_fetches);
+}
+
+LIBDEFLATEAPI void
+libdeflate_free_ranged_input(struct libdeflate_ranged_input *input)
+{
+    delete input;
+}
+
+LIBDEFLATEAPI struct libdeflate_window_cache *
+libdeflate_alloc_window_cache(size_t max_memory)
+{
+    return new libdeflate_window_cache(max_memory);
+}
+
+LIBDEFLATEAPI void
+libdeflate_get_window_cache_stats(struct libdeflate_window_cache *cache,
+				  uint64_t *nb_hits, uint64_t *nb_lookups)
+{
+    cache->stats(nb_hits, nb_lookups);
+}
+
+LIBDEFLATEAPI void
+libdeflate_free_window_cache(struct libdeflate_window_cache *cache)
+{
+    delete cache;
+}
+
+LIBDEFLATEAPI struct libdeflate_fanout *
+libdeflate_alloc_fanout(unsigned max_batches)
+{
+    return new libdeflate_fanout(max_batches);
+}
+
+LIBDEFLATEAPI void
+libdeflate_fanout_add_consumer(struct libdeflate_fanout *fanout,
+			       libdeflate_consume_func consume, void *ctx,
+			       unsigned nthreads)
+{
+    fanout->add_consumer(consume, ctx, nthreads);
+}
+
+LIBDEFLATEAPI void
+libdeflate_free_fanout(struct libdeflate_fanout *fanout)
+{
+    delete fanout;
+}
+
+LIBDEFLATEAPI struct libdeflate_read_queue *
+libdeflate_alloc_read_queue(unsigned capacity, size_t batch_size)
+{
+    return new libdeflate_read_queue(capacity, batch_size);
+}
+
+LIBDEFLATEAPI struct libdeflate_read_batch *
+libdeflate_read_queue_pop(struct libdeflate_read_queue *queue)
+{
+    return queue->pop();
+}
+
+LIBDEFLATEAPI void
+libdeflate_read_queue_release(struct libdeflate_read_queue *queue,
+                              struct libdeflate_read_batch *batch)
+{
+    queue->release(batch);
+}
+
+LIBDEFLATEAPI void
+libdeflate_close_read_queue(struct libdeflate_read_queue *queue)
+{
+    queue->close();
+}
+
+LIBDEFLATEAPI void
+libdeflate_free_read_queue(struct libdeflate_read_queue *queue)
+{
+    delete queue;
+}
+
+LIBDEFLATEAPI int
+libdeflate_bind_thread_to_cpu(unsigned cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0 ? 0 : -1;
+}
+
+LIBDEFLATEAPI struct libdeflate_shm_ring *
+libdeflate_alloc_shm_ring(size_t size)
+{
+    return libdeflate_shm_ring::create(size);
+}
+
+LIBDEFLATEAPI int
+libdeflate_shm_ring_fd(const struct libdeflate_shm_ring *ring)
+{
+    return ring->fd;
+}
+
+LIBDEFLATEAPI void
+libdeflate_shm_ring_wait_consumers(struct libdeflate_shm_ring *ring, unsigned n)
+{
+    ring->wait_consumers(n);
+}
+
+LIBDEFLATEAPI void
+libdeflate_close_shm_ring(struct libdeflate_shm_ring *ring)
+{
+    ring->close_ring();
+}
+
+LIBDEFLATEAPI void
+libdeflate_free_shm_ring(struct libdeflate_shm_ring *ring)
+{
+    delete ring;
+}
+
+LIBDEFLATEAPI struct libdeflate_shm_ring *
+libdeflate_attach_shm_ring(int fd)
+{
+    return libdeflate_shm_ring::attach(fd);
+}
+
+LIBDEFLATEAPI int
+libdeflate_shm_ring_join(struct libdeflate_shm_ring *ring)
+{
+    return ring->join();
+}
+
+LIBDEFLATEAPI int
+libdeflate_shm_ring_next(struct libdeflate_shm_ring *ring, int consumer,
+                         const byte **reads, size_t *len)
+{
+    return ring->next(consumer, reads, len) ? 1 : 0;
+}
+
+LIBDEFLATEAPI void
+libdeflate_shm_ring_advance(struct libdeflate_shm_ring *ring, int consumer)
+{
+    ring->advance(consumer);
+}
+
+LIBDEFLATEAPI void
+libdeflate_shm_ring_leave(struct libdeflate_shm_ring *ring, int consumer)
+{
+    ring->leave(consumer);
+}
+
+LIBDEFLATEAPI struct libdeflate_qc *
+libdeflate_alloc_qc(void)
+{
+    return new libdeflate_qc();
+}
+
+LIBDEFLATEAPI int
+libdeflate_write_qc_json(struct libdeflate_qc *qc, const char *path)
+{
+    FILE* f = fopen(path, "w");
+    if (f == nullptr)
+        return -1;
+    bool ok = qc->write_json(f);
+    ok = fclose(f) == 0 && ok;
+    return ok ? 0 : -1;
+}
+
+LIBDEFLATEAPI void
+libdeflate_free_qc(struct libdeflate_qc *qc)
+{
+    delete qc;
+}
+
+LIBDEFLATEAPI struct libdeflate_demultiplexer *
+libdeflate_alloc_demultiplexer(const char *prefix, const char *barcode_file,
+			       unsigned max_mismatches)
+{
+    libdeflate_demultiplexer* demux = new libdeflate_demultiplexer(prefix, max_mismatches);
+
+    bool ok = demux->add_output("undetermined", "") == libdeflate_demultiplexer::undetermined;
+    if (ok && barcode_file != nullptr)
+        ok = demux->load_barcodes(barcode_file);
+    if (!ok) {
+        delete demux;
+        return nullptr;
+    }
+    return demux;
+}
+
+LIBDEFLATEAPI void
+libdeflate_free_demultiplexer(struct libdeflate_demultiplexer *demux)
+{
+    if (demux == nullptr)
+        return;
+    demux->final_stats();
+    delete demux;
+}
+
+LIBDEFLATEAPI struct libdeflate_duplicates *
+libdeflate_alloc_duplicates(int drop_duplicates)
+{
+    /* The shards are cache line aligned, which plain new doesn't honor before C++17  */
+    void* mem;
+    if (posix_memalign(&mem, alignof(libdeflate_duplicates), sizeof(libdeflate_duplicates)) != 0)
+        return nullptr;
+    return new (mem) libdeflate_duplicates(drop_duplicates != 0);
+}
+
+LIBDEFLATEAPI void
+libdeflate_get_duplicates_stats(const struct libdeflate_duplicates *dups,
+				uint64_t *nb_reads, uint64_t *nb_duplicates)
+{
+    *nb_reads = dups->nb_reads;
+    *nb_duplicates = dups->nb_duplicates;
+}
+
+LIBDEFLATEAPI void
+libdeflate_free_duplicates(struct libdeflate_duplicates *dups)
+{
+    if (dups == nullptr)
+        return;
+    dups->final_stats();
+    dups->~libdeflate_duplicates();
+    free(dups);
+}
+
+LIBDEFLATEAPI enum libdeflate_result
+libdeflate_deflate_decompress_stream(struct libdeflate_decompressor * restrict d,
+				     const byte * restrict const in, size_t in_nbytes,
+				     size_t *actual_in_nbytes_ret,
+				     libdeflate_write_func write, void *ctx)
+{
+    InputStream in_stream(in, in_nbytes);
+    ExactDeflateWindow out_window(write, ctx);
+
+    bool is_final_block = false;
+    do {
+        if (!do_block(d, in_stream, out_window, is_final_block))
+            return LIBDEFLATE_BAD_DATA;
+        out_window.emit();
+    } while (!is_final_block && !out_window.stopped);
+
+    if (actual_in_nbytes_ret != nullptr) {
+        in_stream.align_input();
+        *actual_in_nbytes_ret = in_stream.in_next - in;
+    }
+
+    return out_window.stopped ? LIBDEFLATE_SHORT_OUTPUT : LIBDEFLATE_SUCCESS;
+}
+
+LIBDEFLATEAPI enum libdeflate_result
+libdeflate_deflate_decompress_iov(struct libdeflate_decompressor * restrict d,
+				  const byte * restrict const in, size_t in_nbytes,
+				  const struct libdeflate_iovec *out, size_t out_iovcnt,
+				  size_t *actual_in_nbytes_ret,
+				  size_t *actual_out_nbytes_ret)
+{
+    InputStream in_stream(in, in_nbytes);
+    SegmentedDeflateWindow out_window(out, out_iovcnt);
+
+    bool is_final_block = false;
+    do {
+        if (!do_block(d, in_stream, out_window, is_final_block))
+            return LIBDEFLATE_BAD_DATA;
+    } while (!is_final_block && !out_window.overflowed);
+
+    if (out_window.overflowed)
+        return LIBDEFLATE_INSUFFICIENT_SPACE;
+
+    if (actual_in_nbytes_ret != nullptr) {
+        in_stream.align_input();
+        *actual_in_nbytes_ret = in_stream.in_next - in;
+    }
+
+    if (actual_out_nbytes_ret != nullptr)
+        *actual_out_nbytes_ret = out_window.written;
+    else if (out_window.written != out_window.capacity)
+        return LIBDEFLATE_SHORT_OUTPUT;
+
+    return LIBDEFLATE_SUCCESS;
+}
+
+LIBDEFLATEAPI enum libdeflate_content
+libdeflate_classify_content(const byte *data, size_t len)
+{
+    size_t nb_control = 0, nb_high = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] == 0)
+            return LIBDEFLATE_CONTENT_BINARY;
+        if (data[i] < ' ' && data[i] != '\n' && data[i] != '\r' && data[i] != '\t')
+            nb_control++;
+        else if (data[i] >= 0x80)
+            nb_high++;
+    }
+    // a few stray bytes are tolerated, and UTF-8 text has some high bytes
+    if (nb_control > len / 100 || nb_high > len / 4)
+        return LIBDEFLATE_CONTENT_BINARY;
+
+    auto lines = split_lines(data, len);
+    if (lines.empty())
+        return LIBDEFLATE_CONTENT_UNKNOWN;
+
+    // FASTQ: whole 4-line records with a quality line as long as the sequence
+    bool fastq = lines.size() >= 4;
+    for (size_t i = 0; fastq && i + 3 < lines.size(); i += 4)
+        fastq = starts_with(lines[i], "@") && starts_with(lines[i+2], "+")
+                && lines[i+1].second == lines[i+3].second;
+    if (fastq)
+        return LIBDEFLATE_CONTENT_FASTQ;
+
+    // FASTA: a '>' header then residues
+    if (starts_with(lines[0], ">")) {
+        bool fasta = true;
+        for (size_t i = 1; fasta && i < lines.size(); i++) {
+            if (starts_with(lines[i], ">"))
+                continue;
+            for (size_t j = 0; fasta && j < lines[i].second; j++) {
+                byte c = lines[i].first[j];
+                fasta = (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || c == '*' || c == '-';
+            }
+        }
+        if (fasta)
+            return LIBDEFLATE_CONTENT_FASTA;
+    }
+
+    // SAM/VCF: their header lines, or else the same number of tabs on every line
+    static const char* const tabular_headers[] = {"@HD\t", "@SQ\t", "@RG\t", "@PG\t", "@CO\t", "##"};
+    for (const char* prefix : tabular_headers)
+        if (starts_with(lines[0], prefix))
+            return LIBDEFLATE_CONTENT_TABULAR;
+
+    size_t nb_tabs = 0, nb_data_lines = 0;
+    bool tabular = true;
+    for (auto& line : lines) {
+        if (starts_with(line, "#"))
+            continue;
+        size_t tabs = std::count(line.first, line.first + line.second, byte('\t'));
+        if (nb_data_lines++ == 0)
+            nb_tabs = tabs;
+        tabular &= tabs > 0 && tabs == nb_tabs;
+    }
+    if (tabular && nb_data_lines >= 2)
+        return LIBDEFLATE_CONTENT_TABULAR;
+
+    return LIBDEFLATE_CONTENT_TEXT;
+}
+
+LIBDEFLATEAPI struct libdeflate_stream_output *
+libdeflate_alloc_stream_output(enum libdeflate_content content,
+			       const struct libdeflate_decompress_options *options)
+{
+    return new libdeflate_stream_output(content == LIBDEFLATE_CONTENT_FASTQ, options);
+}
+
+LIBDEFLATEAPI int
+libdeflate_stream_output_write(void *output, const byte *data, size_t len)
+{
+    static_cast<libdeflate_stream_output*>(output)->add(data, len);
+    return 0;
+}
+
+LIBDEFLATEAPI void
+libdeflate_flush_stream_output(struct libdeflate_stream_output *output)
+{
+    output->flush();
+}
+
+LIBDEFLATEAPI void
+libdeflate_free_stream_output(struct libdeflate_stream_output *output)
+{
+    if (output == nullptr)
+        return;
+    output->final_stats();
+    delete output;
+}
+
+size_t thread_memory_estimate(enum libdeflate_strategy strategy, size_t output_buffer_size)
+{
+    constexpr size_t window_size = 1UL << deflate_window_bits;
+    if (strategy != LIBDEFLATE_STRATEGY_PARALLEL_FASTQ)
+        return window_size; // the output is shared
+
+    // parsing window with the origins of its characters and its own output,
+    // plus the context passed to the next thread and the reads waiting for ours
+    return window_size + window_size * sizeof(uint16_t) + output_buffer_size
+           + (1UL << 15) * (sizeof(byte) + sizeof(uint16_t)) + sizeof(synchronizer)
+           + deferred_reads_budget;
+}
+
+LIBDEFLATEAPI void
+libdeflate_get_memory_usage(struct libdeflate_memory_usage *usage)
+{
+    memory_accounting& accounting = memory_accounting::instance();
+    for (unsigned i = 0; i < LIBDEFLATE_MEMORY_NB_COMPONENTS; i++) {
+        usage->current[i] = accounting.current[i].load(std::memory_order_relaxed);
+        usage->peak[i] = accounting.peak[i].load(std::memory_order_relaxed);
+    }
+    usage->total_current = accounting.total_current.load(std::memory_order_relaxed);
+    usage->total_peak = accounting.total_peak.load(std::memory_order_relaxed);
+}
@@ -33,18 +33,12 @@
 
 #include "libdeflate.h"
 
-LIBDEFLATEAPI size_t
-libdeflate_gzip_compress(struct libdeflate_compressor *c,
-			 const void *in, size_t in_size,
-			 void *out, size_t out_nbytes_avail)
+/* Write the gzip header for the level of 'c' to 'out_next', return its end */
+static u8 *
+gzip_write_header(struct libdeflate_compressor *c, u8 *out_next)
 {
-	u8 *out_next = out;
 	unsigned compression_level;
 	u8 xfl;
-	size_t deflate_size;
-
-	if (out_nbytes_avail <= GZIP_MIN_OVERHEAD)
-		return 0;
 
 	/* ID1 */
 	*out_next++ = GZIP_ID1;
@@ -68,6 +62,22 @@ libdeflate_gzip_compress(struct libdeflate_compressor *c,
 	/* OS */
 	*out_next++ = GZIP_OS_UNKNOWN;	/* OS  */
 
+	return out_next;
+}
+
+LIBDEFLATEAPI size_t
+libdeflate_gzip_compress(struct libdeflate_compressor *c,
+			 const void *in, size_t in_size,
+			 void *out, size_t out_nbytes_avail)
+{
+	u8 *out_next = (u8 *)out;
+	size_t deflate_size;
+
+	if (out_nbytes_avail <= GZIP_MIN_OVERHEAD)
+		return 0;
+
+	out_next = gzip_write_header(c, out_next);
+
 	/* Compressed data  */
 	deflate_size = libdeflate_deflate_compress(c, in, in_size, out_next,
 					out_nbytes_avail - GZIP_MIN_OVERHEAD);
@@ -86,6 +96,47 @@ libdeflate_gzip_compress(struct libdeflate_compressor *c,
 	return out_next - (u8 *)out;
 }
 
+LIBDEFLATEAPI size_t
+libdeflate_gzip_compress_iov(struct libdeflate_compressor *c,
+			     const struct libdeflate_iovec *in, size_t in_iovcnt,
+			     void *out, size_t out_nbytes_avail)
+{
+	u8 *out_next = (u8 *)out;
+	size_t deflate_size;
+	u32 crc = 0;
+	size_t in_size = 0;
+	size_t i;
+
+	if (out_nbytes_avail <= GZIP_MIN_OVERHEAD)
+		return 0;
+
+	out_next = gzip_write_header(c, out_next);
+
+	/* Compressed data  */
+	deflate_size = libdeflate_deflate_compress_iov(c, in, in_iovcnt, out_next,
+					out_nbytes_avail - GZIP_MIN_OVERHEAD);
+	if (deflate_size == 0)
+		return 0;
+	out_next += deflate_size;
+
+	for (i = 0; i < in_iovcnt; i++) {
+		/* libdeflate_crc32() restarts on a NULL buffer */
+		if (in[i].len != 0)
+			crc = libdeflate_crc32(crc, in[i].base, in[i].len);
+		in_size += in[i].len;
+	}
+
+	/* CRC32 */
+	put_unaligned_le32(crc, out_next);
+	out_next += 4;
+
+	/* ISIZE */
+	put_unaligned_le32((u32)in_size, out_next);
+	out_next += 4;
+
+	return out_next - (u8 *)out;
+}
+
 LIBDEFLATEAPI size_t
 libdeflate_gzip_compress_bound(struct libdeflate_compressor *c,
 			       size_t in_nbytes)
@@ -42,4 +42,17 @@
 #define GZIP_OS_RISCOS		13
 #define GZIP_OS_UNKNOWN		255
 
+/* BGZF members carry their size minus 1 in a 'BC' subfield of the extra field */
+#define BGZF_SI1		byte('B')
+#define BGZF_SI2		byte('C')
+#define BGZF_XLEN		6
+#define BGZF_HEADER_SIZE	(GZIP_MIN_HEADER_SIZE + 2 + BGZF_XLEN)
+
+/* Largest size of a BGZF member, compressed or not */
+#define BGZF_MAX_MEMBER_SIZE	(1UL << 16)
+
+/* Uncompressed bytes per BGZF member written, as bgzip does: stored in a single
+ * uncompressed block if needed, a member still fits in BGZF_MAX_MEMBER_SIZE */
+#define BGZF_BLOCK_SIZE		0xff00
+
 #endif /* LIB_GZIP_CONSTANTS_H */
@@ -32,38 +32,70 @@
 
 #include "libdeflate.h"
 #include "synchronizer.hpp"
+#include "memory_accounting.hpp"
+#include "checkpoint.hpp"
+#include "ranged_input.hpp"
+#include "flush_marker.hpp"
+#include <stdio.h>
+#include <algorithm>
+#include <memory>
 #include <vector>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
 
 template<typename T>
 bool is_set(T word, T flag) { return word & flag != T{0} ; }
 
-LIBDEFLATEAPI enum libdeflate_result
-libdeflate_gzip_decompress(struct libdeflate_decompressor *d,
-                           const byte *in, size_t in_nbytes,
-                           byte *out, size_t out_nbytes_avail,
-                           size_t *actual_out_nbytes_ret,
-                           unsigned nthreads,
-                           size_t skip, size_t until)
+/* Decompressed bytes looked at to classify the content */
+#define PROBE_SIZE		(1UL << 16)
+
+/* Bytes of a ranged input fetched to parse a gzip header */
+#define HEADER_FETCH_SIZE	(1UL << 16)
+
+/* Compressed bytes after its planned start searched for a flush marker to start
+ * a thread on. pigz flushes every 128K of input */
+#define FLUSH_MARKER_SCAN	(1UL << 20)
+
+/* Compressed bytes searched at a time for the header of another member */
+#define MEMBER_SCAN		(1UL << 20)
+
+/* BGZF members decoded by a thread between two writes */
+#define MEMBERS_PER_BATCH	64
+
+/* Output buffer sizes used by the planner: default, shrunk before using fewer
+ * threads, and smallest */
+#define OUTPUT_BUFFER_SIZE	(1UL << 21)
+#define SMALL_OUTPUT_BUFFER_SIZE	(1UL << 18)
+#define MIN_OUTPUT_BUFFER_SIZE	(1UL << 16)
+
+/*
+ * Parse the header of the gzip member at 'in'. Returns the size of the header,
+ * or 0 if it isn't valid. If 'bgzf_size' isn't NULL, it receives the total size
+ * of the member if it is a BGZF one, 0 otherwise.
+ */
+static size_t
+parse_gzip_header(const byte *in, size_t in_nbytes, size_t *bgzf_size)
 {
 	const byte *in_next = in;
 	const byte * const in_end = in_next + in_nbytes;
 	byte flg;
-	size_t actual_out_nbytes;
-	enum libdeflate_result result;
+
+	if (bgzf_size)
+		*bgzf_size = 0;
 
 	if (in_nbytes < GZIP_MIN_OVERHEAD)
-		return LIBDEFLATE_BAD_DATA;
+		return 0;
 
 	/* ID1 */
 	if (*in_next++ != GZIP_ID1)
-		return LIBDEFLATE_BAD_DATA;
+		return 0;
 	/* ID2 */
 	if (*in_next++ != GZIP_ID2)
-		return LIBDEFLATE_BAD_DATA;
+		return 0;
 	/* CM */
 	if (*in_next++ != GZIP_CM_DEFLATE)
-		return LIBDEFLATE_BAD_DATA;
+		return 0;
 	flg = *in_next++;
 	/* MTIME */
 	in_next += 4;
@@ -73,7 +105,7 @@ libdeflate_gzip_decompress(struct libdeflate_decompressor *d,
 	in_next += 1;
 
 	if (bool(flg & GZIP_FRESERVED))
-		return LIBDEFLATE_BAD_DATA;
+		return 0;
 
 	/* Extra field */
 	if (bool(flg & GZIP_FEXTRA)) {
@@ -81,7 +113,17 @@ libdeflate_gzip_decompress(struct libdeflate_decompressor *d,
 		in_next += 2;
 
 		if (in_end - in_next < (u32)xlen + GZIP_FOOTER_SIZE)
-			return LIBDEFLATE_BAD_DATA;
+			return 0;
+
+		/* Subfields: SI1, SI2, LEN and LEN bytes of data */
+		const byte *sub = in_next;
+		while (bgzf_size && in_next + xlen - sub >= 4) {
+			u16 sub_len = get_unaligned_le16(sub + 2);
+			if (sub[0] == BGZF_SI1 && sub[1] == BGZF_SI2 && sub_len == 2
+			    && in_next + xlen - sub >= 6)
+				*bgzf_size = get_unaligned_le16(sub + 4) + 1;
+			sub += 4 + sub_len;
+		}
 
 		in_next += xlen;
 	}
@@ -91,7 +133,7 @@ libdeflate_gzip_decompress(struct libdeflate_decompressor *d,
 		while (*in_next++ != byte(0) && in_next != in_end)
 			;
 		if (in_end - in_next < GZIP_FOOTER_SIZE)
-			return LIBDEFLATE_BAD_DATA;
+			return 0;
 	}
 
 	/* File comment (zero terminated) */
@@ -99,59 +141,640 @@ libdeflate_gzip_decompress(struct libdeflate_decompressor *d,
 		while (*in_next++ != byte(0) && in_next != in_end)
 			;
 		if (in_end - in_next < GZIP_FOOTER_SIZE)
-			return LIBDEFLATE_BAD_DATA;
+			return 0;
 	}
 
 	/* CRC16 for gzip header */
 	if (bool(flg & GZIP_FHCRC)) {
 		in_next += 2;
 		if (in_end - in_next < GZIP_FOOTER_SIZE)
+			return 0;
+	}
+
+	return in_next - in;
+}
+
+/*
+ * Attaches the ranged input of 'options', if any, to a decompressor for the
+ * duration of a call
+ */
+struct ranged_input_scope {
+	ranged_input_scope(struct libdeflate_decompressor *d,
+			   const struct libdeflate_decompress_options *options) :
+		d(options != nullptr && options->ranged_input != nullptr ? d : nullptr)
+	{
+		if (this->d != nullptr)
+			set_ranged_input(this->d, options->ranged_input);
+	}
+
+	~ranged_input_scope()
+	{
+		if (d != nullptr)
+			set_ranged_input(d, nullptr);
+	}
+
+	struct libdeflate_decompressor * const d;
+};
+
+/* libdeflate_write_func keeping the first PROBE_SIZE bytes */
+static int
+probe_write(void *ctx, const byte *data, size_t len)
+{
+	std::vector<byte> *probe = static_cast<std::vector<byte>*>(ctx);
+	len = std::min(len, PROBE_SIZE - probe->size());
+	probe->insert(probe->end(), data, data + len);
+	return probe->size() == PROBE_SIZE;
+}
+
+static const char *
+content_name(enum libdeflate_content content)
+{
+	switch (content) {
+	case LIBDEFLATE_CONTENT_FASTQ:		return "FASTQ";
+	case LIBDEFLATE_CONTENT_FASTA:		return "FASTA";
+	case LIBDEFLATE_CONTENT_TABULAR:	return "tabular (SAM/VCF)";
+	case LIBDEFLATE_CONTENT_TEXT:		return "text";
+	case LIBDEFLATE_CONTENT_BINARY:		return "binary";
+	default:				return "unknown";
+	}
+}
+
+/* Memory the strategy of 'profile' is expected to use */
+static size_t
+estimate_memory(const struct libdeflate_gzip_profile *profile)
+{
+	size_t per_thread = thread_memory_estimate(profile->strategy, profile->output_buffer_size);
+	size_t shared = 0;
+
+	if (profile->strategy == LIBDEFLATE_STRATEGY_MEMBERS)
+		per_thread += profile->members_per_batch * BGZF_MAX_MEMBER_SIZE;
+	if (profile->strategy != LIBDEFLATE_STRATEGY_PARALLEL_FASTQ)
+		shared += profile->output_buffer_size;
+	else if (profile->nthreads > 0) /* the first thread has no previous one to defer reads for */
+		return shared + profile->nthreads * per_thread - deferred_reads_budget;
+	return shared + profile->nthreads * per_thread;
+}
+
+/*
+ * Fit the plan in 'max_memory': smaller output buffers and BGZF batches first,
+ * as they barely slow down decompression, then fewer threads, then the
+ * smallest buffers.
+ */
+static void
+fit_memory_budget(struct libdeflate_gzip_profile *profile, size_t max_memory,
+		  bool random_access)
+{
+	while (estimate_memory(profile) > max_memory &&
+	       (profile->output_buffer_size > SMALL_OUTPUT_BUFFER_SIZE ||
+		profile->members_per_batch > MEMBERS_PER_BATCH / 4)) {
+		profile->output_buffer_size = std::max(profile->output_buffer_size / 2, SMALL_OUTPUT_BUFFER_SIZE);
+		profile->members_per_batch = std::max(profile->members_per_batch / 2, unsigned(MEMBERS_PER_BATCH / 4));
+	}
+
+	while (estimate_memory(profile) > max_memory && profile->nthreads > 1)
+		profile->nthreads--;
+
+	/* One thread decodes cheaper serially, from the start */
+	if (profile->nthreads == 1 && !random_access)
+		profile->strategy = LIBDEFLATE_STRATEGY_SERIAL;
+
+	while (estimate_memory(profile) > max_memory &&
+	       (profile->output_buffer_size > MIN_OUTPUT_BUFFER_SIZE ||
+		profile->members_per_batch > 1)) {
+		profile->output_buffer_size = std::max(profile->output_buffer_size / 2, MIN_OUTPUT_BUFFER_SIZE);
+		profile->members_per_batch = std::max(profile->members_per_batch / 2, 1U);
+	}
+
+	if (estimate_memory(profile) > max_memory)
+		fprintf(stderr, "warning: a memory budget of %lu bytes is too small, "
+			"%lu bytes are needed\n", (unsigned long)max_memory,
+			(unsigned long)estimate_memory(profile));
+}
+
+/*
+ * Whether another gzip member starts after 'from': a header whose deflate
+ * stream decodes, as far as a probe goes. The first member of a concatenation
+ * usually ends after the probe, so the rest of the input is searched for one.
+ * A false match only makes the members be decoded serially.
+ */
+static bool
+find_next_member(struct libdeflate_decompressor *d,
+		 const byte *in, size_t in_nbytes, size_t from)
+{
+	std::vector<byte> probe;
+	for (size_t pos = from; pos + GZIP_MIN_OVERHEAD <= in_nbytes; ) {
+		const size_t scan_end = std::min(pos + MEMBER_SCAN, in_nbytes - GZIP_MIN_OVERHEAD + 1);
+		require_input(d, in + pos, scan_end - pos + 2);
+		const byte *id = static_cast<const byte*>(memchr(in + pos, GZIP_ID1, scan_end - pos));
+		if (id == nullptr) {
+			pos = scan_end;
+			continue;
+		}
+		pos = id - in + 1;
+		if (id[1] != GZIP_ID2 || id[2] != GZIP_CM_DEFLATE)
+			continue;
+		require_input(d, id, HEADER_FETCH_SIZE);
+		size_t header_size = parse_gzip_header(id, in + in_nbytes - id, nullptr);
+		if (header_size == 0)
+			continue;
+		size_t member_size;
+		probe.clear();
+		if (libdeflate_deflate_decompress_stream(d, id + header_size, in + in_nbytes - id - header_size,
+							 &member_size, probe_write, &probe) != LIBDEFLATE_BAD_DATA)
+			return true;
+	}
+	return false;
+}
+
+static enum libdeflate_result
+profile_input(struct libdeflate_decompressor *d,
+	      const byte *in, size_t in_nbytes,
+	      unsigned nthreads, size_t skip, size_t until,
+	      const struct libdeflate_decompress_options *options,
+	      struct libdeflate_gzip_profile *profile)
+{
+	size_t bgzf_size, member_size = 0;
+	require_input(d, in, HEADER_FETCH_SIZE);
+	size_t header_size = parse_gzip_header(in, in_nbytes, &bgzf_size);
+	if (header_size == 0)
+		return LIBDEFLATE_BAD_DATA;
+
+	std::vector<byte> probe;
+	probe.reserve(PROBE_SIZE);
+	enum libdeflate_result result = libdeflate_deflate_decompress_stream(
+			d, in + header_size, in_nbytes - header_size,
+			&member_size, probe_write, &probe);
+	if (result == LIBDEFLATE_BAD_DATA)
+		return result;
+
+	profile->content = libdeflate_classify_content(probe.data(), probe.size());
+
+	if (bgzf_size != 0)
+		profile->framing = LIBDEFLATE_FRAMING_BGZF;
+	else if (result == LIBDEFLATE_SUCCESS &&
+		 header_size + member_size + GZIP_FOOTER_SIZE < in_nbytes)
+		profile->framing = LIBDEFLATE_FRAMING_MULTI_MEMBER;
+	else
+		profile->framing = LIBDEFLATE_FRAMING_SINGLE_MEMBER;
+
+	/* Random access and sync search need a single FASTQ deflate stream */
+	unsigned fastq_threads = std::min(1 + unsigned(in_nbytes >> 26), nthreads);
+	unsigned member_threads = std::min(1 + unsigned(in_nbytes >> 22), nthreads);
+	bool random_access = skip != 0 || until != SIZE_MAX;
+	bool ranged = options != nullptr && options->ranged_input != nullptr;
+
+	/* Searching a ranged input would fetch all of it once more: the
+	 * parallel decoding stops with an error at the end of the first
+	 * member instead */
+	if (!random_access && !ranged && profile->content == LIBDEFLATE_CONTENT_FASTQ &&
+	    profile->framing == LIBDEFLATE_FRAMING_SINGLE_MEMBER && fastq_threads > 1 &&
+	    find_next_member(d, in, in_nbytes, header_size))
+		profile->framing = LIBDEFLATE_FRAMING_MULTI_MEMBER;
+
+	if (random_access ||
+	    (profile->content == LIBDEFLATE_CONTENT_FASTQ &&
+	     profile->framing == LIBDEFLATE_FRAMING_SINGLE_MEMBER && fastq_threads > 1)) {
+		profile->strategy = LIBDEFLATE_STRATEGY_PARALLEL_FASTQ;
+		profile->nthreads = fastq_threads;
+	} else if (profile->framing == LIBDEFLATE_FRAMING_BGZF && member_threads > 1) {
+		profile->strategy = LIBDEFLATE_STRATEGY_MEMBERS;
+		profile->nthreads = member_threads;
+	} else {
+		profile->strategy = LIBDEFLATE_STRATEGY_SERIAL;
+		profile->nthreads = 1;
+	}
+
+	profile->output_buffer_size = (options != nullptr && options->output_buffer_size != 0) ?
+		options->output_buffer_size : OUTPUT_BUFFER_SIZE;
+	profile->members_per_batch = MEMBERS_PER_BATCH;
+	if (options != nullptr && options->max_memory != 0)
+		fit_memory_budget(profile, options->max_memory, random_access);
+	profile->memory = estimate_memory(profile);
+
+	return LIBDEFLATE_SUCCESS;
+}
+
+LIBDEFLATEAPI enum libdeflate_result
+libdeflate_gzip_profile_input(struct libdeflate_decompressor *d,
+			      const byte *in, size_t in_nbytes,
+			      unsigned nthreads, size_t skip, size_t until,
+			      const struct libdeflate_decompress_options *options,
+			      struct libdeflate_gzip_profile *profile)
+{
+	struct ranged_input_scope ranged(d, options);
+	limit_readahead(d, in);
+	return profile_input(d, in, in_nbytes, nthreads, skip, until, options, profile);
+}
+
+/* Decoded data of a member, checked against its footer */
+struct member_check {
+	u32 crc;
+	u64 size;
+	std::vector<byte> *data; /* kept if not NULL */
+	libdeflate_write_func write; /* passed on to it if not NULL */
+	void *ctx;
+};
+
+static int
+check_write(void *ctx, const byte *data, size_t len)
+{
+	struct member_check *check = static_cast<struct member_check*>(ctx);
+	check->crc = libdeflate_crc32(check->crc, data, len);
+	check->size += len;
+	if (check->data != nullptr)
+		check->data->insert(check->data->end(), data, data + len);
+	if (check->write != nullptr)
+		return check->write(check->ctx, data, len);
+	return 0;
+}
+
+/* Whether the footer 'footer_pos' bytes into 'in' matches the member decoded
+ * by 'check' */
+static bool
+footer_matches(struct libdeflate_decompressor *d, const byte *in, size_t footer_pos,
+	       const struct member_check *check)
+{
+	const byte *footer = in + footer_pos;
+	require_input(d, footer, GZIP_FOOTER_SIZE);
+	if (get_unaligned_le32(footer) == check->crc &&
+	    get_unaligned_le32(footer + 4) == u32(check->size))
+		return true;
+	fprintf(stderr, "the gzip member ending at byte %lu fails its CRC32 or size check\n",
+		(unsigned long)(footer_pos + GZIP_FOOTER_SIZE));
+	return false;
+}
+
+/*
+ * Exact decoding of all the members, in order. Anything following the last
+ * member that isn't a gzip header is ignored, like gzip does.
+ */
+static enum libdeflate_result
+decompress_members_serially(struct libdeflate_decompressor *d,
+			    const byte *in, size_t in_nbytes,
+			    libdeflate_write_func write, void *ctx,
+			    size_t *out_nbytes)
+{
+	const byte *in_next = in;
+	const byte * const in_end = in + in_nbytes;
+
+	*out_nbytes = 0;
+	while (in_next != in_end) {
+		size_t member_size;
+		require_input(d, in_next, HEADER_FETCH_SIZE);
+		size_t header_size = parse_gzip_header(in_next, in_end - in_next, nullptr);
+		if (header_size == 0) {
+			if (in_next == in)
+				return LIBDEFLATE_BAD_DATA;
+			fprintf(stderr, "ignoring %lu bytes of trailing garbage\n",
+				(unsigned long)(in_end - in_next));
+			break;
+		}
+
+		struct member_check check = {0, 0, nullptr, write, ctx};
+		enum libdeflate_result result = libdeflate_deflate_decompress_stream(
+				d, in_next + header_size, in_end - in_next - header_size,
+				&member_size, check_write, &check);
+		if (result != LIBDEFLATE_SUCCESS)
+			return result;
+
+		in_next += header_size + member_size;
+		if (in_end - in_next < GZIP_FOOTER_SIZE ||
+		    !footer_matches(d, in, in_next - in, &check))
 			return LIBDEFLATE_BAD_DATA;
+		*out_nbytes += check.size;
+		in_next += GZIP_FOOTER_SIZE;
 	}
+	return LIBDEFLATE_SUCCESS;
+}
 
-        nthreads = std::min(1 + unsigned(in_nbytes >> 26), nthreads);
+/*
+ * BGZF members are independent and their sizes are known from their headers:
+ * each thread of a pool decodes a batch of consecutive members to memory, and
+ * checks them against their footers, one round after the other, while the
+ * batches of a round are written in order.
+ */
+static enum libdeflate_result
+decompress_bgzf_members(struct libdeflate_decompressor *d,
+			const byte *in, size_t in_nbytes,
+			unsigned nthreads, unsigned members_per_batch,
+			libdeflate_write_func write, void *ctx,
+			size_t *out_nbytes)
+{
+	const size_t round_size = size_t(nthreads) * members_per_batch;
+	std::vector<size_t> members; /* start of each member, then end of the last */
+	size_t pos = 0;
+	bool scanned = false;
+
+	/* Find the members up to 'nb_wanted' (or all of them), as the rounds
+	 * need them, so that a ranged input is fetched once */
+	auto scan = [&](size_t nb_wanted) {
+		while (!scanned && members.size() <= nb_wanted) {
+			size_t bgzf_size = 0;
+			if (pos != in_nbytes)
+				require_input(d, in + pos, HEADER_FETCH_SIZE);
+			if (pos == in_nbytes ||
+			    parse_gzip_header(in + pos, in_nbytes - pos, &bgzf_size) == 0 ||
+			    bgzf_size < GZIP_MIN_OVERHEAD || bgzf_size > in_nbytes - pos) {
+				if (pos != in_nbytes && pos != 0)
+					fprintf(stderr, "ignoring %lu bytes after the last BGZF member\n",
+						(unsigned long)(in_nbytes - pos));
+				members.push_back(pos);
+				scanned = true;
+				break;
+			}
+			members.push_back(pos);
+			pos += bgzf_size;
+		}
+	};
+	scan(round_size);
+	if (pos == 0)
+		return LIBDEFLATE_BAD_DATA;
+
+	std::vector<libdeflate_decompressor*> decompressors(nthreads);
+	for (auto& local_d : decompressors)
+		local_d = libdeflate_copy_decompressor(d);
+	std::vector<std::vector<byte>> batches(nthreads);
+	std::vector<size_t> accounted(nthreads, 0); /* capacity of each batch */
+	std::vector<enum libdeflate_result> results(nthreads);
+
+	/* A round decodes members [round_first, round_end) when 'round' is
+	 * incremented */
+	std::mutex mutex;
+	std::condition_variable cv;
+	unsigned round = 0;
+	size_t round_first = 0, round_end = 0;
+	bool stop = false;
+	std::vector<unsigned> rounds_done(nthreads, 0);
+
+	std::vector<std::thread> threads;
+	threads.reserve(nthreads);
+	for (unsigned t = 0; t < nthreads; t++) {
+		threads.emplace_back([&, t]() {
+			for (unsigned r = 1; ; r++) {
+				size_t first, nb_members;
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					cv.wait(lock, [&]{ return round >= r || stop; });
+					if (stop)
+						return;
+					first = round_first;
+					nb_members = round_end;
+				}
+
+				size_t begin = std::min(first + t * members_per_batch, nb_members);
+				size_t end = std::min(begin + members_per_batch, nb_members);
+				std::vector<byte>& batch = batches[t];
+				/* ISIZE gives the exact size of the batch */
+				size_t batch_size = 0;
+				for (size_t m = begin; m < end; m++) {
+					require_input(decompressors[t], in + members[m+1] - 4, 4);
+					batch_size += get_unaligned_le32(in + members[m+1] - 4);
+				}
+				batch.clear();
+				batch.reserve(std::min(batch_size, size_t(end - begin) * BGZF_MAX_MEMBER_SIZE));
+				results[t] = LIBDEFLATE_SUCCESS;
+				for (size_t m = begin; m < end && results[t] == LIBDEFLATE_SUCCESS; m++) {
+					const byte *member = in + members[m];
+					size_t member_nbytes = members[m+1] - members[m];
+					struct member_check check = {0, 0, &batch, nullptr, nullptr};
+					require_input(decompressors[t], member, HEADER_FETCH_SIZE);
+					size_t header_size = parse_gzip_header(member, member_nbytes, nullptr);
+					results[t] = libdeflate_deflate_decompress_stream(
+							decompressors[t], member + header_size,
+							member_nbytes - header_size - GZIP_FOOTER_SIZE,
+							nullptr, check_write, &check);
+					if (results[t] == LIBDEFLATE_SUCCESS &&
+					    !footer_matches(decompressors[t], in,
+							    members[m+1] - GZIP_FOOTER_SIZE, &check))
+						results[t] = LIBDEFLATE_BAD_DATA;
+				}
+				if (batch.capacity() > accounted[t]) {
+					memory_accounting::instance().allocated(LIBDEFLATE_MEMORY_MEMBERS, batch.capacity() - accounted[t]);
+					accounted[t] = batch.capacity();
+				}
+
+				std::lock_guard<std::mutex> lock(mutex);
+				rounds_done[t] = r;
+				cv.notify_all();
+			}
+		});
+	}
+
+	enum libdeflate_result result = LIBDEFLATE_SUCCESS;
+	*out_nbytes = 0;
+	for (size_t first = 0; result == LIBDEFLATE_SUCCESS; first += round_size) {
+		scan(first + round_size);
+		const size_t nb_members = scanned ? members.size() - 1 : first + round_size;
+		if (first >= nb_members)
+			break;
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			round_first = first;
+			round_end = nb_members;
+			round++;
+			cv.notify_all();
+		}
+		for (unsigned t = 0; t < nthreads; t++) {
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				cv.wait(lock, [&]{ return rounds_done[t] == round; });
+			}
+			if (result == LIBDEFLATE_SUCCESS)
+				result = results[t];
+			if (result == LIBDEFLATE_SUCCESS && !batches[t].empty()) {
+				if (write(ctx, batches[t].data(), batches[t].size()) != 0)
+					result = LIBDEFLATE_SHORT_OUTPUT;
+				*out_nbytes += batches[t].size();
+			}
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stop = true;
+		cv.notify_all();
+	}
+	for (std::thread& thread : threads)
+		thread.join();
+
+	for (unsigned t = 0; t < nthreads; t++)
+		memory_accounting::instance().released(LIBDEFLATE_MEMORY_MEMBERS, accounted[t]);
+	for (auto local_d : decompressors)
+		libdeflate_free_decompressor(local_d);
+	return result;
+}
+
+/*
+ * Move the planned start of a thread, 'start' bytes into the deflate stream at
+ * 'in', to just after the next flush marker if there is one nearby: the thread
+ * then finds its first block without searching for it, bit by bit.
+ */
+static size_t
+snap_to_flush_marker(struct libdeflate_decompressor *d, const byte *in,
+		     const byte *in_end, size_t start)
+{
+	const byte *begin = in + start - 1;
+	if (begin >= in_end)
+		return start;
+	const byte *end = begin + std::min(size_t(in_end - begin), FLUSH_MARKER_SCAN);
+	require_input(d, begin, end - begin);
+	const byte *marker = find_flush_marker(begin, end);
+	if (marker == nullptr || marker + flush_marker_size >= in_end)
+		return start;
+	return marker + flush_marker_size - in;
+}
+
+LIBDEFLATEAPI enum libdeflate_result
+libdeflate_gzip_decompress(struct libdeflate_decompressor *d,
+                           const byte *in, size_t in_nbytes,
+                           byte *out, size_t out_nbytes_avail,
+                           size_t *actual_out_nbytes_ret,
+                           unsigned nthreads,
+                           size_t skip, size_t until,
+                           const struct libdeflate_decompress_options *options)
+{
+	const byte *in_next = in;
+	const byte * const in_end = in_next + in_nbytes;
+	size_t actual_out_nbytes;
+	enum libdeflate_result result;
+	struct libdeflate_gzip_profile profile;
+	struct ranged_input_scope ranged(d, options);
+
+	/* the probes of the header and footer read nothing ahead, the decoding
+	 * does, up to 'until' for a random access */
+	limit_readahead(d, in);
+	result = profile_input(d, in, in_nbytes, nthreads, skip, until, options, &profile);
+	if (result != LIBDEFLATE_SUCCESS)
+		return result;
+
+	/* the output buffers are sized by the plan */
+	struct libdeflate_decompress_options planned = {};
+	if (options != nullptr)
+		planned = *options;
+	planned.output_buffer_size = profile.output_buffer_size;
+	options = &planned;
+
+	/* a resumed decompression runs with the threads it was saved with */
+	std::unique_ptr<checkpointer> checkpoint;
+	if (options->checkpoint_path != nullptr) {
+		if (profile.strategy != LIBDEFLATE_STRATEGY_PARALLEL_FASTQ) {
+			if (options->resume) {
+				fprintf(stderr, "can't resume: only parallel FASTQ decoding can be checkpointed\n");
+				return LIBDEFLATE_BAD_DATA;
+			}
+			fprintf(stderr, "warning: only parallel FASTQ decoding can be checkpointed, not saving any\n");
+		} else {
+			require_input(d, in_end - GZIP_FOOTER_SIZE, GZIP_FOOTER_SIZE);
+			checkpoint.reset(new checkpointer(options->checkpoint_path, options->checkpoint_interval,
+							  in, in_nbytes, profile.nthreads));
+			if (options->resume) {
+				if (!checkpoint->load())
+					return LIBDEFLATE_BAD_DATA;
+				profile.nthreads = checkpoint->nthreads();
+			}
+		}
+	}
+
+	static const char * const framing_names[] = {"single gzip member", "multiple gzip members", "BGZF"};
+	static const char * const strategy_names[] = {"parallel FASTQ decoding", "parallel decoding of the members", "serial exact decoding"};
+	/* Serial decoding doesn't search for the other members beyond the probe */
+	const char *framing_name = framing_names[profile.framing];
+	if (profile.framing == LIBDEFLATE_FRAMING_SINGLE_MEMBER &&
+	    profile.strategy == LIBDEFLATE_STRATEGY_SERIAL)
+		framing_name = "one or more gzip members";
+	fprintf(stderr, "input: %s content, %s, using %s with %u thread%s (about %lu MiB)\n",
+		content_name(profile.content), framing_name,
+		strategy_names[profile.strategy], profile.nthreads, profile.nthreads > 1 ? "s" : "",
+		(unsigned long)(profile.memory >> 20));
+
+	if (profile.strategy != LIBDEFLATE_STRATEGY_PARALLEL_FASTQ) {
+		size_t out_nbytes;
+		limit_readahead(d, nullptr);
+		struct libdeflate_stream_output *output = libdeflate_alloc_stream_output(profile.content, options);
+		if (profile.strategy == LIBDEFLATE_STRATEGY_MEMBERS)
+			result = decompress_bgzf_members(d, in, in_nbytes, profile.nthreads,
+							 profile.members_per_batch,
+							 libdeflate_stream_output_write, output, &out_nbytes);
+		else
+			result = decompress_members_serially(d, in, in_nbytes,
+							     libdeflate_stream_output_write, output, &out_nbytes);
+		libdeflate_free_stream_output(output);
+
+		if (result == LIBDEFLATE_SUCCESS && actual_out_nbytes_ret)
+			*actual_out_nbytes_ret = out_nbytes;
+		return result;
+	}
+
+	require_input(d, in, HEADER_FETCH_SIZE);
+	in_next += parse_gzip_header(in, in_nbytes, nullptr);
+
+        nthreads = profile.nthreads;
         if(nthreads <= 1) {
+            size_t start = skip;
+            if (start != 0)
+                start = snap_to_flush_marker(d, in_next, in_end - GZIP_FOOTER_SIZE, start);
             /* Compressed data  */
             result = libdeflate_deflate_decompress(d, in_next,
                                             in_end - GZIP_FOOTER_SIZE - in_next,
                                             out, out_nbytes_avail,
-                                            actual_out_nbytes_ret, nullptr, nullptr, skip, until);
+                                            actual_out_nbytes_ret, nullptr, nullptr, start, until,
+                                            options, checkpoint.get(), 0);
         } else {
             std::vector<std::thread> threads; threads.reserve(nthreads);
             std::vector<synchronizer> syncs(nthreads-1);
+            std::vector<enum libdeflate_result> results(nthreads, LIBDEFLATE_SUCCESS);
+            memory_accounting::instance().allocated(LIBDEFLATE_MEMORY_CONTEXTS, syncs.size() * sizeof(synchronizer));
 
             size_t first_chunk_size = ((in_end - in_next) - skip)/nthreads + (1UL << 24);
             size_t chunk_size = ((in_end - in_next) - first_chunk_size)/(nthreads-1);
 
-            size_t start = skip;
+            size_t planned = skip;
             synchronizer* prev_sync = nullptr;
             for(unsigned i=0; i < nthreads; i++) {
                 synchronizer* stop = i < nthreads-1 ? &syncs[i] : nullptr;
+                checkpointer* thread_checkpoint = checkpoint.get();
+                enum libdeflate_result* thread_result = &results[i];
+                size_t start = planned;
+                if (start != 0)
+                    start = snap_to_flush_marker(d, in_next, in_end - GZIP_FOOTER_SIZE, start);
+
+                // the previous thread stops and captures our context where we did before
+                if (checkpoint && checkpoint->resuming) {
+                    const worker_checkpoint& resumed = checkpoint->resumed(i);
+                    start = resumed.start;
+                    if (prev_sync != nullptr && resumed.sync_bits != ~0UL)
+                        prev_sync->request_context(resumed.sync_bits);
+                    if (prev_sync != nullptr && resumed.first_block != ~0UL)
+                        prev_sync->signal_first_decoded_sequence(resumed.first_block, 0);
+                }
 
                 threads.emplace_back([=](){
                     libdeflate_decompressor* local_d = libdeflate_copy_decompressor(d);
 
-                    enum libdeflate_result local_result = libdeflate_deflate_decompress(
+                    *thread_result = libdeflate_deflate_decompress(
                                 local_d, in_next,
                                 in_end - GZIP_FOOTER_SIZE - in_next,
                                 out, out_nbytes_avail,
                                 actual_out_nbytes_ret,
                                 stop, prev_sync,
-                                start, until);
-
-                    if (local_result != LIBDEFLATE_SUCCESS)
-                        exit(LIBDEFLATE_SUCCESS); //FIXME: use futures to pass result
+                                start, until, options,
+                                thread_checkpoint, i);
 
                     libdeflate_free_decompressor(local_d);
                 });
 
                 prev_sync = stop;
-                start += i == 0 ? first_chunk_size : chunk_size;
+                planned += i == 0 ? first_chunk_size : chunk_size;
             }
 
             for(auto& thread : threads) thread.join();
+            memory_accounting::instance().released(LIBDEFLATE_MEMORY_CONTEXTS, syncs.size() * sizeof(synchronizer));
 
             result = LIBDEFLATE_SUCCESS;
+            for (enum libdeflate_result thread_result : results)
+                if (result == LIBDEFLATE_SUCCESS)
+                    result = thread_result;
         }
 
 	if (result != LIBDEFLATE_SUCCESS)
@@ -179,3 +802,168 @@ libdeflate_gzip_decompress(struct libdeflate_decompressor *d,
 
 	return LIBDEFLATE_SUCCESS;
 }
+
+/*
+ * Decode the gzip member at 'in' exactly and check it against its footer.
+ * Returns its compressed size, or 0 if it is truncated or corrupt: the decoder
+ * reads zeroes past the end of its input, so only the footer tells a member
+ * cut short apart from a complete one.
+ */
+static size_t
+decode_member(struct libdeflate_decompressor *d, const byte *in, size_t in_nbytes,
+	      struct member_check *check)
+{
+	size_t header_size = parse_gzip_header(in, in_nbytes, nullptr);
+	size_t deflate_size;
+
+	if (header_size == 0 ||
+	    libdeflate_deflate_decompress_stream(d, in + header_size, in_nbytes - header_size,
+						 &deflate_size, check_write, check) != LIBDEFLATE_SUCCESS)
+		return 0;
+
+	size_t member_size = header_size + deflate_size + GZIP_FOOTER_SIZE;
+	if (member_size > in_nbytes ||
+	    get_unaligned_le32(in + member_size - 8) != check->crc ||
+	    get_unaligned_le32(in + member_size - 4) != u32(check->size))
+		return 0;
+	return member_size;
+}
+
+LIBDEFLATEAPI enum libdeflate_result
+libdeflate_gzip_index_members(struct libdeflate_decompressor *d,
+			      const byte *in, size_t in_nbytes,
+			      const byte *index, size_t index_nbytes,
+			      libdeflate_write_func write_index, void *index_ctx,
+			      size_t *indexed_nbytes_ret)
+{
+	std::vector<u8> entries(8);
+	u64 pos = 0, out_pos = 0; /* of the next member */
+
+	/* resume at the last indexed member, whose end isn't in the index */
+	if (index_nbytes != 0) {
+		if (index_nbytes < 8 || (index_nbytes - 8) % 16 != 0 ||
+		    get_unaligned_le64(index) != (index_nbytes - 8) / 16)
+			return LIBDEFLATE_BAD_DATA;
+		entries.assign(index, index + index_nbytes);
+		if (entries.size() > 8) {
+			pos = get_unaligned_le64(&entries[entries.size() - 16]);
+			out_pos = get_unaligned_le64(&entries[entries.size() - 8]);
+			entries.resize(entries.size() - 16);
+		}
+	}
+	if (pos >= in_nbytes || parse_gzip_header(in + pos, in_nbytes - pos, nullptr) == 0)
+		return LIBDEFLATE_BAD_DATA;
+
+	while (pos < in_nbytes) {
+		size_t bgzf_size;
+		size_t member_size;
+		u64 member_out;
+
+		if (parse_gzip_header(in + pos, in_nbytes - pos, &bgzf_size) == 0)
+			break;
+		if (bgzf_size >= GZIP_MIN_OVERHEAD) {
+			/* the sizes are in the header and footer */
+			if (bgzf_size > in_nbytes - pos)
+				break;
+			member_size = bgzf_size;
+			member_out = get_unaligned_le32(in + pos + member_size - 4);
+		} else {
+			struct member_check check = {0, 0, nullptr};
+			member_size = decode_member(d, in + pos, in_nbytes - pos, &check);
+			if (member_size == 0)
+				break;
+			member_out = check.size;
+		}
+
+		if (pos != 0 && member_out != 0) {
+			entries.resize(entries.size() + 16);
+			put_unaligned_le64(pos, &entries[entries.size() - 16]);
+			put_unaligned_le64(out_pos, &entries[entries.size() - 8]);
+		}
+		pos += member_size;
+		out_pos += member_out;
+	}
+
+	put_unaligned_le64(u64(entries.size() / 16), &entries[0]);
+	if (indexed_nbytes_ret)
+		*indexed_nbytes_ret = pos;
+	if (write_index(index_ctx, entries.data(), entries.size()) != 0)
+		return LIBDEFLATE_SHORT_OUTPUT;
+	return LIBDEFLATE_SUCCESS;
+}
+
+LIBDEFLATEAPI enum libdeflate_result
+libdeflate_gzip_decompress_members(struct libdeflate_decompressor *d,
+				   const byte *in, size_t in_nbytes,
+				   libdeflate_write_func write, void *ctx,
+				   size_t *in_consumed_ret)
+{
+	std::vector<byte> data;
+	size_t pos = 0;
+
+	*in_consumed_ret = 0;
+	while (pos < in_nbytes) {
+		struct member_check check = {0, 0, &data};
+		data.clear();
+		size_t member_size = decode_member(d, in + pos, in_nbytes - pos, &check);
+		if (member_size == 0)
+			break;
+		pos += member_size;
+		*in_consumed_ret = pos;
+		if (!data.empty() && write(ctx, data.data(), data.size()) != 0)
+			return LIBDEFLATE_SHORT_OUTPUT;
+	}
+	return LIBDEFLATE_SUCCESS;
+}
+
+LIBDEFLATEAPI enum libdeflate_result
+libdeflate_gzip_decompress_iov(struct libdeflate_decompressor *d,
+			       const byte *in, size_t in_nbytes,
+			       const struct libdeflate_iovec *out, size_t out_iovcnt,
+			       size_t *actual_in_nbytes_ret,
+			       size_t *actual_out_nbytes_ret)
+{
+	size_t header_size = parse_gzip_header(in, in_nbytes, nullptr);
+	size_t deflate_size, out_nbytes, out_nbytes_avail = 0;
+	enum libdeflate_result result;
+
+	if (header_size == 0)
+		return LIBDEFLATE_BAD_DATA;
+
+	result = libdeflate_deflate_decompress_iov(d, in + header_size,
+						   in_nbytes - header_size,
+						   out, out_iovcnt,
+						   &deflate_size, &out_nbytes);
+	if (result != LIBDEFLATE_SUCCESS)
+		return result;
+
+	size_t member_size = header_size + deflate_size + GZIP_FOOTER_SIZE;
+	if (member_size > in_nbytes)
+		return LIBDEFLATE_BAD_DATA;
+
+	/* CRC32, over the segments as far as they were filled */
+	u32 crc = 0;
+	size_t left = out_nbytes;
+	for (size_t i = 0; i < out_iovcnt; i++) {
+		size_t len = std::min(out[i].len, left);
+		if (len != 0) /* libdeflate_crc32() restarts on a NULL buffer */
+			crc = libdeflate_crc32(crc, out[i].base, len);
+		left -= len;
+		out_nbytes_avail += out[i].len;
+	}
+	if (get_unaligned_le32(in + member_size - 8) != crc)
+		return LIBDEFLATE_BAD_DATA;
+
+	/* ISIZE */
+	if (get_unaligned_le32(in + member_size - 4) != u32(out_nbytes))
+		return LIBDEFLATE_BAD_DATA;
+
+	if (actual_in_nbytes_ret)
+		*actual_in_nbytes_ret = member_size;
+	if (actual_out_nbytes_ret)
+		*actual_out_nbytes_ret = out_nbytes;
+	else if (out_nbytes != out_nbytes_avail)
+		return LIBDEFLATE_SHORT_OUTPUT;
+
+	return LIBDEFLATE_SUCCESS;
+}
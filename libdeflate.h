@@ -59,6 +59,29 @@ struct libdeflate_compressor;
 LIBDEFLATEAPI struct libdeflate_compressor *
 libdeflate_alloc_compressor(int compression_level);
 
+/*
+ * Options of libdeflate_alloc_compressor_ex().  A zero-initialized structure
+ * (or a NULL pointer) gives the same compressor as
+ * libdeflate_alloc_compressor().
+ */
+struct libdeflate_compress_options {
+	/* If not 0, the compressor measures its own speed and moves between
+	 * compression levels (parsers, search depths and nice match lengths)
+	 * to compress at about this many MB/s, with the best ratio it can.
+	 * 'compression_level' is then the highest level used.  The first MiB
+	 * is compressed with level 1, whose speed gives the level to continue
+	 * with, and the level can change before any block.  */
+	unsigned target_mb_per_sec;
+
+	/* If not 0, the levels whose compressor would not fit in this many
+	 * bytes are not used, and the allocation fails if none fits.  */
+	size_t max_memory;
+};
+
+LIBDEFLATEAPI struct libdeflate_compressor *
+libdeflate_alloc_compressor_ex(int compression_level,
+			       const struct libdeflate_compress_options *options);
+
 /*
  * libdeflate_deflate_compress() performs raw DEFLATE compression on a buffer of
  * data.  The function attempts to compress 'in_nbytes' bytes of data located at
@@ -136,6 +159,66 @@ LIBDEFLATEAPI size_t
 libdeflate_gzip_compress_bound(struct libdeflate_compressor *compressor,
 			       size_t in_nbytes);
 
+/*
+ * A segment of a scatter/gather buffer.  It is laid out like POSIX 'struct
+ * iovec', so an array of those can be passed as is.
+ */
+struct libdeflate_iovec {
+	void *base;
+	size_t len;
+};
+
+/*
+ * libdeflate_deflate_compress_iov() is like libdeflate_deflate_compress(), for
+ * the data of the 'in_iovcnt' segments at 'in', taken in order, without first
+ * gathering them into a single buffer.  Segments of 256 KiB or more are
+ * compressed in place, and matches don't reach across the start of such a
+ * segment: the compressed data before it ends with a sync flush (an empty
+ * stored block).  Shorter segments are copied into a buffer of that size,
+ * which is compressed once full.  Each segment may add up to 16 bytes to
+ * libdeflate_deflate_compress_bound() of the total size.
+ */
+LIBDEFLATEAPI size_t
+libdeflate_deflate_compress_iov(struct libdeflate_compressor *compressor,
+				const struct libdeflate_iovec *in, size_t in_iovcnt,
+				void *out, size_t out_nbytes_avail);
+
+/*
+ * Like libdeflate_deflate_compress_iov(), but stores the data in the gzip
+ * wrapper format.
+ */
+LIBDEFLATEAPI size_t
+libdeflate_gzip_compress_iov(struct libdeflate_compressor *compressor,
+			     const struct libdeflate_iovec *in, size_t in_iovcnt,
+			     void *out, size_t out_nbytes_avail);
+
+/*
+ * Callback receiving the output of a streaming compression or decompression, in
+ * order.  Returning nonzero stops the compression or decompression.
+ */
+typedef int (*libdeflate_write_func)(void *ctx, const byte *data, size_t len);
+
+/*
+ * libdeflate_bgzf_compress() compresses 'in_nbytes' bytes at 'in' to the BGZF
+ * format of htslib: gzip members of at most 65280 uncompressed bytes, each with
+ * a 'BC' extra subfield giving its compressed size, followed by the empty EOF
+ * member.  The members are compressed concurrently by 'nthreads' threads, each
+ * with its own compressor allocated with libdeflate_alloc_compressor_ex(), and
+ * are handed to 'write' in order.  If 'write_index' isn't NULL, it then
+ * receives the .gzi index of the output: the number of members after the first
+ * as a 64-bit little endian integer, then the compressed and uncompressed
+ * offsets of each of these members, as 64-bit little endian integers.
+ *
+ * The return value is the compressed size in bytes, or 0 if a compressor could
+ * not be allocated or a write function returned nonzero.
+ */
+LIBDEFLATEAPI size_t
+libdeflate_bgzf_compress(int compression_level,
+			 const struct libdeflate_compress_options *options,
+			 const void *in, size_t in_nbytes, unsigned nthreads,
+			 libdeflate_write_func write, void *ctx,
+			 libdeflate_write_func write_index, void *index_ctx);
+
 /*
  * libdeflate_free_compressor() frees a compressor that was allocated with
  * libdeflate_alloc_compressor().  If a NULL pointer is passed in, no action is
@@ -187,6 +270,13 @@ enum libdeflate_result {
 	/* The data would have decompressed to more than 'out_nbytes_avail'
 	 * bytes.  */
 	LIBDEFLATE_INSUFFICIENT_SPACE = 3,
+
+	/* The parallel FASTQ decompression output fewer reads than the stream
+	 * holds records: some could not be delimited from the data decoded
+	 * without its context.  The stream itself is valid, and decompressing
+	 * it with a single thread outputs all of them.  Also returned by a
+	 * random access that output no reads.  */
+	LIBDEFLATE_INCOMPLETE_OUTPUT = 4,
 };
 
 /*
@@ -220,6 +310,87 @@ enum libdeflate_result {
  */
 
 class synchronizer;
+class checkpointer;
+
+struct libdeflate_demultiplexer;
+struct libdeflate_duplicates;
+struct libdeflate_ranged_input;
+struct libdeflate_window_cache;
+struct libdeflate_fanout;
+struct libdeflate_read_queue;
+struct libdeflate_shm_ring;
+struct libdeflate_qc;
+
+/*
+ * Optional settings of the FASTQ decompressor.  A zero-initialized struct (or a
+ * NULL pointer) selects the default behavior, which is to write every resolved
+ * read to standard output.
+ */
+struct libdeflate_decompress_options {
+	/* If not NULL, reads are routed to per-barcode outputs instead of
+	 * standard output.  See libdeflate_alloc_demultiplexer().  */
+	struct libdeflate_demultiplexer *demux;
+
+	/* If not NULL, every resolved read is looked up in this set to count
+	 * (and optionally drop) duplicate reads.  See
+	 * libdeflate_alloc_duplicates().  */
+	struct libdeflate_duplicates *duplicates;
+
+	/* If not 0, libdeflate_gzip_decompress() plans the decompression to
+	 * use at most about this many bytes, see
+	 * libdeflate_gzip_profile_input().  Past it, the parallel FASTQ
+	 * threads holding reads that depend on the previous thread's data wait
+	 * for it instead of decoding ahead, as they do anyway once they hold
+	 * 32 MiB of such reads each.  */
+	size_t max_memory;
+
+	/* Size of each output buffer, 0 for the default of 2 MiB.  */
+	size_t output_buffer_size;
+
+	/* If not NULL, the parallel FASTQ decompression saves the state of its
+	 * threads to this file every 'checkpoint_interval' seconds (0 for 60),
+	 * along with the size of standard output, which must be a regular
+	 * file.  Not supported with 'demux' or 'duplicates'.  */
+	const char *checkpoint_path;
+	unsigned checkpoint_interval;
+
+	/* If nonzero, the decompression resumes from the state saved in
+	 * 'checkpoint_path', after truncating standard output to its saved
+	 * size.  */
+	int resume;
+
+	/* If not NULL, the input is the data of this ranged input, which the
+	 * decompression fetches as it goes.  See
+	 * libdeflate_alloc_ranged_input().  */
+	struct libdeflate_ranged_input *ranged_input;
+
+	/* If not NULL, random access with 'skip' restarts from a window cached
+	 * by an earlier decompression of the same input, when there is one
+	 * close to 'skip', and caches the windows it reconstructs.  See
+	 * libdeflate_alloc_window_cache().  */
+	struct libdeflate_window_cache *window_cache;
+
+	/* If not NULL, the reads that would be written to standard output are
+	 * published by batches to the consumers of this fan-out instead.  Not
+	 * supported with 'checkpoint_path'.  See libdeflate_alloc_fanout().  */
+	struct libdeflate_fanout *fanout;
+
+	/* If not NULL, the reads that would be written to standard output are
+	 * distributed by batches among the consumers of this queue instead,
+	 * each batch to one of them.  Not supported with 'checkpoint_path' or
+	 * 'fanout'.  See libdeflate_alloc_read_queue().  */
+	struct libdeflate_read_queue *read_queue;
+
+	/* If not NULL, the reads that would be written to standard output are
+	 * published by batches to this shared-memory ring instead, for other
+	 * processes to read.  Not supported with 'checkpoint_path', 'fanout'
+	 * or 'read_queue'.  See libdeflate_alloc_shm_ring().  */
+	struct libdeflate_shm_ring *shm_ring;
+
+	/* If not NULL, quality control statistics of the resolved reads are
+	 * gathered into this set.  See libdeflate_alloc_qc().  */
+	struct libdeflate_qc *qc;
+};
 
 LIBDEFLATEAPI enum libdeflate_result
 libdeflate_deflate_decompress(struct libdeflate_decompressor *decompressor,
@@ -228,7 +399,10 @@ libdeflate_deflate_decompress(struct libdeflate_decompressor *decompressor,
 			      size_t *actual_out_nbytes_ret,
                   synchronizer* stop,  // indicating where to stop
                   synchronizer* prev_sync, // for passing our first extracted sequence coordinate to the previous thread
-                  size_t skip, size_t until);
+                  size_t skip, size_t until,
+                  const struct libdeflate_decompress_options *options,
+                  checkpointer* checkpoint, // saving the state of the threads, or nullptr
+                  unsigned worker); // index of the thread for 'checkpoint'
 
 /*
  * Like libdeflate_deflate_decompress(), but assumes the zlib wrapper format
@@ -242,7 +416,14 @@ libdeflate_zlib_decompress(struct libdeflate_decompressor *decompressor,
 
 /*
  * Like libdeflate_deflate_decompress(), but assumes the gzip wrapper format
- * instead of raw DEFLATE.
+ * instead of raw DEFLATE.  The input is first profiled with
+ * libdeflate_gzip_profile_input(), and only single-member FASTQ files (or
+ * random access with 'skip' and 'until') go through the parallel FASTQ
+ * decompression; other files are written to standard output through a
+ * libdeflate_stream_output.  When a whole FASTQ stream is decompressed, the
+ * reads output are checked against its number of records, and
+ * LIBDEFLATE_INCOMPLETE_OUTPUT is returned if some of them could not be
+ * delimited, as it is when random access with 'skip' outputs no reads.
  */
 LIBDEFLATEAPI enum libdeflate_result
 libdeflate_gzip_decompress(struct libdeflate_decompressor *decompressor,
@@ -250,7 +431,536 @@ libdeflate_gzip_decompress(struct libdeflate_decompressor *decompressor,
 			   byte *out, size_t out_nbytes_avail,
                size_t *actual_out_nbytes_ret,
                unsigned nthreads,
-               size_t skip, size_t until);
+               size_t skip, size_t until,
+               const struct libdeflate_decompress_options *options);
+
+/*
+ * libdeflate_deflate_decompress_stream() decompresses the raw DEFLATE stream
+ * starting at 'in' serially and exactly, whatever its content, handing the
+ * uncompressed data to 'write' as it goes.  The input may extend past the end of
+ * the stream: if 'actual_in_nbytes_ret' isn't NULL, the compressed size of the
+ * stream is written to it.  Returns LIBDEFLATE_SHORT_OUTPUT if 'write' stopped
+ * the decompression.
+ */
+LIBDEFLATEAPI enum libdeflate_result
+libdeflate_deflate_decompress_stream(struct libdeflate_decompressor *decompressor,
+				     const byte *in, size_t in_nbytes,
+				     size_t *actual_in_nbytes_ret,
+				     libdeflate_write_func write, void *ctx);
+
+/*
+ * libdeflate_deflate_decompress_iov() decompresses the raw DEFLATE stream at
+ * 'in' exactly, like libdeflate_deflate_decompress_stream(), directly into the
+ * 'out_iovcnt' segments at 'out', filled in order: matches are copied across
+ * the segment edges.  The output size and the result follow the conventions
+ * described for libdeflate_deflate_decompress(), with the total size of the
+ * segments as 'out_nbytes_avail'.  If 'actual_in_nbytes_ret' isn't NULL, it
+ * receives the size of the stream, rounded up to a whole byte.
+ */
+LIBDEFLATEAPI enum libdeflate_result
+libdeflate_deflate_decompress_iov(struct libdeflate_decompressor *decompressor,
+				  const byte *in, size_t in_nbytes,
+				  const struct libdeflate_iovec *out, size_t out_iovcnt,
+				  size_t *actual_in_nbytes_ret,
+				  size_t *actual_out_nbytes_ret);
+
+/*
+ * Like libdeflate_deflate_decompress_iov(), but for the gzip member at 'in',
+ * whose CRC32 and size are checked.  'actual_in_nbytes_ret' receives the size
+ * of the member.
+ */
+LIBDEFLATEAPI enum libdeflate_result
+libdeflate_gzip_decompress_iov(struct libdeflate_decompressor *decompressor,
+			       const byte *in, size_t in_nbytes,
+			       const struct libdeflate_iovec *out, size_t out_iovcnt,
+			       size_t *actual_in_nbytes_ret,
+			       size_t *actual_out_nbytes_ret);
+
+/* Kind of uncompressed data, see libdeflate_classify_content().  */
+enum libdeflate_content {
+	LIBDEFLATE_CONTENT_UNKNOWN = 0,
+	LIBDEFLATE_CONTENT_FASTQ = 1,
+	LIBDEFLATE_CONTENT_FASTA = 2,
+	/* Tab-separated text such as SAM or VCF */
+	LIBDEFLATE_CONTENT_TABULAR = 3,
+	LIBDEFLATE_CONTENT_TEXT = 4,
+	LIBDEFLATE_CONTENT_BINARY = 5,
+};
+
+/*
+ * libdeflate_classify_content() guesses the kind of data from its first bytes
+ * (typically the first 64 KiB of a file).  Only whole lines are considered.
+ */
+LIBDEFLATEAPI enum libdeflate_content
+libdeflate_classify_content(const byte *data, size_t len);
+
+/*
+ * A stream output writes the data of a serial decompression to standard
+ * output.  FASTQ content is reduced to its sequence lines, like the parallel
+ * decompression does, and honors 'options'; anything else is written as is.
+ * libdeflate_stream_output_write() is a libdeflate_write_func taking the
+ * stream output as context.  libdeflate_flush_stream_output() writes out
+ * what is buffered, and libdeflate_free_stream_output() flushes the output
+ * and prints its statistics.
+ */
+struct libdeflate_stream_output;
+
+LIBDEFLATEAPI struct libdeflate_stream_output *
+libdeflate_alloc_stream_output(enum libdeflate_content content,
+			       const struct libdeflate_decompress_options *options);
+
+LIBDEFLATEAPI int
+libdeflate_stream_output_write(void *output, const byte *data, size_t len);
+
+LIBDEFLATEAPI void
+libdeflate_flush_stream_output(struct libdeflate_stream_output *output);
+
+LIBDEFLATEAPI void
+libdeflate_free_stream_output(struct libdeflate_stream_output *output);
+
+/* How the gzip file is split into members.  */
+enum libdeflate_framing {
+	LIBDEFLATE_FRAMING_SINGLE_MEMBER = 0,
+	LIBDEFLATE_FRAMING_MULTI_MEMBER = 1,
+	/* Members of at most 64 KiB whose size is in a 'BC' extra subfield */
+	LIBDEFLATE_FRAMING_BGZF = 2,
+};
+
+/* How libdeflate_gzip_decompress() decodes a file.  */
+enum libdeflate_strategy {
+	/* Threads start at arbitrary blocks of a FASTQ member, and resolve
+	 * their unknown context with the previous thread's data  */
+	LIBDEFLATE_STRATEGY_PARALLEL_FASTQ = 0,
+	/* Independent BGZF members are decoded in parallel */
+	LIBDEFLATE_STRATEGY_MEMBERS = 1,
+	/* Exact decoding of every member in order */
+	LIBDEFLATE_STRATEGY_SERIAL = 2,
+};
+
+struct libdeflate_gzip_profile {
+	enum libdeflate_content content;
+	enum libdeflate_framing framing;
+	enum libdeflate_strategy strategy;
+	unsigned nthreads;
+
+	/* Memory plan: size of the output buffers, BGZF members decoded by a
+	 * thread between two writes, and the expected memory use in bytes  */
+	size_t output_buffer_size;
+	unsigned members_per_batch;
+	size_t memory;
+};
+
+/*
+ * libdeflate_gzip_profile_input() decompresses the start of a gzip file to
+ * classify its content, looks at its framing, and picks the strategy
+ * libdeflate_gzip_decompress() uses for the given settings ('skip' and 'until'
+ * are 0 and SIZE_MAX when random access isn't used).  A file is
+ * reported multi-member only if its first member ends within the probed
+ * data, or if it is BGZF.
+ *
+ * If 'options' sets a 'max_memory', the plan is fitted to it by shrinking the
+ * output buffers and BGZF batches, then by using fewer threads.  The deflate
+ * windows keep their size, as they must hold whole blocks.  A warning is
+ * printed if the budget is still exceeded.
+ */
+LIBDEFLATEAPI enum libdeflate_result
+libdeflate_gzip_profile_input(struct libdeflate_decompressor *decompressor,
+			      const byte *in, size_t in_nbytes,
+			      unsigned nthreads, size_t skip, size_t until,
+			      const struct libdeflate_decompress_options *options,
+			      struct libdeflate_gzip_profile *profile);
+
+/*
+ * libdeflate_gzip_index_members() indexes the members of a multi-member gzip
+ * file, in the .gzi format written by libdeflate_bgzf_compress(): an entry for
+ * each member after the first that isn't empty.  If 'index_nbytes' isn't 0,
+ * 'index' is a previous index of the same file, which is extended from its
+ * last member instead of being rebuilt, as the file was appended to.  Members
+ * are decoded to find their end, except BGZF ones, and checked against their
+ * footer.  The index stops before a truncated or corrupt member, such as one
+ * still being appended.
+ *
+ * The index is handed to 'write_index', and '*indexed_nbytes_ret' receives
+ * the size of the indexed members, from the start of the file.  Returns
+ * LIBDEFLATE_BAD_DATA if the file doesn't start with a gzip member, or if
+ * 'index' doesn't match it, and LIBDEFLATE_SHORT_OUTPUT if 'write_index'
+ * returned nonzero.
+ */
+LIBDEFLATEAPI enum libdeflate_result
+libdeflate_gzip_index_members(struct libdeflate_decompressor *decompressor,
+			      const byte *in, size_t in_nbytes,
+			      const byte *index, size_t index_nbytes,
+			      libdeflate_write_func write_index, void *index_ctx,
+			      size_t *indexed_nbytes_ret);
+
+/*
+ * libdeflate_gzip_decompress_members() decompresses the complete gzip members
+ * at the start of 'in' in order, handing the data of each one to 'write' once
+ * it is checked against its footer, and writes their total compressed size to
+ * '*in_consumed_ret'.  A truncated member at the end is left alone, so that a
+ * file being appended to can be followed by calling it again on the data from
+ * there once more has landed.  Returns LIBDEFLATE_SHORT_OUTPUT if 'write'
+ * returned nonzero.
+ */
+LIBDEFLATEAPI enum libdeflate_result
+libdeflate_gzip_decompress_members(struct libdeflate_decompressor *decompressor,
+				   const byte *in, size_t in_nbytes,
+				   libdeflate_write_func write, void *ctx,
+				   size_t *in_consumed_ret);
+
+/*
+ * Callback reading the 'len' bytes at 'offset' of an input to 'buf'.  Returns 0
+ * on success, nonzero on failure.  It may be called from several threads at
+ * once.
+ */
+typedef int (*libdeflate_read_range_func)(void *ctx, uint64_t offset, byte *buf,
+					  size_t len);
+
+/*
+ * libdeflate_alloc_ranged_input() allocates an input of 'size' bytes which
+ * can't be mapped, such as a file in object storage, and is only read as it is
+ * decompressed.  libdeflate_ranged_input_data() is the address of the input, to
+ * pass to libdeflate_gzip_decompress() along with the ranged input in its
+ * options: the decompression then fetches the chunks of 'chunk_size' bytes (at
+ * least 1 MiB) it reaches with 'read_range'.  A thread going through the input
+ * in order also gets the chunks following its own fetched in the background, up
+ * to 'readahead' of them, as long as they fit in the cache and start before
+ * 'until'.  Nothing is read ahead for the probes of the gzip header and footer.
+ * Fetched chunks are cached up to 'cache_size' bytes (0 for no limit), dropping
+ * the least recently used ones which no thread is decoding.  The cache only
+ * exceeds it if the two chunks each thread may be decoding from don't fit in
+ * it.  Random access with 'skip' and 'until' thus only fetches the chunks of
+ * the decoded range, and those holding the gzip header and footer.
+ *
+ * A fetch failing three times in a row ends the process.  The return value is
+ * NULL if the input couldn't be reserved.
+ */
+LIBDEFLATEAPI struct libdeflate_ranged_input *
+libdeflate_alloc_ranged_input(uint64_t size, libdeflate_read_range_func read_range,
+			      void *ctx, size_t chunk_size, unsigned readahead,
+			      size_t cache_size);
+
+LIBDEFLATEAPI const byte *
+libdeflate_ranged_input_data(const struct libdeflate_ranged_input *input);
+
+/*
+ * libdeflate_get_ranged_input_stats() returns the number of bytes fetched so far
+ * (counting the chunks fetched again after being dropped) and the number of
+ * calls to 'read_range' it took.
+ */
+LIBDEFLATEAPI void
+libdeflate_get_ranged_input_stats(struct libdeflate_ranged_input *input,
+				  uint64_t *fetched_nbytes, uint64_t *nb_fetches);
+
+/*
+ * libdeflate_free_ranged_input() frees a ranged input, once the decompressions
+ * using it are done.
+ */
+LIBDEFLATEAPI void
+libdeflate_free_ranged_input(struct libdeflate_ranged_input *input);
+
+/*
+ * libdeflate_alloc_window_cache() allocates a cache of the 32K windows the
+ * parallel FASTQ decompression reconstructs, keyed by the position of the block
+ * they precede: that of the first block whose reads a decompression outputs,
+ * then about one per MiB of input.  A random access (with 'skip') to a part of
+ * an input that was already decoded then restarts from a cached block instead
+ * of searching for a block and decoding 20 more to resolve its context: from
+ * its first block if an access from the same place cached it, else from the
+ * nearest one at most 2 MiB before 'skip', decoding without output up to the
+ * block it would have started from, so that it outputs the same reads.  The
+ * least recently used windows are dropped to keep the cache under about
+ * 'max_memory' bytes.
+ *
+ * A window cache may be shared by all the threads of a decompression, and by
+ * successive decompressions, of the same input or not: inputs are told apart
+ * by their size and their last 8 bytes.
+ */
+LIBDEFLATEAPI struct libdeflate_window_cache *
+libdeflate_alloc_window_cache(size_t max_memory);
+
+/*
+ * libdeflate_get_window_cache_stats() returns the number of lookups of a
+ * cached window (one per decoding thread starting after 'skip'), and how many
+ * of them found one.
+ */
+LIBDEFLATEAPI void
+libdeflate_get_window_cache_stats(struct libdeflate_window_cache *cache,
+				  uint64_t *nb_hits, uint64_t *nb_lookups);
+
+/*
+ * libdeflate_free_window_cache() frees a window cache, once the decompressions
+ * using it are done.
+ */
+LIBDEFLATEAPI void
+libdeflate_free_window_cache(struct libdeflate_window_cache *cache);
+
+/* Parts of the decompression whose memory is accounted.  */
+enum libdeflate_memory_component {
+	/* Windows of decoded data */
+	LIBDEFLATE_MEMORY_WINDOWS = 0,
+	/* Where undetermined characters come from, and other statistics
+	 * kept by the parallel FASTQ decoder */
+	LIBDEFLATE_MEMORY_INSTRUMENTATION = 1,
+	/* Buffered output, including demultiplexed outputs */
+	LIBDEFLATE_MEMORY_OUTPUT_BUFFERS = 2,
+	/* 32K contexts passed from a thread to the next one */
+	LIBDEFLATE_MEMORY_CONTEXTS = 3,
+	/* Set of reads for duplicate detection */
+	LIBDEFLATE_MEMORY_DUPLICATES = 4,
+	/* BGZF members decoded ahead of being written */
+	LIBDEFLATE_MEMORY_MEMBERS = 5,
+	/* Cached chunks of a ranged input */
+	LIBDEFLATE_MEMORY_INPUT = 6,
+	/* Windows kept for later random accesses */
+	LIBDEFLATE_MEMORY_WINDOW_CACHE = 7,
+	/* Reads waiting for the previous thread's context or output, in the
+	 * parallel FASTQ decoder */
+	LIBDEFLATE_MEMORY_DEFERRED_READS = 8,
+
+	LIBDEFLATE_MEMORY_NB_COMPONENTS = 9,
+};
+
+struct libdeflate_memory_usage {
+	size_t current[LIBDEFLATE_MEMORY_NB_COMPONENTS];
+	size_t peak[LIBDEFLATE_MEMORY_NB_COMPONENTS];
+	size_t total_current;
+	size_t total_peak;
+};
+
+/*
+ * libdeflate_get_memory_usage() returns the bytes currently allocated by each
+ * component, for all the decompressions of the process, and the most each
+ * component (and all of them together) used at once.
+ */
+LIBDEFLATEAPI void
+libdeflate_get_memory_usage(struct libdeflate_memory_usage *usage);
+
+/*
+ * libdeflate_alloc_demultiplexer() allocates a demultiplexer that routes each
+ * resolved read to an output file chosen by the barcode found at the end of the
+ * read header (e.g. "1:N:0:ACGTACGT" or "1:N:0:ACGTACGT+TTGCAAGG").  Reads are
+ * written to '<prefix><sample>', and reads whose barcode is missing, unresolved
+ * or unknown go to '<prefix>undetermined'.
+ *
+ * If 'barcode_file' is NULL, every distinct barcode gets its own output named
+ * after the barcode itself.  Otherwise 'barcode_file' lists the expected
+ * barcodes, one per line, either as "BARCODE" or "SAMPLE BARCODE", and a read
+ * is assigned to a sample if its barcode is within 'max_mismatches'
+ * substitutions of exactly one expected barcode.
+ *
+ * A demultiplexer may be shared by all the threads of a decompression.  The
+ * return value is NULL if an output file or the barcode file couldn't be
+ * opened.
+ */
+LIBDEFLATEAPI struct libdeflate_demultiplexer *
+libdeflate_alloc_demultiplexer(const char *prefix, const char *barcode_file,
+			       unsigned max_mismatches);
+
+/*
+ * Consumer of the reads of a decompression: 'reads' holds whole reads, each
+ * followed by a newline (for content other than FASTQ, it is a part of the
+ * decompressed data, cut anywhere).  Returning nonzero stops the batches from
+ * being handed to the consumer.
+ */
+typedef int (*libdeflate_consume_func)(void *ctx, const byte *reads, size_t len);
+
+/*
+ * libdeflate_alloc_fanout() allocates a fan-out, which publishes the reads of
+ * one decompression (or several in turn) to any number of consumers, so that
+ * they all get the reads of a single decoding.  Reads are published by batches
+ * of the size of an output buffer, which all the consumers share.  At most
+ * 'max_batches' batches are in flight: once the slowest consumer is that far
+ * behind, the decompression waits for it.
+ *
+ * libdeflate_fanout_add_consumer() registers a consumer, called from
+ * 'nthreads' threads of its own (so concurrently, and in no particular order,
+ * if 'nthreads' > 1).  Consumers are added before decompressing.
+ *
+ * libdeflate_free_fanout() waits for the consumers to get the batches in
+ * flight, stops their threads and frees the fan-out.
+ */
+LIBDEFLATEAPI struct libdeflate_fanout *
+libdeflate_alloc_fanout(unsigned max_batches);
+
+LIBDEFLATEAPI void
+libdeflate_fanout_add_consumer(struct libdeflate_fanout *fanout,
+			       libdeflate_consume_func consume, void *ctx,
+			       unsigned nthreads);
+
+LIBDEFLATEAPI void
+libdeflate_free_fanout(struct libdeflate_fanout *fanout);
+
+/* A batch of newline-terminated reads, see libdeflate_read_queue_pop().  */
+struct libdeflate_read_batch {
+	const byte *reads;
+	size_t len;
+};
+
+/*
+ * libdeflate_alloc_read_queue() allocates a queue which distributes the reads
+ * of one decompression (or several in turn) among any number of consumer
+ * threads, such as the workers of an aligner: unlike with a fan-out, each batch
+ * goes to a single consumer.  The decoding threads and the consumers go through
+ * the queue without taking any lock.  At most 'capacity' batches (rounded up to
+ * a power of 2) are queued: once the consumers are that far behind, the
+ * decompression waits for them.  Batches are cut at read boundaries to about
+ * 'batch_size' bytes, or if 0, half of the L2 cache, so that a consumer works
+ * on a batch while it is in its cache.
+ *
+ * libdeflate_read_queue_pop() returns the next batch, waiting for one if
+ * needed, or NULL once the queue was closed and every batch was taken.  It may
+ * be called from any number of threads, and the batch is handed back with
+ * libdeflate_read_queue_release() once done with.
+ *
+ * libdeflate_close_read_queue() tells the consumers that no more batches come,
+ * once the decompressions are done.  libdeflate_free_read_queue() frees the
+ * queue once the consumers are done with it.
+ *
+ * libdeflate_bind_thread_to_cpu() optionally pins the calling thread (a
+ * consumer, for instance) to CPU 'cpu', returns 0 on success.
+ */
+LIBDEFLATEAPI struct libdeflate_read_queue *
+libdeflate_alloc_read_queue(unsigned capacity, size_t batch_size);
+
+LIBDEFLATEAPI struct libdeflate_read_batch *
+libdeflate_read_queue_pop(struct libdeflate_read_queue *queue);
+
+LIBDEFLATEAPI void
+libdeflate_read_queue_release(struct libdeflate_read_queue *queue,
+			      struct libdeflate_read_batch *batch);
+
+LIBDEFLATEAPI void
+libdeflate_close_read_queue(struct libdeflate_read_queue *queue);
+
+LIBDEFLATEAPI void
+libdeflate_free_read_queue(struct libdeflate_read_queue *queue);
+
+LIBDEFLATEAPI int
+libdeflate_bind_thread_to_cpu(unsigned cpu);
+
+/*
+ * libdeflate_alloc_shm_ring() allocates a ring of about 'size' bytes in a new
+ * memfd, which publishes the reads of the decompressions using it to consumer
+ * processes on the same host.  These map the memfd, which they get with
+ * libdeflate_shm_ring_fd() (through fork(), a UNIX socket or
+ * /proc/PID/fd/FD), and read the batches in place, without going through
+ * pipes.  Each consumer has its own position in the ring: they all get every
+ * batch published after they joined, and the decompression waits for the
+ * slowest one once the ring is full.  Batches are at most a quarter of the
+ * ring, and waiting is done on futexes.
+ *
+ * libdeflate_shm_ring_wait_consumers() waits for 'n' consumers to have joined,
+ * so that they get the reads from the start.  libdeflate_close_shm_ring()
+ * tells the consumers that no more batches come, once the decompressions are
+ * done.  libdeflate_free_shm_ring() unmaps the ring and closes the memfd, which
+ * the consumers keep mapped.
+ *
+ * On the consumer side, libdeflate_attach_shm_ring() maps the ring of the
+ * memfd 'fd', which it then owns, and returns NULL if it isn't one.
+ * libdeflate_shm_ring_join() takes a consumer slot, and returns its index or
+ * -1 if there is none left.  libdeflate_shm_ring_next() waits for the next
+ * batch, points '*reads' and '*len' to it, and returns 1, or returns 0 once the
+ * ring is closed and every batch was read.  The batch stays valid until
+ * libdeflate_shm_ring_advance() hands its space back.
+ * libdeflate_shm_ring_leave() releases the slot, so that the decompression
+ * doesn't wait for it any more.  The slot of a consumer process which exits
+ * without leaving is released once the decompression waits for it.
+ */
+LIBDEFLATEAPI struct libdeflate_shm_ring *
+libdeflate_alloc_shm_ring(size_t size);
+
+LIBDEFLATEAPI int
+libdeflate_shm_ring_fd(const struct libdeflate_shm_ring *ring);
+
+LIBDEFLATEAPI void
+libdeflate_shm_ring_wait_consumers(struct libdeflate_shm_ring *ring,
+				   unsigned n);
+
+LIBDEFLATEAPI void
+libdeflate_close_shm_ring(struct libdeflate_shm_ring *ring);
+
+LIBDEFLATEAPI void
+libdeflate_free_shm_ring(struct libdeflate_shm_ring *ring);
+
+LIBDEFLATEAPI struct libdeflate_shm_ring *
+libdeflate_attach_shm_ring(int fd);
+
+LIBDEFLATEAPI int
+libdeflate_shm_ring_join(struct libdeflate_shm_ring *ring);
+
+LIBDEFLATEAPI int
+libdeflate_shm_ring_next(struct libdeflate_shm_ring *ring, int consumer,
+			 const byte **reads, size_t *len);
+
+LIBDEFLATEAPI void
+libdeflate_shm_ring_advance(struct libdeflate_shm_ring *ring, int consumer);
+
+LIBDEFLATEAPI void
+libdeflate_shm_ring_leave(struct libdeflate_shm_ring *ring, int consumer);
+
+/*
+ * libdeflate_alloc_qc() allocates a set of quality control statistics, which
+ * the decompressions fill in as they resolve reads, like FastQC does: the
+ * length distribution, the base composition and mean quality score at each
+ * position (so the N rate), the GC content, overall and per read.  Each thread
+ * gathers its own statistics, added to the set when it is done, so the set may
+ * be shared by all the threads of a decompression, and by several
+ * decompressions.
+ *
+ * Quality scores (Phred+33) are taken from the reads whose quality line is
+ * decoded, and determined, when they are resolved: all of them with the serial
+ * decompression, and most of them with the parallel FASTQ decompression, which
+ * may leave some quality characters undetermined.
+ *
+ * libdeflate_write_qc_json() writes the statistics as a JSON object to
+ * 'path', returns 0 on success.  libdeflate_free_qc() frees the set, once the
+ * decompressions using it are done.
+ */
+LIBDEFLATEAPI struct libdeflate_qc *
+libdeflate_alloc_qc(void);
+
+LIBDEFLATEAPI int
+libdeflate_write_qc_json(struct libdeflate_qc *qc, const char *path);
+
+LIBDEFLATEAPI void
+libdeflate_free_qc(struct libdeflate_qc *qc);
+
+/*
+ * libdeflate_free_demultiplexer() prints the number of reads routed to each
+ * output, closes the output files and frees the demultiplexer.  It must only be
+ * called once all the decompressions using it are done.
+ */
+LIBDEFLATEAPI void
+libdeflate_free_demultiplexer(struct libdeflate_demultiplexer *demux);
+
+/*
+ * libdeflate_alloc_duplicates() allocates a set of reads used to detect exact
+ * duplicate reads during decompression.  The set is safe to share between all
+ * the threads of a decompression, and between several decompressions if
+ * duplicates across files should be detected.  If 'drop_duplicates' is nonzero,
+ * only the first occurrence of each read is written out.  The return value is
+ * NULL if out of memory.
+ *
+ * Reads are stored as 64-bit fingerprints, so memory use is about 16 bytes per
+ * distinct read.
+ */
+LIBDEFLATEAPI struct libdeflate_duplicates *
+libdeflate_alloc_duplicates(int drop_duplicates);
+
+/*
+ * libdeflate_get_duplicates_stats() returns the number of reads looked up and
+ * how many of them were duplicates, for all the decompressions that are done.
+ */
+LIBDEFLATEAPI void
+libdeflate_get_duplicates_stats(const struct libdeflate_duplicates *dups,
+				uint64_t *nb_reads, uint64_t *nb_duplicates);
+
+/*
+ * libdeflate_free_duplicates() prints the duplication rate and frees the set.
+ */
+LIBDEFLATEAPI void
+libdeflate_free_duplicates(struct libdeflate_duplicates *dups);
 
 /*
  * libdeflate_free_decompressor() frees a decompressor that was allocated with
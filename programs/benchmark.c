@@ -29,7 +29,14 @@
 
 #include "prog_util.h"
 
-static const tchar *const optstring = T("1::2::3::4::5::6::7::8::9::C:D:ghs:VYZz");
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <vector>
+
+static const tchar *const optstring = T("1::2::3::4::5::6::7::8::9::C:D:ghM:Pp:s:St:T:VYZz");
 
 enum wrapper {
 	NO_WRAPPER,
@@ -39,15 +46,16 @@ enum wrapper {
 
 struct compressor {
 	int level;
+	struct libdeflate_compress_options options;
 	enum wrapper wrapper;
 	const struct engine *engine;
-	void *private;
+	void *priv;
 };
 
 struct decompressor {
 	enum wrapper wrapper;
 	const struct engine *engine;
-	void *private;
+	void *priv;
 };
 
 struct engine {
@@ -69,23 +77,26 @@ struct engine {
 static bool
 libdeflate_engine_init_compressor(struct compressor *c)
 {
-	c->private = alloc_compressor(c->level);
-	return c->private != NULL;
+	c->priv = libdeflate_alloc_compressor_ex(c->level, &c->options);
+	return c->priv != NULL;
 }
 
 static size_t
 libdeflate_engine_compress(struct compressor *c, const void *in,
 			   size_t in_nbytes, void *out, size_t out_nbytes_avail)
 {
+	struct libdeflate_compressor *compressor =
+		(struct libdeflate_compressor *)c->priv;
+
 	switch (c->wrapper) {
 	case ZLIB_WRAPPER:
-		return libdeflate_zlib_compress(c->private, in, in_nbytes,
+		return libdeflate_zlib_compress(compressor, in, in_nbytes,
 						out, out_nbytes_avail);
 	case GZIP_WRAPPER:
-		return libdeflate_gzip_compress(c->private, in, in_nbytes,
+		return libdeflate_gzip_compress(compressor, in, in_nbytes,
 						out, out_nbytes_avail);
 	default:
-		return libdeflate_deflate_compress(c->private, in, in_nbytes,
+		return libdeflate_deflate_compress(compressor, in, in_nbytes,
 						   out, out_nbytes_avail);
 	}
 }
@@ -93,49 +104,72 @@ libdeflate_engine_compress(struct compressor *c, const void *in,
 static void
 libdeflate_engine_destroy_compressor(struct compressor *c)
 {
-	libdeflate_free_compressor(c->private);
+	libdeflate_free_compressor((struct libdeflate_compressor *)c->priv);
 }
 
 static bool
 libdeflate_engine_init_decompressor(struct decompressor *d)
 {
-	d->private = alloc_decompressor();
-	return d->private != NULL;
+	d->priv = alloc_decompressor();
+	return d->priv != NULL;
+}
+
+struct output_buffer {
+	u8 *next;
+	u8 *end;
+};
+
+static int
+write_to_buffer(void *ctx, const byte *data, size_t len)
+{
+	struct output_buffer *buf = (struct output_buffer *)ctx;
+
+	if (len > (size_t)(buf->end - buf->next))
+		return 1;
+	memcpy(buf->next, data, len);
+	buf->next += len;
+	return 0;
 }
 
+/*
+ * The exact decompressor of the library streams raw DEFLATE, so the wrapper
+ * header is skipped: neither compressor writes the optional zlib or gzip header
+ * fields.  The checksums aren't verified, since the output is compared to the
+ * original anyway.
+ */
 static bool
 libdeflate_engine_decompress(struct decompressor *d, const void *in,
 			     size_t in_nbytes, void *out, size_t out_nbytes)
 {
-	switch (d->wrapper) {
-	case ZLIB_WRAPPER:
-		return !libdeflate_zlib_decompress(d->private, in, in_nbytes,
-						   out, out_nbytes, NULL);
-	case GZIP_WRAPPER:
-		return !libdeflate_gzip_decompress(d->private, in, in_nbytes,
-						   out, out_nbytes, NULL);
-	default:
-		return !libdeflate_deflate_decompress(d->private, in, in_nbytes,
-						      out, out_nbytes, NULL);
-	}
+	size_t header_size = d->wrapper == ZLIB_WRAPPER ? 2 :
+			     d->wrapper == GZIP_WRAPPER ? 10 : 0;
+	struct output_buffer buf = { (u8 *)out, (u8 *)out + out_nbytes };
+
+	if (in_nbytes < header_size)
+		return false;
+	return libdeflate_deflate_decompress_stream(
+			(struct libdeflate_decompressor *)d->priv,
+			(const byte *)in + header_size, in_nbytes - header_size,
+			NULL, write_to_buffer, &buf) == LIBDEFLATE_SUCCESS &&
+	       buf.next == buf.end;
 }
 
 static void
 libdeflate_engine_destroy_decompressor(struct decompressor *d)
 {
-	libdeflate_free_decompressor(d->private);
+	libdeflate_free_decompressor((struct libdeflate_decompressor *)d->priv);
 }
 
 static const struct engine libdeflate_engine = {
-	.name			= T("libdeflate"),
+	T("libdeflate"),
 
-	.init_compressor	= libdeflate_engine_init_compressor,
-	.compress		= libdeflate_engine_compress,
-	.destroy_compressor	= libdeflate_engine_destroy_compressor,
+	libdeflate_engine_init_compressor,
+	libdeflate_engine_compress,
+	libdeflate_engine_destroy_compressor,
 
-	.init_decompressor	= libdeflate_engine_init_decompressor,
-	.decompress		= libdeflate_engine_decompress,
-	.destroy_decompressor	= libdeflate_engine_destroy_decompressor,
+	libdeflate_engine_init_decompressor,
+	libdeflate_engine_decompress,
+	libdeflate_engine_destroy_decompressor,
 };
 
 /******************************************************************************/
@@ -164,7 +198,7 @@ libz_engine_init_compressor(struct compressor *c)
 		return false;
 	}
 
-	z = xmalloc(sizeof(*z));
+	z = (z_stream *)malloc(sizeof(*z));
 	if (z == NULL)
 		return false;
 
@@ -182,7 +216,7 @@ libz_engine_init_compressor(struct compressor *c)
 		return false;
 	}
 
-	c->private = z;
+	c->priv = z;
 	return true;
 }
 
@@ -190,13 +224,13 @@ static size_t
 libz_engine_compress(struct compressor *c, const void *in, size_t in_nbytes,
 		     void *out, size_t out_nbytes_avail)
 {
-	z_stream *z = c->private;
+	z_stream *z = (z_stream *)c->priv;
 
 	deflateReset(z);
 
-	z->next_in = (void *)in;
+	z->next_in = (Bytef *)in;
 	z->avail_in = in_nbytes;
-	z->next_out = out;
+	z->next_out = (Bytef *)out;
 	z->avail_out = out_nbytes_avail;
 
 	if (deflate(z, Z_FINISH) != Z_STREAM_END)
@@ -208,7 +242,7 @@ libz_engine_compress(struct compressor *c, const void *in, size_t in_nbytes,
 static void
 libz_engine_destroy_compressor(struct compressor *c)
 {
-	z_stream *z = c->private;
+	z_stream *z = (z_stream *)c->priv;
 
 	deflateEnd(z);
 	free(z);
@@ -219,7 +253,7 @@ libz_engine_init_decompressor(struct decompressor *d)
 {
 	z_stream *z;
 
-	z = xmalloc(sizeof(*z));
+	z = (z_stream *)malloc(sizeof(*z));
 	if (z == NULL)
 		return false;
 
@@ -234,7 +268,7 @@ libz_engine_init_decompressor(struct decompressor *d)
 		return false;
 	}
 
-	d->private = z;
+	d->priv = z;
 	return true;
 }
 
@@ -242,13 +276,13 @@ static bool
 libz_engine_decompress(struct decompressor *d, const void *in, size_t in_nbytes,
 		       void *out, size_t out_nbytes)
 {
-	z_stream *z = d->private;
+	z_stream *z = (z_stream *)d->priv;
 
 	inflateReset(z);
 
-	z->next_in = (void *)in;
+	z->next_in = (Bytef *)in;
 	z->avail_in = in_nbytes;
-	z->next_out = out;
+	z->next_out = (Bytef *)out;
 	z->avail_out = out_nbytes;
 
 	return inflate(z, Z_FINISH) == Z_STREAM_END && z->avail_out == 0;
@@ -257,22 +291,22 @@ libz_engine_decompress(struct decompressor *d, const void *in, size_t in_nbytes,
 static void
 libz_engine_destroy_decompressor(struct decompressor *d)
 {
-	z_stream *z = d->private;
+	z_stream *z = (z_stream *)d->priv;
 
 	inflateEnd(z);
 	free(z);
 }
 
 static const struct engine libz_engine = {
-	.name			= T("libz"),
+	T("libz"),
 
-	.init_compressor	= libz_engine_init_compressor,
-	.compress		= libz_engine_compress,
-	.destroy_compressor	= libz_engine_destroy_compressor,
+	libz_engine_init_compressor,
+	libz_engine_compress,
+	libz_engine_destroy_compressor,
 
-	.init_decompressor	= libz_engine_init_decompressor,
-	.decompress		= libz_engine_decompress,
-	.destroy_decompressor	= libz_engine_destroy_decompressor,
+	libz_engine_init_decompressor,
+	libz_engine_decompress,
+	libz_engine_destroy_decompressor,
 };
 
 /******************************************************************************/
@@ -298,10 +332,12 @@ name_to_engine(const tchar *name)
 /******************************************************************************/
 
 static bool
-compressor_init(struct compressor *c, int level, enum wrapper wrapper,
-		const struct engine *engine)
+compressor_init(struct compressor *c, int level,
+		const struct libdeflate_compress_options *options,
+		enum wrapper wrapper, const struct engine *engine)
 {
 	c->level = level;
+	c->options = *options;
 	c->wrapper = wrapper;
 	c->engine = engine;
 	return engine->init_compressor(c);
@@ -351,18 +387,19 @@ show_available_engines(FILE *fp)
 
 	fprintf(fp, "Available ENGINEs are: ");
 	for (i = 0; i < ARRAY_LEN(all_engines); i++) {
-		fprintf(fp, "%"TS, all_engines[i]->name);
+		fprintf(fp, "%" TS, all_engines[i]->name);
 		if (i < ARRAY_LEN(all_engines) - 1)
 			fprintf(fp, ", ");
 	}
-	fprintf(fp, ".  Default is %"TS"\n", DEFAULT_ENGINE.name);
+	fprintf(fp, ".  Default is %" TS "\n", DEFAULT_ENGINE.name);
 }
 
 static void
 show_usage(FILE *fp)
 {
 	fprintf(fp,
-"Usage: %"TS" [-LVL] [-C ENGINE] [-D ENGINE] [-ghVz] [-s SIZE] [FILE]...\n"
+"Usage: %" TS " [-LVL] [-C ENGINE] [-D ENGINE] [-ghPSVz] [-M BYTES] [-p N]\n"
+"       [-s SIZE] [-t N] [-T MBPS] [FILE]...\n"
 "Benchmark DEFLATE compression and decompression on the specified FILEs.\n"
 "\n"
 "Options:\n"
@@ -373,10 +410,19 @@ show_usage(FILE *fp)
 "  -D ENGINE decompression engine\n"
 "  -g        use gzip wrapper\n"
 "  -h        print this help\n"
+"  -M BYTES  use only the compression levels fitting in BYTES of memory\n"
+"  -P        also show hardware performance counters per byte\n"
+"  -p N      benchmark the parallel FASTQ decoder with N threads on gzip\n"
+"            FILEs, checking that it outputs all their reads\n"
 "  -s SIZE   chunk size\n"
+"  -S        share a single copy of the input between the instances\n"
+"  -t N      run N independent instances concurrently, and report their\n"
+"            aggregate throughput and scaling efficiency\n"
+"  -T MBPS   adapt the compression level to compress at MBPS MB/s, using\n"
+"            at most level LVL\n"
 "  -V        show version and legal information\n"
 "  -z        use zlib wrapper\n"
-"\n", program_invocation_name);
+"\n", _program_invocation_name);
 
 	show_available_engines(fp);
 }
@@ -401,7 +447,8 @@ static int
 do_benchmark(struct file_stream *in, void *original_buf, void *compressed_buf,
 	     void *decompressed_buf, u32 chunk_size,
 	     struct compressor *compressor,
-	     struct decompressor *decompressor)
+	     struct decompressor *decompressor,
+	     struct perf_counters *counters)
 {
 	u64 total_uncompressed_size = 0;
 	u64 total_compressed_size = 0;
@@ -419,11 +466,15 @@ do_benchmark(struct file_stream *in, void *original_buf, void *compressed_buf,
 
 		/* Compress the chunk of data. */
 		start_time = timer_ticks();
+		if (counters != NULL)
+			perf_counters_start(&counters[0]);
 		compressed_size = do_compress(compressor,
 					      original_buf,
 					      original_size,
 					      compressed_buf,
 					      original_size - 1);
+		if (counters != NULL)
+			perf_counters_stop(&counters[0]);
 		total_compress_time += timer_ticks() - start_time;
 
 		if (compressed_size) {
@@ -432,13 +483,17 @@ do_benchmark(struct file_stream *in, void *original_buf, void *compressed_buf,
 			/* Decompress the data we just compressed and compare
 			 * the result with the original. */
 			start_time = timer_ticks();
+			if (counters != NULL)
+				perf_counters_start(&counters[1]);
 			ok = do_decompress(decompressor,
 					   compressed_buf, compressed_size,
 					   decompressed_buf, original_size);
+			if (counters != NULL)
+				perf_counters_stop(&counters[1]);
 			total_decompress_time += timer_ticks() - start_time;
 
 			if (!ok) {
-				msg("%"TS": failed to decompress data",
+				msg("%" TS ": failed to decompress data",
 				    in->name);
 				return -1;
 			}
@@ -446,7 +501,7 @@ do_benchmark(struct file_stream *in, void *original_buf, void *compressed_buf,
 			if (memcmp(original_buf, decompressed_buf,
 				   original_size) != 0)
 			{
-				msg("%"TS": data did not decompress to "
+				msg("%" TS ": data did not decompress to "
 				    "original", in->name);
 				return -1;
 			}
@@ -471,27 +526,465 @@ do_benchmark(struct file_stream *in, void *original_buf, void *compressed_buf,
 	if (total_decompress_time == 0)
 		total_decompress_time = 1;
 
-	printf("\tCompressed %"PRIu64 " => %"PRIu64" bytes (%u.%03u%%)\n",
+	printf("\tCompressed %" PRIu64 " => %" PRIu64 " bytes (%u.%03u%%)\n",
 	       total_uncompressed_size, total_compressed_size,
 	       (unsigned int)(total_compressed_size * 100 /
 				total_uncompressed_size),
 	       (unsigned int)(total_compressed_size * 100000 /
 				total_uncompressed_size % 1000));
-	printf("\tCompression time: %"PRIu64" ms (%"PRIu64" MB/s)\n",
+	printf("\tCompression time: %" PRIu64 " ms (%" PRIu64 " MB/s)\n",
 	       timer_ticks_to_ms(total_compress_time),
 	       timer_MB_per_s(total_uncompressed_size, total_compress_time));
-	printf("\tDecompression time: %"PRIu64" ms (%"PRIu64" MB/s)\n",
+	printf("\tDecompression time: %" PRIu64 " ms (%" PRIu64 " MB/s)\n",
 	       timer_ticks_to_ms(total_decompress_time),
 	       timer_MB_per_s(total_uncompressed_size, total_decompress_time));
+	if (counters != NULL) {
+		perf_counters_show(&counters[0], "Compression",
+				   total_uncompressed_size);
+		perf_counters_show(&counters[1], "Decompression",
+				   total_uncompressed_size);
+	}
 
 	return 0;
 }
 
+/******************************************************************************/
+
+/*
+ * The concurrent mode runs several independent instances at the same time on
+ * the whole file, each with its own compressor and decompressor, on its own
+ * copy of the file or on a single shared copy.  All the instances compress
+ * every chunk, then all of them decompress their chunks, so that each phase has
+ * an aggregate throughput.  One instance alone runs first, as the reference of
+ * the scaling efficiency: the aggregate throughput of N instances divided by N
+ * times the throughput of one.
+ */
+struct instance {
+	struct compressor compressor;
+	struct decompressor decompressor;
+	struct libdeflate_decompressor *fastq_decompressor;
+	const u8 *original;
+	u8 *copy;
+	u8 *compressed_buf;	/* the chunks, 'chunk_size' bytes apart */
+	u32 *compressed_sizes;
+	u8 *decompressed_buf;
+	u64 compressed_size;
+	u64 time;		/* of the last phase */
+	bool ok;
+};
+
+static int
+read_whole_file(struct file_stream *in, u8 **data_ret, size_t *size_ret)
+{
+	size_t capacity = 1 << 20;
+	size_t size = 0;
+	u8 *data = (u8 *)malloc(capacity);
+	ssize_t ret;
+
+	while (data != NULL &&
+	       (ret = xread(in, data + size, capacity - size)) > 0) {
+		size += ret;
+		if (size == capacity) {
+			u8 *p = (u8 *)realloc(data, capacity * 2);
+			if (p == NULL)
+				free(data);
+			data = p;
+			capacity *= 2;
+		}
+	}
+	if (data == NULL) {
+		msg("%" TS ": out of memory", in->name);
+		return -1;
+	}
+	if (ret < 0) {
+		free(data);
+		return -1;
+	}
+	*data_ret = data;
+	*size_ret = size;
+	return 0;
+}
+
+/* Run 'phase' on the first 'nb_instances' instances at once; return the wall
+ * clock time.  The counters, if any, include all the threads. */
+static u64
+run_concurrently(struct instance *instances, unsigned nb_instances,
+		 const std::function<void(struct instance *)> &phase,
+		 struct perf_counters *counters = NULL)
+{
+	std::vector<std::thread> threads;
+	u64 start_time = timer_ticks();
+
+	if (counters != NULL)
+		perf_counters_start(counters);
+	for (unsigned i = 0; i < nb_instances; i++)
+		threads.emplace_back(phase, &instances[i]);
+	for (auto &thread : threads)
+		thread.join();
+	if (counters != NULL)
+		perf_counters_stop(counters);
+	return timer_ticks() - start_time;
+}
+
+static void
+show_scaling(const char *phase, const struct instance *instances,
+	     unsigned nb_instances, u64 nbytes, u64 reference_time, u64 time)
+{
+	if (reference_time == 0)
+		reference_time = 1;
+	if (time == 0)
+		time = 1;
+
+	printf("	%s, 1 instance: %" PRIu64 " MB/s\n", phase,
+	       timer_MB_per_s(nbytes, reference_time));
+	printf("	%s, %u instances: %" PRIu64 " MB/s aggregate, "
+	       "scaling efficiency %u%%\n", phase, nb_instances,
+	       timer_MB_per_s(nbytes * nb_instances, time),
+	       (unsigned int)(reference_time * 100 / time));
+	for (unsigned i = 0; i < nb_instances; i++)
+		printf("		instance %u: %" PRIu64 " MB/s\n", i,
+		       timer_MB_per_s(nbytes, instances[i].time ?
+					      instances[i].time : 1));
+}
+
+static void
+compress_chunks(struct instance *inst, size_t size, u32 chunk_size)
+{
+	u64 start_time = timer_ticks();
+
+	inst->compressed_size = 0;
+	for (size_t i = 0, pos = 0; pos < size; i++, pos += chunk_size) {
+		u32 original_size = MIN(chunk_size, size - pos);
+		u32 compressed_size = do_compress(&inst->compressor,
+						  inst->original + pos,
+						  original_size,
+						  inst->compressed_buf + pos,
+						  original_size - 1);
+
+		inst->compressed_sizes[i] = compressed_size;
+		inst->compressed_size += compressed_size ? compressed_size :
+							   original_size;
+	}
+	inst->time = timer_ticks() - start_time;
+}
+
+static void
+decompress_chunks(struct instance *inst, size_t size, u32 chunk_size)
+{
+	u64 start_time = timer_ticks();
+
+	inst->ok = true;
+	for (size_t i = 0, pos = 0; pos < size && inst->ok;
+	     i++, pos += chunk_size) {
+		u32 original_size = MIN(chunk_size, size - pos);
+
+		if (inst->compressed_sizes[i] == 0) {
+			memcpy(inst->decompressed_buf + pos,
+			       inst->original + pos, original_size);
+			continue;
+		}
+		inst->ok = do_decompress(&inst->decompressor,
+					 inst->compressed_buf + pos,
+					 inst->compressed_sizes[i],
+					 inst->decompressed_buf + pos,
+					 original_size);
+	}
+	inst->time = timer_ticks() - start_time;
+}
+
+/* Decompress a gzip file with the parallel FASTQ decoder, writing the reads to
+ * standard output, which is redirected to count_lines() by the caller. */
+static void
+decode_fastq(struct instance *inst, size_t size, unsigned nthreads)
+{
+	u64 start_time = timer_ticks();
+	size_t actual_out_nbytes = 0;
+
+	inst->ok = libdeflate_gzip_decompress(inst->fastq_decompressor,
+					      inst->original, size, NULL,
+					      0, &actual_out_nbytes, nthreads,
+					      0, SIZE_MAX, NULL) == LIBDEFLATE_SUCCESS;
+	inst->time = timer_ticks() - start_time;
+}
+
+/* Decompress the gzip members of 'in' with zlib, as the reference of the
+ * parallel FASTQ decoder: return their uncompressed size and number of FASTQ
+ * records, or false if they are not valid gzip data. */
+static bool
+count_fastq_records(const u8 *in, size_t size, u64 *uncompressed_size_ret,
+		    u64 *nb_records_ret)
+{
+	std::vector<u8> buf(1 << 20);
+	z_stream z = {};
+	u64 nb_lines = 0;
+	u8 last = '\n';
+	int ret = Z_STREAM_END;
+
+	*uncompressed_size_ret = 0;
+	if (inflateInit2(&z, 31) != Z_OK)
+		return false;
+	z.next_in = (u8 *)in;
+	while (ret == Z_STREAM_END && (z.next_in - in) < (ptrdiff_t)size) {
+		inflateReset(&z);
+		do {
+			z.avail_in = MIN(size - (z.next_in - in), UINT_MAX);
+			z.next_out = buf.data();
+			z.avail_out = buf.size();
+			ret = inflate(&z, Z_NO_FLUSH);
+			size_t n = buf.size() - z.avail_out;
+			nb_lines += std::count(buf.data(), buf.data() + n, '\n');
+			*uncompressed_size_ret += n;
+			if (n != 0)
+				last = buf[n - 1];
+		} while (ret == Z_OK);
+	}
+	inflateEnd(&z);
+	/* a last record may lack its final newline */
+	*nb_records_ret = (nb_lines + (last != '\n')) / 4;
+	return ret == Z_STREAM_END;
+}
+
+/* Count the lines written to 'fd' until it is closed: the reads output by the
+ * parallel FASTQ decoder, one per line. */
+static void
+count_lines(int fd, u64 *nb_lines_ret)
+{
+	std::vector<char> buf(1 << 20);
+	ssize_t n;
+
+	*nb_lines_ret = 0;
+	while ((n = read(fd, buf.data(), buf.size())) > 0)
+		*nb_lines_ret += std::count(buf.data(), buf.data() + n, '\n');
+}
+
+static void
+free_instances(struct instance *instances, unsigned nb_instances,
+	       unsigned fastq_threads)
+{
+	for (unsigned i = 0; i < nb_instances; i++) {
+		if (fastq_threads != 0) {
+			libdeflate_free_decompressor(
+				instances[i].fastq_decompressor);
+		} else {
+			decompressor_destroy(&instances[i].decompressor);
+			compressor_destroy(&instances[i].compressor);
+		}
+	}
+	free(instances);
+}
+
+static struct instance *
+alloc_instances(unsigned nb_instances, unsigned fastq_threads, int level,
+		const struct libdeflate_compress_options *options,
+		enum wrapper wrapper, const struct engine *compress_engine,
+		const struct engine *decompress_engine)
+{
+	struct instance *instances =
+		(struct instance *)calloc(nb_instances, sizeof(*instances));
+	unsigned i;
+
+	if (instances == NULL) {
+		msg("out of memory");
+		return NULL;
+	}
+	for (i = 0; i < nb_instances; i++) {
+		struct instance *inst = &instances[i];
+
+		if (fastq_threads != 0) {
+			inst->fastq_decompressor = alloc_decompressor();
+			if (inst->fastq_decompressor == NULL)
+				break;
+			continue;
+		}
+		if (!compressor_init(&inst->compressor, level, options,
+				     wrapper, compress_engine))
+			break;
+		if (!decompressor_init(&inst->decompressor, wrapper,
+				       decompress_engine)) {
+			compressor_destroy(&inst->compressor);
+			break;
+		}
+	}
+	if (i < nb_instances) {
+		free_instances(instances, i, fastq_threads);
+		return NULL;
+	}
+	return instances;
+}
+
+static int
+do_concurrent_benchmark(struct file_stream *in, struct instance *instances,
+			unsigned nb_instances, bool shared_input,
+			u32 chunk_size, unsigned fastq_threads,
+			struct perf_counters *counters)
+{
+	u8 *original = NULL;
+	size_t size;
+	size_t nb_chunks;
+	u64 reference_time;
+	u64 time;
+	unsigned i;
+	int saved_stdout = -1;
+	int ret;
+	auto compress_phase = [&](struct instance *inst) {
+		compress_chunks(inst, size, chunk_size);
+	};
+	auto decompress_phase = [&](struct instance *inst) {
+		decompress_chunks(inst, size, chunk_size);
+	};
+	auto fastq_phase = [&](struct instance *inst) {
+		decode_fastq(inst, size, fastq_threads);
+	};
+
+	ret = read_whole_file(in, &original, &size);
+	if (ret != 0)
+		return ret;
+	if (size == 0) {
+		printf("\tFile was empty.\n");
+		free(original);
+		return 0;
+	}
+	nb_chunks = (size + chunk_size - 1) / chunk_size;
+
+	ret = -1;
+	for (i = 0; i < nb_instances; i++) {
+		struct instance *inst = &instances[i];
+
+		inst->original = original;
+		if (!shared_input) {
+			inst->copy = (u8 *)malloc(size);
+			if (inst->copy == NULL)
+				goto out;
+			memcpy(inst->copy, original, size);
+			inst->original = inst->copy;
+		}
+		if (fastq_threads != 0)
+			continue;
+		inst->compressed_buf = (u8 *)malloc(nb_chunks * chunk_size);
+		inst->compressed_sizes = (u32 *)malloc(nb_chunks * sizeof(u32));
+		inst->decompressed_buf = (u8 *)malloc(size);
+		if (inst->compressed_buf == NULL ||
+		    inst->compressed_sizes == NULL ||
+		    inst->decompressed_buf == NULL)
+			goto out;
+	}
+
+	if (fastq_threads != 0) {
+		/* The decoder only outputs the reads: the uncompressed size and
+		 * the number of reads it must output are those of zlib. */
+		u64 uncompressed_size, nb_records, nb_reads;
+		int fds[2];
+
+		if (!count_fastq_records(original, size, &uncompressed_size,
+					 &nb_records)) {
+			msg("%" TS ": file corrupt or not in gzip format",
+			    in->name);
+			goto out;
+		}
+
+		/* The reads are counted as they are written, so that a run
+		 * stopping early can't report the throughput of the whole
+		 * file. */
+		fflush(stdout);
+		saved_stdout = dup(1);
+		if (pipe(fds) != 0 || saved_stdout < 0 || dup2(fds[1], 1) < 0) {
+			msg_errno("Unable to redirect standard output");
+			goto out;
+		}
+		close(fds[1]);
+		std::thread counter(count_lines, fds[0], &nb_reads);
+
+		reference_time = run_concurrently(instances, 1, fastq_phase);
+		time = run_concurrently(instances, nb_instances, fastq_phase,
+					counters ? &counters[1] : NULL);
+
+		dup2(saved_stdout, 1);
+		counter.join();
+		close(fds[0]);
+		for (i = 0; i < nb_instances; i++) {
+			if (!instances[i].ok) {
+				msg("%" TS ": file corrupt or not in gzip format",
+				    in->name);
+				goto out;
+			}
+		}
+		if (nb_reads != nb_records * (1 + nb_instances)) {
+			msg("%" TS ": the decoder output %" PRIu64 " reads "
+			    "instead of %" PRIu64, in->name, nb_reads,
+			    nb_records * (1 + nb_instances));
+			goto out;
+		}
+		printf("\tFASTQ decoder threads per instance: %u\n",
+		       fastq_threads);
+		show_scaling("Decompression", instances, nb_instances,
+			     uncompressed_size, reference_time, time);
+		if (counters != NULL)
+			perf_counters_show(&counters[1], "Decompression",
+					   uncompressed_size * nb_instances);
+		ret = 0;
+		goto out;
+	}
+
+	reference_time = run_concurrently(instances, 1, compress_phase);
+	time = run_concurrently(instances, nb_instances, compress_phase,
+				counters ? &counters[0] : NULL);
+	printf("\tCompressed %zu => %" PRIu64 " bytes (%u.%03u%%)\n",
+	       size, instances[0].compressed_size,
+	       (unsigned int)(instances[0].compressed_size * 100 / size),
+	       (unsigned int)(instances[0].compressed_size * 100000 / size % 1000));
+	show_scaling("Compression", instances, nb_instances, size,
+		     reference_time, time);
+	if (counters != NULL)
+		perf_counters_show(&counters[0], "Compression",
+				   (u64)size * nb_instances);
+
+	reference_time = run_concurrently(instances, 1, decompress_phase);
+	time = run_concurrently(instances, nb_instances, decompress_phase,
+				counters ? &counters[1] : NULL);
+	for (i = 0; i < nb_instances; i++) {
+		if (!instances[i].ok) {
+			msg("%" TS ": failed to decompress data", in->name);
+			goto out;
+		}
+		if (memcmp(instances[i].decompressed_buf, original, size) != 0) {
+			msg("%" TS ": data did not decompress to original",
+			    in->name);
+			goto out;
+		}
+	}
+	show_scaling("Decompression", instances, nb_instances, size,
+		     reference_time, time);
+	if (counters != NULL)
+		perf_counters_show(&counters[1], "Decompression",
+				   (u64)size * nb_instances);
+	ret = 0;
+out:
+	if (saved_stdout >= 0) {
+		dup2(saved_stdout, 1);
+		close(saved_stdout);
+	}
+	for (i = 0; i < nb_instances; i++) {
+		struct instance *inst = &instances[i];
+
+		free(inst->copy);
+		free(inst->compressed_buf);
+		free(inst->compressed_sizes);
+		free(inst->decompressed_buf);
+		inst->copy = NULL;
+		inst->compressed_buf = NULL;
+		inst->compressed_sizes = NULL;
+		inst->decompressed_buf = NULL;
+	}
+	free(original);
+	return ret;
+}
+
 int
 tmain(int argc, tchar *argv[])
 {
 	u32 chunk_size = 1048576;
 	int level = 6;
+	struct libdeflate_compress_options compress_options = { 0 };
 	enum wrapper wrapper = NO_WRAPPER;
 	const struct engine *compress_engine = &DEFAULT_ENGINE;
 	const struct engine *decompress_engine = &DEFAULT_ENGINE;
@@ -500,12 +993,18 @@ tmain(int argc, tchar *argv[])
 	void *decompressed_buf = NULL;
 	struct compressor compressor;
 	struct decompressor decompressor;
+	struct instance *instances = NULL;
+	struct perf_counters all_counters[2]; /* compression, decompression */
+	struct perf_counters *counters = NULL;
+	unsigned nb_instances = 1;
+	bool shared_input = false;
+	unsigned fastq_threads = 0;
 	tchar *default_file_list[] = { NULL };
 	int opt_char;
 	int i;
 	int ret;
 
-	program_invocation_name = get_filename(argv[0]);
+	_program_invocation_name = get_filename(argv[0]);
 
 	while ((opt_char = tgetopt(argc, argv, optstring)) != -1) {
 		switch (opt_char) {
@@ -519,13 +1018,13 @@ tmain(int argc, tchar *argv[])
 		case '8':
 		case '9':
 			level = parse_compression_level(opt_char, toptarg);
-			if (level == 0)
+			if (level < 0)
 				return 1;
 			break;
 		case 'C':
 			compress_engine = name_to_engine(toptarg);
 			if (compress_engine == NULL) {
-				msg("invalid compression engine: \"%"TS"\"", toptarg);
+				msg("invalid compression engine: \"%" TS "\"", toptarg);
 				show_available_engines(stderr);
 				return 1;
 			}
@@ -533,7 +1032,7 @@ tmain(int argc, tchar *argv[])
 		case 'D':
 			decompress_engine = name_to_engine(toptarg);
 			if (decompress_engine == NULL) {
-				msg("invalid decompression engine: \"%"TS"\"", toptarg);
+				msg("invalid decompression engine: \"%" TS "\"", toptarg);
 				show_available_engines(stderr);
 				return 1;
 			}
@@ -544,13 +1043,42 @@ tmain(int argc, tchar *argv[])
 		case 'h':
 			show_usage(stdout);
 			return 0;
+		case 'M':
+			compress_options.max_memory = tstrtoul(toptarg, NULL, 10);
+			break;
+		case 'P':
+			counters = all_counters;
+			break;
+		case 'p':
+			fastq_threads = tstrtoul(toptarg, NULL, 10);
+			if (fastq_threads == 0) {
+				msg("invalid number of threads: \"%" TS "\"",
+				    toptarg);
+				return 1;
+			}
+			break;
 		case 's':
 			chunk_size = tstrtoul(toptarg, NULL, 10);
 			if (chunk_size == 0) {
-				msg("invalid chunk size: \"%"TS"\"", toptarg);
+				msg("invalid chunk size: \"%" TS "\"", toptarg);
+				return 1;
+			}
+			break;
+		case 'S':
+			shared_input = true;
+			break;
+		case 't':
+			nb_instances = tstrtoul(toptarg, NULL, 10);
+			if (nb_instances == 0) {
+				msg("invalid number of instances: \"%" TS "\"",
+				    toptarg);
 				return 1;
 			}
 			break;
+		case 'T':
+			compress_options.target_mb_per_sec =
+				tstrtoul(toptarg, NULL, 10);
+			break;
 		case 'V':
 			show_version();
 			return 0;
@@ -572,21 +1100,37 @@ tmain(int argc, tchar *argv[])
 	argc -= toptind;
 	argv += toptind;
 
-	original_buf = xmalloc(chunk_size);
-	compressed_buf = xmalloc(chunk_size - 1);
-	decompressed_buf = xmalloc(chunk_size);
+	if (counters != NULL) {
+		perf_counters_open(&counters[0]);
+		perf_counters_open(&counters[1]);
+	}
+
+	original_buf = malloc(chunk_size);
+	compressed_buf = malloc(chunk_size - 1);
+	decompressed_buf = malloc(chunk_size);
 
 	ret = -1;
 	if (original_buf == NULL || compressed_buf == NULL ||
 	    decompressed_buf == NULL)
 		goto out0;
 
-	if (!compressor_init(&compressor, level, wrapper, compress_engine))
+	if (nb_instances > 1 || fastq_threads != 0) {
+		instances = alloc_instances(nb_instances, fastq_threads, level,
+					    &compress_options, wrapper,
+					    compress_engine, decompress_engine);
+		if (instances == NULL)
+			goto out0;
+		goto files;
+	}
+
+	if (!compressor_init(&compressor, level, &compress_options,
+			     wrapper, compress_engine))
 		goto out0;
 
 	if (!decompressor_init(&decompressor, wrapper, decompress_engine))
 		goto out1;
 
+files:
 	if (argc == 0) {
 		argv = default_file_list;
 		argc = ARRAY_LEN(default_file_list);
@@ -596,14 +1140,22 @@ tmain(int argc, tchar *argv[])
 				argv[i] = NULL;
 	}
 
-	printf("Benchmarking DEFLATE compression:\n");
-	printf("\tCompression level: %d\n", level);
-	printf("\tChunk size: %"PRIu32"\n", chunk_size);
-	printf("\tWrapper: %s\n",
-	       wrapper == NO_WRAPPER ? "None" :
-	       wrapper == ZLIB_WRAPPER ? "zlib" : "gzip");
-	printf("\tCompression engine: %"TS"\n", compress_engine->name);
-	printf("\tDecompression engine: %"TS"\n", decompress_engine->name);
+	if (fastq_threads != 0) {
+		printf("Benchmarking the parallel FASTQ decoder:\n");
+	} else {
+		printf("Benchmarking DEFLATE compression:\n");
+		printf("\tCompression level: %d\n", level);
+		printf("\tChunk size: %" PRIu32 "\n", chunk_size);
+		printf("\tWrapper: %s\n",
+		       wrapper == NO_WRAPPER ? "None" :
+		       wrapper == ZLIB_WRAPPER ? "zlib" : "gzip");
+		printf("\tCompression engine: %" TS "\n", compress_engine->name);
+		printf("\tDecompression engine: %" TS "\n",
+		       decompress_engine->name);
+	}
+	if (instances != NULL)
+		printf("\tConcurrent instances: %u (%s input)\n", nb_instances,
+		       shared_input ? "shared" : "distinct");
 
 	for (i = 0; i < argc; i++) {
 		struct file_stream in;
@@ -612,21 +1164,42 @@ tmain(int argc, tchar *argv[])
 		if (ret != 0)
 			goto out2;
 
-		printf("Processing %"TS"...\n", in.name);
+		printf("Processing %" TS "...\n", in.name);
+
+		/* The counters of each file start from zero */
+		if (counters != NULL) {
+			memset(counters[0].values, 0, sizeof(counters[0].values));
+			memset(counters[1].values, 0, sizeof(counters[1].values));
+		}
 
-		ret = do_benchmark(&in, original_buf, compressed_buf,
-				   decompressed_buf, chunk_size, &compressor,
-				   &decompressor);
+		if (instances != NULL)
+			ret = do_concurrent_benchmark(&in, instances,
+						      nb_instances,
+						      shared_input, chunk_size,
+						      fastq_threads, counters);
+		else
+			ret = do_benchmark(&in, original_buf, compressed_buf,
+					   decompressed_buf, chunk_size,
+					   &compressor, &decompressor,
+					   counters);
 		xclose(&in);
 		if (ret != 0)
 			goto out2;
 	}
 	ret = 0;
 out2:
+	if (instances != NULL) {
+		free_instances(instances, nb_instances, fastq_threads);
+		goto out0;
+	}
 	decompressor_destroy(&decompressor);
 out1:
 	compressor_destroy(&compressor);
 out0:
+	if (counters != NULL) {
+		perf_counters_close(&counters[0]);
+		perf_counters_close(&counters[1]);
+	}
 	free(decompressed_buf);
 	free(compressed_buf);
 	free(original_buf);
@@ -30,8 +30,12 @@
 
 
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <atomic>
+#include <thread>
+#include <vector>
 #ifdef _WIN32
 #  include <sys/utime.h>
 #else
@@ -46,18 +50,38 @@ struct options {
 	bool keep;
 	const tchar *suffix;
     unsigned nthreads;
-    size_t skip;
-    size_t until;
+    std::vector<size_t> skips; /* one random access per skip */
+    std::vector<size_t> untils;
+    const tchar *demux_prefix;
+    const tchar *demux_barcodes;
+    unsigned demux_mismatches;
+    bool count_duplicates;
+    bool drop_duplicates;
+    size_t max_memory;
+    const char *checkpoint_path;
+    unsigned checkpoint_interval;
+    bool resume;
+    bool index;
+    bool follow;
+    bool compress;
+    int compression_level;
+    const tchar *consumers;
+    unsigned nworkers;
+    unsigned nconsumers;
+    const char *attach_path;
+    const char *qc_path;
 };
 
-static const tchar *const optstring = T("1::2::3::4::5::6::7::8::9::cdfhknS:s:t:u:V");
+static const tchar *const optstring = T("1::2::3::4::5::6::7::8::9::A:B:b:C:cDdFfH:hIi:kM:m:nO:Q:RS:s:t:u:VW:xz");
 
 static void
 show_usage(FILE *fp)
 {
 	fprintf(fp,
-"Usage: %" TS " [-LEVEL] [-cdfhkV] [-S SUF] FILE...\n"
+"Usage: %" TS " [-LEVEL] [-cdfhkVz] [-S SUF] FILE...\n"
 "Compress or decompress the specified FILEs.\n"
+"A FILE given as an http:// URL is decompressed to standard output, fetching\n"
+"only the byte ranges needed (e.g. with -s and -u).\n"
 "\n"
 "Options:\n"
 "  -1        fastest (worst) compression\n"
@@ -72,7 +96,27 @@ show_usage(FILE *fp)
 "  -S SUF    use suffix SUF instead of .gz\n"
 "  -s BYTES  skip BYTES of compressed data, then skip 20 blocks, then decompress the rest\n"
 "  -u BYTES  stop 20 block after position BYTES in compressed data\n"
-"  -V        show version and legal information\n",
+"            -s and -u may list several comma-separated positions, decoded in turn,\n"
+"            restarting from the windows cached by the previous ones when close\n"
+"  -b PFX    demultiplex reads by header barcode into files PFX<barcode>\n"
+"  -B FILE   expected barcodes for -b, as \"BARCODE\" or \"SAMPLE BARCODE\" lines\n"
+"  -m n      allow n mismatches when matching -B barcodes (default 0)\n"
+"  -D        count duplicate reads\n"
+"  -x        count duplicate reads and only print the first occurrence\n"
+"  -M SIZE   keep memory use under SIZE bytes (K, M and G suffixes allowed)\n"
+"  -C FILE   save the decompression state to FILE periodically, standard output being a regular file\n"
+"  -i SEC    save the state every SEC seconds with -C (default 60)\n"
+"  -R        resume the decompression saved with -C, truncating standard output to where it stopped\n"
+"  -V        show version and legal information\n"
+"  -z        compress to BGZF, writing a .gzi index next to each output file\n"
+"  -I        write the .gzi index of multi-member gzip files, extending the existing one\n"
+"  -F        keep decompressing the members appended to the file, like \"tail -f\"\n"
+"  -O LIST   hand the reads of a single decoding to several consumers, among:\n"
+"            reads (write them out), count (reads and bases), gc (base composition)\n"
+"  -Q FILE   write quality control statistics of the reads to FILE, as JSON\n"
+"  -W n      distribute the reads of the decoding among n worker threads, which count them\n"
+"  -H n      publish the reads to n consumer processes through a shared-memory ring\n"
+"  -A PATH   consume the reads of the ring printed by -H, writing them to standard output\n",
 	program_invocation_name);
 }
 
@@ -125,10 +169,53 @@ load_u32_gzip(const byte *p)
 		((u32)p[2] << 16) | ((u32)p[3] << 24);
 }
 
+/*
+ * Offset of standard output to truncate it back to if the parallel FASTQ
+ * decompression returns LIBDEFLATE_INCOMPLETE_OUTPUT, to decompress the stream
+ * again with a single thread, or -1 if it can't be redone: standard output
+ * isn't a regular file, or the reads went elsewhere or were counted.
+ */
+static off_t
+serial_retry_offset(unsigned nthreads, const struct libdeflate_decompress_options *dopts)
+{
+	struct stat stbuf;
+
+	if (nthreads <= 1 || dopts->demux != NULL || dopts->duplicates != NULL ||
+	    dopts->qc != NULL || dopts->fanout != NULL || dopts->read_queue != NULL ||
+	    dopts->shm_ring != NULL || dopts->checkpoint_path != NULL)
+		return -1;
+	if (fstat(STDOUT_FILENO, &stbuf) != 0 || !S_ISREG(stbuf.st_mode))
+		return -1;
+	return lseek(STDOUT_FILENO, 0, SEEK_CUR);
+}
+
+/*
+ * Report a LIBDEFLATE_INCOMPLETE_OUTPUT result, and truncate standard output to
+ * 'offset' if the stream can be decompressed again with a single thread.  A
+ * random access that output no reads can't.
+ */
+static bool
+truncate_for_serial_retry(const tchar *name, size_t skip, off_t offset)
+{
+	if (skip != 0) {
+		msg("%" TS ": random access at byte %zu output no reads", name, skip);
+		return false;
+	}
+	if (offset < 0 || ftruncate(STDOUT_FILENO, offset) != 0 ||
+	    lseek(STDOUT_FILENO, offset, SEEK_SET) != offset) {
+		msg("%" TS ": some reads could not be delimited by the parallel "
+		    "decompression, decompress it with -t 1", name);
+		return false;
+	}
+	msg("%" TS ": some reads could not be delimited by the parallel "
+	    "decompression, decompressing it again with a single thread", name);
+	return true;
+}
+
 static int
 do_decompress(struct libdeflate_decompressor *decompressor,
           struct file_stream *in, struct file_stream *out, unsigned nthreads, size_t skip,
-          size_t until)
+          size_t until, const struct libdeflate_decompress_options *dopts)
 {
 	const byte *compressed_data = static_cast<const byte*>(in->mmap_mem);
 	size_t compressed_size = in->mmap_size;
@@ -136,6 +223,7 @@ do_decompress(struct libdeflate_decompressor *decompressor,
 	size_t uncompressed_size;
     size_t actual_uncompressed_size = 0; // in case we decompress less 
 	enum libdeflate_result result;
+	off_t retry_offset;
 	int ret;
 
 	if (compressed_size < sizeof(u32)) {
@@ -155,12 +243,24 @@ do_decompress(struct libdeflate_decompressor *decompressor,
 //	}
 
 
+	retry_offset = serial_retry_offset(nthreads, dopts);
 	result = libdeflate_gzip_decompress(decompressor,
 					    compressed_data,
 					    compressed_size,
 					    uncompressed_data,
                         uncompressed_size, &actual_uncompressed_size, nthreads,
-                        skip, until);
+                        skip, until, dopts);
+
+	if (result == LIBDEFLATE_INCOMPLETE_OUTPUT) {
+		if (!truncate_for_serial_retry(in->name, skip, retry_offset)) {
+			ret = -1;
+			goto out;
+		}
+		result = libdeflate_gzip_decompress(decompressor, compressed_data,
+						    compressed_size, uncompressed_data,
+						    uncompressed_size, &actual_uncompressed_size,
+						    1, skip, until, dopts);
+	}
 
 	if (result == LIBDEFLATE_INSUFFICIENT_SPACE) {
 		msg("%" TS ": file corrupt or too large to be processed by this "
@@ -176,6 +276,7 @@ do_decompress(struct libdeflate_decompressor *decompressor,
 	}
 
 	//ret = full_write(out, uncompressed_data, actual_uncompressed_size);
+	ret = 0; /* the reads were written to standard output */
 out:
     // delete uncompressed_data;
 	return ret;
@@ -262,7 +363,8 @@ restore_metadata(struct file_stream *out, const tchar *newpath,
 
 static int
 decompress_file(struct libdeflate_decompressor *decompressor, const tchar *path,
-		const struct options *options)
+		const struct options *options,
+		const struct libdeflate_decompress_options *dopts)
 {
 	tchar *oldpath = (tchar *)path;
 	tchar *newpath = NULL;
@@ -334,7 +436,10 @@ decompress_file(struct libdeflate_decompressor *decompressor, const tchar *path,
 	if (ret != 0)
 		goto out_close_out;
 
-    ret = do_decompress(decompressor, &in, &out, options->nthreads, options->skip, options->until);
+	for (size_t r = 0; r < options->skips.size() && ret == 0; r++) {
+		ret = do_decompress(decompressor, &in, &out, options->nthreads,
+				    options->skips[r], options->untils[r], dopts);
+	}
 	if (ret != 0)
 		goto out_close_out;
 
@@ -359,6 +464,628 @@ out_free_paths:
 	return ret;
 }
 
+/* Batches of reads the slowest -O consumer may be behind the decoding */
+#define FANOUT_BATCHES		8
+
+/* Consumers of -O, fed with batches of newline-terminated reads */
+struct read_counts {
+	std::atomic<uint64_t> nb_reads;
+	std::atomic<uint64_t> nb_bases;
+};
+
+static int
+write_reads(void *ctx, const byte *reads, size_t len)
+{
+	(void)ctx;
+	return fwrite(reads, 1, len, stdout) == len ? 0 : -1;
+}
+
+static int
+count_reads(void *ctx, const byte *reads, size_t len)
+{
+	struct read_counts *counts = (struct read_counts *)ctx;
+	const byte *p = reads, *end = reads + len;
+	uint64_t nb_reads = 0;
+
+	while ((p = (const byte *)memchr(p, '\n', end - p)) != NULL) {
+		nb_reads++;
+		p++;
+	}
+	counts->nb_reads += nb_reads;
+	counts->nb_bases += len - nb_reads;
+	return 0;
+}
+
+static int
+count_bases(void *ctx, const byte *reads, size_t len)
+{
+	std::atomic<uint64_t> *composition = (std::atomic<uint64_t> *)ctx;
+	uint64_t counts[256] = {};
+
+	for (size_t i = 0; i < len; i++)
+		counts[reads[i]]++;
+	for (unsigned c = 0; c < 256; c++)
+		if (counts[c] != 0)
+			composition[c] += counts[c];
+	return 0;
+}
+
+struct consumers {
+	struct read_counts counts;
+	std::atomic<uint64_t> composition[256];
+	bool count;
+	bool gc;
+};
+
+/* Register the consumers listed in 'list', returns false if one is unknown */
+static bool
+add_consumers(struct libdeflate_fanout *fanout, const tchar *list,
+	      struct consumers *consumers)
+{
+	const tchar *name = list;
+
+	for (;;) {
+		const tchar *end = tstrchr(name, ',');
+		size_t len = end != NULL ? size_t(end - name) : tstrlen(name);
+		tchar buf[16] = {};
+
+		if (len < ARRAY_LEN(buf))
+			tmemcpy(buf, name, len);
+		if (tstrcmp(buf, T("reads")) == 0) {
+			libdeflate_fanout_add_consumer(fanout, write_reads, NULL, 1);
+		} else if (tstrcmp(buf, T("count")) == 0) {
+			consumers->count = true;
+			libdeflate_fanout_add_consumer(fanout, count_reads, &consumers->counts, 2);
+		} else if (tstrcmp(buf, T("gc")) == 0) {
+			consumers->gc = true;
+			libdeflate_fanout_add_consumer(fanout, count_bases, consumers->composition, 2);
+		} else {
+			msg("unknown consumer \"%.*" TS "\" for -O", (int)len, name);
+			return false;
+		}
+		if (end == NULL)
+			break;
+		name = end + 1;
+	}
+	return true;
+}
+
+static void
+print_consumers(struct consumers *consumers)
+{
+	if (consumers->count)
+		fprintf(stderr, "counted %lu reads, %lu bases\n",
+			(unsigned long)consumers->counts.nb_reads.load(),
+			(unsigned long)consumers->counts.nb_bases.load());
+	if (consumers->gc) {
+		const std::atomic<uint64_t> *c = consumers->composition;
+		uint64_t at = c['A'] + c['a'] + c['T'] + c['t'];
+		uint64_t gc = c['C'] + c['c'] + c['G'] + c['g'];
+		uint64_t n = c['N'] + c['n'];
+
+		fprintf(stderr, "GC content: %.2f%% of %lu ACGT bases, %lu N\n",
+			at + gc != 0 ? 100.0 * gc / (at + gc) : 0.0,
+			(unsigned long)(at + gc), (unsigned long)n);
+	}
+}
+
+/* Batches of reads the -W workers may be behind the decoding */
+#define READ_QUEUE_BATCHES	64
+
+/* Body of a -W worker, taking batches from the queue until it is closed */
+static void
+run_worker(struct libdeflate_read_queue *queue, struct read_counts *counts)
+{
+	struct libdeflate_read_batch *batch;
+
+	while ((batch = libdeflate_read_queue_pop(queue)) != NULL) {
+		count_reads(counts, batch->reads, batch->len);
+		libdeflate_read_queue_release(queue, batch);
+	}
+}
+
+/* Size of the shared-memory ring of -H */
+#define SHM_RING_SIZE		(64UL << 20)
+
+/* Consumer process of -A: write the batches of the ring at 'path' until it is closed */
+static int
+consume_shm_ring(const char *path)
+{
+	struct libdeflate_shm_ring *ring;
+	const byte *reads;
+	size_t len;
+	int consumer, ret = 0;
+	int fd = open(path, O_RDWR);
+
+	if (fd < 0) {
+		msg_errno("cannot open %s", path);
+		return 1;
+	}
+	ring = libdeflate_attach_shm_ring(fd);
+	if (ring == NULL)
+		return 1;
+	consumer = libdeflate_shm_ring_join(ring);
+	if (consumer < 0) {
+		libdeflate_free_shm_ring(ring);
+		return 1;
+	}
+	while (libdeflate_shm_ring_next(ring, consumer, &reads, &len)) {
+		if (ret == 0 && fwrite(reads, 1, len, stdout) != len) {
+			msg_errno("write error");
+			ret = 1; /* keep consuming, not to hold the others back */
+		}
+		libdeflate_shm_ring_advance(ring, consumer);
+	}
+	libdeflate_shm_ring_leave(ring, consumer);
+	libdeflate_free_shm_ring(ring);
+	if (fflush(stdout) != 0)
+		ret = 1;
+	return ret;
+}
+
+/* Memory for the windows cached between the random accesses of a -s list */
+#define WINDOW_CACHE_SIZE	(64UL << 20)
+
+/* Range requests of a URL: chunk size (down to the smaller one under a memory
+ * budget, or for random accesses), chunks read ahead, and cache size */
+#define URL_CHUNK_SIZE		(4UL << 20)
+#define URL_MIN_CHUNK_SIZE	(1UL << 20)
+#define URL_READAHEAD		4
+#define URL_CACHE_SIZE		(256UL << 20)
+
+/*
+ * Decompress a file served over HTTP to standard output, fetching only the
+ * chunks the decompression reaches.  With a memory budget, a quarter of it goes
+ * to the cache of fetched chunks, whose size is then cut so that the two chunks
+ * each decompressor may be reading from fit in it.  Random accesses, which
+ * decode a few MiB around each position, fetch the smaller chunks.
+ */
+static int
+decompress_url(struct libdeflate_decompressor *decompressor, const tchar *url,
+	       const struct options *options,
+	       const struct libdeflate_decompress_options *dopts)
+{
+	struct libdeflate_decompress_options url_dopts = *dopts;
+	struct http_file file;
+	byte footer[4];
+	size_t cache_size = URL_CACHE_SIZE;
+	size_t chunk_size = URL_CHUNK_SIZE;
+	size_t actual_uncompressed_size = 0;
+	uint64_t fetched_nbytes, nb_fetches;
+	enum libdeflate_result result;
+
+	if (http_open(url, &file) != 0)
+		return -1;
+	if (file.size < sizeof(u32)) {
+		msg("%" TS ": not in gzip format", url);
+		return -1;
+	}
+	if (http_read_range(&file, file.size - 4, footer, 4) != 0)
+		return -1;
+
+	for (size_t r = 0; r < options->skips.size(); r++)
+		if (options->skips[r] != 0 || options->untils[r] != SIZE_MAX)
+			chunk_size = URL_MIN_CHUNK_SIZE;
+	if (options->max_memory != 0) {
+		/* the threads, and the decompressor profiling the input */
+		size_t nb_readers = options->nthreads + 1;
+		cache_size = MAX(options->max_memory / 4, 2 * nb_readers * URL_MIN_CHUNK_SIZE);
+		chunk_size = MAX(MIN(cache_size / (2 * nb_readers), chunk_size), URL_MIN_CHUNK_SIZE);
+		url_dopts.max_memory = options->max_memory - MIN(cache_size, options->max_memory / 2);
+	}
+	url_dopts.ranged_input = libdeflate_alloc_ranged_input(file.size, http_read_range, &file,
+							       chunk_size, URL_READAHEAD,
+							       cache_size);
+	if (url_dopts.ranged_input == NULL) {
+		msg("%" TS " is too large to be processed by this program", url);
+		return -1;
+	}
+
+	result = LIBDEFLATE_SUCCESS;
+	for (size_t r = 0; r < options->skips.size() && result == LIBDEFLATE_SUCCESS; r++) {
+		const off_t retry_offset = serial_retry_offset(options->nthreads, &url_dopts);
+
+		result = libdeflate_gzip_decompress(decompressor,
+						    libdeflate_ranged_input_data(url_dopts.ranged_input),
+						    file.size, NULL, load_u32_gzip(footer),
+						    &actual_uncompressed_size, options->nthreads,
+						    options->skips[r], options->untils[r], &url_dopts);
+		if (result == LIBDEFLATE_INCOMPLETE_OUTPUT) {
+			if (!truncate_for_serial_retry(url, options->skips[r], retry_offset))
+				break;
+			result = libdeflate_gzip_decompress(decompressor,
+							    libdeflate_ranged_input_data(url_dopts.ranged_input),
+							    file.size, NULL, load_u32_gzip(footer),
+							    &actual_uncompressed_size, 1,
+							    options->skips[r], options->untils[r], &url_dopts);
+		}
+	}
+
+	libdeflate_get_ranged_input_stats(url_dopts.ranged_input, &fetched_nbytes, &nb_fetches);
+	fprintf(stderr, "fetched %.1f MiB of %.1f MiB (%.2f%%) in %lu requests\n",
+		fetched_nbytes / 1048576.0, file.size / 1048576.0,
+		100.0 * fetched_nbytes / file.size, (unsigned long)nb_fetches);
+	libdeflate_free_ranged_input(url_dopts.ranged_input);
+
+	if (result == LIBDEFLATE_INCOMPLETE_OUTPUT)
+		return -1; /* already reported */
+	if (result != LIBDEFLATE_SUCCESS) {
+		msg("%" TS ": file corrupt or not in gzip format", url);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+write_to_stream(void *ctx, const byte *data, size_t len)
+{
+	return full_write((struct file_stream *)ctx, data, len);
+}
+
+/*
+ * Compress a file to BGZF.  Unless writing to standard output, the index of
+ * the members is written to the output path with a ".gzi" suffix, the format
+ * 'samtools faidx' and 'bgzip -i' use.
+ */
+static int
+compress_file(const tchar *path, const struct options *options)
+{
+	tchar *newpath = NULL;
+	tchar *indexpath = NULL;
+	struct file_stream in;
+	struct file_stream out;
+	struct file_stream index;
+	bool has_index = false;
+	stat_t stbuf;
+	int ret;
+	int ret2;
+
+	if (path != NULL && !options->to_stdout) {
+		if (get_suffix(path, options->suffix) != NULL) {
+			msg("\"%" TS "\" already has the %" TS " suffix -- "
+			    "skipping", path, options->suffix);
+			return -2;
+		}
+		newpath = append_suffix(path, options->suffix);
+		if (newpath == NULL)
+			return -1;
+		indexpath = append_suffix(newpath, T(".gzi"));
+		if (indexpath == NULL) {
+			ret = -1;
+			goto out_free_paths;
+		}
+	}
+
+	ret = xopen_for_read(path, options->force || options->to_stdout, &in);
+	if (ret != 0)
+		goto out_free_paths;
+
+	ret = stat_file(&in, &stbuf, options->force || options->keep ||
+			path == NULL || newpath == NULL);
+	if (ret != 0)
+		goto out_close_in;
+
+	ret = xopen_for_write(newpath, options->force, &out);
+	if (ret != 0)
+		goto out_close_in;
+
+	if (!options->force && isatty(out.fd)) {
+		msg("Refusing to write compressed data to terminal. "
+		    "Use -f to override.\nFor help, use -h.");
+		ret = -1;
+		goto out_close_out;
+	}
+
+	if (indexpath != NULL) {
+		ret = xopen_for_write(indexpath, options->force, &index);
+		if (ret != 0)
+			goto out_close_out;
+		has_index = true;
+	}
+
+	ret = map_file_contents(&in, stbuf.st_size);
+	if (ret != 0)
+		goto out_close_index;
+
+	if (libdeflate_bgzf_compress(options->compression_level, NULL,
+				     in.mmap_mem, in.mmap_size,
+				     options->nthreads, write_to_stream, &out,
+				     has_index ? write_to_stream : NULL,
+				     &index) == 0) {
+		msg("%" TS ": compression failed", in.name);
+		ret = -1;
+		goto out_close_index;
+	}
+
+	if (newpath != NULL)
+		restore_metadata(&out, newpath, &stbuf);
+	ret = 0;
+out_close_index:
+	if (has_index) {
+		ret2 = xclose(&index);
+		if (ret == 0)
+			ret = ret2;
+		if (ret != 0)
+			tunlink(indexpath);
+	}
+out_close_out:
+	ret2 = xclose(&out);
+	if (ret == 0)
+		ret = ret2;
+	if (ret != 0 && newpath != NULL)
+		tunlink(newpath);
+out_close_in:
+	xclose(&in);
+	if (ret == 0 && path != NULL && newpath != NULL && !options->keep)
+		tunlink(path);
+out_free_paths:
+	delete[] indexpath;
+	delete[] newpath;
+	return ret;
+}
+
+static int
+write_to_vector(void *ctx, const byte *data, size_t len)
+{
+	std::vector<byte> *v = static_cast<std::vector<byte>*>(ctx);
+	v->insert(v->end(), data, data + len);
+	return 0;
+}
+
+/*
+ * Index the members of a gzip file to the path with a ".gzi" suffix, extending
+ * the existing index from its last member if there is one.  The new index is
+ * renamed over the old one, so that readers never see a partial index.
+ */
+static int
+index_file(struct libdeflate_decompressor *d, const tchar *path)
+{
+	tchar *indexpath = NULL;
+	tchar *tmppath = NULL;
+	struct file_stream in;
+	struct file_stream old_index;
+	struct file_stream out;
+	std::vector<byte> index;
+	const byte *old_data = NULL;
+	size_t old_size = 0;
+	bool has_old_index = false;
+	size_t indexed;
+	stat_t stbuf;
+	enum libdeflate_result result;
+	int ret;
+	int ret2;
+
+	if (path == NULL) {
+		msg("can't index standard input");
+		return -1;
+	}
+	indexpath = append_suffix(path, T(".gzi"));
+	if (indexpath == NULL)
+		return -1;
+	tmppath = append_suffix(indexpath, T(".tmp"));
+	if (tmppath == NULL) {
+		ret = -1;
+		goto out_free_paths;
+	}
+
+	ret = xopen_for_read(path, true, &in);
+	if (ret != 0)
+		goto out_free_paths;
+	ret = stat_file(&in, &stbuf, true);
+	if (ret != 0)
+		goto out_close_in;
+	ret = map_file_contents(&in, stbuf.st_size);
+	if (ret != 0)
+		goto out_close_in;
+
+	if (tstat(indexpath, &stbuf) == 0) {
+		ret = xopen_for_read(indexpath, true, &old_index);
+		if (ret != 0)
+			goto out_close_in;
+		has_old_index = true;
+		ret = map_file_contents(&old_index, stbuf.st_size);
+		if (ret != 0)
+			goto out_close_old_index;
+		old_data = static_cast<const byte *>(old_index.mmap_mem);
+		old_size = old_index.mmap_size;
+	}
+
+	result = libdeflate_gzip_index_members(d, static_cast<const byte *>(in.mmap_mem),
+					       in.mmap_size, old_data, old_size,
+					       write_to_vector, &index, &indexed);
+	if (result != LIBDEFLATE_SUCCESS) {
+		msg("%" TS ": not in gzip format, or %" TS " doesn't match it",
+		    in.name, has_old_index ? old_index.name : T("its index"));
+		ret = -1;
+		goto out_close_old_index;
+	}
+	fprintf(stderr, "%" TS ": %lu members indexed (%lu new)",
+		in.name, (unsigned long)((index.size() - 8) / 16),
+		(unsigned long)((index.size() - 8) / 16 - (old_size > 8 ? (old_size - 8) / 16 : 0)));
+	if (indexed != in.mmap_size)
+		fprintf(stderr, ", %lu bytes after them left for later",
+			(unsigned long)(in.mmap_size - indexed));
+	fprintf(stderr, "\n");
+
+	ret = xopen_for_write(tmppath, true, &out);
+	if (ret != 0)
+		goto out_close_old_index;
+	ret = full_write(&out, index.data(), index.size());
+	ret2 = xclose(&out);
+	if (ret == 0)
+		ret = ret2;
+	if (ret == 0 && trename(tmppath, indexpath) != 0) {
+		msg_errno("Unable to rename %" TS " to %" TS, tmppath, indexpath);
+		ret = -1;
+	}
+	if (ret != 0)
+		tunlink(tmppath);
+out_close_old_index:
+	if (has_old_index)
+		xclose(&old_index);
+out_close_in:
+	xclose(&in);
+out_free_paths:
+	delete[] tmppath;
+	delete[] indexpath;
+	return ret;
+}
+
+/* Output of a followed file, set up for the content of its first member */
+struct follow_output {
+	const struct libdeflate_decompress_options *dopts;
+	struct libdeflate_stream_output *output;
+};
+
+/* Bytes read at a time, decoded at least at a time, and seconds between two
+ * looks at a followed file */
+#define FOLLOW_READ_SIZE	(1UL << 20)
+#define FOLLOW_DECODE_SIZE	(1UL << 26)
+#define FOLLOW_INTERVAL		1
+
+static int
+follow_write(void *ctx, const byte *data, size_t len)
+{
+	struct follow_output *f = static_cast<struct follow_output *>(ctx);
+
+	if (f->output == NULL)
+		f->output = libdeflate_alloc_stream_output(
+				libdeflate_classify_content(data, len), f->dopts);
+	return libdeflate_stream_output_write(f->output, data, len);
+}
+
+/*
+ * Decompress a gzip file to standard output like "tail -f": once its complete
+ * members are written, wait for more to be appended and write them as they
+ * land, until interrupted.  A member still being written is only decoded once
+ * it is complete.  With -I, the index of the file is extended as it grows.
+ */
+static int
+follow_file(struct libdeflate_decompressor *d, const tchar *path,
+	    const struct options *options,
+	    const struct libdeflate_decompress_options *dopts)
+{
+	struct file_stream in;
+	struct follow_output output = {dopts, NULL};
+	std::vector<byte> pending; /* data after the last complete member */
+	size_t filled = 0;
+	/* pending data decoded again as it doubles, while catching up with a
+	 * large file: a member cut by a read is then decoded only a few times */
+	size_t decode_at = FOLLOW_DECODE_SIZE;
+	bool unindexed = false;
+	int ret;
+
+	if (path == NULL) {
+		msg("can't follow standard input");
+		return -1;
+	}
+	ret = xopen_for_read(path, true, &in);
+	if (ret != 0)
+		return ret;
+
+	for (;;) {
+		/* read what was appended, up to the next decoding */
+		bool grew = false, at_end = false;
+		while (!at_end && filled < decode_at) {
+			if (pending.size() - filled < FOLLOW_READ_SIZE)
+				pending.resize(filled + FOLLOW_READ_SIZE);
+			size_t room = pending.size() - filled;
+			ssize_t n = xread(&in, &pending[filled], room);
+			if (n < 0)
+				goto out;
+			filled += n;
+			grew |= n != 0;
+			at_end = (size_t)n != room;
+		}
+
+		size_t consumed = 0;
+		if (grew && libdeflate_gzip_decompress_members(d, pending.data(), filled,
+							       follow_write, &output,
+							       &consumed) != LIBDEFLATE_SUCCESS)
+			goto out;
+		pending.erase(pending.begin(), pending.begin() + consumed);
+		filled -= consumed;
+		decode_at = std::max(FOLLOW_DECODE_SIZE, 2 * filled);
+		unindexed |= consumed != 0;
+		if (!at_end)
+			continue;
+
+		if (output.output != NULL)
+			libdeflate_flush_stream_output(output.output);
+		if (options->index && unindexed) {
+			index_file(d, path);
+			unindexed = false;
+		}
+		sleep(FOLLOW_INTERVAL);
+	}
+out:
+	ret = -1;
+
+	libdeflate_free_stream_output(output.output);
+	xclose(&in);
+	return ret;
+}
+
+/* Parse comma-separated compressed positions, returns false if invalid */
+static bool
+parse_positions(const tchar *arg, std::vector<size_t> *positions)
+{
+	char *end;
+
+	positions->clear();
+	do {
+		positions->push_back(strtoul(arg, &end, 10));
+		if (end == arg)
+			return false;
+		arg = end + 1;
+	} while (*end == ',');
+	return *end == '\0';
+}
+
+/* Parse a size such as "4096", "512M" or "2G", returns 0 if invalid */
+static size_t
+parse_size(const tchar *arg)
+{
+	char *end;
+	unsigned long long size = strtoull(arg, &end, 10);
+
+	switch (*end) {
+	case 'G': case 'g':
+		size <<= 10;
+		/* fall through */
+	case 'M': case 'm':
+		size <<= 10;
+		/* fall through */
+	case 'K': case 'k':
+		size <<= 10;
+		end++;
+		break;
+	}
+	return *end == '\0' ? size_t(size) : 0;
+}
+
+static void
+print_memory_usage(void)
+{
+	static const char * const names[LIBDEFLATE_MEMORY_NB_COMPONENTS] = {
+		"windows", "instrumentation", "output buffers",
+		"contexts", "duplicates", "BGZF members", "input chunks",
+		"cached windows", "deferred reads"
+	};
+	struct libdeflate_memory_usage usage;
+	const char *sep = "";
+
+	libdeflate_get_memory_usage(&usage);
+	fprintf(stderr, "peak memory: %.1f MiB (", usage.total_peak / 1048576.0);
+	for (int i = 0; i < LIBDEFLATE_MEMORY_NB_COMPONENTS; i++) {
+		if (usage.peak[i] == 0)
+			continue;
+		fprintf(stderr, "%s%s %.1f MiB", sep, names[i], usage.peak[i] / 1048576.0);
+		sep = ", ";
+	}
+	fprintf(stderr, ")\n");
+}
+
 int
 tmain(int argc, tchar *argv[])
 {
@@ -375,23 +1102,96 @@ tmain(int argc, tchar *argv[])
 	options.keep = false;
 	options.suffix = T(".gz");
     options.nthreads = 1;
-	options.skip = 0;
-    options.until = SIZE_MAX;
+	options.skips.assign(1, 0);
+    options.untils.clear();
+    options.demux_prefix = NULL;
+    options.demux_barcodes = NULL;
+    options.demux_mismatches = 0;
+    options.count_duplicates = false;
+    options.drop_duplicates = false;
+    options.max_memory = 0;
+    options.checkpoint_path = NULL;
+    options.checkpoint_interval = 0;
+    options.resume = false;
+    options.index = false;
+    options.follow = false;
+    options.compress = false;
+    options.compression_level = 6;
+    options.consumers = NULL;
+    options.nworkers = 0;
+    options.nconsumers = 0;
+    options.attach_path = NULL;
+    options.qc_path = NULL;
 
 	while ((opt_char = tgetopt(argc, argv, optstring)) != -1) {
 		switch (opt_char) {
+		case '1':
+		case '2':
+		case '3':
+		case '4':
+		case '5':
+		case '6':
+		case '7':
+		case '8':
+		case '9':
+			options.compression_level =
+				parse_compression_level(opt_char, toptarg);
+			if (options.compression_level < 0)
+				return 1;
+			break;
+		case 'A':
+			options.attach_path = toptarg;
+			break;
+		case 'b':
+			options.demux_prefix = toptarg;
+			break;
+		case 'B':
+			options.demux_barcodes = toptarg;
+			break;
+		case 'C':
+			options.checkpoint_path = toptarg;
+			break;
 		case 'c':
 			options.to_stdout = true;
 			break;
+		case 'D':
+			options.count_duplicates = true;
+			break;
+		case 'F':
+			options.follow = true;
+			break;
 		case 'f':
 			options.force = true;
 			break;
+		case 'H':
+			options.nconsumers = atoi(toptarg);
+			if (options.nconsumers == 0) {
+				msg("invalid number of consumers");
+				return 1;
+			}
+			break;
 		case 'h':
 			show_usage(stdout);
 			return 0;
+		case 'I':
+			options.index = true;
+			break;
+		case 'i':
+			options.checkpoint_interval = atoi(toptarg);
+			break;
 		case 'k':
 			options.keep = true;
 			break;
+		case 'M':
+			options.max_memory = parse_size(toptarg);
+			if (options.max_memory == 0) {
+				msg("invalid memory size");
+				return 1;
+			}
+			break;
+		case 'm':
+			options.demux_mismatches = atoi(toptarg);
+			break;
 		case 'n':
 			/*
 			 * -n means don't save or restore the original filename
@@ -400,6 +1200,22 @@ tmain(int argc, tchar *argv[])
 			 *  option as a no-op.
 			 */
 			break;
+		case 'O':
+			options.consumers = toptarg;
+			break;
+		case 'Q':
+			options.qc_path = toptarg;
+			break;
+		case 'W':
+			options.nworkers = atoi(toptarg);
+			if (options.nworkers == 0) {
+				msg("invalid number of workers");
+				return 1;
+			}
+			break;
+		case 'R':
+			options.resume = true;
+			break;
 		case 'S':
 			options.suffix = toptarg;
 			if (options.suffix[0] == T('\0')) {
@@ -409,20 +1225,34 @@ tmain(int argc, tchar *argv[])
 			break;
         case 't':
             options.nthreads = atoi(toptarg);
-            fprintf(stderr,"using %d threads for decompression (experimental)\n",options.nthreads);
             break;
 		case 's':
-            options.skip = strtoul(toptarg, NULL, 10);
-            fprintf(stderr,"skipping %lu bytes (experimental)\n",options.skip);
+            if (!parse_positions(toptarg, &options.skips)) {
+                msg("invalid position list for -s");
+                return 1;
+            }
+            for (size_t skip : options.skips)
+                fprintf(stderr,"skipping %lu bytes (experimental)\n",skip);
 			break;
 		case 'u':
-            options.until = strtoul(toptarg, NULL, 10);
-            fprintf(stderr,"decoding until 20 blocks after compressed position %lu\n",options.until);
+            if (!parse_positions(toptarg, &options.untils)) {
+                msg("invalid position list for -u");
+                return 1;
+            }
+            for (size_t until : options.untils)
+                fprintf(stderr,"decoding until 20 blocks after compressed position %lu\n",until);
 			break;
 
 		case 'V':
 			show_version();
 			return 0;
+		case 'x':
+			options.count_duplicates = true;
+			options.drop_duplicates = true;
+			break;
+		case 'z':
+			options.compress = true;
+			break;
 		default:
 			show_usage(stderr);
 			return 1;
@@ -432,6 +1262,9 @@ tmain(int argc, tchar *argv[])
 	argv += toptind;
 	argc -= toptind;
 
+	if (options.attach_path != NULL)
+		return consume_shm_ring(options.attach_path);
+
 	if (argc == 0) {
 		argv = default_file_list;
 		argc = ARRAY_LEN(default_file_list);
@@ -441,16 +1274,221 @@ tmain(int argc, tchar *argv[])
 				argv[i] = NULL;
 	}
 
+	if (options.untils.empty())
+		options.untils.assign(options.skips.size(), SIZE_MAX);
+	if (options.untils.size() != options.skips.size()) {
+		msg("-s and -u must list as many positions");
+		return 1;
+	}
+
+	if ((options.demux_barcodes != NULL || options.demux_mismatches > 0) &&
+	    options.demux_prefix == NULL) {
+		msg("-B and -m require -b");
+		return 1;
+	}
+	if (options.demux_mismatches > 0 && options.demux_barcodes == NULL) {
+		msg("-m requires a list of expected barcodes (-B)");
+		return 1;
+	}
+	if ((options.resume || options.checkpoint_interval > 0) &&
+	    options.checkpoint_path == NULL) {
+		msg("-R and -i require -C");
+		return 1;
+	}
+	if (options.checkpoint_path != NULL) {
+		struct stat out_stbuf;
+
+		if (options.demux_prefix != NULL || options.count_duplicates) {
+			msg("-C can't be used with -b, -D or -x");
+			return 1;
+		}
+		if (argc != 1 || options.compress) {
+			msg("-C requires decompressing a single file");
+			return 1;
+		}
+		/* resuming truncates the output back to the checkpoint */
+		if (fstat(STDOUT_FILENO, &out_stbuf) != 0 ||
+		    !S_ISREG(out_stbuf.st_mode)) {
+			msg("-C requires standard output to be a regular file");
+			return 1;
+		}
+	}
+
+	if (options.consumers != NULL &&
+	    (options.compress || options.checkpoint_path != NULL ||
+	     options.demux_prefix != NULL || !options.to_stdout)) {
+		msg("-O decompresses to standard output (-c), without -z, -C or -b");
+		return 1;
+	}
+
+	if (options.nworkers != 0 &&
+	    (options.compress || options.checkpoint_path != NULL ||
+	     options.demux_prefix != NULL || options.consumers != NULL ||
+	     !options.to_stdout)) {
+		msg("-W takes the reads -c would write, without -z, -C, -b or -O");
+		return 1;
+	}
+
+	if (options.nconsumers != 0 &&
+	    (options.compress || options.checkpoint_path != NULL ||
+	     options.demux_prefix != NULL || options.consumers != NULL ||
+	     options.nworkers != 0 || !options.to_stdout)) {
+		msg("-H takes the reads -c would write, without -z, -C, -b, -O or -W");
+		return 1;
+	}
+
+	if (options.qc_path != NULL && options.compress) {
+		msg("-Q only applies to decompression");
+		return 1;
+	}
+
+	if (options.follow && (argc != 1 || options.compress ||
+				options.checkpoint_path != NULL)) {
+		msg("-F follows a single file being decompressed, without -C");
+		return 1;
+	}
+	if (options.index && options.compress) {
+		msg("-z already writes the index of the files it compresses");
+		return 1;
+	}
+	for (i = 0; i < argc; i++) {
+		if (is_http_url(argv[i]) && (!options.to_stdout || options.compress ||
+					     options.index || options.follow)) {
+			msg("URLs can only be decompressed to standard output (-c)");
+			return 1;
+		}
+	}
+
+	if (options.nthreads > 1)
+		fprintf(stderr, options.compress ?
+			"using %u threads for compression\n" :
+			"using %u threads for decompression (experimental)\n",
+			options.nthreads);
+
 	ret = 0;
+	if (options.compress) {
+		for (i = 0; i < argc; i++)
+			ret |= -compress_file(argv[i], &options);
+		if (ret != 0 && ret != 2)
+			ret = 1;
+		return ret;
+	}
+
     struct libdeflate_decompressor *d;
+    struct libdeflate_decompress_options dopts = {};
 
     d = alloc_decompressor();
     if (d == NULL)
         return 1;
 
-    for (i = 0; i < argc; i++)
-        ret |= -decompress_file(d, argv[i], &options);
+    if (options.demux_prefix != NULL) {
+        dopts.demux = libdeflate_alloc_demultiplexer(options.demux_prefix,
+                                                     options.demux_barcodes,
+                                                     options.demux_mismatches);
+        if (dopts.demux == NULL) {
+            libdeflate_free_decompressor(d);
+            return 1;
+        }
+    }
+
+    if (options.count_duplicates) {
+        dopts.duplicates = libdeflate_alloc_duplicates(options.drop_duplicates);
+        if (dopts.duplicates == NULL) {
+            libdeflate_free_demultiplexer(dopts.demux);
+            libdeflate_free_decompressor(d);
+            return 1;
+        }
+    }
+    dopts.max_memory = options.max_memory;
+    dopts.checkpoint_path = options.checkpoint_path;
+    dopts.checkpoint_interval = options.checkpoint_interval;
+    dopts.resume = options.resume;
+    if (options.skips.size() > 1)
+        dopts.window_cache = libdeflate_alloc_window_cache(WINDOW_CACHE_SIZE);
+
+    if (options.qc_path != NULL)
+        dopts.qc = libdeflate_alloc_qc();
+
+    struct consumers consumers = {};
+    if (options.consumers != NULL) {
+        dopts.fanout = libdeflate_alloc_fanout(FANOUT_BATCHES);
+        if (!add_consumers(dopts.fanout, options.consumers, &consumers)) {
+            libdeflate_free_fanout(dopts.fanout);
+            libdeflate_free_qc(dopts.qc);
+            libdeflate_free_duplicates(dopts.duplicates);
+            libdeflate_free_decompressor(d);
+            return 1;
+        }
+    }
+
+    struct read_counts worker_counts = {};
+    std::vector<std::thread> workers;
+    if (options.nworkers != 0) {
+        dopts.read_queue = libdeflate_alloc_read_queue(READ_QUEUE_BATCHES, 0);
+        for (i = 0; i < (int)options.nworkers; i++)
+            workers.emplace_back(run_worker, dopts.read_queue, &worker_counts);
+    }
+
+    if (options.nconsumers != 0) {
+        dopts.shm_ring = libdeflate_alloc_shm_ring(SHM_RING_SIZE);
+        if (dopts.shm_ring == NULL) {
+            libdeflate_free_qc(dopts.qc);
+            libdeflate_free_duplicates(dopts.duplicates);
+            libdeflate_free_decompressor(d);
+            return 1;
+        }
+        fprintf(stderr, "shared-memory ring: attach with -A /proc/%d/fd/%d, waiting for %u consumers\n",
+                (int)getpid(), libdeflate_shm_ring_fd(dopts.shm_ring), options.nconsumers);
+        libdeflate_shm_ring_wait_consumers(dopts.shm_ring, options.nconsumers);
+    }
+
+    if (options.follow)
+        ret = -follow_file(d, argv[0], &options, &dopts);
+    else if (options.index)
+        for (i = 0; i < argc; i++)
+            ret |= -index_file(d, argv[i]);
+    else
+        for (i = 0; i < argc; i++)
+            ret |= is_http_url(argv[i]) ? -decompress_url(d, argv[i], &options, &dopts)
+                                        : -decompress_file(d, argv[i], &options, &dopts);
+    /* a completed decompression has nothing to resume */
+    if (ret == 0 && options.checkpoint_path != NULL)
+        unlink(options.checkpoint_path);
+    if (dopts.fanout != NULL) {
+        libdeflate_free_fanout(dopts.fanout);
+        fflush(stdout);
+        print_consumers(&consumers);
+    }
+    if (dopts.read_queue != NULL) {
+        libdeflate_close_read_queue(dopts.read_queue);
+        for (std::thread &worker : workers)
+            worker.join();
+        libdeflate_free_read_queue(dopts.read_queue);
+        fprintf(stderr, "%u workers got %lu reads, %lu bases\n", options.nworkers,
+                (unsigned long)worker_counts.nb_reads.load(),
+                (unsigned long)worker_counts.nb_bases.load());
+    }
+    if (dopts.shm_ring != NULL) {
+        libdeflate_close_shm_ring(dopts.shm_ring);
+        libdeflate_free_shm_ring(dopts.shm_ring);
+    }
+    if (dopts.qc != NULL && libdeflate_write_qc_json(dopts.qc, options.qc_path) != 0) {
+        msg("unable to write quality control statistics to %s", options.qc_path);
+        ret |= 1;
+    }
+    if (dopts.window_cache != NULL) {
+        uint64_t nb_hits, nb_lookups;
+
+        libdeflate_get_window_cache_stats(dopts.window_cache, &nb_hits, &nb_lookups);
+        fprintf(stderr, "window cache: %lu hits out of %lu lookups\n",
+                (unsigned long)nb_hits, (unsigned long)nb_lookups);
+    }
+    print_memory_usage();
 
+    libdeflate_free_qc(dopts.qc);
+    libdeflate_free_window_cache(dopts.window_cache);
+    libdeflate_free_duplicates(dopts.duplicates);
+    libdeflate_free_demultiplexer(dopts.demux);
     libdeflate_free_decompressor(d);
 
 	/*
@@ -0,0 +1,454 @@
+/*
+ * microbench.c - benchmark the kernels of the decompressor in isolation
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * The decompressor is compiled into this program, so that its internal classes
+ * and functions can be called directly.  All the inputs are synthetic.
+ */
+#include "../lib/deflate_decompress.cpp"
+
+#include "prog_util.h"
+
+#include <functional>
+
+static const tchar *const optstring = T("hk:n:");
+
+/* Keeps the results of the kernels alive */
+static volatile u64 sink;
+
+static u32 rng_state = 0x12345678;
+
+static u32
+rng(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+/* Reads of 100 bases with their header, '+' line and quality line */
+static std::vector<byte>
+make_fastq(size_t size)
+{
+	static const char bases[] = "ACGT";
+	std::vector<byte> fastq;
+	char header[64];
+
+	for (unsigned i = 0; fastq.size() < size; i++) {
+		int len = snprintf(header, sizeof(header),
+				   "@SIM:1:FCX:1:%u:%u:%u 1:N:0:ACGTACGT\n",
+				   i / 4096, rng() % 20000, rng() % 20000);
+		fastq.insert(fastq.end(), header, header + len);
+		for (int j = 0; j < 100; j++)
+			fastq.push_back(bases[rng() % 4]);
+		fastq.push_back('\n');
+		fastq.push_back('+');
+		fastq.push_back('\n');
+		for (int j = 0; j < 100; j++)
+			fastq.push_back(rng() % 8 ? 'F' + rng() % 5 : ',');
+		fastq.push_back('\n');
+	}
+	fastq.resize(size);
+	return fastq;
+}
+
+/*
+ * Run 'kernel' 'nb_runs' times and return the time per unit of the fastest run,
+ * in nanoseconds.
+ */
+static double
+best_ns_per_unit(unsigned nb_runs, u64 units_per_run,
+		 const std::function<void()> &kernel)
+{
+	u64 best = UINT64_MAX;
+
+	for (unsigned i = 0; i < nb_runs; i++) {
+		u64 start_time = timer_ticks();
+		kernel();
+		best = MIN(best, timer_ticks() - start_time);
+	}
+	return (double)timer_ticks_to_ns(best) / units_per_run;
+}
+
+/******************************************************************************/
+
+/* A window giving access to its buffer */
+class BenchWindow : public FASTQParserDeflateWindow {
+public:
+	BenchWindow(byte *target, byte *target_end)
+		: FASTQParserDeflateWindow(target, target_end)
+	{}
+
+	/* Append 'data' after the 32K context */
+	void fill(const std::vector<byte> &data) {
+		memcpy(next, data.data(), data.size());
+		next += data.size();
+	}
+
+	byte *start() { return buffer + (1 << 15); }
+	byte *end() { return next; }
+};
+
+struct match {
+	u16 length;
+	u16 offset;
+};
+
+/* The matches of a distribution, with the number of bytes they copy */
+static std::vector<struct match>
+make_matches(unsigned min_length, unsigned max_length,
+	     unsigned min_offset, unsigned max_offset, u64 *nbytes)
+{
+	std::vector<struct match> matches(1 << 16);
+
+	*nbytes = 0;
+	for (auto &m : matches) {
+		m.length = min_length + rng() % (max_length - min_length + 1);
+		m.offset = min_offset + rng() % (max_offset - min_offset + 1);
+		*nbytes += m.length;
+	}
+	return matches;
+}
+
+static double
+bench_copy_match(unsigned nb_runs, unsigned min_length, unsigned max_length,
+		 unsigned min_offset, unsigned max_offset)
+{
+	DeflateWindow window;
+	u64 nbytes;
+	std::vector<struct match> matches =
+		make_matches(min_length, max_length, min_offset, max_offset,
+			     &nbytes);
+
+	for (unsigned i = 0; i < (1 << 15); i++)
+		window.push(byte(rng()));
+
+	return best_ns_per_unit(nb_runs, nbytes, [&]() {
+		for (const struct match &m : matches) {
+			if (window.available() < 1024)
+				window.flush();
+			window.copy_match(m.length, m.offset);
+		}
+	});
+}
+
+/*
+ * Read the codeword lengths of the dynamic Huffman block at the start of 'in',
+ * as prepare_dynamic() does, but keep them: they are overwritten by the
+ * litlen decode table there.
+ */
+static bool
+read_code_lens(struct libdeflate_decompressor *d, InputStream &in,
+	       len_t lens[], unsigned *num_litlen_syms,
+	       unsigned *num_offset_syms)
+{
+	static constexpr u8 permutation[DEFLATE_NUM_PRECODE_SYMS] = {
+		16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+	};
+
+	in.ensure_bits<1 + 2 + 5 + 5 + 4>();
+	in.pop_bits(1);
+	if (in.pop_bits(2) != DEFLATE_BLOCKTYPE_DYNAMIC_HUFFMAN)
+		return false;
+	*num_litlen_syms = in.pop_bits(5) + 257;
+	*num_offset_syms = in.pop_bits(5) + 1;
+	const unsigned num_explicit_precode_lens = in.pop_bits(4) + 4;
+
+	in.ensure_bits<DEFLATE_NUM_PRECODE_SYMS * 3>();
+	for (unsigned i = 0; i < DEFLATE_NUM_PRECODE_SYMS; i++)
+		d->u.precode_lens[permutation[i]] =
+			i < num_explicit_precode_lens ? in.pop_bits(3) : 0;
+	if (!build_precode_decode_table(d))
+		return false;
+
+	for (unsigned i = 0; i < *num_litlen_syms + *num_offset_syms; ) {
+		in.ensure_bits<DEFLATE_MAX_PRE_CODEWORD_LEN + 7>();
+		const u32 entry = d->u.l.precode_decode_table[
+				in.bits(DEFLATE_MAX_PRE_CODEWORD_LEN)];
+		in.remove_bits(entry & HUFFDEC_LENGTH_MASK);
+		const unsigned presym = entry >> HUFFDEC_RESULT_SHIFT;
+		unsigned rep_count;
+		len_t rep_val = 0;
+
+		if (presym < 16) {
+			lens[i++] = presym;
+			continue;
+		}
+		if (presym == 16) {
+			if (i == 0)
+				return false;
+			rep_val = lens[i - 1];
+			rep_count = 3 + in.pop_bits(2);
+		} else if (presym == 17) {
+			rep_count = 3 + in.pop_bits(3);
+		} else {
+			rep_count = 11 + in.pop_bits(7);
+		}
+		if (i + rep_count > *num_litlen_syms + *num_offset_syms)
+			return false;
+		memset(&lens[i], rep_val, rep_count);
+		i += rep_count;
+	}
+	return true;
+}
+
+/* The first block of the compressed FASTQ, which is a dynamic Huffman block */
+static std::vector<byte>
+make_dynamic_block(void)
+{
+	std::vector<byte> fastq = make_fastq(1 << 18);
+	std::vector<byte> block(fastq.size());
+	struct libdeflate_compressor *c = libdeflate_alloc_compressor(6);
+
+	block.resize(libdeflate_deflate_compress(c, fastq.data(), fastq.size(),
+						 block.data(), block.size()));
+	libdeflate_free_compressor(c);
+	return block;
+}
+
+static double
+bench_build_decode_table(unsigned nb_runs)
+{
+	const unsigned nb_calls = 1000;
+	std::vector<byte> block = make_dynamic_block();
+	struct libdeflate_decompressor *d = libdeflate_alloc_decompressor();
+	InputStream in(block.data(), block.size());
+	len_t lens[DEFLATE_NUM_LITLEN_SYMS + DEFLATE_NUM_OFFSET_SYMS];
+	unsigned num_litlen_syms, num_offset_syms;
+	double ns;
+
+	if (!read_code_lens(d, in, lens, &num_litlen_syms, &num_offset_syms)) {
+		msg("the compressed FASTQ doesn't start with a dynamic block");
+		libdeflate_free_decompressor(d);
+		return 0;
+	}
+	memcpy(d->u.l.lens, lens, num_litlen_syms + num_offset_syms);
+	if (!build_offset_decode_table(d, num_litlen_syms, num_offset_syms) ||
+	    !build_litlen_decode_table(d, num_litlen_syms, num_offset_syms)) {
+		msg("invalid codeword lengths");
+		libdeflate_free_decompressor(d);
+		return 0;
+	}
+
+	ns = best_ns_per_unit(nb_runs, nb_calls, [&]() {
+		for (unsigned i = 0; i < nb_calls; i++) {
+			memcpy(d->u.l.lens, lens,
+			       num_litlen_syms + num_offset_syms);
+			sink += build_offset_decode_table(d, num_litlen_syms,
+							  num_offset_syms);
+			sink += build_litlen_decode_table(d, num_litlen_syms,
+							  num_offset_syms);
+		}
+	});
+	libdeflate_free_decompressor(d);
+	return ns;
+}
+
+static double
+bench_prepare_dynamic(unsigned nb_runs)
+{
+	const unsigned nb_calls = 1000;
+	std::vector<byte> block = make_dynamic_block();
+	struct libdeflate_decompressor *d = libdeflate_alloc_decompressor();
+	double ns;
+
+	ns = best_ns_per_unit(nb_runs, nb_calls, [&]() {
+		for (unsigned i = 0; i < nb_calls; i++) {
+			InputStream in(block.data(), block.size());
+
+			in.ensure_bits<1 + 2 + 5 + 5 + 4>();
+			in.pop_bits(3);
+			sink += prepare_dynamic(d, in);
+		}
+	});
+	libdeflate_free_decompressor(d);
+	return ns;
+}
+
+/* Huffman decoding pops codewords and extra bits of varied lengths */
+static double
+bench_input_stream(unsigned nb_runs)
+{
+	static const unsigned widths[8] = { 7, 9, 3, 12, 5, 8, 15, 1 };
+	std::vector<byte> data(1 << 22);
+
+	for (byte &b : data)
+		b = byte(rng());
+
+	return best_ns_per_unit(nb_runs, data.size(), [&]() {
+		InputStream in(data.data(), data.size());
+		u32 sum = 0;
+
+		for (unsigned i = 0; in.size() > sizeof(bitbuf_t); i++) {
+			in.ensure_bits<15>();
+			sum += in.pop_bits(widths[i % 8]);
+		}
+		sink += sum;
+	});
+}
+
+static double
+bench_update_state(unsigned nb_runs)
+{
+	std::vector<byte> fastq = make_fastq(1 << 20);
+	std::vector<byte> target(1 << 21);
+	BenchWindow window(target.data(), target.data() + target.size());
+
+	window.fill(fastq);
+	window.quality_header_length = 0;
+	window.same_readlength = 100;
+
+	return best_ns_per_unit(nb_runs, fastq.size(), [&]() {
+		window.putative_sequences.clear();
+		window.dont_record = false;
+		window.reset_state('\n');
+		for (byte *p = window.start(); p < window.end(); p++)
+			window.update_state(*p, p);
+		sink += window.putative_sequences.size();
+	});
+}
+
+static double
+bench_check_ascii(unsigned nb_runs)
+{
+	std::vector<byte> fastq = make_fastq(1 << 20);
+	std::vector<byte> target(1 << 21);
+	BenchWindow window(target.data(), target.data() + target.size());
+
+	window.fill(fastq);
+	return best_ns_per_unit(nb_runs, fastq.size(), [&]() {
+		sink += window.InstrDeflateWindow::check_ascii();
+	});
+}
+
+static double
+bench_checksum(unsigned nb_runs, u32 (*checksum)(u32, const void *, size_t),
+	       size_t chunk_size)
+{
+	std::vector<byte> data(1 << 22);
+
+	for (byte &b : data)
+		b = byte(rng());
+
+	return best_ns_per_unit(nb_runs, data.size(), [&]() {
+		u32 value = 0;
+
+		for (size_t pos = 0; pos < data.size(); pos += chunk_size)
+			value = checksum(value, &data[pos], chunk_size);
+		sink += value;
+	});
+}
+
+/******************************************************************************/
+
+static const struct {
+	const char *name;
+	const char *unit;
+	std::function<double(unsigned)> run;
+} kernels[] = {
+	{ "copy_match/short", "byte", [](unsigned n) {
+		return bench_copy_match(n, 3, 24, 8, 32768); } },
+	{ "copy_match/overlapping", "byte", [](unsigned n) {
+		return bench_copy_match(n, 3, 32, 1, 7); } },
+	{ "copy_match/long", "byte", [](unsigned n) {
+		return bench_copy_match(n, 64, 258, 258, 32768); } },
+	{ "build_decode_table", "call", bench_build_decode_table },
+	{ "prepare_dynamic", "call", bench_prepare_dynamic },
+	{ "InputStream", "byte", bench_input_stream },
+	{ "update_state", "byte", bench_update_state },
+	{ "check_ascii", "byte", bench_check_ascii },
+	{ "crc32/64", "byte", [](unsigned n) {
+		return bench_checksum(n, libdeflate_crc32, 64); } },
+	{ "crc32/4096", "byte", [](unsigned n) {
+		return bench_checksum(n, libdeflate_crc32, 4096); } },
+	{ "crc32/1048576", "byte", [](unsigned n) {
+		return bench_checksum(n, libdeflate_crc32, 1 << 20); } },
+	{ "adler32/64", "byte", [](unsigned n) {
+		return bench_checksum(n, libdeflate_adler32, 64); } },
+	{ "adler32/4096", "byte", [](unsigned n) {
+		return bench_checksum(n, libdeflate_adler32, 4096); } },
+	{ "adler32/1048576", "byte", [](unsigned n) {
+		return bench_checksum(n, libdeflate_adler32, 1 << 20); } },
+};
+
+static void
+show_usage(FILE *fp)
+{
+	fprintf(fp,
+"Usage: %" TS " [-h] [-k KERNEL] [-n RUNS]\n"
+"Benchmark the kernels of the decompressor on synthetic inputs.\n"
+"\n"
+"Options:\n"
+"  -h        print this help\n"
+"  -k KERNEL only run the kernels whose name starts with KERNEL\n"
+"  -n RUNS   keep the fastest of RUNS runs (default 10)\n"
+"\n"
+"Kernels:", _program_invocation_name);
+	for (size_t i = 0; i < ARRAY_LEN(kernels); i++)
+		fprintf(fp, " %s", kernels[i].name);
+	fprintf(fp, "\n");
+}
+
+int
+tmain(int argc, tchar *argv[])
+{
+	const tchar *prefix = T("");
+	unsigned nb_runs = 10;
+	int opt_char;
+
+	_program_invocation_name = get_filename(argv[0]);
+
+	while ((opt_char = tgetopt(argc, argv, optstring)) != -1) {
+		switch (opt_char) {
+		case 'h':
+			show_usage(stdout);
+			return 0;
+		case 'k':
+			prefix = toptarg;
+			break;
+		case 'n':
+			nb_runs = tstrtoul(toptarg, NULL, 10);
+			if (nb_runs == 0) {
+				msg("invalid number of runs: \"%" TS "\"",
+				    toptarg);
+				return 1;
+			}
+			break;
+		default:
+			show_usage(stderr);
+			return 1;
+		}
+	}
+
+	for (size_t i = 0; i < ARRAY_LEN(kernels); i++) {
+		if (strncmp(kernels[i].name, prefix, tstrlen(prefix)) != 0)
+			continue;
+		printf("%-24s %10.3f ns/%s\n", kernels[i].name,
+		       kernels[i].run(nb_runs), kernels[i].unit);
+		fflush(stdout);
+	}
+	return 0;
+}
@@ -34,10 +34,18 @@
 #ifdef _WIN32
 #  include <windows.h>
 #else
+#  include <netdb.h>
+#  include <strings.h>
 #  include <unistd.h>
 #  include <sys/mman.h>
+#  include <sys/socket.h>
 #  include <sys/time.h>
 #endif
+#ifdef __linux__
+#  include <linux/perf_event.h>
+#  include <sys/ioctl.h>
+#  include <sys/syscall.h>
+#endif
 
 #ifndef O_BINARY
 #  define O_BINARY 0
@@ -144,6 +152,16 @@ u64 timer_ticks_to_ms(u64 ticks)
 	return ticks * 1000 / timer_frequency();
 }
 
+/*
+ * Convert a number of elapsed timer ticks to nanoseconds
+ */
+u64 timer_ticks_to_ns(u64 ticks)
+{
+	u64 freq = timer_frequency();
+
+	return ticks / freq * 1000000000 + ticks % freq * 1000000000 / freq;
+}
+
 /*
  * Convert a byte count and a number of elapsed timer ticks to MB/s
  */
@@ -152,6 +170,131 @@ u64 timer_MB_per_s(u64 bytes, u64 ticks)
 	return bytes * timer_frequency() / ticks / 1000000;
 }
 
+#ifdef __linux__
+static const struct {
+	u32 type;
+	u64 config;
+	const char *name;
+} perf_events[NUM_COUNTERS] = {
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles" },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions" },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "branch misses" },
+	{ PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+			      (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+			      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+	  "L1D misses" },
+	{ PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL |
+			      (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+			      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+	  "LLC misses" },
+	{ PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+			      (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+			      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+	  "dTLB misses" },
+};
+#endif
+
+/*
+ * Open the counters, disabled.  Each counter is a separate event rather than a
+ * group, so that the available ones work when others don't; if there are more
+ * than the hardware counts at once, the kernel multiplexes them and the values
+ * are scaled.
+ */
+void
+perf_counters_open(struct perf_counters *counters)
+{
+	for (int i = 0; i < NUM_COUNTERS; i++) {
+		counters->fds[i] = -1;
+		counters->values[i] = 0;
+#ifdef __linux__
+		struct perf_event_attr attr;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = perf_events[i].type;
+		attr.config = perf_events[i].config;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+				   PERF_FORMAT_TOTAL_TIME_RUNNING;
+		attr.disabled = 1;
+		attr.inherit = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		counters->fds[i] = syscall(__NR_perf_event_open, &attr, 0, -1,
+					   -1, 0);
+#endif
+	}
+}
+
+void
+perf_counters_start(struct perf_counters *counters)
+{
+#ifdef __linux__
+	for (int i = 0; i < NUM_COUNTERS; i++) {
+		if (counters->fds[i] < 0)
+			continue;
+		ioctl(counters->fds[i], PERF_EVENT_IOC_RESET, 0);
+		ioctl(counters->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+	}
+#endif
+}
+
+/* Stop the counters and add what they counted since perf_counters_start() */
+void
+perf_counters_stop(struct perf_counters *counters)
+{
+#ifdef __linux__
+	for (int i = 0; i < NUM_COUNTERS; i++) {
+		u64 data[3]; /* value, time enabled, time running */
+
+		if (counters->fds[i] < 0)
+			continue;
+		ioctl(counters->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+		if (read(counters->fds[i], data, sizeof(data)) != sizeof(data) ||
+		    data[2] == 0)
+			continue;
+		counters->values[i] += (u64)((double)data[0] * data[1] /
+					     data[2]);
+	}
+#endif
+}
+
+/* Show the counters as rates per byte of 'nbytes' */
+void
+perf_counters_show(const struct perf_counters *counters, const char *phase,
+		   u64 nbytes)
+{
+#ifdef __linux__
+	printf("\t%s counters per byte:\n", phase);
+	for (int i = 0; i < NUM_COUNTERS; i++) {
+		if (counters->fds[i] < 0) {
+			printf("\t\t%-14s unavailable\n", perf_events[i].name);
+			continue;
+		}
+		printf("\t\t%-14s %.4f", perf_events[i].name,
+		       (double)counters->values[i] / (nbytes ? nbytes : 1));
+		if (i == COUNTER_INSTRUCTIONS &&
+		    counters->fds[COUNTER_CYCLES] >= 0 &&
+		    counters->values[COUNTER_CYCLES] != 0)
+			printf(" (%.2f per cycle)",
+			       (double)counters->values[i] /
+			       counters->values[COUNTER_CYCLES]);
+		printf("\n");
+	}
+#else
+	printf("\t%s counters: unavailable on this platform\n", phase);
+#endif
+}
+
+void
+perf_counters_close(struct perf_counters *counters)
+{
+#ifdef __linux__
+	for (int i = 0; i < NUM_COUNTERS; i++)
+		if (counters->fds[i] >= 0)
+			close(counters->fds[i]);
+#endif
+}
+
 /*
  * Retrieve a pointer to the filename component of the specified path.
  *
@@ -294,16 +437,24 @@ read_full_contents(struct file_stream *strm)
 {
 	size_t filled = 0;
 	size_t capacity = 4096;
-	std::vector<char> buf;
+	char *buf;
 	int ret;
 
-    buf.resize(capacity);
+	/* Freed by xclose(), so the buffer must come from malloc() */
+	buf = (char *)malloc(capacity);
+	if (buf == NULL)
+		goto oom;
 	do {
 		if (filled == capacity) {
+			char *newbuf;
+
 			if (capacity == SIZE_MAX)
 				goto oom;
 			capacity += MIN(SIZE_MAX - capacity, capacity);
-            buf.resize(capacity);
+			newbuf = (char *)realloc(buf, capacity);
+			if (newbuf == NULL)
+				goto oom;
+			buf = newbuf;
 		}
 		ret = xread(strm, &buf[filled], capacity - filled);
 		if (ret < 0)
@@ -311,11 +462,12 @@ read_full_contents(struct file_stream *strm)
 		filled += ret;
 	} while (ret != 0);
 
-	strm->mmap_mem = &buf[0];
+	strm->mmap_mem = buf;
 	strm->mmap_size = filled;
 	return 0;
 
 err:
+	free(buf);
 	return ret;
 oom:
 	msg("Out of memory!  %" TS " is too large to be processed by "
@@ -458,8 +610,253 @@ xclose(struct file_stream *strm)
 	return ret;
 }
 
+/* Seconds without progress before an HTTP request fails */
+#define HTTP_TIMEOUT		30
+
+/* Longest accepted response header */
+#define HTTP_MAX_HEADER		16384
+
+bool
+is_http_url(const tchar *path)
+{
+	static const char prefix[] = "http://";
+
+	if (path == NULL)
+		return false;
+	for (size_t i = 0; prefix[i] != '\0'; i++)
+		if (path[i] != (tchar)prefix[i])
+			return false;
+	return true;
+}
+
+#ifdef _WIN32
+
+int
+http_open(const tchar *url, struct http_file *file)
+{
+	msg("%" TS ": HTTP input isn't supported on Windows", url);
+	return -1;
+}
+
+int
+http_read_range(void *file, uint64_t offset, byte *buf, size_t len)
+{
+	return -1;
+}
+
+#else /* _WIN32 */
+
+/* Connect to the server of 'file', returning the socket or -1 */
+static int
+http_connect(const struct http_file *file)
+{
+	struct addrinfo hints = {};
+	struct addrinfo *addrs, *addr;
+	struct timeval timeout = { HTTP_TIMEOUT, 0 };
+	int fd = -1;
+	int err;
+
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	err = getaddrinfo(file->host, file->port, &hints, &addrs);
+	if (err != 0) {
+		msg("%s: unable to resolve %s: %s", file->url, file->host,
+		    gai_strerror(err));
+		return -1;
+	}
+	for (addr = addrs; addr != NULL && fd < 0; addr = addr->ai_next) {
+		fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+		if (fd >= 0 && connect(fd, addr->ai_addr, addr->ai_addrlen) != 0) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(addrs);
+	if (fd < 0) {
+		msg_errno("%s: unable to connect to %s", file->url, file->authority);
+		return -1;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	return fd;
+}
+
+/* Value of the response header 'name' (with its colon), or NULL */
+static const char *
+http_header(const char *head, const char *name)
+{
+	size_t name_len = strlen(name);
+
+	for (const char *line = strstr(head, "\r\n"); line != NULL;
+	     line = strstr(line + 2, "\r\n")) {
+		if (strncasecmp(line + 2, name, name_len) == 0)
+			return line + 2 + name_len;
+	}
+	return NULL;
+}
+
+/*
+ * Read the 'len' bytes at 'offset' of 'file' to 'buf', and the size of the file
+ * to '*size_ret' if it isn't NULL
+ */
+static int
+http_get_range(const struct http_file *file, u64 offset, byte *buf, size_t len,
+	       u64 *size_ret)
+{
+	char request[sizeof(file->path) + sizeof(file->authority) + 256];
+	char head[HTTP_MAX_HEADER + 1];
+	size_t head_len = 0, body_start = 0, done;
+	unsigned long long first, last, size;
+	const char *range;
+	int status = 0;
+	int fd;
+
+	fd = http_connect(file);
+	if (fd < 0)
+		return -1;
+
+	snprintf(request, sizeof(request),
+		 "GET %s HTTP/1.1\r\nHost: %s\r\nRange: bytes=%llu-%llu\r\n"
+		 "Connection: close\r\n\r\n", file->path, file->authority,
+		 (unsigned long long)offset, (unsigned long long)(offset + len - 1));
+	for (size_t sent = 0, n = strlen(request); sent < n; ) {
+		ssize_t ret = send(fd, request + sent, n - sent, MSG_NOSIGNAL);
+		if (ret <= 0) {
+			msg_errno("%s: unable to send a request", file->url);
+			close(fd);
+			return -1;
+		}
+		sent += ret;
+	}
+
+	/* the header, which may be followed by the start of the body */
+	while (body_start == 0) {
+		ssize_t ret = head_len < HTTP_MAX_HEADER ?
+			recv(fd, head + head_len, HTTP_MAX_HEADER - head_len, 0) : 0;
+		if (ret <= 0) {
+			msg("%s: no valid response to a range request", file->url);
+			close(fd);
+			return -1;
+		}
+		head_len += ret;
+		for (size_t i = 3; i < head_len && body_start == 0; i++)
+			if (memcmp(head + i - 3, "\r\n\r\n", 4) == 0)
+				body_start = i + 1;
+	}
+	head[body_start - 2] = '\0'; /* after the last header line */
+
+	sscanf(head, "HTTP/%*s %d", &status);
+	range = http_header(head, "Content-Range:");
+	if (status != 206 || range == NULL ||
+	    sscanf(range, " bytes %llu-%llu/%llu", &first, &last, &size) != 3 ||
+	    first != offset || last != offset + len - 1) {
+		msg("%s: the server didn't serve bytes %llu-%llu (status %d)",
+		    file->url, (unsigned long long)offset,
+		    (unsigned long long)(offset + len - 1), status);
+		close(fd);
+		return -1;
+	}
+
+	done = MIN(head_len - body_start, len);
+	memcpy(buf, head + body_start, done);
+	while (done < len) {
+		ssize_t ret = recv(fd, buf + done, len - done, 0);
+		if (ret <= 0) {
+			msg("%s: connection lost after %zu of %zu bytes",
+			    file->url, done, len);
+			close(fd);
+			return -1;
+		}
+		done += ret;
+	}
+	close(fd);
+
+	if (size_ret != NULL)
+		*size_ret = size;
+	return 0;
+}
+
+int
+http_open(const tchar *url, struct http_file *file)
+{
+	const char *authority = url + strlen("http://");
+	const char *path = strchr(authority, '/');
+	size_t authority_len = path != NULL ? size_t(path - authority) : strlen(authority);
+	const char *colon;
+	byte first;
+
+	if (path == NULL)
+		path = "/";
+	if (authority_len == 0 || authority_len >= sizeof(file->authority) ||
+	    strlen(path) >= sizeof(file->path)) {
+		msg("%s: invalid URL", url);
+		return -1;
+	}
+	file->url = url;
+	memcpy(file->authority, authority, authority_len);
+	file->authority[authority_len] = '\0';
+	strcpy(file->path, path);
+
+	colon = strchr(file->authority, ':');
+	if (colon != NULL && (strlen(colon + 1) == 0 ||
+			      strlen(colon + 1) >= sizeof(file->port))) {
+		msg("%s: invalid port", url);
+		return -1;
+	}
+	strcpy(file->port, colon != NULL ? colon + 1 : "80");
+	memcpy(file->host, file->authority, colon != NULL ? size_t(colon - file->authority) : authority_len);
+	file->host[colon != NULL ? size_t(colon - file->authority) : authority_len] = '\0';
+
+	/* the size comes with the first byte */
+	return http_get_range(file, 0, &first, 1, &file->size);
+}
+
+int
+http_read_range(void *file, uint64_t offset, byte *buf, size_t len)
+{
+	return http_get_range(static_cast<const struct http_file *>(file),
+			      offset, buf, len, NULL);
+}
+
+#endif /* !_WIN32 */
+
+
+/* Parse the compression level given on the command line */
+int
+parse_compression_level(tchar opt_char, const tchar *arg)
+{
+	unsigned long level = opt_char - '0';
+	const tchar *p;
+
+	if (arg == NULL)
+		arg = T("");
+
+	for (p = arg; *p >= '0' && *p <= '9'; p++)
+		level = (level * 10) + (*p - '0');
+
+	if (level < 1 || level > 12 || *p != '\0') {
+		msg("Invalid compression level: \"%c%" TS "\".  "
+		    "Must be an integer in the range [1, 12].", opt_char, arg);
+		return -1;
+	}
+
+	return level;
+}
 
+/* Allocate a new DEFLATE compressor */
+struct libdeflate_compressor *
+alloc_compressor(int level)
+{
+	struct libdeflate_compressor *c;
+
+	c = libdeflate_alloc_compressor(level);
+	if (c == NULL) {
+		msg_errno("Unable to allocate compressor with "
+			  "compression level %d", level);
+	}
 
+	return c;
+}
 
 /* Allocate a new DEFLATE decompressor */
 struct libdeflate_decompressor *
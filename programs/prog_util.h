@@ -74,6 +74,7 @@ extern int wmain(int argc, wchar_t **argv);
 #  define	tstrtoul	wcstoul
 #  define	tstrxcmp	wcsicmp
 #  define	tunlink		_wunlink
+#  define	trename		_wrename
 #  define	tutimbuf	__utimbuf64
 #  define	tutime		_wutime64
 #  define	tstat		_wstat64
@@ -106,6 +107,7 @@ extern int wmain(int argc, wchar_t **argv);
 #  define	tstrtoul	strtoul
 #  define	tstrxcmp	strcmp
 #  define	tunlink		unlink
+#  define	trename		rename
 #  define	tutimbuf	utimbuf
 #  define	tutime		utime
 #  define	tstat		stat
@@ -122,8 +124,37 @@ extern void _printf(1, 2) msg_errno(const char *fmt, ...);
 
 extern u64 timer_ticks(void);
 extern u64 timer_ticks_to_ms(u64 ticks);
+extern u64 timer_ticks_to_ns(u64 ticks);
 extern u64 timer_MB_per_s(u64 bytes, u64 ticks);
 
+/*
+ * Hardware performance counters of the process and of the threads it creates
+ * afterwards, counted only between perf_counters_start() and
+ * perf_counters_stop().  They are read with perf_event_open() on Linux; the
+ * counters which can't be opened are shown as unavailable.
+ */
+enum perf_counter {
+	COUNTER_CYCLES,
+	COUNTER_INSTRUCTIONS,
+	COUNTER_BRANCH_MISSES,
+	COUNTER_L1D_MISSES,
+	COUNTER_LLC_MISSES,
+	COUNTER_DTLB_MISSES,
+	NUM_COUNTERS,
+};
+
+struct perf_counters {
+	int fds[NUM_COUNTERS];
+	u64 values[NUM_COUNTERS];
+};
+
+extern void perf_counters_open(struct perf_counters *counters);
+extern void perf_counters_start(struct perf_counters *counters);
+extern void perf_counters_stop(struct perf_counters *counters);
+extern void perf_counters_show(const struct perf_counters *counters,
+			       const char *phase, u64 nbytes);
+extern void perf_counters_close(struct perf_counters *counters);
+
 extern const tchar *get_filename(const tchar *path);
 
 struct file_stream {
@@ -146,6 +177,26 @@ extern int full_write(struct file_stream *strm, const void *buf, size_t count);
 
 extern int xclose(struct file_stream *strm);
 
+/*
+ * A file served over HTTP, read in byte ranges with "Range" requests.  Only
+ * plain "http://" URLs are supported (not on Windows).  Each range is read on a
+ * connection of its own, so http_read_range() may be called from several
+ * threads at once; it is a libdeflate_read_range_func taking the file as
+ * context.
+ */
+struct http_file {
+	const tchar *url;
+	char authority[256]; /* host[:port], for the Host header */
+	char host[256];
+	char port[8];
+	char path[2048];
+	u64 size;
+};
+
+extern bool is_http_url(const tchar *path);
+extern int http_open(const tchar *url, struct http_file *file);
+extern int http_read_range(void *file, uint64_t offset, byte *buf, size_t len);
+
 extern int parse_compression_level(tchar opt_char, const tchar *arg);
 
 extern struct libdeflate_compressor *alloc_compressor(int level);
@@ -0,0 +1,91 @@
+#!/bin/bash
+# Decompresses a gzipped FASTQ file with several thread counts and checks that
+# the reads output are exactly those of its records, as decoded by gzip itself:
+# same number, and same multiset of sequences.
+# Run from the top of the tree after 'make': ./scripts/check_fastq_reads.sh file.fq.gz [threads...]
+# With --flush first, also checks the file recompressed with a Z_SYNC_FLUSH every 128 KiB, as pigz writes it, and
+# with a Z_FULL_FLUSH: threads then start on blocks that follow a flush, decode them exactly, and must output the
+# reads in the same order as one thread.
+
+trap 'exit 130' INT
+
+flush=
+if [ "$1" = "--flush" ]
+then
+    flush=1
+    shift
+fi
+f=$1
+shift
+threads=${@:-1 2 4 8}
+if [ -z "$f" ] || [ ! -x ./gzip ]
+then
+    echo "usage (from the built tree): $0 [--flush] file.fq.gz [threads...]"
+    exit 1
+fi
+
+tmp=$(mktemp -d)
+trap 'rm -rf $tmp' EXIT
+
+recompress() {
+    python3 -c '
+import sys, zlib
+flush = zlib.Z_SYNC_FLUSH if sys.argv[1] == "sync" else zlib.Z_FULL_FLUSH
+c = zlib.compressobj(6, zlib.DEFLATED, 31)
+while True:
+    data = sys.stdin.buffer.read(128 << 10)
+    if not data:
+        break
+    sys.stdout.buffer.write(c.compress(data) + c.flush(flush))
+sys.stdout.buffer.write(c.flush())
+' $1
+}
+
+fails=0
+# check FILE [ordered]
+check() {
+    gzip -dc "$1" | awk 'NR % 4 == 2' | LC_ALL=C sort > $tmp/expected || exit 1
+    expected=$(wc -l < $tmp/expected)
+    [ -n "$2" ] && ./gzip -c -t 1 "$1" 2> /dev/null | cat > $tmp/serial
+
+    for t in $threads
+    do
+        # through a pipe, as gzip decodes the file again with one thread when it writes to a regular file
+        ./gzip -c -t $t "$1" 2> $tmp/log | cat > $tmp/reads
+        status=${PIPESTATUS[0]}
+        LC_ALL=C sort $tmp/reads > $tmp/sorted
+        got=$(wc -l < $tmp/sorted)
+        if [ $status -ne 0 ]
+        then
+            echo "$t threads: exit status $status"
+            tail -3 $tmp/log
+            fails=$((fails + 1))
+        elif ! cmp -s $tmp/expected $tmp/sorted
+        then
+            missing=$(LC_ALL=C comm -23 $tmp/expected $tmp/sorted | wc -l)
+            extra=$(LC_ALL=C comm -13 $tmp/expected $tmp/sorted | wc -l)
+            echo "$t threads: $got reads instead of $expected, $missing missing, $extra unexpected"
+            fails=$((fails + 1))
+        elif [ -n "$2" ] && ! cmp -s $tmp/serial $tmp/reads
+        then
+            echo "$t threads: $got reads, not in the order of 1 thread"
+            fails=$((fails + 1))
+        else
+            echo "$t threads: $got reads"
+        fi
+    done
+}
+
+check "$f"
+if [ -n "$flush" ]
+then
+    for mode in sync full
+    do
+        echo "with a $mode flush every 128 KiB:"
+        gzip -dc "$f" | recompress $mode > $tmp/$mode.gz
+        check $tmp/$mode.gz $([ $mode = full ] && echo ordered)
+    done
+fi
+
+[ $fails -eq 0 ] && echo "OK"
+exit $((fails != 0))
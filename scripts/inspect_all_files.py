@@ -21,4 +21,4 @@ for filename in glob.glob("/nvme/fastq/*"):
     if seq_in_headers > 5000:
         print("header ends with sequence")
     if len(set(len_seqs)) > 1 and seq_in_headers:
-        print("XXXXXX the type we don't support")
+        print("variable read lengths with sequence in headers (delimited using the quality lines)")
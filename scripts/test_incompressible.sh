@@ -0,0 +1,100 @@
+#!/bin/bash
+# Round-trips inputs whose bytes look random through the compressor at levels
+# 1, 6 and 12, and checks their compressed sizes: data without repeats is
+# stored, while data repeating itself within the window, even if its byte
+# histogram is flat, must still be compressed.
+# Run from the top of the tree after 'make': ./scripts/test_incompressible.sh
+
+trap 'exit 130' INT
+
+if [ ! -f libdeflate.a ]
+then
+    echo "usage (from the built tree): $0"
+    exit 1
+fi
+
+tmp=$(mktemp -d)
+trap 'rm -rf $tmp' EXIT
+
+cat > $tmp/incompressible.cpp << 'EOF'
+#include "libdeflate.h"
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+typedef std::vector<unsigned char> bytes;
+
+static bytes random_bytes(size_t n, std::mt19937& rng) {
+    bytes v(n);
+    for (auto& b : v)
+        b = rng();
+    return v;
+}
+
+static void append(bytes& v, const bytes& w, int times = 1) {
+    while (times--)
+        v.insert(v.end(), w.begin(), w.end());
+}
+
+int main() {
+    std::mt19937 rng(12345);
+    struct input { const char* name; bytes data; double max_ratio; };
+    std::vector<input> inputs;
+
+    bytes ramp;
+    for (int i = 0; i < 4096; i++)
+        for (int b = 0; b < 256; b++)
+            ramp.push_back(b);
+    inputs.push_back({"1 MiB of 0..255 ramps", ramp, 0.01});
+
+    bytes repeated;
+    append(repeated, random_bytes(2048, rng), 512);
+    inputs.push_back({"512 copies of 2 KiB of random bytes", repeated, 0.01});
+
+    /* an attachment, then another one, then both again, within the window */
+    bytes attachments, a = random_bytes(12000, rng), b = random_bytes(9000, rng);
+    append(attachments, a);
+    append(attachments, b);
+    append(attachments, a);
+    append(attachments, b);
+    inputs.push_back({"2 random attachments, twice", attachments, 0.52});
+
+    inputs.push_back({"1 MiB of random bytes", random_bytes(1 << 20, rng), 1.001});
+
+    int fails = 0;
+    for (const input& in : inputs) {
+        for (int level : {1, 6, 12}) {
+            const size_t n = in.data.size();
+            libdeflate_compressor* c = libdeflate_alloc_compressor(level);
+            size_t bound = libdeflate_deflate_compress_bound(c, n);
+            bytes comp(bound);
+            size_t csize = libdeflate_deflate_compress(c, in.data.data(), n, comp.data(), bound);
+            libdeflate_free_compressor(c);
+
+            bytes out(n + 10, 0xAA);
+            libdeflate_iovec outv = {out.data(), out.size()};
+            libdeflate_decompressor* d = libdeflate_alloc_decompressor();
+            size_t actual_in = 0, actual_out = 0;
+            libdeflate_result r = libdeflate_deflate_decompress_iov(d, comp.data(), csize, &outv, 1,
+                                                                    &actual_in, &actual_out);
+            libdeflate_free_decompressor(d);
+
+            const char* failure = nullptr;
+            if (csize == 0 || r != LIBDEFLATE_SUCCESS || actual_in != csize || actual_out != n
+                || memcmp(out.data(), in.data.data(), n) != 0)
+                failure = "round trip FAILED";
+            else if (csize > n * in.max_ratio)
+                failure = "too large";
+            printf("%s, level %d: %zu => %zu bytes%s%s\n", in.name, level, n, csize,
+                   failure ? ", " : "", failure ? failure : "");
+            fails += failure != nullptr;
+        }
+    }
+    return fails != 0;
+}
+EOF
+
+g++ -O2 -std=c++14 -I. $tmp/incompressible.cpp libdeflate.a -lpthread -o $tmp/incompressible || exit 1
+$tmp/incompressible || exit 1
+echo "OK"
@@ -0,0 +1,99 @@
+#!/bin/bash
+# Round-trips a file through the scatter/gather (iovec) API with random
+# segmentations, on both sides, and checks the gzip output with gzip itself.
+# Run from the top of the tree after 'make': ./scripts/test_iovec.sh file [iterations]
+
+trap 'exit 130' INT
+
+f=$1
+iterations=${2:-40}
+if [ -z "$f" ] || [ ! -f libdeflate.a ]
+then
+    echo "usage (from the built tree): $0 file [iterations]"
+    exit 1
+fi
+
+tmp=$(mktemp -d)
+trap 'rm -rf $tmp' EXIT
+
+cat > $tmp/iovec.cpp << 'EOF'
+#include "libdeflate.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+/* Cut [base, base+total) into segments, some empty, some large */
+static std::vector<libdeflate_iovec> cut(unsigned char* base, size_t total, std::mt19937& rng) {
+    std::vector<libdeflate_iovec> v;
+    for (size_t pos = 0; pos < total;) {
+        size_t len = rng() % 3 == 0 ? rng() % 600000 : rng() % 5000;
+        len = std::min(len, total - pos);
+        v.push_back({base + pos, len});
+        pos += len;
+    }
+    return v;
+}
+
+int main(int argc, char** argv) {
+    FILE* f = fopen(argv[1], "rb");
+    std::vector<unsigned char> data;
+    unsigned char buf[1 << 16];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        data.insert(data.end(), buf, buf + n);
+    fclose(f);
+    const int iterations = atoi(argv[2]);
+    std::mt19937 rng(12345);
+    int fails = 0;
+    for (int iter = 0; iter < iterations; iter++) {
+        const bool gzip = iter & 1;
+        size_t total = data.empty() ? 0 : 1 + rng() % std::min<size_t>(data.size(), 3000000);
+        size_t start = data.size() > total ? rng() % (data.size() - total) : 0;
+        std::vector<libdeflate_iovec> in = cut(data.data() + start, total, rng);
+        int level = 1 + rng() % 12;
+        libdeflate_compressor* c = libdeflate_alloc_compressor(level);
+        size_t bound = libdeflate_gzip_compress_bound(c, total);
+        std::vector<unsigned char> comp(bound);
+        size_t csize = gzip ? libdeflate_gzip_compress_iov(c, in.data(), in.size(), comp.data(), bound)
+                            : libdeflate_deflate_compress_iov(c, in.data(), in.size(), comp.data(), bound);
+        libdeflate_free_compressor(c);
+
+        /* Room for a few more bytes than needed, which must stay untouched */
+        std::vector<unsigned char> out(total + 10, 0xAA);
+        std::vector<libdeflate_iovec> outv = cut(out.data(), out.size(), rng);
+        libdeflate_decompressor* d = libdeflate_alloc_decompressor();
+        size_t actual_in = 0, actual_out = 0;
+        libdeflate_result r = gzip
+            ? libdeflate_gzip_decompress_iov(d, comp.data(), csize, outv.data(), outv.size(), &actual_in, &actual_out)
+            : libdeflate_deflate_decompress_iov(d, comp.data(), csize, outv.data(), outv.size(), &actual_in, &actual_out);
+        libdeflate_free_decompressor(d);
+
+        if (csize == 0 || r != LIBDEFLATE_SUCCESS || actual_in != csize || actual_out != total
+            || memcmp(out.data(), data.data() + start, total) != 0 || out[total] != 0xAA) {
+            printf("iteration %d (%s, level %d, %zu bytes in %zu segments): FAILED\n",
+                   iter, gzip ? "gzip" : "deflate", level, total, in.size());
+            fails++;
+        } else if (gzip && iter == 1) {
+            /* One member for gzip itself to check */
+            FILE* g = fopen(argv[3], "wb");
+            fwrite(comp.data(), 1, csize, g);
+            fclose(g);
+            FILE* o = fopen(argv[4], "wb");
+            fwrite(data.data() + start, 1, total, o);
+            fclose(o);
+        }
+    }
+    printf("%d/%d round trips failed\n", fails, iterations);
+    return fails != 0;
+}
+EOF
+
+g++ -O2 -std=c++14 -I. $tmp/iovec.cpp libdeflate.a -lpthread -o $tmp/iovec || exit 1
+$tmp/iovec $f $iterations $tmp/member.gz $tmp/member || exit 1
+if [ -f $tmp/member.gz ]
+then
+    gzip -dc $tmp/member.gz | cmp - $tmp/member || exit 1
+fi
+echo "OK"
@@ -1,3 +1,46 @@
+# with files as arguments, e.g. written with Z_SYNC_FLUSH as pigz does, checks instead that random access at a third
+# of each succeeds and outputs some of its reads, and only those, and that successive seeks there output the same
+# reads as separate ones: ./scripts/test_random_access.sh sync_flush.fq.gz
+if [ $# -gt 0 ]
+then
+    tmp=$(mktemp -d)
+    trap 'rm -rf $tmp' EXIT
+    fails=0
+    for f in "$@"
+    do
+        offset=$(($(stat -c%s "$f")/3))
+        gzip -dc "$f" | awk 'NR % 4 == 2' > $tmp/expected
+        ./gzip -c -s $offset "$f" > $tmp/reads 2> $tmp/log
+        status=$?
+        got=$(wc -l < $tmp/reads)
+        extra=$(awk 'NR == FNR { seen[$0] = 1; next } !($0 in seen)' $tmp/expected $tmp/reads | wc -l)
+        if [ $status -ne 0 ] || [ $got -eq 0 ] || [ $extra -ne 0 ]
+        then
+            echo "$f seek at $offset: exit status $status, $got reads, $extra unexpected"
+            tail -3 $tmp/log
+            fails=$((fails + 1))
+        else
+            echo "$f seek at $offset: $got reads"
+        fi
+        # successive seeks restart from the windows cached by the previous ones, and must output what they do alone
+        before=$((offset > 3145728 ? offset - 3145728 : 1))
+        : > $tmp/alone
+        for start in $before $offset $offset
+        do
+            ./gzip -c -s $start -u $((offset + 1048576)) "$f" >> $tmp/alone 2> /dev/null
+        done
+        ./gzip -c -s $before,$offset,$offset -u $((offset + 1048576)),$((offset + 1048576)),$((offset + 1048576)) \
+            "$f" > $tmp/successive 2> $tmp/log
+        if ! cmp -s $tmp/alone $tmp/successive
+        then
+            echo "$f successive seeks at $before, $offset, $offset: not the reads of separate seeks"
+            grep "window cache" $tmp/log
+            fails=$((fails + 1))
+        fi
+    done
+    exit $((fails != 0))
+fi
+
 #for f in `ls /nvme/fastq/ERA*.gz`
 for f in `ls /home/gzip/fastq/hdd_files/ERA*.gz`
 #for f in `cat list_lowest`